@@ -0,0 +1,884 @@
+/*
+ * Samsung Galaxy S23 Device Manager - benchmark suite
+ * Measures the portable core (devcore.h) against fake adb and fastboot
+ * executables, so the numbers are repeatable on any Linux box without
+ * devices attached. The stand-ins are this binary under another name: run
+ * as "adb" or "fastboot" it simulates a fleet of devices with a configured
+ * latency and output volume.
+ * Compile with: g++ -std=c++17 -O2 -o devbench devbench.cpp -pthread
+ * Requires: a POSIX system (Linux, macOS)
+ *
+ * Usage:
+ *   devbench [--devices N] [--latency-us U] [--jitter-us J] [--output-bytes B]
+ *            [--iterations I] [--jobs J] [--package-mb M] [--text-mb M] [--seed S]
+ *            [--only phase,...] [--json] [--stats file.csv|file.json]
+ * Phases: discovery exec batch parse-adb parse-fastboot parse-getvar
+ *         parse-getprop log-append package-index package-verify
+ *         newline-scalar newline-simd collect-string collect-pooled
+ *         lines-stream lines-view
+ * In-process phases also report bytes per TSC cycle (x86) and heap
+ * allocations per operation.
+ * Exit status: 0 when every phase checked out, 1 on a mismatch, 2 on bad usage.
+ */
+
+#include "devcore.h"
+#include <climits>
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_TSC 1
+#else
+#define BENCH_TSC 0
+#endif
+
+#define BENCH_DEVICES 8
+#define BENCH_LATENCY_US 2000
+#define BENCH_OUTPUT_BYTES 16384
+#define BENCH_ITERATIONS 20
+#define BENCH_JOBS 4
+#define BENCH_PACKAGE_MB 64
+#define BENCH_TEXT_MB 8                 // output path phases
+#define BENCH_FEED_SIZE 4096            // bytes per simulated pipe read
+#define BENCH_PARSE_FLEET 256           // devices in the parser inputs
+#define BENCH_LOG_LINES 200000          // per producer
+#define BENCH_FASTBOOT_EVERY 4          // every 4th device sits in fastboot
+
+// Heap allocations made by the calling thread, for the allocations per
+// operation column. Kept out of line so the compiler doesn't pair the
+// inlined malloc/free with the standard operators and warn.
+static thread_local uint64_t t_allocations = 0;
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    t_allocations++;
+    void* p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { free(p); }
+
+// Stand-in configuration, passed to the fake tools through the environment
+struct StandInConfig {
+    unsigned devices;
+    unsigned latencyUs;
+    unsigned jitterUs;
+    size_t outputBytes;
+    uint32_t seed;
+    
+    StandInConfig() : devices(BENCH_DEVICES), latencyUs(BENCH_LATENCY_US), jitterUs(BENCH_LATENCY_US / 4),
+                      outputBytes(BENCH_OUTPUT_BYTES), seed(1) {}
+};
+
+static unsigned EnvNumber(const char* name, unsigned fallback) {
+    const char* value = getenv(name);
+    return value && *value ? (unsigned)strtoul(value, NULL, 10) : fallback;
+}
+
+static StandInConfig ConfigFromEnvironment() {
+    StandInConfig config;
+    config.devices = EnvNumber("DEVBENCH_DEVICES", config.devices);
+    config.latencyUs = EnvNumber("DEVBENCH_LATENCY_US", config.latencyUs);
+    config.jitterUs = EnvNumber("DEVBENCH_JITTER_US", config.jitterUs);
+    config.outputBytes = EnvNumber("DEVBENCH_OUTPUT_BYTES", (unsigned)config.outputBytes);
+    config.seed = EnvNumber("DEVBENCH_SEED", config.seed);
+    return config;
+}
+
+static void ExportConfig(const StandInConfig& config) {
+    setenv("DEVBENCH_DEVICES", std::to_string(config.devices).c_str(), 1);
+    setenv("DEVBENCH_LATENCY_US", std::to_string(config.latencyUs).c_str(), 1);
+    setenv("DEVBENCH_JITTER_US", std::to_string(config.jitterUs).c_str(), 1);
+    setenv("DEVBENCH_OUTPUT_BYTES", std::to_string(config.outputBytes).c_str(), 1);
+    setenv("DEVBENCH_SEED", std::to_string(config.seed).c_str(), 1);
+}
+
+// Deterministic per-input noise (FNV-1a and a final mix), so a run with the
+// same seed sees the same latencies
+static uint32_t BenchHash(uint32_t seed, const std::string& text) {
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < text.size(); i++) h = (h ^ (unsigned char)text[i]) * 16777619u;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    return h;
+}
+
+// Synthetic output
+// The stand-ins and the parser phases share these, so what is parsed in
+// process is byte for byte what the fake tools print.
+static std::string BenchSerial(unsigned index) {
+    char serial[32];
+    snprintf(serial, sizeof(serial), "%s%04u", index % BENCH_FASTBOOT_EVERY == BENCH_FASTBOOT_EVERY - 1 ?
+             "FB" : "R5CW", index + 1);
+    return serial;
+}
+
+static bool BenchInFastboot(unsigned index) {
+    return index % BENCH_FASTBOOT_EVERY == BENCH_FASTBOOT_EVERY - 1;
+}
+
+static std::string AdbDevicesText(unsigned devices) {
+    std::string text = "List of devices attached\n";
+    for (unsigned i = 0; i < devices; i++) {
+        if (BenchInFastboot(i)) continue;
+        text += BenchSerial(i) + "         device usb:1-" + std::to_string(i + 1) +
+                " product:dm1qxxx model:SM_S911B device:dm1q transport_id:" + std::to_string(i + 1) + "\n";
+    }
+    return text + "\n";
+}
+
+static std::string FastbootDevicesText(unsigned devices) {
+    std::string text;
+    for (unsigned i = 0; i < devices; i++) {
+        if (BenchInFastboot(i)) text += BenchSerial(i) + "\tfastboot\n";
+    }
+    return text;
+}
+
+// "getprop" dump of at least bytes bytes; the well-known keys come first
+static std::string GetpropText(const std::string& serial, size_t bytes) {
+    std::string text = "[ro.product.model]: [SM-S911B]\n[ro.product.device]: [dm1q]\n"
+                       "[ro.serialno]: [" + serial + "]\n[ro.boot.flash.locked]: [1]\n"
+                       "[ro.build.version.release]: [14]\n";
+    for (unsigned i = 0; text.size() < bytes; i++) {
+        text += "[persist.vendor.bench.key" + std::to_string(i) + "]: [value-" + std::to_string(i * 7919) + "]\n";
+    }
+    return text;
+}
+
+// "getvar all" as fastboot prints it (to stderr) for a bootloader with
+// enough partitions to reach bytes bytes
+static std::string GetvarAllText(const std::string& serial, size_t bytes) {
+    std::string text = "(bootloader) max-download-size:0x10000000\n(bootloader) slot-count:2\n"
+                       "(bootloader) current-slot:a\n(bootloader) unlocked:no\n(bootloader) secure:yes\n"
+                       "(bootloader) serialno:" + serial + "\n(bootloader) is-userspace:no\n";
+    char line[160];
+    for (unsigned i = 0; text.size() < bytes; i++) {
+        snprintf(line, sizeof(line), "(bootloader) partition-size:bench%u_%c:0x%llx\n"
+                 "(bootloader) partition-type:bench%u_%c:raw\n"
+                 "(bootloader) is-logical:bench%u_%c:%s\n",
+                 i / 2, 'a' + i % 2, (unsigned long long)(i + 1) * 0x100000, i / 2, 'a' + i % 2,
+                 i / 2, 'a' + i % 2, i % 3 ? "no" : "yes");
+        text += line;
+    }
+    return text + "all:\nFinished. Total time: 0.012s\n";
+}
+
+// Shell output of about bytes bytes with lines of varied length; every 8th
+// line ends in \r\n, as output relayed from Windows tools does
+static std::string OutputText(size_t bytes, uint32_t seed) {
+    std::string text;
+    text.reserve(bytes + 160);
+    uint32_t state = seed | 1;
+    for (unsigned i = 0; text.size() < bytes; i++) {
+        state = state * 1664525u + 1013904223u;
+        text += "I/bench   (" + std::to_string(1000 + i % 9000) + "): ";
+        text.append(16 + (state >> 8) % 100, (char)('a' + i % 26));
+        text += i % 8 == 7 ? "\r\n" : "\n";
+    }
+    return text;
+}
+
+static std::string FillerText(size_t bytes) {
+    std::string text;
+    text.reserve(bytes + 80);
+    for (unsigned i = 0; text.size() < bytes; i++) {
+        text += "bench output line " + std::to_string(i) + " ................................................\n";
+    }
+    return text;
+}
+
+// Stand-in adb/fastboot
+// Answers the commands the core sends: "devices [-l]", "-s S shell
+// getprop [key]", "-s S shell <anything>" (filler output), "-s S
+// get-state" and "-s S getvar all|<name>". Each invocation sleeps for the
+// configured latency plus its deterministic jitter before answering.
+static int RunStandIn(const std::string& tool, int argc, char** argv) {
+    StandInConfig config = ConfigFromEnvironment();
+    std::vector<std::string> args(argv + 1, argv + argc);
+    std::string joined = tool;
+    for (size_t i = 0; i < args.size(); i++) joined += " " + args[i];
+    unsigned delay = config.latencyUs + (config.jitterUs ? BenchHash(config.seed, joined) % (config.jitterUs + 1) : 0);
+    if (delay) std::this_thread::sleep_for(std::chrono::microseconds(delay));
+    
+    bool fastboot = tool == "fastboot";
+    std::string serial;
+    if (args.size() >= 2 && args[0] == "-s") {
+        serial = args[1];
+        args.erase(args.begin(), args.begin() + 2);
+    }
+    if (args.empty()) {
+        fprintf(stderr, "%s: no command\n", tool.c_str());
+        return 1;
+    }
+    if (args[0] == "devices") {
+        std::string text = fastboot ? FastbootDevicesText(config.devices) : AdbDevicesText(config.devices);
+        fwrite(text.data(), 1, text.size(), stdout);
+        return 0;
+    }
+    
+    bool known = false;
+    for (unsigned i = 0; i < config.devices && !known; i++) {
+        known = BenchSerial(i) == serial && BenchInFastboot(i) == fastboot;
+    }
+    if (!known) {
+        fprintf(stderr, fastboot ? "< waiting for %s >\n" : "error: device '%s' not found\n", serial.c_str());
+        return 1;
+    }
+    std::string text;
+    FILE* out = stdout;
+    if (fastboot && args[0] == "getvar" && args.size() > 1) {
+        out = stderr;
+        if (args[1] == "all") text = GetvarAllText(serial, config.outputBytes);
+        else text = args[1] + ": " + (args[1] == "serialno" ? serial : std::string("bench")) +
+                    "\nFinished. Total time: 0.001s\n";
+    } else if (!fastboot && args[0] == "get-state") {
+        text = "device\n";
+    } else if (!fastboot && args[0] == "shell" && args.size() > 1 && args[1] == "getprop") {
+        std::string props = GetpropText(serial, config.outputBytes);
+        if (args.size() > 2) {
+            PropertySnapshot snapshot;
+            snapshot.Parse(props);
+            snapshot.Get(args[2], text);
+            text += "\n";
+        } else {
+            text = props;
+        }
+    } else if (!fastboot && args[0] == "shell") {
+        text = FillerText(config.outputBytes);
+    } else {
+        fprintf(stderr, "%s: unsupported command %s\n", tool.c_str(), args[0].c_str());
+        return 1;
+    }
+    fwrite(text.data(), 1, text.size(), out);
+    return 0;
+}
+
+// Harness
+struct BenchOptions {
+    StandInConfig config;
+    unsigned iterations;
+    size_t jobs;
+    unsigned packageMB;
+    unsigned textMB;
+    bool json;
+    std::vector<std::string> only;
+    std::string statsPath;
+    
+    BenchOptions() : iterations(BENCH_ITERATIONS), jobs(BENCH_JOBS), packageMB(BENCH_PACKAGE_MB),
+                     textMB(BENCH_TEXT_MB), json(false) {}
+};
+
+// One phase's outcome: a latency histogram (microseconds per operation)
+// plus the volume it moved
+struct BenchResult {
+    std::string phase;
+    std::string unit;               // what one operation is
+    LatencyHistogram latency;
+    uint64_t operations;
+    uint64_t bytes;
+    long long elapsedUs;
+    uint64_t cycles;                // TSC cycles, 0 where not measured
+    uint64_t allocations;           // heap allocations, in-process phases
+    std::string error;              // set when the output didn't check out
+    
+    BenchResult() : operations(0), bytes(0), elapsedUs(0), cycles(0), allocations(0) {}
+};
+
+static uint64_t CycleCount() {
+#if BENCH_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+class BenchTimer {
+public:
+    BenchTimer() : start(std::chrono::steady_clock::now()), tsc(CycleCount()) {}
+    long long Us() const { return CoreMicrosecondsSince(start); }
+    uint64_t Cycles() const { return CycleCount() - tsc; }
+
+private:
+    std::chrono::steady_clock::time_point start;
+    uint64_t tsc;
+};
+
+static bool ParseBenchArgs(const std::vector<std::string>& args, BenchOptions& options, std::string& error) {
+    for (size_t i = 1; i < args.size(); i++) {
+        bool hasValue = i + 1 < args.size();
+        long value = hasValue ? atol(args[i + 1].c_str()) : 0;
+        if (args[i] == "--json") options.json = true;
+        else if (args[i] == "--devices" && hasValue) options.config.devices = (unsigned)std::max(value, 1L), i++;
+        else if (args[i] == "--latency-us" && hasValue) options.config.latencyUs = (unsigned)std::max(value, 0L), i++;
+        else if (args[i] == "--jitter-us" && hasValue) options.config.jitterUs = (unsigned)std::max(value, 0L), i++;
+        else if (args[i] == "--output-bytes" && hasValue) options.config.outputBytes = (size_t)std::max(value, 0L), i++;
+        else if (args[i] == "--seed" && hasValue) options.config.seed = (uint32_t)value, i++;
+        else if (args[i] == "--iterations" && hasValue) options.iterations = (unsigned)std::max(value, 1L), i++;
+        else if (args[i] == "--jobs" && hasValue) options.jobs = (size_t)std::max(value, 1L), i++;
+        else if (args[i] == "--package-mb" && hasValue) options.packageMB = (unsigned)std::max(value, 1L), i++;
+        else if (args[i] == "--text-mb" && hasValue) options.textMB = (unsigned)std::max(value, 1L), i++;
+        else if (args[i] == "--stats" && hasValue) options.statsPath = args[++i];
+        else if (args[i] == "--only" && hasValue) {
+            std::istringstream list(args[++i]);
+            std::string phase;
+            while (std::getline(list, phase, ',')) {
+                if (!phase.empty()) options.only.push_back(phase);
+            }
+        } else {
+            error = "unknown option " + args[i];
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool Selected(const BenchOptions& options, const char* phase) {
+    return options.only.empty() || std::find(options.only.begin(), options.only.end(), phase) != options.only.end();
+}
+
+// Runs work(index) for index in [0, count) on jobs threads
+template <typename Work>
+static void ParallelFor(size_t count, size_t jobs, const Work& work) {
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < std::min(jobs, count); t++) {
+        threads.push_back(std::thread([&]() {
+            for (size_t i = next++; i < count; i = next++) work(i);
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+}
+
+static std::vector<std::string> ExpectedSerials(const StandInConfig& config, bool fastboot) {
+    std::vector<std::string> serials;
+    for (unsigned i = 0; i < config.devices; i++) {
+        if (BenchInFastboot(i) == fastboot) serials.push_back(BenchSerial(i));
+    }
+    return serials;
+}
+
+static bool SameSerials(const std::vector<AdbDevice>& found, const std::vector<std::string>& expected) {
+    if (found.size() != expected.size()) return false;
+    for (size_t i = 0; i < found.size(); i++) {
+        if (found[i].serial != expected[i]) return false;
+    }
+    return true;
+}
+
+// Both device lists through the stand-ins, one round after another
+static BenchResult BenchDiscovery(const BenchOptions& options, const std::string& dir) {
+    BenchResult result;
+    result.phase = "discovery";
+    result.unit = "round";
+    std::vector<std::string> adbArgs, fastbootArgs;
+    adbArgs.push_back(dir + "/adb");
+    adbArgs.push_back("devices");
+    adbArgs.push_back("-l");
+    fastbootArgs.push_back(dir + "/fastboot");
+    fastbootArgs.push_back("devices");
+    std::vector<std::string> adbExpected = ExpectedSerials(options.config, false);
+    std::vector<std::string> fastbootExpected = ExpectedSerials(options.config, true);
+    
+    BenchTimer total;
+    for (unsigned i = 0; i < options.iterations; i++) {
+        std::string adbList, fastbootList;
+        BenchTimer round;
+        ProcessResult adb = RunProcess(adbArgs, [&](const char* data, size_t len) { adbList.append(data, len); },
+            PROCESS_DEFAULT_TIMEOUT_MS);
+        ProcessResult fastboot = RunProcess(fastbootArgs,
+            [&](const char* data, size_t len) { fastbootList.append(data, len); }, PROCESS_DEFAULT_TIMEOUT_MS);
+        std::vector<AdbDevice> adbDevices = ParseAdbDevices(adbList);
+        std::vector<AdbDevice> fastbootDevices = ParseFastbootDevices(fastbootList);
+        result.latency.Record((uint64_t)round.Us());
+        result.operations++;
+        result.bytes += adb.bytes + fastboot.bytes;
+        if (!adb.started || !fastboot.started) result.error = adb.started ? fastboot.error : adb.error;
+        else if (!SameSerials(adbDevices, adbExpected) || !SameSerials(fastbootDevices, fastbootExpected)) {
+            result.error = "device lists differ from the stand-in fleet";
+        }
+    }
+    result.elapsedUs = total.Us();
+    return result;
+}
+
+// "adb -s S shell getprop" on every adb device, jobs at a time
+static BenchResult BenchExec(const BenchOptions& options, const std::string& dir) {
+    BenchResult result;
+    result.phase = "exec";
+    result.unit = "command";
+    std::vector<std::string> serials = ExpectedSerials(options.config, false);
+    size_t count = serials.size() * options.iterations;
+    std::vector<long long> latencies(count);
+    std::vector<size_t> bytes(count);
+    std::atomic<size_t> mismatches(0);
+    
+    BenchTimer total;
+    ParallelFor(count, options.jobs, [&](size_t i) {
+        const std::string& serial = serials[i % serials.size()];
+        std::vector<std::string> argv;
+        argv.push_back(dir + "/adb");
+        argv.push_back("-s");
+        argv.push_back(serial);
+        argv.push_back("shell");
+        argv.push_back("getprop");
+        std::string output;
+        BenchTimer one;
+        ProcessResult r = RunProcess(argv, [&](const char* data, size_t len) { output.append(data, len); },
+            PROCESS_DEFAULT_TIMEOUT_MS);
+        latencies[i] = one.Us();
+        bytes[i] = r.bytes;
+        std::string model;
+        PropertySnapshot snapshot;
+        snapshot.Parse(output);
+        if (r.exitCode != 0 || !snapshot.Get("ro.serialno", model) || model != serial) mismatches++;
+    });
+    result.elapsedUs = total.Us();
+    for (size_t i = 0; i < count; i++) {
+        result.latency.Record((uint64_t)latencies[i]);
+        result.bytes += bytes[i];
+    }
+    result.operations = count;
+    if (mismatches) result.error = std::to_string(mismatches.load()) + " command(s) failed or returned the wrong device";
+    return result;
+}
+
+// The batch runner end to end: discovery, a script on every device, JSON out
+static BenchResult BenchBatch(const BenchOptions& options, const std::string& dir) {
+    BenchResult result;
+    result.phase = "batch";
+    result.unit = "run";
+    BatchOptions batch;
+    batch.adbPath = dir + "/adb";
+    batch.fastbootPath = dir + "/fastboot";
+    batch.jobs = options.jobs;
+    batch.script = "adb shell getprop ro.product.model\nexpect SM-S911B\nadb shell getprop\n"
+                   "fastboot getvar all\nexpect max-download-size\n";
+    size_t expectedCommands = ExpectedSerials(options.config, false).size() * 2 +
+                              ExpectedSerials(options.config, true).size();
+    
+    BenchTimer total;
+    for (unsigned i = 0; i < options.iterations; i++) {
+        size_t lines = 0, results = 0;
+        BenchTimer run;
+        int failed = RunBatch(batch, [&](const std::string& line) {
+            lines++;
+            result.bytes += line.size() + 1;
+            if (line.find("\"type\":\"result\"") != std::string::npos) results++;
+        });
+        result.latency.Record((uint64_t)run.Us());
+        result.operations++;
+        if (failed) result.error = std::to_string(failed) + " batch failure(s)";
+        else if (results != expectedCommands) result.error = "expected " + std::to_string(expectedCommands) +
+                                                              " results, got " + std::to_string(results);
+    }
+    result.elapsedUs = total.Us();
+    return result;
+}
+
+// Times parse(input) rounds times; the parsers are in process, so each
+// operation is a whole input
+template <typename Parse>
+static BenchResult BenchParser(const char* phase, unsigned rounds, const std::string& input, const Parse& parse) {
+    BenchResult result;
+    result.phase = phase;
+    result.unit = "input";
+    uint64_t allocations = t_allocations;
+    BenchTimer total;
+    for (unsigned i = 0; i < rounds; i++) {
+        BenchTimer one;
+        if (!parse(input)) result.error = "parse result differs from the input";
+        result.latency.Record((uint64_t)std::max(one.Us(), 0LL));
+        result.bytes += input.size();
+    }
+    result.cycles = total.Cycles();
+    result.elapsedUs = total.Us();
+    result.allocations = t_allocations - allocations;
+    result.operations = rounds;
+    return result;
+}
+
+// Output path baselines
+// The byte-at-a-time normalizer and the stream line splitter the output
+// path used before pooled collection and the SIMD kernel; the "before"
+// side of the comparison and the reference the new code is checked against.
+static std::string NormalizeNewlinesScalar(const std::string& text) {
+    std::string cleaned;
+    cleaned.reserve(text.size());
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] == '\n' && (i == 0 || text[i-1] != '\r')) {
+            cleaned += '\r';
+            cleaned += '\n';
+        } else {
+            cleaned += text[i];
+        }
+    }
+    return cleaned;
+}
+
+static size_t CountLinesStream(const std::string& text) {
+    std::istringstream stream(text);
+    std::string line;
+    size_t lines = 0;
+    while (std::getline(stream, line)) lines++;
+    return lines;
+}
+
+// Output as the executors deliver it, in BENCH_FEED_SIZE pieces: appended
+// to a string and normalized afterwards (before), or gathered in pooled
+// chunks and normalized on the way out (after)
+static std::string CollectString(const std::string& text) {
+    std::string result;
+    for (size_t at = 0; at < text.size(); at += BENCH_FEED_SIZE) result.append(text, at, BENCH_FEED_SIZE);
+    return NormalizeNewlinesScalar(result);
+}
+
+static std::string CollectPooled(const std::string& text) {
+    OutputCollector output;
+    OutputCallback collect = output.Callback();
+    for (size_t at = 0; at < text.size(); at += BENCH_FEED_SIZE) {
+        collect(text.data() + at, std::min<size_t>(BENCH_FEED_SIZE, text.size() - at));
+    }
+    return output.Normalized();
+}
+
+static void BenchOutputPath(const BenchOptions& options, const std::function<void(const BenchResult&)>& report) {
+    std::string text = OutputText((size_t)options.textMB * 1024 * 1024, options.config.seed);
+    std::string expected = NormalizeNewlinesScalar(text);
+    size_t lines = CountLinesStream(text);
+    unsigned rounds = options.iterations;
+    
+    // Full comparisons once up front; the timed loops only check sizes
+    struct Candidate {
+        const char* phase;
+        std::function<std::string(const std::string&)> normalize;
+    };
+    Candidate candidates[] = {
+        { "newline-scalar", NormalizeNewlinesScalar },
+        { "newline-simd", [](const std::string& in) { return NormalizeNewlines(in); } },
+        { "collect-string", CollectString },
+        { "collect-pooled", CollectPooled },
+    };
+    for (size_t c = 0; c < sizeof(candidates) / sizeof(candidates[0]); c++) {
+        if (!Selected(options, candidates[c].phase)) continue;
+        bool same = candidates[c].normalize(text) == expected;
+        BenchResult r = BenchParser(candidates[c].phase, rounds, text, [&](const std::string& in) {
+            return candidates[c].normalize(in).size() == expected.size();
+        });
+        if (!same) r.error = "output differs from the byte-at-a-time reference";
+        report(r);
+    }
+    if (Selected(options, "lines-stream")) {
+        report(BenchParser("lines-stream", rounds, text, [&](const std::string& in) {
+            return CountLinesStream(in) == lines;
+        }));
+    }
+    if (Selected(options, "lines-view")) {
+        report(BenchParser("lines-view", rounds, text, [&](const std::string& in) {
+            size_t count = 0, bytes = 0;
+            ForEachLine(in, [&](std::string_view line) {
+                count++;
+                bytes += line.size();
+            });
+            return count == lines && bytes > 0;
+        }));
+    }
+}
+
+// jobs producers append BENCH_LOG_LINES lines each while one consumer
+// drains the queue into the ring, as the log view does
+static BenchResult BenchLogAppend(const BenchOptions& options) {
+    BenchResult result;
+    result.phase = "log-append";
+    result.unit = "line, ns per push";     // a push is far below a microsecond
+    BoundedQueue<LogRecord> queue(LOG_QUEUE_CAPACITY);
+    LogRing ring;
+    std::atomic<size_t> producing(options.jobs);
+    std::vector<LatencyHistogram> latencies(options.jobs);
+    uint64_t consumed = 0, bytes = 0;
+    
+    BenchTimer total;
+    std::thread consumer([&]() {
+        LogRecord rec;
+        for (;;) {
+            bool done = producing.load() == 0;
+            bool any = false;
+            while (queue.Pop(rec)) {
+                bytes += rec.text.size();
+                ring.Append(rec);
+                consumed++;
+                any = true;
+            }
+            if (done && !any) break;
+            if (!any) std::this_thread::yield();
+        }
+    });
+    ParallelFor(options.jobs, options.jobs, [&](size_t p) {
+        std::string line = "[R5CW" + std::to_string(p) + "] shell: bench output line with a typical length ....";
+        for (unsigned i = 0; i < BENCH_LOG_LINES; i++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            while (!queue.Push([&](LogRecord& rec) {
+                rec.time = i;
+                rec.text.assign(line);
+            })) {
+                std::this_thread::yield();      // full; the real log drops, here every line counts
+            }
+            latencies[p].Record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count());
+        }
+        producing--;
+    });
+    consumer.join();
+    result.elapsedUs = total.Us();
+    for (size_t p = 0; p < latencies.size(); p++) result.latency.Merge(latencies[p]);
+    result.operations = consumed;
+    result.bytes = bytes;
+    queue.TakeDropped();
+    if (consumed != (uint64_t)options.jobs * BENCH_LOG_LINES) result.error = "lines lost between queue and ring";
+    return result;
+}
+
+// Synthetic .tar.md5: ustar members of varied sizes, end-of-archive blocks
+// and the "<md5>  <name>" trailer line
+static std::string BuildPackage(unsigned megabytes, uint32_t seed, size_t& members, std::string& digest) {
+    static const char* names[] = { "boot.img.lz4", "recovery.img.lz4", "vbmeta.img.lz4", "super.img.lz4",
+                                   "dtbo.img.lz4", "vendor_boot.img.lz4", "init_boot.img.lz4", "userdata.img.lz4" };
+    uint64_t target = (uint64_t)megabytes * 1024 * 1024;
+    std::string package;
+    package.reserve((size_t)target + 1024 * 1024);
+    uint32_t state = seed | 1;
+    members = 0;
+    while (package.size() < target) {
+        state = state * 1664525u + 1013904223u;
+        size_t size = std::min<uint64_t>(4096 + state % (8 * 1024 * 1024), target - package.size() + 1);
+        char header[TAR_BLOCK];
+        memset(header, 0, sizeof(header));
+        std::string name = "bench" + std::to_string(members) + "_" + names[members % 8];
+        memcpy(header, name.data(), std::min(name.size(), (size_t)99));
+        snprintf(header + 100, 8, "%07o", 0644);
+        snprintf(header + 108, 8, "%07o", 0);
+        snprintf(header + 116, 8, "%07o", 0);
+        snprintf(header + 124, 12, "%011llo", (unsigned long long)size);
+        snprintf(header + 136, 12, "%011o", 0);
+        header[156] = '0';
+        memcpy(header + 257, "ustar\0" "00", 8);
+        memset(header + 148, ' ', 8);
+        unsigned sum = 0;
+        for (int i = 0; i < TAR_BLOCK; i++) sum += (unsigned char)header[i];
+        snprintf(header + 148, 8, "%06o", sum);
+        package.append(header, TAR_BLOCK);
+        size_t from = package.size();
+        package.resize(from + ((size + TAR_BLOCK - 1) & ~(size_t)(TAR_BLOCK - 1)));
+        for (size_t i = from; i < from + size; i += 4096) package[i] = (char)(state >> (i % 24));
+        members++;
+    }
+    package.append(2 * TAR_BLOCK, '\0');
+    Md5 md5;
+    md5.Update(package.data(), package.size());
+    digest = md5.HexDigest();
+    package += digest + "  bench.tar\n";
+    return package;
+}
+
+// Header walk over the package in memory
+static BenchResult BenchPackageIndex(const BenchOptions& options, const std::string& package, size_t members) {
+    BenchResult result;
+    result.phase = "package-index";
+    result.unit = "scan";
+    BenchTimer total;
+    for (unsigned i = 0; i < options.iterations * 10; i++) {
+        std::vector<TarMember> found;
+        std::string error;
+        BenchTimer one;
+        bool ok = ScanTarHeaders([&](uint64_t offset, size_t len) -> const char* {
+            return offset + len <= package.size() ? package.data() + offset : NULL;
+        }, found, error);
+        result.latency.Record((uint64_t)one.Us());
+        result.operations++;
+        result.bytes += package.size();
+        if (!ok) result.error = error;
+        else if (found.size() != members) result.error = "found " + std::to_string(found.size()) + " members";
+    }
+    result.elapsedUs = total.Us();
+    return result;
+}
+
+// Read from disk and hash, the way --verify checks a package, in the
+// verifier's chunk size
+static BenchResult BenchPackageVerify(const BenchOptions& options, const std::string& path,
+                                      const std::string& digest, size_t hashedLen) {
+    BenchResult result;
+    result.phase = "package-verify";
+    result.unit = "package";
+    std::vector<char> buffer(4 * 1024 * 1024);
+    BenchTimer total;
+    for (unsigned i = 0; i < std::max(options.iterations / 5, 1u); i++) {
+        BenchTimer one;
+        std::ifstream in(path.c_str(), std::ios::binary);
+        Md5 md5;
+        size_t left = hashedLen;
+        while (left && in.read(&buffer[0], std::min(buffer.size(), left))) {
+            md5.Update(&buffer[0], (size_t)in.gcount());
+            left -= (size_t)in.gcount();
+        }
+        std::string actual = md5.HexDigest();
+        result.latency.Record((uint64_t)one.Us());
+        result.operations++;
+        result.bytes += hashedLen;
+        if (left || actual != digest) result.error = "MD5 mismatch: " + actual;
+    }
+    result.elapsedUs = total.Us();
+    return result;
+}
+
+static std::string FormatResult(const BenchResult& r, bool json) {
+    double seconds = r.elapsedUs / 1e6;
+    double opsPerSecond = seconds > 0 ? r.operations / seconds : 0;
+    double mbPerSecond = seconds > 0 ? r.bytes / seconds / (1024 * 1024) : 0;
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    if (json) {
+        out << "{\"phase\":\"" << r.phase << "\",\"unit\":\"" << JsonEscape(r.unit) << "\",\"ops\":" << r.operations
+            << ",\"bytes\":" << r.bytes << ",\"elapsed_us\":" << r.elapsedUs << ",\"ops_per_s\":" << opsPerSecond
+            << ",\"mb_per_s\":" << mbPerSecond << ",\"p50\":" << r.latency.Percentile(0.5) << ",\"p90\":"
+            << r.latency.Percentile(0.9) << ",\"p99\":" << r.latency.Percentile(0.99) << ",\"max\":"
+            << r.latency.Max();
+        if (r.cycles) out << ",\"bytes_per_cycle\":" << std::setprecision(3) << (double)r.bytes / r.cycles;
+        if (r.cycles) out << ",\"allocs_per_op\":" << std::setprecision(1) << (double)r.allocations / r.operations;
+        out << ",\"ok\":" << (r.error.empty() ? "true" : "false");
+        if (!r.error.empty()) out << ",\"error\":\"" << JsonEscape(r.error) << "\"";
+        out << "}";
+        return out.str();
+    }
+    out << std::left << std::setw(16) << r.phase << std::right << std::setw(9) << r.operations
+        << std::setw(12) << opsPerSecond << std::setw(10) << mbPerSecond
+        << std::setw(10) << r.latency.Percentile(0.5) << std::setw(10) << r.latency.Percentile(0.9)
+        << std::setw(10) << r.latency.Percentile(0.99) << std::setw(10) << r.latency.Max();
+    std::ostringstream perCycle, perOp;
+    perCycle << std::fixed << std::setprecision(3) << (double)r.bytes / std::max<uint64_t>(r.cycles, 1);
+    perOp << std::fixed << std::setprecision(1) << (double)r.allocations / std::max<uint64_t>(r.operations, 1);
+    out << std::setw(8) << (r.cycles ? perCycle.str() : "-")
+        << std::setw(10) << (r.cycles ? perOp.str() : "-") << "  " << r.unit;
+    if (!r.error.empty()) out << "  MISMATCH: " << r.error;
+    return out.str();
+}
+
+// Path of this executable, for the stand-in links
+static std::string SelfPath(const char* argv0) {
+    char path[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len > 0) return std::string(path, (size_t)len);
+    return realpath(argv0, path) ? std::string(path) : std::string(argv0);
+}
+
+int main(int argc, char** argv) {
+    std::string self = argv[0];
+    size_t slash = self.find_last_of('/');
+    std::string name = slash == std::string::npos ? self : self.substr(slash + 1);
+    if (name == "adb" || name == "fastboot") return RunStandIn(name, argc, argv);
+    
+    std::vector<std::string> args(argv, argv + argc);
+    BenchOptions options;
+    std::string error;
+    if (!ParseBenchArgs(args, options, error)) {
+        std::cerr << "devbench: " << error << "\n"
+                  << "Usage: devbench [--devices N] [--latency-us U] [--jitter-us J] [--output-bytes B] "
+                     "[--iterations I] [--jobs J] [--package-mb M] [--text-mb M] [--seed S] [--only phase,...] [--json] "
+                     "[--stats file.csv|file.json]\n";
+        return 2;
+    }
+    
+    // Stand-ins: links to this binary in a private directory
+    char dirTemplate[] = "/tmp/devbench.XXXXXX";
+    if (!mkdtemp(dirTemplate)) {
+        std::cerr << "devbench: cannot create a temporary directory: " << strerror(errno) << "\n";
+        return 1;
+    }
+    std::string dir = dirTemplate, exe = SelfPath(argv[0]);
+    if (symlink(exe.c_str(), (dir + "/adb").c_str()) != 0 || symlink(exe.c_str(), (dir + "/fastboot").c_str()) != 0) {
+        std::cerr << "devbench: cannot link the stand-ins: " << strerror(errno) << "\n";
+        return 1;
+    }
+    ExportConfig(options.config);
+    
+    const StandInConfig& c = options.config;
+    if (!options.json) {
+        std::cout << "devbench: " << c.devices << " devices (" << ExpectedSerials(c, true).size()
+                  << " in fastboot), latency " << c.latencyUs << " us +0.." << c.jitterUs << ", output "
+                  << c.outputBytes << " bytes, " << options.iterations << " iterations, " << options.jobs
+                  << " jobs, seed " << c.seed << "\n"
+                  << "phase                 ops       ops/s      MB/s       p50       p90       p99       max"
+                     "   B/cyc  alloc/op  (us per op unless noted)\n";
+    }
+    int mismatches = 0;
+    auto report = [&](const BenchResult& r) {
+        if (!r.error.empty()) mismatches++;
+        std::cout << FormatResult(r, options.json) << std::endl;
+    };
+    
+    if (Selected(options, "discovery")) report(BenchDiscovery(options, dir));
+    if (Selected(options, "exec")) report(BenchExec(options, dir));
+    if (Selected(options, "batch")) report(BenchBatch(options, dir));
+    
+    // Parser inputs for a larger fleet than the stand-ins simulate
+    unsigned fleet = std::max<unsigned>(c.devices, BENCH_PARSE_FLEET);
+    StandInConfig parseFleet = c;
+    parseFleet.devices = fleet;
+    if (Selected(options, "parse-adb")) {
+        std::vector<std::string> expected = ExpectedSerials(parseFleet, false);
+        report(BenchParser("parse-adb", options.iterations * 50, AdbDevicesText(fleet), [&](const std::string& text) {
+            return SameSerials(ParseAdbDevices(text), expected);
+        }));
+    }
+    if (Selected(options, "parse-fastboot")) {
+        std::vector<std::string> expected = ExpectedSerials(parseFleet, true);
+        report(BenchParser("parse-fastboot", options.iterations * 50, FastbootDevicesText(fleet), [&](const std::string& text) {
+            return SameSerials(ParseFastbootDevices(text), expected);
+        }));
+    }
+    if (Selected(options, "parse-getvar")) {
+        report(BenchParser("parse-getvar", options.iterations * 50, GetvarAllText("FB0004", std::max<size_t>(c.outputBytes, 4096)),
+            [](const std::string& text) {
+                FastbootVarTable table;
+                table.Parse(text.data(), text.size());
+                return table.Value("serialno") == "FB0004" && table.PartitionSize("bench0_a") == 0x100000;
+            }));
+    }
+    if (Selected(options, "parse-getprop")) {
+        report(BenchParser("parse-getprop", options.iterations * 50, GetpropText("R5CW0001", std::max<size_t>(c.outputBytes, 4096)),
+            [](const std::string& text) {
+                PropertySnapshot snapshot;
+                snapshot.Parse(text);
+                std::string model;
+                return snapshot.Get("ro.product.model", model) && model == "SM-S911B";
+            }));
+    }
+    if (Selected(options, "log-append")) report(BenchLogAppend(options));
+    BenchOutputPath(options, report);
+    
+    if (Selected(options, "package-index") || Selected(options, "package-verify")) {
+        size_t members;
+        std::string digest;
+        std::string package = BuildPackage(options.packageMB, c.seed, members, digest);
+        size_t hashedLen = package.size() - digest.size() - strlen("  bench.tar\n");
+        if (Selected(options, "package-index")) report(BenchPackageIndex(options, package, members));
+        if (Selected(options, "package-verify")) {
+            std::string path = dir + "/bench.tar.md5";
+            std::ofstream(path.c_str(), std::ios::binary).write(package.data(), package.size());
+            report(BenchPackageVerify(options, path, digest, hashedLen));
+            unlink(path.c_str());
+        }
+    }
+    
+    if (!options.statsPath.empty() && !g_commandStats.Export(options.statsPath, error)) {
+        std::cerr << "devbench: " << error << "\n";
+    }
+    unlink((dir + "/adb").c_str());
+    unlink((dir + "/fastboot").c_str());
+    rmdir(dir.c_str());
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,32 @@
+/*
+ * Samsung Galaxy S23 Device Manager - headless batch runner
+ * Runs a command script across attached devices and prints JSON lines, for
+ * automation hosts without the GUI. Same runner as frpunlock.exe --batch.
+ * Compile with: g++ -std=c++17 -O2 -o devcli devcli.cpp -pthread
+ * Requires: a POSIX system (Linux, macOS); adb and fastboot on PATH or given
+ *
+ * Usage:
+ *   devcli <script.txt|-> [--serial S[,S...]] [--jobs N] [--timeout ms]
+ *          [--adb path] [--fastboot path] [--stats file.csv|file.json]
+ * --stats writes per-command and per-device latency percentiles when done.
+ * Exit status: 0 when everything passed, 1 on any failure, 2 on bad usage.
+ */
+
+#include "devcore.h"
+
+int main(int argc, char** argv) {
+    std::vector<std::string> args(argv, argv + argc);
+    BatchOptions options;
+    std::string error;
+    if (!ParseBatchArgs(args, options, error)) {
+        std::cerr << "devcli: " << error << "\n"
+                  << "Usage: devcli <script.txt|-> [--serial S,...] [--jobs N] [--timeout ms] "
+                     "[--adb path] [--fastboot path] [--stats file.csv|file.json]\n";
+        return 2;
+    }
+    int failed = RunBatch(options, [](const std::string& line) {
+        std::cout << line << "\n";
+        std::cout.flush();
+    });
+    return failed ? 1 : 0;
+}
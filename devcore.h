@@ -0,0 +1,1840 @@
+/*
+ * Samsung Galaxy S23 Device Manager - portable core
+ * Command execution, output parsers and batch runs, in standard C++ with no
+ * window handles, so they build on Windows (inside frpunlock.cpp) and on
+ * Linux/macOS (devcli.cpp). RunProcess is declared here; the POSIX version
+ * is below, the Windows one lives in frpunlock.cpp.
+ */
+
+#ifndef DEVCORE_H
+#define DEVCORE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define OUTPUT_SIMD 1
+#else
+#define OUTPUT_SIMD 0
+#endif
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#define PROCESS_DEFAULT_TIMEOUT_MS 10000
+#define PROCESS_PIPE_BUFFER 65536
+#define PROCESS_POLL_MS 100
+#define PROCESS_DRAIN_MS 250
+
+// Output chunk callback for streaming command execution
+typedef std::function<void(const char* data, size_t len)> OutputCallback;
+
+// Outcome of a streamed child process (see RunProcess)
+struct ProcessResult {
+    bool started;
+    bool timedOut;
+    bool cancelled;
+    unsigned long exitCode;
+    size_t bytes;
+    long long firstByteMs;      // time to first output byte, -1 if none
+    long long totalMs;
+    std::string error;
+    
+    ProcessResult() : started(false), timedOut(false), cancelled(false),
+                      exitCode((unsigned long)-1), bytes(0), firstByteMs(-1), totalMs(0) {}
+};
+
+// Quotes one argument so CommandLineToArgvW/the MSVC runtime read it back
+// verbatim (backslashes only need doubling in front of a quote)
+inline std::string QuoteArgument(const std::string& arg) {
+    if (!arg.empty() && arg.find_first_of(" \t\n\v\"") == std::string::npos) {
+        return arg;
+    }
+    std::string out = "\"";
+    for (size_t i = 0; ; i++) {
+        size_t backslashes = 0;
+        while (i < arg.size() && arg[i] == '\\') {
+            i++;
+            backslashes++;
+        }
+        if (i == arg.size()) {
+            out.append(backslashes * 2, '\\');
+            break;
+        }
+        if (arg[i] == '"') {
+            out.append(backslashes * 2 + 1, '\\');
+        } else {
+            out.append(backslashes, '\\');
+        }
+        out += arg[i];
+    }
+    out += '"';
+    return out;
+}
+
+inline std::string BuildCommandLine(const std::vector<std::string>& argv) {
+    std::string cmdLine;
+    for (size_t i = 0; i < argv.size(); i++) {
+        if (i > 0) cmdLine += ' ';
+        cmdLine += QuoteArgument(argv[i]);
+    }
+    return cmdLine;
+}
+
+// Splits a command string into arguments: whitespace separates, double
+// quotes group, \" is a literal quote
+inline std::vector<std::string> SplitCommandLine(const std::string& cmd) {
+    std::vector<std::string> argv;
+    std::string current;
+    bool inArg = false, quoted = false;
+    for (size_t i = 0; i < cmd.size(); i++) {
+        char c = cmd[i];
+        if (c == '\\' && i + 1 < cmd.size() && cmd[i + 1] == '"') {
+            current += '"';
+            inArg = true;
+            i++;
+        } else if (c == '"') {
+            quoted = !quoted;
+            inArg = true;
+        } else if ((c == ' ' || c == '\t') && !quoted) {
+            if (inArg) argv.push_back(current);
+            current.clear();
+            inArg = false;
+        } else {
+            current += c;
+            inArg = true;
+        }
+    }
+    if (inArg) argv.push_back(current);
+    return argv;
+}
+
+// Escapes text for a JSON string literal
+inline std::string JsonEscape(const std::string& text) {
+    std::string out;
+    out.reserve(text.size() + 8);
+    for (size_t i = 0; i < text.size(); i++) {
+        unsigned char c = (unsigned char)text[i];
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char esc[8];
+                    snprintf(esc, sizeof(esc), "\\u%04x", c);
+                    out += esc;
+                } else {
+                    out += (char)c;
+                }
+        }
+    }
+    return out;
+}
+
+// Output path
+// Command output is read into pooled chunks and gathered in pooled chunks,
+// then copied out once into a string of exactly the right size, so a
+// multi-megabyte output costs the same few allocations as a short one and
+// steady state allocates only the result. The newline work - turning bare
+// \n into \r\n for the Windows edit controls - looks at 16 bytes per step
+// with SSE2 and copies whole runs between line ends. Parsers walk lines as
+// string_views over the output instead of copying it through streams.
+#define OUTPUT_CHUNK_SIZE PROCESS_PIPE_BUFFER
+#define OUTPUT_POOL_KEEP 256            // idle chunks kept for reuse (16 MB)
+#define OUTPUT_CHUNK_LIST 16            // chunk pointers reserved per collector
+
+class ChunkPool {
+public:
+    ~ChunkPool() {
+        for (size_t i = 0; i < idle.size(); i++) delete[] idle[i];
+    }
+    
+    char* Acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!idle.empty()) {
+                char* chunk = idle.back();
+                idle.pop_back();
+                return chunk;
+            }
+        }
+        return new char[OUTPUT_CHUNK_SIZE];
+    }
+    
+    void Release(char* chunk) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (idle.size() < OUTPUT_POOL_KEEP) {
+                idle.push_back(chunk);
+                return;
+            }
+        }
+        delete[] chunk;
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<char*> idle;
+};
+
+inline ChunkPool g_chunkPool;
+
+// One pooled chunk for the lifetime of a read loop
+class PooledChunk {
+public:
+    PooledChunk() : data(g_chunkPool.Acquire()) {}
+    ~PooledChunk() { g_chunkPool.Release(data); }
+    
+    char* Data() const { return data; }
+    size_t Size() const { return OUTPUT_CHUNK_SIZE; }
+
+private:
+    char* data;
+};
+
+// Bits set for the \n bytes in [p, p + 16) that have no \r before them;
+// prevCr says whether the byte before p is a \r
+#if OUTPUT_SIMD
+
+inline unsigned BareNewlineMask(const char* p, bool prevCr) {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    unsigned nl = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    if (!nl) return 0;
+    unsigned cr = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    return nl & ~((cr << 1) | (prevCr ? 1u : 0u));
+}
+#else
+inline unsigned BareNewlineMask(const char* p, bool prevCr) {
+    unsigned mask = 0;
+    for (int i = 0; i < 16; i++) {
+        if (p[i] == '\n' && !(i ? p[i - 1] == '\r' : prevCr)) mask |= 1u << i;
+    }
+    return mask;
+}
+#endif
+
+// Set bits in a mask, and the index of the lowest one (mask non-zero).
+// MSVC has no __builtin_popcount/ctz, and _mm_popcnt_u32 would need POPCNT,
+// which SSE2 doesn't promise.
+#if defined(_MSC_VER) && !defined(__clang__)
+inline unsigned MaskBitCount(unsigned mask) {
+    mask = mask - ((mask >> 1) & 0x55555555u);
+    mask = (mask & 0x33333333u) + ((mask >> 2) & 0x33333333u);
+    return (((mask + (mask >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24;
+}
+
+inline unsigned MaskLowestBit(unsigned mask) {
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned)index;
+}
+#else
+inline unsigned MaskBitCount(unsigned mask) { return (unsigned)__builtin_popcount(mask); }
+inline unsigned MaskLowestBit(unsigned mask) { return (unsigned)__builtin_ctz(mask); }
+#endif
+
+// Number of \n in data not preceded by \r; prev is the byte before data
+inline size_t CountBareNewlines(const char* data, size_t len, char prev) {
+    size_t count = 0, i = 0;
+    for (; i + 16 <= len; i += 16) {
+        count += MaskBitCount(BareNewlineMask(data + i, (i ? data[i - 1] : prev) == '\r'));
+    }
+    for (; i < len; i++) {
+        if (data[i] == '\n' && (i ? data[i - 1] : prev) != '\r') count++;
+    }
+    return count;
+}
+
+// Copies data to out with every bare \n turned into \r\n; out must have
+// room for len + CountBareNewlines(...) bytes. Returns the end of what was
+// written.
+inline char* WriteNormalized(const char* data, size_t len, char prev, char* out) {
+    size_t copied = 0, i = 0;
+    for (; i + 16 <= len; i += 16) {
+        for (unsigned bare = BareNewlineMask(data + i, (i ? data[i - 1] : prev) == '\r'); bare; bare &= bare - 1) {
+            size_t pos = i + MaskLowestBit(bare);
+            memcpy(out, data + copied, pos - copied);
+            out += pos - copied;
+            *out++ = '\r';
+            copied = pos;           // the \n goes out with the next run
+        }
+    }
+    for (; i < len; i++) {
+        if (data[i] == '\n' && (i ? data[i - 1] : prev) != '\r') {
+            memcpy(out, data + copied, i - copied);
+            out += i - copied;
+            *out++ = '\r';
+            copied = i;
+        }
+    }
+    memcpy(out, data + copied, len - copied);
+    return out + (len - copied);
+}
+
+// Appends data to out with bare \n turned into \r\n. prev is the byte that
+// came before data in the stream, so a \r\n split across two appends stays
+// one line end.
+inline void AppendNormalized(std::string& out, const char* data, size_t len, char prev) {
+    size_t at = out.size();
+    out.resize(at + len + CountBareNewlines(data, len, prev));
+    WriteNormalized(data, len, prev, &out[0] + at);
+}
+
+// Convert single \n to \r\n for Windows edit control
+inline std::string NormalizeNewlines(const std::string& text) {
+    std::string cleaned;
+    AppendNormalized(cleaned, text.data(), text.size(), 0);
+    return cleaned;
+}
+
+// Gathers streamed output in pooled chunks; Text() and Normalized() copy
+// it out once, into a string allocated at its final size
+class OutputCollector {
+public:
+    OutputCollector() : size(0) { chunks.reserve(OUTPUT_CHUNK_LIST); }
+    ~OutputCollector() {
+        for (size_t i = 0; i < chunks.size(); i++) g_chunkPool.Release(chunks[i]);
+    }
+    
+    void Append(const char* data, size_t len) {
+        while (len) {
+            if (size == chunks.size() * OUTPUT_CHUNK_SIZE) chunks.push_back(g_chunkPool.Acquire());
+            size_t used = size - (chunks.size() - 1) * OUTPUT_CHUNK_SIZE;
+            size_t take = std::min(len, OUTPUT_CHUNK_SIZE - used);
+            memcpy(chunks.back() + used, data, take);
+            size += take;
+            data += take;
+            len -= take;
+        }
+    }
+    
+    OutputCallback Callback() {
+        return [this](const char* data, size_t len) { Append(data, len); };
+    }
+    
+    size_t Size() const { return size; }
+    
+    std::string Text() const {
+        std::string text(size, '\0');
+        for (size_t c = 0; c < chunks.size(); c++) memcpy(&text[0] + c * OUTPUT_CHUNK_SIZE, chunks[c], ChunkLength(c));
+        return text;
+    }
+    
+    std::string Normalized() const {
+        size_t extra = 0;
+        char prev = 0;
+        for (size_t c = 0; c < chunks.size(); c++) {
+            extra += CountBareNewlines(chunks[c], ChunkLength(c), prev);
+            prev = chunks[c][ChunkLength(c) - 1];
+        }
+        std::string text(size + extra, '\0');
+        char* out = size ? &text[0] : NULL;
+        prev = 0;
+        for (size_t c = 0; c < chunks.size(); c++) {
+            out = WriteNormalized(chunks[c], ChunkLength(c), prev, out);
+            prev = chunks[c][ChunkLength(c) - 1];
+        }
+        return text;
+    }
+
+private:
+    std::vector<char*> chunks;
+    size_t size;
+    
+    size_t ChunkLength(size_t c) const {
+        return c + 1 < chunks.size() ? OUTPUT_CHUNK_SIZE : size - c * OUTPUT_CHUNK_SIZE;
+    }
+};
+
+// Calls line(std::string_view) for each line of text, without its \n or
+// \r\n; a last line without a line end counts too
+template <typename Line>
+void ForEachLine(std::string_view text, const Line& line) {
+    const char* p = text.data();
+    const char* end = p + text.size();
+    while (p < end) {
+        const char* eol = (const char*)memchr(p, '\n', (size_t)(end - p));
+        const char* next = eol ? eol + 1 : end;
+        if (!eol) eol = end;
+        if (eol > p && eol[-1] == '\r') eol--;
+        line(std::string_view(p, (size_t)(eol - p)));
+        p = next;
+    }
+}
+
+// Next whitespace-separated field of line at or after pos, empty at the end
+inline std::string_view NextField(std::string_view line, size_t& pos) {
+    while (pos < line.size() && (line[pos] == ' ' || line[pos] == '\t')) pos++;
+    size_t start = pos;
+    while (pos < line.size() && line[pos] != ' ' && line[pos] != '\t') pos++;
+    return line.substr(start, pos - start);
+}
+
+// Command statistics
+// Every command run (spawned or native) and every device probe leaves one
+// sample: spawn time, time to first byte, total time, bytes, timeout and
+// failure. Samples go into log-linear histograms per command and per
+// device: 32 linear sub-buckets per power of two, so any recorded value is
+// known to within about 3% from 1 us to days, in a fixed 8 KB per
+// histogram, and recording is an increment. Commands are keyed by tool and
+// verb ("adb shell getprop", "fastboot getvar all"), with serials and file
+// arguments dropped, so the key set stays small.
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB)
+
+class LatencyHistogram {
+public:
+    LatencyHistogram() : count(0), sum(0), min(0), max(0) { memset(counts, 0, sizeof(counts)); }
+    
+    void Record(uint64_t value) {
+        counts[Bucket(value)]++;
+        if (count == 0 || value < min) min = value;
+        if (value > max) max = value;
+        count++;
+        sum += value;
+    }
+    
+    // Value at or below which fraction p (0..1) of the samples fall (nearest
+    // rank), as the middle of its bucket, clamped to what was recorded
+    uint64_t Percentile(double p) const {
+        if (count == 0) return 0;
+        uint64_t rank = (uint64_t)(p * count), seen = 0;
+        if ((double)rank < p * count || rank == 0) rank++;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                uint64_t mid = Lower(i) + (Lower(i + 1) - Lower(i)) / 2;
+                return std::min(std::max(mid, min), max);
+            }
+        }
+        return max;
+    }
+    
+    void Merge(const LatencyHistogram& other) {
+        if (!other.count) return;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) counts[i] += other.counts[i];
+        if (count == 0 || other.min < min) min = other.min;
+        if (other.max > max) max = other.max;
+        count += other.count;
+        sum += other.sum;
+    }
+    
+    uint64_t Count() const { return count; }
+    uint64_t Min() const { return min; }
+    uint64_t Max() const { return max; }
+    double Mean() const { return count ? (double)sum / count : 0; }
+    
+    // Non-empty buckets as "[upper,count],..." for export
+    std::string BucketsJson() const {
+        std::ostringstream json;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            if (!counts[i]) continue;
+            if (json.tellp() > 0) json << ",";
+            json << "[" << Lower(i + 1) - 1 << "," << counts[i] << "]";
+        }
+        return json.str();
+    }
+    
+    static int Bucket(uint64_t value) {
+        if (value < 2 * HISTOGRAM_SUB) return (int)value;
+        int msb = 63;
+        while (!(value >> msb)) msb--;
+        int shift = msb - HISTOGRAM_SUB_BITS;
+        return (shift + 1) * HISTOGRAM_SUB + (int)((value >> shift) - HISTOGRAM_SUB);
+    }
+    
+    static uint64_t Lower(int bucket) {
+        if (bucket < 2 * HISTOGRAM_SUB) return (uint64_t)bucket;
+        int shift = bucket / HISTOGRAM_SUB - 1;
+        return (uint64_t)(bucket % HISTOGRAM_SUB + HISTOGRAM_SUB) << shift;
+    }
+
+private:
+    uint32_t counts[HISTOGRAM_BUCKETS];
+    uint64_t count, sum, min, max;
+};
+
+struct CommandSample {
+    std::string command;        // as run; keyed by CommandStatsKey
+    std::string serial;         // taken from "-s <serial>" when empty
+    long long spawnUs;          // -1 when nothing was spawned
+    long long firstByteUs;      // -1 when there was no output
+    long long totalUs;
+    uint64_t bytes;
+    bool timedOut;
+    bool failed;
+    
+    CommandSample() : spawnUs(-1), firstByteUs(-1), totalUs(0), bytes(0), timedOut(false), failed(false) {}
+};
+
+// Sample of the command this thread is running, if its caller keeps one
+// (frpunlock.cpp's JournalCommand); executors add spawn time and timeouts
+// to it instead of recording on their own
+inline thread_local CommandSample* t_commandSample = NULL;
+
+// Tool and verb of a command line: "C:\tools\adb.exe -s X shell getprop
+// ro.x" -> "adb shell getprop". The second word is kept only for verbs
+// whose argument says what ran.
+inline std::string CommandStatsKey(const std::string& command, std::string* serial) {
+    std::vector<std::string> argv = SplitCommandLine(command);
+    size_t i = 0;
+    if (argv.size() > 2 && (argv[0] == "cmd.exe" || argv[0] == "cmd") && argv[1] == "/c") i = 2;
+    if (i >= argv.size()) return "(empty)";
+    std::string tool = argv[i++];
+    size_t slash = tool.find_last_of("\\/");
+    if (slash != std::string::npos) tool.erase(0, slash + 1);
+    if (tool.size() > 4 && tool.compare(tool.size() - 4, 4, ".exe") == 0) tool.erase(tool.size() - 4);
+    
+    static const char* detailed[] = { "shell", "exec-out", "getvar", "oem", "flash", "erase", "reboot", "devices" };
+    std::string key = tool, verb;
+    for (; i < argv.size(); i++) {
+        if ((argv[i] == "-s" || argv[i] == "-t" || argv[i] == "-H" || argv[i] == "-P") && i + 1 < argv.size()) {
+            if (argv[i] == "-s" && serial && serial->empty()) *serial = argv[i + 1];
+            i++;
+        } else if (verb.empty()) {
+            verb = argv[i];
+            key += " " + verb;
+        } else {
+            for (size_t d = 0; d < sizeof(detailed) / sizeof(detailed[0]); d++) {
+                if (verb == detailed[d]) key += " " + argv[i];
+            }
+            break;
+        }
+    }
+    return key;
+}
+
+struct CommandStatsRow {
+    std::string scope;          // "command" or "device"
+    std::string key;
+    uint64_t count, bytes, timeouts, failures;
+    LatencyHistogram total, firstByte, spawn;
+};
+
+class CommandStats {
+public:
+    void Record(const CommandSample& sample) {
+        std::string serial = sample.serial;
+        std::string key = CommandStatsKey(sample.command, &serial);
+        std::lock_guard<std::mutex> lock(mutex);
+        Add(byCommand[key], "command", key, sample);
+        if (!serial.empty()) Add(byDevice[serial], "device", serial, sample);
+    }
+    
+    std::vector<CommandStatsRow> Rows() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<CommandStatsRow> rows;
+        for (std::map<std::string, CommandStatsRow>::const_iterator it = byCommand.begin(); it != byCommand.end(); ++it) {
+            rows.push_back(it->second);
+        }
+        for (std::map<std::string, CommandStatsRow>::const_iterator it = byDevice.begin(); it != byDevice.end(); ++it) {
+            rows.push_back(it->second);
+        }
+        return rows;
+    }
+    
+    void Reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        byCommand.clear();
+        byDevice.clear();
+    }
+    
+    // One row per command and device; times in microseconds
+    std::string Csv() const {
+        std::vector<CommandStatsRow> rows = Rows();
+        std::ostringstream csv;
+        csv << "scope,key,count,failures,timeouts,bytes,total_p50_us,total_p90_us,total_p99_us,total_p999_us,"
+               "total_max_us,total_mean_us,first_byte_p50_us,first_byte_p99_us,spawn_p50_us,spawn_p99_us\n";
+        for (size_t i = 0; i < rows.size(); i++) {
+            const CommandStatsRow& r = rows[i];
+            std::string key = r.key;
+            if (key.find_first_of(",\"") != std::string::npos) {
+                std::string quoted = "\"";
+                for (size_t c = 0; c < key.size(); c++) quoted += key[c] == '"' ? std::string("\"\"") : std::string(1, key[c]);
+                key = quoted + "\"";
+            }
+            csv << r.scope << "," << key << "," << r.count << "," << r.failures << "," << r.timeouts << ","
+                << r.bytes << "," << r.total.Percentile(0.5) << "," << r.total.Percentile(0.9) << ","
+                << r.total.Percentile(0.99) << "," << r.total.Percentile(0.999) << "," << r.total.Max() << ","
+                << (uint64_t)r.total.Mean() << "," << Cell(r.firstByte, 0.5) << ","
+                << Cell(r.firstByte, 0.99) << "," << Cell(r.spawn, 0.5) << ","
+                << Cell(r.spawn, 0.99) << "\n";
+        }
+        return csv.str();
+    }
+    
+    // One JSON object per line, with the histogram buckets
+    std::string JsonLines() const {
+        std::vector<CommandStatsRow> rows = Rows();
+        std::ostringstream json;
+        for (size_t i = 0; i < rows.size(); i++) {
+            const CommandStatsRow& r = rows[i];
+            json << "{\"scope\":\"" << r.scope << "\",\"key\":\"" << JsonEscape(r.key) << "\",\"count\":" << r.count
+                 << ",\"failures\":" << r.failures << ",\"timeouts\":" << r.timeouts << ",\"bytes\":" << r.bytes;
+            const LatencyHistogram* histograms[] = { &r.total, &r.firstByte, &r.spawn };
+            const char* names[] = { "total_us", "first_byte_us", "spawn_us" };
+            for (int h = 0; h < 3; h++) {
+                const LatencyHistogram& hist = *histograms[h];
+                json << ",\"" << names[h] << "\":{\"count\":" << hist.Count() << ",\"min\":" << hist.Min()
+                     << ",\"p50\":" << hist.Percentile(0.5) << ",\"p90\":" << hist.Percentile(0.9)
+                     << ",\"p99\":" << hist.Percentile(0.99) << ",\"p999\":" << hist.Percentile(0.999)
+                     << ",\"max\":" << hist.Max() << ",\"buckets\":[" << hist.BucketsJson() << "]}";
+            }
+            json << "}\n";
+        }
+        return json.str();
+    }
+    
+    // CSV for a .csv path, JSON lines otherwise
+    bool Export(const std::string& path, std::string& error) const {
+        bool csv = path.size() > 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+        std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+        out << (csv ? Csv() : JsonLines());
+        if (!out) {
+            error = "cannot write " + path;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    mutable std::mutex mutex;
+    std::map<std::string, CommandStatsRow> byCommand, byDevice;
+    
+    // Empty when nothing was recorded (no output, nothing spawned)
+    static std::string Cell(const LatencyHistogram& hist, double p) {
+        return hist.Count() ? std::to_string(hist.Percentile(p)) : std::string();
+    }
+    
+    static void Add(CommandStatsRow& row, const char* scope, const std::string& key, const CommandSample& sample) {
+        if (row.key.empty()) {
+            row.scope = scope;
+            row.key = key;
+            row.count = row.bytes = row.timeouts = row.failures = 0;
+        }
+        row.count++;
+        row.bytes += sample.bytes;
+        if (sample.timedOut) row.timeouts++;
+        if (sample.failed) row.failures++;
+        row.total.Record((uint64_t)std::max(sample.totalUs, 0LL));
+        if (sample.firstByteUs >= 0) row.firstByte.Record((uint64_t)sample.firstByteUs);
+        if (sample.spawnUs >= 0) row.spawn.Record((uint64_t)sample.spawnUs);
+    }
+};
+
+inline CommandStats g_commandStats;
+
+inline long long CoreMicrosecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+// Called by the executors once a process is done: fills in the caller's
+// sample, or records one of its own
+inline void RecordProcessSample(const std::string& command, long long spawnUs, long long firstByteUs,
+                                long long totalUs, uint64_t bytes, bool timedOut, bool failed) {
+    if (t_commandSample) {
+        t_commandSample->spawnUs = spawnUs;
+        t_commandSample->timedOut = timedOut;
+        return;
+    }
+    CommandSample sample;
+    sample.command = command;
+    sample.spawnUs = spawnUs;
+    sample.firstByteUs = firstByteUs;
+    sample.totalUs = totalUs;
+    sample.bytes = bytes;
+    sample.timedOut = timedOut;
+    sample.failed = failed;
+    g_commandStats.Record(sample);
+}
+
+struct AdbDevice {
+    std::string serial;
+    std::string state;      // device, offline, unauthorized, recovery, sideload...
+    std::string product;
+    std::string model;
+    std::string device;
+    std::string transportId;
+};
+
+// Parses "host:devices-l" / "adb devices -l" output into device records
+inline std::vector<AdbDevice> ParseAdbDevices(const std::string& text) {
+    std::vector<AdbDevice> devices;
+    ForEachLine(text, [&](std::string_view line) {
+        if (line.empty() || line.compare(0, 7, "List of") == 0 || line[0] == '*') return;
+        size_t pos = 0;
+        std::string_view serial = NextField(line, pos), state = NextField(line, pos);
+        if (state.empty()) return;
+        AdbDevice dev;
+        dev.serial.assign(serial);
+        dev.state.assign(state);
+        for (std::string_view field = NextField(line, pos); !field.empty(); field = NextField(line, pos)) {
+            size_t colon = field.find(':');
+            if (colon == std::string_view::npos) continue;
+            std::string_view key = field.substr(0, colon), value = field.substr(colon + 1);
+            if (key == "product") dev.product.assign(value);
+            else if (key == "model") dev.model.assign(value);
+            else if (key == "device") dev.device.assign(value);
+            else if (key == "transport_id") dev.transportId.assign(value);
+        }
+        devices.push_back(dev);
+    });
+    return devices;
+}
+
+// Parses "fastboot devices" output ("<serial>\tfastboot", fastbootd too)
+inline std::vector<AdbDevice> ParseFastbootDevices(const std::string& text) {
+    std::vector<AdbDevice> devices;
+    ForEachLine(text, [&](std::string_view line) {
+        size_t tab = line.find('\t');
+        if (tab != std::string_view::npos && line.find("fastboot", tab) != std::string_view::npos) {
+            AdbDevice dev;
+            dev.serial.assign(line.substr(0, tab));
+            dev.state = "fastboot";
+            devices.push_back(dev);
+        }
+    });
+    return devices;
+}
+
+// Device properties
+// A "getprop" dump parsed into an immutable snapshot: keys and values live
+// in a single arena, entries are sorted by key and indexed by an
+// open-addressing hash table.
+class PropertySnapshot {
+public:
+    // Parses getprop output: "[key]: [value]" lines, values may span lines
+    void Parse(const std::string& dump) {
+        struct Raw { size_t keyOff, keyLen, valOff, valLen; };
+        std::vector<Raw> raw;
+        arena.clear();
+        arena.reserve(dump.size());
+        
+        size_t pos = 0;
+        while (pos < dump.size()) {
+            size_t eol = dump.find('\n', pos);
+            if (eol == std::string::npos) eol = dump.size();
+            size_t end = eol;
+            if (end > pos && dump[end - 1] == '\r') end--;
+            
+            size_t keyEnd = dump.find("]: [", pos);
+            if (dump[pos] == '[' && keyEnd != std::string::npos && keyEnd < end) {
+                Raw r;
+                r.keyOff = arena.size();
+                r.keyLen = keyEnd - pos - 1;
+                arena.append(dump, pos + 1, r.keyLen);
+                r.valOff = arena.size();
+                size_t valStart = keyEnd + 4;
+                size_t valEnd = (end > valStart && dump[end - 1] == ']') ? end - 1 : end;
+                arena.append(dump, valStart, valEnd - valStart);
+                r.valLen = valEnd - valStart;
+                raw.push_back(r);
+            } else if (!raw.empty() && raw.back().valOff + raw.back().valLen == arena.size()) {
+                // Continuation of a multi-line value
+                size_t valEnd = (end > pos && dump[end - 1] == ']') ? end - 1 : end;
+                arena += '\n';
+                arena.append(dump, pos, valEnd - pos);
+                raw.back().valLen = arena.size() - raw.back().valOff;
+            }
+            pos = eol + 1;
+        }
+        
+        std::sort(raw.begin(), raw.end(), [this](const Raw& a, const Raw& b) {
+            return arena.compare(a.keyOff, a.keyLen, arena, b.keyOff, b.keyLen) < 0;
+        });
+        entries.resize(raw.size());
+        for (size_t i = 0; i < raw.size(); i++) {
+            entries[i].keyOff = (uint32_t)raw[i].keyOff;
+            entries[i].keyLen = (uint32_t)raw[i].keyLen;
+            entries[i].valOff = (uint32_t)raw[i].valOff;
+            entries[i].valLen = (uint32_t)raw[i].valLen;
+        }
+        
+        size_t buckets = 16;
+        while (buckets < entries.size() * 2) buckets <<= 1;
+        table.assign(buckets, -1);
+        for (size_t i = 0; i < entries.size(); i++) {
+            size_t slot = Hash(arena.data() + entries[i].keyOff, entries[i].keyLen) & (buckets - 1);
+            while (table[slot] >= 0) slot = (slot + 1) & (buckets - 1);
+            table[slot] = (int32_t)i;
+        }
+    }
+    
+    bool Get(const std::string& key, std::string& value) const {
+        if (table.empty()) return false;
+        size_t mask = table.size() - 1;
+        for (size_t slot = Hash(key.data(), key.size()) & mask; table[slot] >= 0; slot = (slot + 1) & mask) {
+            const Entry& e = entries[table[slot]];
+            if (e.keyLen == key.size() && memcmp(arena.data() + e.keyOff, key.data(), e.keyLen) == 0) {
+                value.assign(arena, e.valOff, e.valLen);
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    size_t Size() const { return entries.size(); }
+
+private:
+    struct Entry { uint32_t keyOff, keyLen, valOff, valLen; };
+    std::string arena;
+    std::vector<Entry> entries;     // sorted by key
+    std::vector<int32_t> table;     // hash slot -> entry index, -1 = empty
+    
+    static size_t Hash(const char* data, size_t len) {
+        uint32_t h = 2166136261u;   // FNV-1a
+        for (size_t i = 0; i < len; i++) {
+            h = (h ^ (unsigned char)data[i]) * 16777619u;
+        }
+        return h;
+    }
+};
+
+// Fastboot variables
+// "getvar all" and "oem device-info" output is parsed in a single pass into
+// a table: the text is copied once into an arena and every variable is an
+// offset/length pair into it, so no line allocates. The values other
+// features need (max-download-size, slots, partition sizes and types, lock
+// state) are decoded into typed fields along the way.
+#define FASTBOOT_UNKNOWN -1
+
+class FastbootVarTable {
+public:
+    struct Partition {
+        uint32_t nameOff, nameLen;
+        uint32_t typeOff, typeLen;
+        uint64_t size;
+        int logical;                // FASTBOOT_UNKNOWN, 0 or 1
+    };
+    
+    struct Slot {
+        char name;
+        int successful, unbootable, retryCount;
+    };
+    
+    FastbootVarTable() : maxDownloadSize(0), slotCount(0), currentSlot(0), unlocked(FASTBOOT_UNKNOWN),
+                         criticalUnlocked(FASTBOOT_UNKNOWN), secure(FASTBOOT_UNKNOWN),
+                         tampered(FASTBOOT_UNKNOWN), userspace(FASTBOOT_UNKNOWN) {}
+    
+    // Merges fastboot output ("(bootloader) key: value", "key:value" or, for
+    // single getvars, "key: value") into the table. Later values win.
+    // Returns the number of variables read.
+    size_t Parse(const char* data, size_t len) {
+        size_t base = arena.size();
+        arena.append(data, len);
+        const char* text = arena.data();
+        size_t before = entries.size();
+        size_t partitionsBefore = partitions.size();
+        
+        for (size_t pos = base, end = arena.size(); pos < end; ) {
+            const char* line = text + pos;
+            const char* eol = (const char*)memchr(line, '\n', end - pos);
+            if (!eol) eol = text + end;
+            pos = eol - text + 1;
+            
+            const char* last = eol;
+            while (last > line && (last[-1] == '\r' || last[-1] == ' ')) last--;
+            bool bootloader = last - line > 13 && memcmp(line, "(bootloader) ", 13) == 0;
+            if (bootloader) line += 13;
+            
+            // "key: value" (bootloaders, fastboot.exe) or "key:value" (fastbootd)
+            const char* sep = NULL;
+            for (const char* p = line; p + 1 < last; p++) {
+                if (p[0] == ':' && p[1] == ' ') { sep = p; break; }
+            }
+            const char* value;
+            if (sep) {
+                value = sep + 2;
+            } else {
+                for (const char* p = last; p > line && !sep; p--) {
+                    if (p[-1] == ':') sep = p - 1;
+                }
+                if (!sep) continue;
+                value = sep + 1;
+            }
+            while (value < last && *value == ' ') value++;
+            size_t keyLen = sep - line;
+            // Unprefixed lines are tool chatter ("Finished. Total time: ...",
+            // "all:") unless they look like a single getvar answer
+            if (keyLen == 0 || (!bootloader && (line[0] < 'a' || line[0] > 'z' ||
+                                memchr(line, ' ', keyLen) || KeyIs(line, keyLen, "all")))) {
+                continue;
+            }
+            Entry e = { (uint32_t)(line - text), (uint32_t)keyLen,
+                        (uint32_t)(value - text), (uint32_t)(last - value) };
+            entries.push_back(e);
+            Decode(e);
+        }
+        
+        if (partitions.size() > partitionsBefore) MergePartitions();
+        // Stable, so among equal keys the most recent stays last
+        std::stable_sort(entries.begin(), entries.end(), [this](const Entry& a, const Entry& b) {
+            return Compare(a.keyOff, a.keyLen, arena.data() + b.keyOff, b.keyLen) < 0;
+        });
+        return entries.size() - before;
+    }
+    
+    bool Get(const std::string& key, std::string& value) const {
+        const Entry* e = Find(key.data(), key.size());
+        if (!e) return false;
+        value.assign(arena, e->valOff, e->valLen);
+        return true;
+    }
+    
+    std::string Value(const std::string& key) const {
+        std::string value;
+        Get(key, value);
+        return value;
+    }
+    
+    std::string PartitionName(const Partition& p) const { return arena.substr(p.nameOff, p.nameLen); }
+    std::string PartitionType(const Partition& p) const { return arena.substr(p.typeOff, p.typeLen); }
+    
+    // Size in bytes, 0 when the device didn't report the partition
+    uint64_t PartitionSize(const std::string& name) const {
+        const Partition* p = FindPartition(name.data(), name.size());
+        return p ? p->size : 0;
+    }
+    
+    size_t Size() const { return entries.size(); }
+    
+    uint64_t maxDownloadSize;
+    int slotCount;
+    char currentSlot;               // 0 when not A/B
+    int unlocked;                   // "unlocked" or oem "Device unlocked"
+    int criticalUnlocked;
+    int secure;
+    int tampered;
+    int userspace;                  // fastbootd rather than the bootloader
+    std::vector<Partition> partitions;  // sorted by name
+    std::vector<Slot> slots;            // sorted by name
+
+private:
+    struct Entry { uint32_t keyOff, keyLen, valOff, valLen; };
+    std::string arena;
+    std::vector<Entry> entries;     // sorted by key
+    
+    static bool KeyIs(const char* key, size_t len, const char* name) {
+        return strlen(name) == len && memcmp(key, name, len) == 0;
+    }
+    
+    // Prefix match; rest/restLen get what follows it ("partition-size:" -> "boot")
+    static bool KeyHas(const char* key, size_t len, const char* prefix, const char*& rest, size_t& restLen) {
+        size_t n = strlen(prefix);
+        if (len <= n || memcmp(key, prefix, n) != 0) return false;
+        rest = key + n;
+        restLen = len - n;
+        return true;
+    }
+    
+    static int ParseBool(const char* v, size_t len) {
+        if (KeyIs(v, len, "yes") || KeyIs(v, len, "true") || KeyIs(v, len, "1")) return 1;
+        if (KeyIs(v, len, "no") || KeyIs(v, len, "false") || KeyIs(v, len, "0")) return 0;
+        return FASTBOOT_UNKNOWN;
+    }
+    
+    // Numbers are hex with 0x (sizes) or decimal (counts); values end at the
+    // line end, so parse without strtoull's NUL terminator
+    static uint64_t ParseNumber(const char* v, size_t len) {
+        uint64_t n = 0;
+        if (len > 2 && v[0] == '0' && (v[1] == 'x' || v[1] == 'X')) {
+            for (size_t i = 2; i < len; i++) {
+                char c = v[i];
+                int d = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                        c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+                if (d < 0) break;
+                n = n * 16 + d;
+            }
+        } else {
+            for (size_t i = 0; i < len && v[i] >= '0' && v[i] <= '9'; i++) n = n * 10 + (v[i] - '0');
+        }
+        return n;
+    }
+    
+    int Compare(uint32_t off, uint32_t len, const char* key, size_t keyLen) const {
+        int c = memcmp(arena.data() + off, key, std::min<size_t>(len, keyLen));
+        return c ? c : (len < keyLen ? -1 : len > keyLen ? 1 : 0);
+    }
+    
+    const Entry* Find(const char* key, size_t len) const {
+        // Last of the equal keys: the most recent value
+        std::vector<Entry>::const_iterator it = std::upper_bound(entries.begin(), entries.end(), 0,
+            [this, key, len](int, const Entry& e) { return Compare(e.keyOff, e.keyLen, key, len) > 0; });
+        if (it == entries.begin()) return NULL;
+        --it;
+        return Compare(it->keyOff, it->keyLen, key, len) == 0 ? &*it : NULL;
+    }
+    
+    const Partition* FindPartition(const char* name, size_t len) const {
+        std::vector<Partition>::const_iterator it = std::lower_bound(partitions.begin(), partitions.end(), 0,
+            [this, name, len](const Partition& p, int) { return Compare(p.nameOff, p.nameLen, name, len) < 0; });
+        return it != partitions.end() && Compare(it->nameOff, it->nameLen, name, len) == 0 ? &*it : NULL;
+    }
+    
+    Slot& SlotNamed(char name) {
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (slots[i].name == name) return slots[i];
+        }
+        Slot slot = { name, FASTBOOT_UNKNOWN, FASTBOOT_UNKNOWN, FASTBOOT_UNKNOWN };
+        slots.insert(std::upper_bound(slots.begin(), slots.end(), slot,
+            [](const Slot& a, const Slot& b) { return a.name < b.name; }), slot);
+        return SlotNamed(name);
+    }
+    
+    void Decode(const Entry& e) {
+        const char* key = arena.data() + e.keyOff;
+        const char* v = arena.data() + e.valOff;
+        const char* rest;
+        size_t restLen;
+        if (KeyIs(key, e.keyLen, "max-download-size")) maxDownloadSize = ParseNumber(v, e.valLen);
+        else if (KeyIs(key, e.keyLen, "slot-count")) slotCount = (int)ParseNumber(v, e.valLen);
+        else if (KeyIs(key, e.keyLen, "current-slot")) currentSlot = e.valLen ? v[e.valLen - 1] : 0;   // "a" or "_a"
+        else if (KeyIs(key, e.keyLen, "unlocked") || KeyIs(key, e.keyLen, "Device unlocked")) unlocked = ParseBool(v, e.valLen);
+        else if (KeyIs(key, e.keyLen, "Device critical unlocked")) criticalUnlocked = ParseBool(v, e.valLen);
+        else if (KeyIs(key, e.keyLen, "Device tampered")) tampered = ParseBool(v, e.valLen);
+        else if (KeyIs(key, e.keyLen, "secure")) secure = ParseBool(v, e.valLen);
+        else if (KeyIs(key, e.keyLen, "is-userspace")) userspace = ParseBool(v, e.valLen);
+        else if (KeyHas(key, e.keyLen, "slot-successful:", rest, restLen) && restLen == 1) SlotNamed(*rest).successful = ParseBool(v, e.valLen);
+        else if (KeyHas(key, e.keyLen, "slot-unbootable:", rest, restLen) && restLen == 1) SlotNamed(*rest).unbootable = ParseBool(v, e.valLen);
+        else if (KeyHas(key, e.keyLen, "slot-retry-count:", rest, restLen) && restLen == 1) SlotNamed(*rest).retryCount = (int)ParseNumber(v, e.valLen);
+        else {
+            // One record per line for now; MergePartitions folds them per name
+            Partition p = { 0, 0, 0, 0, 0, FASTBOOT_UNKNOWN };
+            if (KeyHas(key, e.keyLen, "partition-size:", rest, restLen)) p.size = ParseNumber(v, e.valLen);
+            else if (KeyHas(key, e.keyLen, "partition-type:", rest, restLen)) { p.typeOff = e.valOff; p.typeLen = e.valLen; }
+            else if (KeyHas(key, e.keyLen, "is-logical:", rest, restLen)) p.logical = ParseBool(v, e.valLen);
+            else return;
+            p.nameOff = (uint32_t)(rest - arena.data());
+            p.nameLen = (uint32_t)restLen;
+            partitions.push_back(p);
+        }
+    }
+    
+    void MergePartitions() {
+        std::stable_sort(partitions.begin(), partitions.end(), [this](const Partition& a, const Partition& b) {
+            return Compare(a.nameOff, a.nameLen, arena.data() + b.nameOff, b.nameLen) < 0;
+        });
+        size_t out = 0;
+        for (size_t i = 0; i < partitions.size(); i++) {
+            const Partition& p = partitions[i];
+            if (out > 0 && Compare(partitions[out - 1].nameOff, partitions[out - 1].nameLen,
+                                   arena.data() + p.nameOff, p.nameLen) == 0) {
+                Partition& merged = partitions[out - 1];
+                if (p.size) merged.size = p.size;
+                if (p.typeLen) { merged.typeOff = p.typeOff; merged.typeLen = p.typeLen; }
+                if (p.logical != FASTBOOT_UNKNOWN) merged.logical = p.logical;
+            } else {
+                partitions[out++] = p;
+            }
+        }
+        partitions.resize(out);
+    }
+};
+
+ProcessResult RunProcess(const std::vector<std::string>& argv, const OutputCallback& onOutput, unsigned long timeoutMs);
+
+// Log pipeline
+// Log lines from any thread go into a bounded lock-free queue; one consumer
+// drains it into a fixed-capacity ring. frpunlock.cpp's log view reads the
+// ring, devbench.cpp measures both.
+#define LOG_QUEUE_CAPACITY 65536
+#define LOG_RING_CAPACITY 100000
+
+struct LogRecord {
+    unsigned long long time;    // UTC FILETIME ticks
+    std::string text;
+    
+    LogRecord() : time(0) {}
+};
+
+// Bounded multi-producer queue (Vyukov sequence-numbered ring) with a single
+// consumer. Producers fill the slot in place and the consumer swaps it out,
+// so slot buffers keep their capacity and steady-state pushes do not
+// allocate. A full queue drops the item and counts it rather than blocking.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity)   // power of two
+        : slots(new Slot[capacity]), mask(capacity - 1), enqueuePos(0), dequeuePos(0), dropped(0) {
+        for (size_t i = 0; i < capacity; i++) {
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+    
+    // fill(T&) runs on the claimed slot before it is published
+    template <typename Fill>
+    bool Push(const Fill& fill) {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &slots[pos & mask];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        fill(slot->item);
+        slot->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+    
+    // Consumer side; one thread only. The caller's old contents are
+    // recycled into the slot.
+    bool Pop(T& out) {
+        Slot& slot = slots[dequeuePos & mask];
+        if (slot.seq.load(std::memory_order_acquire) != dequeuePos + 1) return false;
+        std::swap(out, slot.item);
+        slot.seq.store(dequeuePos + mask + 1, std::memory_order_release);
+        dequeuePos++;
+        return true;
+    }
+    
+    size_t TakeDropped() { return dropped.exchange(0); }
+    
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        T item;
+    };
+    
+    std::unique_ptr<Slot[]> slots;
+    size_t mask;
+    std::atomic<size_t> enqueuePos;
+    size_t dequeuePos;
+    std::atomic<size_t> dropped;
+};
+
+// Fixed-capacity record ring; consumer thread only
+class LogRing {
+public:
+    LogRing() : start(0), count(0) {}
+    
+    size_t Size() const { return count; }
+    const LogRecord& At(size_t index) const { return records[(start + index) % LOG_RING_CAPACITY]; }
+    
+    // Takes ownership of rec's contents; rec receives the evicted buffer.
+    // Returns true when the oldest record was overwritten.
+    bool Append(LogRecord& rec) {
+        if (records.size() < LOG_RING_CAPACITY) {
+            records.push_back(LogRecord());
+            records.back().time = rec.time;
+            records.back().text.swap(rec.text);
+            count++;
+            return false;
+        }
+        LogRecord& slot = records[(start + count) % LOG_RING_CAPACITY];
+        slot.time = rec.time;
+        slot.text.swap(rec.text);
+        if (count < LOG_RING_CAPACITY) {
+            count++;
+            return false;
+        }
+        start = (start + 1) % LOG_RING_CAPACITY;
+        return true;
+    }
+    
+    void Clear() {
+        start = 0;
+        count = 0;
+    }
+    
+private:
+    std::vector<LogRecord> records;
+    size_t start;
+    size_t count;
+};
+
+// Firmware packages
+// Samsung .tar.md5 packages are a tar archive followed by one "<md5 hex>
+// <name>" line whose MD5 covers everything before it. The header walk and
+// the hash are here; how the bytes are read (mapped windows, overlapped
+// reads on Windows) is up to the caller.
+#define TAR_BLOCK 512
+#define TAR_MAX_LONG_NAME 65536
+
+#define MD5_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD5_G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+#define MD5_STEP(f, a, b, c, d, x, t, s) \
+    (a) += f((b), (c), (d)) + (x) + (t); \
+    (a) = ((a) << (s)) | ((a) >> (32 - (s))); \
+    (a) += (b)
+
+// RFC 1321 MD5
+class Md5 {
+public:
+    Md5() : length(0), buffered(0) {
+        state[0] = 0x67452301;
+        state[1] = 0xefcdab89;
+        state[2] = 0x98badcfe;
+        state[3] = 0x10325476;
+    }
+    
+    void Update(const void* data, size_t len) {
+        const uint8_t* p = (const uint8_t*)data;
+        length += len;
+        if (buffered) {
+            size_t take = std::min(sizeof(buffer) - buffered, len);
+            memcpy(buffer + buffered, p, take);
+            buffered += take;
+            p += take;
+            len -= take;
+            if (buffered < sizeof(buffer)) return;
+            Blocks(buffer, 1);
+            buffered = 0;
+        }
+        if (len >= 64) {
+            Blocks(p, len / 64);
+            p += len & ~(size_t)63;
+            len &= 63;
+        }
+        if (len) {
+            memcpy(buffer, p, len);
+            buffered = len;
+        }
+    }
+    
+    std::string HexDigest() {
+        static const uint8_t padding[64] = { 0x80 };
+        uint64_t bits = length * 8;
+        Update(padding, buffered < 56 ? 56 - buffered : 120 - buffered);
+        uint8_t tail[8];
+        for (int i = 0; i < 8; i++) tail[i] = (uint8_t)(bits >> (8 * i));
+        Update(tail, sizeof(tail));
+        
+        char hex[33];
+        for (int i = 0; i < 16; i++) {
+            snprintf(hex + 2 * i, 3, "%02x", (state[i / 4] >> (8 * (i % 4))) & 0xFF);
+        }
+        return std::string(hex, 32);
+    }
+    
+private:
+    uint32_t state[4];
+    uint64_t length;
+    uint8_t buffer[64];
+    size_t buffered;
+    
+    // Little-endian input words; x86/x64 and little-endian ARM only
+    void Blocks(const uint8_t* p, size_t count) {
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t x[16];
+        for (; count > 0; count--, p += 64) {
+            memcpy(x, p, sizeof(x));
+            uint32_t aa = a, bb = b, cc = c, dd = d;
+            
+            MD5_STEP(MD5_F, a, b, c, d, x[0], 0xd76aa478, 7);
+            MD5_STEP(MD5_F, d, a, b, c, x[1], 0xe8c7b756, 12);
+            MD5_STEP(MD5_F, c, d, a, b, x[2], 0x242070db, 17);
+            MD5_STEP(MD5_F, b, c, d, a, x[3], 0xc1bdceee, 22);
+            MD5_STEP(MD5_F, a, b, c, d, x[4], 0xf57c0faf, 7);
+            MD5_STEP(MD5_F, d, a, b, c, x[5], 0x4787c62a, 12);
+            MD5_STEP(MD5_F, c, d, a, b, x[6], 0xa8304613, 17);
+            MD5_STEP(MD5_F, b, c, d, a, x[7], 0xfd469501, 22);
+            MD5_STEP(MD5_F, a, b, c, d, x[8], 0x698098d8, 7);
+            MD5_STEP(MD5_F, d, a, b, c, x[9], 0x8b44f7af, 12);
+            MD5_STEP(MD5_F, c, d, a, b, x[10], 0xffff5bb1, 17);
+            MD5_STEP(MD5_F, b, c, d, a, x[11], 0x895cd7be, 22);
+            MD5_STEP(MD5_F, a, b, c, d, x[12], 0x6b901122, 7);
+            MD5_STEP(MD5_F, d, a, b, c, x[13], 0xfd987193, 12);
+            MD5_STEP(MD5_F, c, d, a, b, x[14], 0xa679438e, 17);
+            MD5_STEP(MD5_F, b, c, d, a, x[15], 0x49b40821, 22);
+
+            MD5_STEP(MD5_G, a, b, c, d, x[1], 0xf61e2562, 5);
+            MD5_STEP(MD5_G, d, a, b, c, x[6], 0xc040b340, 9);
+            MD5_STEP(MD5_G, c, d, a, b, x[11], 0x265e5a51, 14);
+            MD5_STEP(MD5_G, b, c, d, a, x[0], 0xe9b6c7aa, 20);
+            MD5_STEP(MD5_G, a, b, c, d, x[5], 0xd62f105d, 5);
+            MD5_STEP(MD5_G, d, a, b, c, x[10], 0x02441453, 9);
+            MD5_STEP(MD5_G, c, d, a, b, x[15], 0xd8a1e681, 14);
+            MD5_STEP(MD5_G, b, c, d, a, x[4], 0xe7d3fbc8, 20);
+            MD5_STEP(MD5_G, a, b, c, d, x[9], 0x21e1cde6, 5);
+            MD5_STEP(MD5_G, d, a, b, c, x[14], 0xc33707d6, 9);
+            MD5_STEP(MD5_G, c, d, a, b, x[3], 0xf4d50d87, 14);
+            MD5_STEP(MD5_G, b, c, d, a, x[8], 0x455a14ed, 20);
+            MD5_STEP(MD5_G, a, b, c, d, x[13], 0xa9e3e905, 5);
+            MD5_STEP(MD5_G, d, a, b, c, x[2], 0xfcefa3f8, 9);
+            MD5_STEP(MD5_G, c, d, a, b, x[7], 0x676f02d9, 14);
+            MD5_STEP(MD5_G, b, c, d, a, x[12], 0x8d2a4c8a, 20);
+
+            MD5_STEP(MD5_H, a, b, c, d, x[5], 0xfffa3942, 4);
+            MD5_STEP(MD5_H, d, a, b, c, x[8], 0x8771f681, 11);
+            MD5_STEP(MD5_H, c, d, a, b, x[11], 0x6d9d6122, 16);
+            MD5_STEP(MD5_H, b, c, d, a, x[14], 0xfde5380c, 23);
+            MD5_STEP(MD5_H, a, b, c, d, x[1], 0xa4beea44, 4);
+            MD5_STEP(MD5_H, d, a, b, c, x[4], 0x4bdecfa9, 11);
+            MD5_STEP(MD5_H, c, d, a, b, x[7], 0xf6bb4b60, 16);
+            MD5_STEP(MD5_H, b, c, d, a, x[10], 0xbebfbc70, 23);
+            MD5_STEP(MD5_H, a, b, c, d, x[13], 0x289b7ec6, 4);
+            MD5_STEP(MD5_H, d, a, b, c, x[0], 0xeaa127fa, 11);
+            MD5_STEP(MD5_H, c, d, a, b, x[3], 0xd4ef3085, 16);
+            MD5_STEP(MD5_H, b, c, d, a, x[6], 0x04881d05, 23);
+            MD5_STEP(MD5_H, a, b, c, d, x[9], 0xd9d4d039, 4);
+            MD5_STEP(MD5_H, d, a, b, c, x[12], 0xe6db99e5, 11);
+            MD5_STEP(MD5_H, c, d, a, b, x[15], 0x1fa27cf8, 16);
+            MD5_STEP(MD5_H, b, c, d, a, x[2], 0xc4ac5665, 23);
+
+            MD5_STEP(MD5_I, a, b, c, d, x[0], 0xf4292244, 6);
+            MD5_STEP(MD5_I, d, a, b, c, x[7], 0x432aff97, 10);
+            MD5_STEP(MD5_I, c, d, a, b, x[14], 0xab9423a7, 15);
+            MD5_STEP(MD5_I, b, c, d, a, x[5], 0xfc93a039, 21);
+            MD5_STEP(MD5_I, a, b, c, d, x[12], 0x655b59c3, 6);
+            MD5_STEP(MD5_I, d, a, b, c, x[3], 0x8f0ccc92, 10);
+            MD5_STEP(MD5_I, c, d, a, b, x[10], 0xffeff47d, 15);
+            MD5_STEP(MD5_I, b, c, d, a, x[1], 0x85845dd1, 21);
+            MD5_STEP(MD5_I, a, b, c, d, x[8], 0x6fa87e4f, 6);
+            MD5_STEP(MD5_I, d, a, b, c, x[15], 0xfe2ce6e0, 10);
+            MD5_STEP(MD5_I, c, d, a, b, x[6], 0xa3014314, 15);
+            MD5_STEP(MD5_I, b, c, d, a, x[13], 0x4e0811a1, 21);
+            MD5_STEP(MD5_I, a, b, c, d, x[4], 0xf7537e82, 6);
+            MD5_STEP(MD5_I, d, a, b, c, x[11], 0xbd3af235, 10);
+            MD5_STEP(MD5_I, c, d, a, b, x[2], 0x2ad7d2bb, 15);
+            MD5_STEP(MD5_I, b, c, d, a, x[9], 0xeb86d391, 21);
+            a += aa;
+            b += bb;
+            c += cc;
+            d += dd;
+        }
+        state[0] = a;
+        state[1] = b;
+        state[2] = c;
+        state[3] = d;
+    }
+};
+
+struct TarMember {
+    std::string name;
+    uint64_t offset;            // of the member data
+    uint64_t size;
+    char type;                  // tar typeflag: '0' file, '5' directory, ...
+};
+
+// Octal tar number, or GNU base-256 when the top bit of the field is set
+inline uint64_t TarNumber(const char* field, size_t len) {
+    if ((unsigned char)field[0] & 0x80) {
+        uint64_t value = (unsigned char)field[0] & 0x7F;
+        for (size_t i = 1; i < len; i++) value = (value << 8) | (unsigned char)field[i];
+        return value;
+    }
+    uint64_t value = 0;
+    size_t i = 0;
+    while (i < len && field[i] == ' ') i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) value = value * 8 + (field[i] - '0');
+    return value;
+}
+
+inline std::string TarString(const char* field, size_t len) {
+    return std::string(field, strnlen(field, len));
+}
+
+inline bool TarChecksumValid(const char* header) {
+    uint64_t stored = TarNumber(header + 148, 8);
+    uint64_t sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        sum += (i >= 148 && i < 156) ? ' ' : (unsigned char)header[i];
+    }
+    return sum == stored;
+}
+
+// Extracts "path" from a pax extended header ("<len> path=<value>\n" records)
+inline std::string PaxPath(const char* data, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        size_t recLen = 0, i = pos;
+        while (i < len && data[i] >= '0' && data[i] <= '9') recLen = recLen * 10 + (data[i++] - '0');
+        if (recLen == 0 || pos + recLen > len || i >= len) break;
+        std::string record(data + i + 1, recLen - (i + 1 - pos));
+        if (record.compare(0, 5, "path=") == 0) {
+            size_t end = record.size();
+            if (end > 5 && record[end - 1] == '\n') end--;
+            return record.substr(5, end - 5);
+        }
+        pos += recLen;
+    }
+    return "";
+}
+
+// Walks the 512-byte headers of a tar archive; member data is never
+// touched. map(offset, len) returns a pointer to that many bytes of the
+// archive, or NULL past its end.
+template <typename Map>
+bool ScanTarHeaders(const Map& map, std::vector<TarMember>& members, std::string& error) {
+    std::string longName;
+    uint64_t offset = 0;
+    for (;;) {
+        const char* header = map(offset, TAR_BLOCK);
+        if (!header) break;                             // truncated or .md5 trailer
+        if (header[0] == '\0') break;                   // end-of-archive block
+        if (!TarChecksumValid(header)) {
+            if (offset == 0) {
+                error = "not a tar archive";
+                return false;
+            }
+            break;                                      // .tar.md5 trailer line
+        }
+        
+        uint64_t size = TarNumber(header + 124, 12);
+        char type = header[156];
+        uint64_t dataOffset = offset + TAR_BLOCK;
+        uint64_t next = dataOffset + ((size + TAR_BLOCK - 1) & ~(uint64_t)(TAR_BLOCK - 1));
+        
+        if (type == 'L' || type == 'x') {
+            // Name for the following member (GNU long name / pax path)
+            if (size > TAR_MAX_LONG_NAME) {
+                error = "oversized long name at offset " + std::to_string(offset);
+                return false;
+            }
+            const char* data = map(dataOffset, (size_t)size);
+            if (!data) break;
+            longName = type == 'L' ? TarString(data, (size_t)size) : PaxPath(data, (size_t)size);
+        } else if (type != 'g' && type != 'K') {
+            TarMember member;
+            if (!longName.empty()) {
+                member.name.swap(longName);
+            } else {
+                member.name = TarString(header, 100);
+                if (memcmp(header + 257, "ustar", 5) == 0 && header[345]) {
+                    member.name = TarString(header + 345, 155) + "/" + member.name;
+                }
+            }
+            member.offset = dataOffset;
+            member.size = size;
+            member.type = type ? type : '0';
+            members.push_back(member);
+            longName.clear();
+        }
+        offset = next;
+    }
+    if (members.empty()) {
+        error = "empty or not a tar archive";
+        return false;
+    }
+    return true;
+}
+
+inline long long CoreMillisecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+#ifndef _WIN32
+
+// Pipe with both ends close-on-exec from the start, so a fork on another
+// thread can't inherit it; dup2 clears the flag on the child's stdout/stderr
+inline bool CorePipe(int fds[2]) {
+#ifdef __APPLE__
+    if (pipe(fds) != 0) return false;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+#else
+    return pipe2(fds, O_CLOEXEC) == 0;
+#endif
+}
+
+// POSIX executor: the child gets its own process group, so a timeout kills
+// whatever it started too. Output is read as it arrives, like on Windows.
+// exec failures come back through a close-on-exec pipe.
+inline ProcessResult RunProcess(const std::vector<std::string>& argv, const OutputCallback& onOutput,
+                                unsigned long timeoutMs) {
+    ProcessResult result;
+    if (argv.empty()) {
+        result.error = "Error: Empty command";
+        return result;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    
+    int out[2], status[2];
+    if (!CorePipe(out)) {
+        result.error = "Error: Failed to create pipe";
+        return result;
+    }
+    if (!CorePipe(status)) {
+        close(out[0]);
+        close(out[1]);
+        result.error = "Error: Failed to create pipe";
+        return result;
+    }
+    
+    std::vector<char*> args;
+    for (size_t i = 0; i < argv.size(); i++) args.push_back(const_cast<char*>(argv[i].c_str()));
+    args.push_back(NULL);
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, 0);
+        dup2(out[1], 1);
+        dup2(out[1], 2);
+        close(out[1]);
+        close(status[0]);
+        execvp(args[0], &args[0]);
+        int error = errno;
+        if (write(status[1], &error, sizeof(error)) < 0) _exit(127);
+        _exit(127);
+    }
+    close(out[1]);
+    close(status[1]);
+    int execError = 0;
+    std::string command = BuildCommandLine(argv);
+    if (pid < 0 || read(status[0], &execError, sizeof(execError)) > 0) {
+        close(status[0]);
+        close(out[0]);
+        if (pid > 0) waitpid(pid, NULL, 0);
+        result.error = "Error: Failed to execute command" + (execError ? ": " + std::string(strerror(execError)) : "");
+        RecordProcessSample(command, -1, -1, CoreMicrosecondsSince(start), 0, false, true);
+        return result;
+    }
+    close(status[0]);
+    result.started = true;
+    long long spawnUs = CoreMicrosecondsSince(start), firstByteUs = -1;
+    
+    PooledChunk buffer;
+    bool exited = false, killed = false;
+    int waitStatus = 0;
+    std::chrono::steady_clock::time_point drainDeadline;
+    for (;;) {
+        struct pollfd pfd = { out[0], POLLIN, 0 };
+        int ready = poll(&pfd, 1, PROCESS_POLL_MS);
+        if (ready > 0) {
+            ssize_t n = read(out[0], buffer.Data(), buffer.Size());
+            if (n <= 0) break;      // EOF: every writer has gone away
+            if (result.bytes == 0) {
+                firstByteUs = CoreMicrosecondsSince(start);
+                result.firstByteMs = firstByteUs / 1000;
+            }
+            result.bytes += (size_t)n;
+            if (onOutput) onOutput(buffer.Data(), (size_t)n);
+        } else if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        // Checked on every pass, data or not: a child that writes more often
+        // than PROCESS_POLL_MS would otherwise never time out
+        if (!exited && waitpid(pid, &waitStatus, WNOHANG) == pid) {
+            // Grandchildren may still hold the pipe; give them a moment
+            exited = true;
+            drainDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(PROCESS_DRAIN_MS);
+        }
+        if (exited && std::chrono::steady_clock::now() > drainDeadline) break;
+        if (!exited && !killed && (unsigned long long)CoreMillisecondsSince(start) > timeoutMs) {
+            result.timedOut = true;
+            killed = true;
+            kill(-pid, SIGKILL);
+        }
+    }
+    close(out[0]);
+    if (!exited) waitpid(pid, &waitStatus, 0);
+    if (killed) kill(-pid, SIGKILL);    // anything left of the group
+    
+    if (WIFEXITED(waitStatus)) result.exitCode = WEXITSTATUS(waitStatus);
+    else if (WIFSIGNALED(waitStatus)) result.exitCode = 128 + WTERMSIG(waitStatus);
+    long long totalUs = CoreMicrosecondsSince(start);
+    result.totalMs = totalUs / 1000;
+    RecordProcessSample(command, spawnUs, firstByteUs, totalUs, result.bytes, result.timedOut,
+        result.timedOut || result.exitCode != 0);
+    return result;
+}
+#endif
+
+// Batch runs
+// A script is run line by line on every target device, with the devices
+// side by side. Script lines:
+//   adb <args>          on each adb device, as adb -s <serial> <args>
+//   fastboot <args>     on each fastboot device
+//   expect <text>       the device's previous output must contain text
+//   # comment
+// Devices, command results, expectations and a final summary are written
+// as one JSON object per line. Failures (non-zero exit, timeout, a failed
+// expect, a requested device that isn't attached) are counted, not fatal.
+struct BatchOptions {
+    std::string adbPath;
+    std::string fastbootPath;
+    std::vector<std::string> serials;   // empty: every device found
+    size_t jobs;                        // devices run at once
+    unsigned long timeoutMs;            // per command
+    std::string script;
+    std::string statsPath;              // latency export, CSV or JSON lines
+    
+    BatchOptions() : adbPath("adb"), fastbootPath("fastboot"), jobs(8), timeoutMs(PROCESS_DEFAULT_TIMEOUT_MS) {}
+};
+
+typedef std::function<void(const std::string& line)> BatchEmit;
+
+// args[0] is the program or mode name; reads the script (a path or "-" for
+// stdin). Returns false with a message on bad arguments.
+inline bool ParseBatchArgs(const std::vector<std::string>& args, BatchOptions& options, std::string& error) {
+    std::string scriptPath;
+    for (size_t i = 1; i < args.size(); i++) {
+        bool hasValue = i + 1 < args.size();
+        if (args[i] == "--adb" && hasValue) options.adbPath = args[++i];
+        else if (args[i] == "--fastboot" && hasValue) options.fastbootPath = args[++i];
+        else if (args[i] == "--stats" && hasValue) options.statsPath = args[++i];
+        else if (args[i] == "--jobs" && hasValue) options.jobs = (size_t)std::max(atoi(args[++i].c_str()), 1);
+        else if (args[i] == "--timeout" && hasValue) options.timeoutMs = (unsigned long)std::max(atol(args[++i].c_str()), 1L);
+        else if (args[i] == "--serial" && hasValue) {
+            std::istringstream list(args[++i]);
+            std::string serial;
+            while (std::getline(list, serial, ',')) {
+                if (!serial.empty()) options.serials.push_back(serial);
+            }
+        } else if (scriptPath.empty() && (args[i] == "-" || args[i].compare(0, 2, "--") != 0)) {
+            scriptPath = args[i];
+        } else {
+            error = "unknown option " + args[i];
+            return false;
+        }
+    }
+    if (scriptPath.empty()) {
+        error = "no script given";
+        return false;
+    }
+    std::ostringstream text;
+    if (scriptPath == "-") {
+        text << std::cin.rdbuf();
+    } else {
+        std::ifstream in(scriptPath.c_str());
+        if (!in) {
+            error = "cannot open " + scriptPath;
+            return false;
+        }
+        text << in.rdbuf();
+    }
+    options.script = text.str();
+    return true;
+}
+
+struct BatchStep {
+    int line;
+    std::string text;
+    std::vector<std::string> argv;      // without the tool; empty for expect
+    bool fastboot;
+    bool expect;
+};
+
+struct BatchDevice {
+    std::string serial;
+    std::string transport;              // "adb" or "fastboot"
+    std::string state;
+    std::string model;
+};
+
+inline std::string BatchDeviceJson(const BatchDevice& dev) {
+    return "{\"type\":\"device\",\"serial\":\"" + JsonEscape(dev.serial) + "\",\"transport\":\"" + dev.transport +
+           "\",\"state\":\"" + JsonEscape(dev.state) + "\",\"model\":\"" + JsonEscape(dev.model) + "\"}";
+}
+
+// Typed fields for output the core knows how to parse
+inline std::string BatchParsedJson(const BatchStep& step, const std::string& output) {
+    std::ostringstream json;
+    if (step.fastboot && !step.argv.empty() && step.argv[0] == "getvar") {
+        FastbootVarTable vars;
+        vars.Parse(output.data(), output.size());
+        json << ",\"vars\":" << vars.Size();
+        if (vars.maxDownloadSize) json << ",\"max_download_size\":" << vars.maxDownloadSize;
+        if (vars.currentSlot) json << ",\"current_slot\":\"" << vars.currentSlot << "\"";
+        if (vars.unlocked != FASTBOOT_UNKNOWN) json << ",\"unlocked\":" << (vars.unlocked ? "true" : "false");
+    } else if (!step.fastboot && step.argv.size() == 2 && step.argv[0] == "shell" && step.argv[1] == "getprop") {
+        PropertySnapshot props;
+        props.Parse(output);
+        json << ",\"props\":" << props.Size();
+    }
+    return json.str();
+}
+
+// Returns the number of failures
+inline int RunBatch(const BatchOptions& options, const BatchEmit& emit) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::mutex emitMutex;
+    auto write = [&](const std::string& line) {
+        std::lock_guard<std::mutex> lock(emitMutex);
+        emit(line);
+    };
+    
+    std::vector<BatchStep> steps;
+    std::istringstream lines(options.script);
+    std::string text;
+    for (int number = 1; std::getline(lines, text); number++) {
+        if (!text.empty() && text[text.size() - 1] == '\r') text.erase(text.size() - 1);
+        std::vector<std::string> argv = SplitCommandLine(text);
+        if (argv.empty() || argv[0][0] == '#') continue;
+        BatchStep step;
+        step.line = number;
+        step.text = text;
+        step.fastboot = argv[0] == "fastboot";
+        step.expect = argv[0] == "expect";
+        if (step.expect) {
+            size_t from = text.find_first_not_of(" \t", text.find("expect") + 6);
+            step.argv.push_back(from == std::string::npos ? "" : text.substr(from));
+        } else if (argv[0] == "adb" || step.fastboot) {
+            step.argv.assign(argv.begin() + 1, argv.end());
+        } else {
+            write("{\"type\":\"error\",\"line\":" + std::to_string(number) +
+                  ",\"error\":\"expected adb, fastboot or expect\",\"text\":\"" + JsonEscape(text) + "\"}");
+            return 1;
+        }
+        steps.push_back(step);
+    }
+    
+    // Both transports are listed at once
+    std::vector<BatchDevice> found;
+    std::string adbList, fastbootList;
+    std::vector<std::string> adbArgs, fastbootArgs;
+    adbArgs.push_back(options.adbPath);
+    adbArgs.push_back("devices");
+    adbArgs.push_back("-l");
+    fastbootArgs.push_back(options.fastbootPath);
+    fastbootArgs.push_back("devices");
+    ProcessResult adbScan, fastbootScan;
+    std::thread fastbootThread([&]() {
+        fastbootScan = RunProcess(fastbootArgs, [&](const char* data, size_t len) { fastbootList.append(data, len); },
+            options.timeoutMs);
+    });
+    adbScan = RunProcess(adbArgs, [&](const char* data, size_t len) { adbList.append(data, len); }, options.timeoutMs);
+    fastbootThread.join();
+    
+    // A missing tool only matters if the script needs it
+    std::atomic<int> failed(0);
+    bool needAdb = false, needFastboot = false;
+    for (size_t s = 0; s < steps.size(); s++) {
+        if (!steps[s].expect) (steps[s].fastboot ? needFastboot : needAdb) = true;
+    }
+    if (needAdb && !adbScan.started) {
+        write("{\"type\":\"error\",\"error\":\"" + JsonEscape(options.adbPath + ": " + adbScan.error) + "\"}");
+        failed++;
+    }
+    if (needFastboot && !fastbootScan.started) {
+        write("{\"type\":\"error\",\"error\":\"" + JsonEscape(options.fastbootPath + ": " + fastbootScan.error) + "\"}");
+        failed++;
+    }
+    std::vector<AdbDevice> adbDevices = ParseAdbDevices(adbList);
+    std::vector<AdbDevice> fastbootDevices = ParseFastbootDevices(fastbootList);
+    for (size_t i = 0; i < adbDevices.size() + fastbootDevices.size(); i++) {
+        bool fastboot = i >= adbDevices.size();
+        const AdbDevice& d = fastboot ? fastbootDevices[i - adbDevices.size()] : adbDevices[i];
+        BatchDevice dev;
+        dev.serial = d.serial;
+        dev.transport = fastboot ? "fastboot" : "adb";
+        dev.state = d.state;
+        dev.model = d.model;
+        found.push_back(dev);
+    }
+    
+    std::vector<BatchDevice> targets;
+    if (options.serials.empty()) {
+        targets = found;
+    } else {
+        for (size_t s = 0; s < options.serials.size(); s++) {
+            size_t before = targets.size();
+            for (size_t i = 0; i < found.size(); i++) {
+                if (found[i].serial == options.serials[s]) targets.push_back(found[i]);
+            }
+            if (targets.size() == before) {
+                BatchDevice missing;
+                missing.serial = options.serials[s];
+                missing.transport = "none";
+                missing.state = "missing";
+                write(BatchDeviceJson(missing));
+                failed++;
+            }
+        }
+    }
+    for (size_t i = 0; i < targets.size(); i++) write(BatchDeviceJson(targets[i]));
+    
+    std::atomic<size_t> next(0);
+    std::atomic<int> commands(0);
+    auto worker = [&]() {
+        for (size_t d = next++; d < targets.size(); d = next++) {
+            const BatchDevice& dev = targets[d];
+            bool fastboot = dev.transport == "fastboot";
+            bool ran = false;
+            std::string output;
+            for (size_t s = 0; s < steps.size(); s++) {
+                const BatchStep& step = steps[s];
+                std::string where = ",\"serial\":\"" + JsonEscape(dev.serial) + "\",\"line\":" +
+                                    std::to_string(step.line);
+                if (step.expect) {
+                    if (!ran) continue;     // nothing on this device to check
+                    bool ok = output.find(step.argv[0]) != std::string::npos;
+                    if (!ok) failed++;
+                    write("{\"type\":\"expect\"" + where + ",\"text\":\"" + JsonEscape(step.argv[0]) +
+                          "\",\"ok\":" + (ok ? "true" : "false") + "}");
+                    continue;
+                }
+                ran = step.fastboot == fastboot;
+                if (!ran || (!fastboot && dev.state != "device")) {
+                    ran = false;
+                    continue;
+                }
+                
+                std::vector<std::string> argv;
+                argv.push_back(fastboot ? options.fastbootPath : options.adbPath);
+                argv.push_back("-s");
+                argv.push_back(dev.serial);
+                argv.insert(argv.end(), step.argv.begin(), step.argv.end());
+                output.clear();
+                ProcessResult r = RunProcess(argv, [&](const char* data, size_t len) { output.append(data, len); },
+                    options.timeoutMs);
+                commands++;
+                bool ok = r.started && !r.timedOut && r.exitCode == 0;
+                if (!ok) failed++;
+                std::ostringstream json;
+                json << "{\"type\":\"result\"" << where << ",\"transport\":\"" << dev.transport
+                     << "\",\"command\":\"" << JsonEscape(step.text) << "\",\"exit\":" << (long long)(int)r.exitCode
+                     << ",\"ok\":" << (ok ? "true" : "false") << ",\"timed_out\":" << (r.timedOut ? "true" : "false")
+                     << ",\"ms\":" << r.totalMs << ",\"first_byte_ms\":" << r.firstByteMs << ",\"bytes\":" << r.bytes;
+                if (!r.error.empty()) json << ",\"error\":\"" << JsonEscape(r.error) << "\"";
+                json << BatchParsedJson(step, output) << ",\"output\":\"" << JsonEscape(output) << "\"}";
+                write(json.str());
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < std::min(options.jobs, targets.size()); t++) threads.push_back(std::thread(worker));
+    for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+    
+    write("{\"type\":\"summary\",\"devices\":" + std::to_string(targets.size()) + ",\"steps\":" +
+          std::to_string(steps.size()) + ",\"commands\":" + std::to_string(commands.load()) + ",\"failed\":" +
+          std::to_string(failed.load()) + ",\"ms\":" + std::to_string(CoreMillisecondsSince(start)) + "}");
+    std::string error;
+    if (!options.statsPath.empty() && !g_commandStats.Export(options.statsPath, error)) {
+        write("{\"type\":\"error\",\"error\":\"" + JsonEscape(error) + "\"}");
+    }
+    return failed;
+}
+
+#endif
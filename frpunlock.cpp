@@ -1,31 +1,92 @@
 /*
  * Samsung Galaxy S23 Device Manager
  * Windows GUI Application using ADB/Fastboot
- * Compile with: g++ -o frpunlock.exe frpunlock.cpp -mwindows -lcomctl32 -lwininet -static-libgcc -static-libstdc++ -O2 -s
- * Requires: Windows SDK, MinGW-w64 or MSYS2
+ * Compile with: g++ -std=c++17 -o frpunlock.exe frpunlock.cpp -mwindows -lcomctl32 -lwininet -lws2_32 -static-libgcc -static-libstdc++ -O2 -s
+ * Requires: Windows SDK, MinGW-w64 or MSYS2; devcore.h alongside (portable core, see devcli.cpp)
+ *
+ * Command line:
+ *   --bench-spawn [iterations] [stand-in.exe]   spawn latency, cmd.exe shim vs direct launch
+ *   --export-journal <output> [--json] [--serial S] [--since T] [--until T] [--dir D]
+ *                                               session journal to text or JSON lines
+ *   --verify <package.tar.md5>...                check embedded MD5s, report throughput
+ *   --index <package.tar.md5>...                 list tar members (cached per size/mtime)
+ *   --extract <package> <member> <output>        unpack one member, decoding .lz4
+ *   --lz4 <input.lz4> <output> [threads]         decode an LZ4 file
+ *   --bench-lz4 [total-MB] [max-threads]         parallel LZ4 decode throughput
+ *   --sparse <raw.img> <out-prefix> [max-download-size] [--verify]
+ *                                               raw -> split sparse images, round-trip check
+ *   --bench-fastboot [tcp:host[:port]] [download-MB]
+ *                                               fastboot TCP phases (built-in stand-in by default)
+ *   --fastboot-standin [port] [seconds]          fake fastboot device on 127.0.0.1
+ *   --getvar <output.txt>...                     typed table from saved getvar all / oem device-info
+ *   --bench-shell [commands] [shell-open-ms] [command-ms]
+ *                                               one-shot shells vs persistent session (stand-in adb)
+ *   --adb-selftest                               adb client against the stand-in server
+ *   --shell-batch <serial> <script.txt>          run script lines over one shell session
+ *   --broadcast <serial>[,<serial>...] <command...>
+ *                                               run an adb/fastboot command on several devices at once
+ *   --logcat <dump.bin> [filter...]              filter a saved "adb exec-out logcat -B -d" dump
+ *                                               (tag:T prio:W pid:N since:/until:/last:<s> -i regex)
+ *   --packages <baseline.txt> <listing.txt>...   diff saved "pm list packages --show-versioncode" listings
+ *   --bench-packages [packages] [devices]        inventory parse and diff cost, synthetic fleet
+ *   --build-catalog <models.csv> <devices.cat>   compile a device catalogue for lookup by model
+ *   --catalog <model>... [--file devices.cat]    look models up, with load and lookup cost
+ *   --batch <script.txt|-> [--serial S,...] [--jobs N] [--timeout ms] [--stats file.csv|file.json]
+ *                                               run a command script across devices, JSON lines out
  */
 
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
 #include <commctrl.h>
 #include <string>
 #include <vector>
+#include <map>
 #include <sstream>
 #include <iomanip>
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <set>
+#include <regex>
+#include <unordered_map>
+#include <ctime>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
 #include <cstring>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#include "devcore.h"
 
 #pragma comment(lib, "comctl32.lib")
 #pragma comment(lib, "wininet.lib")
+#pragma comment(lib, "ws2_32.lib")
 
 // Application constants
 #define APP_NAME "Samsung Galaxy S23 Device Manager"
 #define APP_VERSION "2.0.0"
 #define WM_UPDATE_LOG (WM_USER + 1)
 #define WM_DEVICE_DETECTED (WM_USER + 2)
+#define WM_DEVICE_SCAN_DONE (WM_USER + 3)
+#define WM_DEVICE_EVENT (WM_USER + 4)
+#define WM_JOB_PROGRESS (WM_USER + 5)
+#define WM_JOB_DONE (WM_USER + 6)
+#define WM_BROADCAST_UPDATE (WM_USER + 7)
+#define WM_LOGCAT_OPEN (WM_USER + 8)
+#define IDT_PROGRESS_RESET 1
+#define IDT_FASTBOOT_WATCH 2
+#define IDT_LOG_FLUSH 3
+#define LOG_FLUSH_DELAY_MS 30
+#define DISCOVERY_MAX_WORKERS 8
+#define MAX_COMMAND_LINE 32767
 
 // Control IDs
 #define IDC_BTN_DETECT 1001
@@ -44,27 +105,376 @@
 #define IDC_COMBO_COMMANDS 1014
 #define IDC_BTN_EXECUTE 1015
 #define IDC_CHK_AUTO_DETECT 1016
+#define IDC_BTN_CANCEL 1017
+#define IDC_CHK_BROADCAST 1018
 
-// Samsung Galaxy S23 Model IDs
-struct DeviceModel {
-    const char* model;
+// Device catalogue
+// Model codes (ro.product.model) map to a codename, marketing name, chipset
+// and partition layout hints. Entries are keyed by the model code without
+// its region suffix ("SM-S911"); a lookup tries the full code first, then
+// drops trailing characters, so "SM-S911U1" finds "SM-S911" and the dropped
+// "U1" names the region. Both tables use hash-and-displace perfect hashing,
+// so every probe is one hash, one displacement and one string compare:
+//   bucket = H(key, 0) % buckets, slot = H(key, disp[bucket]) & (slots - 1)
+// The displacements for the built-in table are found by the compiler.
+// devices.cat next to the executable extends and overrides the built-in
+// entries. It is mapped read-only and used in place, so loading is a
+// header check. --build-catalog writes one from CSV.
+#define CATALOG_AB 1                // A/B slots
+#define CATALOG_DYNAMIC 2           // super partition
+#define CATALOG_VENDOR_BOOT 4
+#define CATALOG_INIT_BOOT 8
+#define CATALOG_FILE "devices.cat"
+#define CATALOG_MAGIC "S23CAT01"
+#define CATALOG_EMPTY 0xFFFFFFFFu
+#define CATALOG_MAX_BUCKET 16
+
+struct CatalogRecord {
+    const char* model;              // without region suffix
     const char* codename;
-    const char* description;
+    const char* name;
+    const char* chipset;
+    uint32_t flags;
+};
+
+static constexpr CatalogRecord g_builtinCatalog[] = {
+    // Galaxy S
+    {"SM-G980", "x1s", "Galaxy S20", "Exynos 990", CATALOG_DYNAMIC},
+    {"SM-G981", "x1q", "Galaxy S20 5G", "Exynos 990 / Snapdragon 865", CATALOG_DYNAMIC},
+    {"SM-G985", "y2s", "Galaxy S20+", "Exynos 990", CATALOG_DYNAMIC},
+    {"SM-G986", "y2q", "Galaxy S20+ 5G", "Exynos 990 / Snapdragon 865", CATALOG_DYNAMIC},
+    {"SM-G988", "z3q", "Galaxy S20 Ultra", "Exynos 990 / Snapdragon 865", CATALOG_DYNAMIC},
+    {"SM-G780", "r8s", "Galaxy S20 FE", "Exynos 990", CATALOG_DYNAMIC},
+    {"SM-G781", "r8q", "Galaxy S20 FE 5G", "Snapdragon 865", CATALOG_DYNAMIC},
+    {"SM-G991", "o1s", "Galaxy S21", "Exynos 2100 / Snapdragon 888", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-G996", "t2s", "Galaxy S21+", "Exynos 2100 / Snapdragon 888", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-G998", "p3s", "Galaxy S21 Ultra", "Exynos 2100 / Snapdragon 888", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-G990", "r9q", "Galaxy S21 FE", "Exynos 2100 / Snapdragon 888", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-S901", "r0q", "Galaxy S22", "Exynos 2200 / Snapdragon 8 Gen 1", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-S906", "g0q", "Galaxy S22+", "Exynos 2200 / Snapdragon 8 Gen 1", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-S908", "b0q", "Galaxy S22 Ultra", "Exynos 2200 / Snapdragon 8 Gen 1", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-S911", "dm1q", "Galaxy S23", "Snapdragon 8 Gen 2", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    {"SM-S916", "dm2q", "Galaxy S23+", "Snapdragon 8 Gen 2", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    {"SM-S918", "dm3q", "Galaxy S23 Ultra", "Snapdragon 8 Gen 2", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    {"SM-S711", "r11q", "Galaxy S23 FE", "Exynos 2200 / Snapdragon 8 Gen 1", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    {"SM-S921", "e1s", "Galaxy S24", "Exynos 2400 / Snapdragon 8 Gen 3", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    {"SM-S926", "e2s", "Galaxy S24+", "Exynos 2400 / Snapdragon 8 Gen 3", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    {"SM-S928", "e3q", "Galaxy S24 Ultra", "Snapdragon 8 Gen 3", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    {"SM-S721", "r12s", "Galaxy S24 FE", "Exynos 2400e", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    // Galaxy Note
+    {"SM-N970", "d1", "Galaxy Note10", "Exynos 9825 / Snapdragon 855", 0},
+    {"SM-N975", "d2s", "Galaxy Note10+", "Exynos 9825 / Snapdragon 855", 0},
+    {"SM-N976", "d2x", "Galaxy Note10+ 5G", "Exynos 9825 / Snapdragon 855", 0},
+    {"SM-N980", "c1s", "Galaxy Note20", "Exynos 990", CATALOG_DYNAMIC},
+    {"SM-N981", "c1q", "Galaxy Note20 5G", "Exynos 990 / Snapdragon 865+", CATALOG_DYNAMIC},
+    {"SM-N985", "c2s", "Galaxy Note20 Ultra", "Exynos 990", CATALOG_DYNAMIC},
+    {"SM-N986", "c2q", "Galaxy Note20 Ultra 5G", "Exynos 990 / Snapdragon 865+", CATALOG_DYNAMIC},
+    // Galaxy Z
+    {"SM-F700", "bloomq", "Galaxy Z Flip", "Snapdragon 855+", 0},
+    {"SM-F707", "bloomxq", "Galaxy Z Flip 5G", "Snapdragon 865+", CATALOG_DYNAMIC},
+    {"SM-F711", "b2q", "Galaxy Z Flip3", "Snapdragon 888", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-F721", "b4q", "Galaxy Z Flip4", "Snapdragon 8+ Gen 1", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-F731", "b5q", "Galaxy Z Flip5", "Snapdragon 8 Gen 2", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    {"SM-F741", "b6q", "Galaxy Z Flip6", "Snapdragon 8 Gen 3", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    {"SM-F916", "f2q", "Galaxy Z Fold2", "Snapdragon 865+", CATALOG_DYNAMIC},
+    {"SM-F926", "q2q", "Galaxy Z Fold3", "Snapdragon 888", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-F936", "q4q", "Galaxy Z Fold4", "Snapdragon 8+ Gen 1", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-F946", "q5q", "Galaxy Z Fold5", "Snapdragon 8 Gen 2", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    {"SM-F956", "q6q", "Galaxy Z Fold6", "Snapdragon 8 Gen 3", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    // Galaxy A
+    {"SM-A125", "a12", "Galaxy A12", "Helio P35", CATALOG_DYNAMIC},
+    {"SM-A135", "a13", "Galaxy A13", "Exynos 850", CATALOG_DYNAMIC},
+    {"SM-A145", "a14", "Galaxy A14", "Helio G80 / Exynos 850", CATALOG_DYNAMIC},
+    {"SM-A155", "a15", "Galaxy A15", "Helio G99", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-A245", "a24", "Galaxy A24", "Helio G99", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-A256", "a25x", "Galaxy A25 5G", "Exynos 1280", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-A325", "a32", "Galaxy A32", "Helio G80", CATALOG_DYNAMIC},
+    {"SM-A336", "a33x", "Galaxy A33 5G", "Exynos 1280", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-A346", "a34x", "Galaxy A34 5G", "Dimensity 1080", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    {"SM-A356", "a35x", "Galaxy A35 5G", "Exynos 1380", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    {"SM-A515", "a51", "Galaxy A51", "Exynos 9611", CATALOG_DYNAMIC},
+    {"SM-A525", "a52q", "Galaxy A52", "Snapdragon 720G", CATALOG_DYNAMIC},
+    {"SM-A526", "a52xq", "Galaxy A52 5G", "Snapdragon 750G", CATALOG_DYNAMIC},
+    {"SM-A528", "a52sxq", "Galaxy A52s 5G", "Snapdragon 778G", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-A536", "a53x", "Galaxy A53 5G", "Exynos 1280", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-A546", "a54x", "Galaxy A54 5G", "Exynos 1380", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    {"SM-A556", "a55x", "Galaxy A55 5G", "Exynos 1480", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    {"SM-A715", "a71", "Galaxy A71", "Snapdragon 730", CATALOG_DYNAMIC},
+    {"SM-A725", "a72q", "Galaxy A72", "Snapdragon 720G", CATALOG_DYNAMIC},
+    {"SM-A736", "a73xq", "Galaxy A73 5G", "Snapdragon 778G", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    // Galaxy Tab S
+    {"SM-X700", "gts8wifi", "Galaxy Tab S8", "Snapdragon 8 Gen 1", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-X706", "gts8", "Galaxy Tab S8 5G", "Snapdragon 8 Gen 1", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-X800", "gts8pwifi", "Galaxy Tab S8+", "Snapdragon 8 Gen 1", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-X900", "gts8uwifi", "Galaxy Tab S8 Ultra", "Snapdragon 8 Gen 1", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT},
+    {"SM-X710", "gts9wifi", "Galaxy Tab S9", "Snapdragon 8 Gen 2", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    {"SM-X810", "gts9pwifi", "Galaxy Tab S9+", "Snapdragon 8 Gen 2", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+    {"SM-X910", "gts9uwifi", "Galaxy Tab S9 Ultra", "Snapdragon 8 Gen 2", CATALOG_DYNAMIC | CATALOG_VENDOR_BOOT | CATALOG_INIT_BOOT},
+};
+
+#define CATALOG_BUILTIN_COUNT (sizeof(g_builtinCatalog) / sizeof(g_builtinCatalog[0]))
+#define CATALOG_BUILTIN_BUCKETS CATALOG_BUILTIN_COUNT
+#define CATALOG_BUILTIN_SLOTS 128       // power of two, >= 1.5x the entries
+
+// Region suffixes, matched against the whole suffix after the catalogue
+// model ("U1" in SM-S911U1, never its "U" prefix), so order doesn't matter.
+// A trailing "/DS" (dual SIM) is split off before the lookup and kept on the
+// suffix by CatalogFile::Find.
+static const char* const g_catalogRegions[][2] = {
+    {"U1", "USA, unlocked"}, {"B", "Global"}, {"U", "USA"}, {"W", "Canada"},
+    {"N", "Korea"}, {"0", "China"}, {"E", "Asia"}, {"F", "Global"}, {"M", "Latin America"},
+    {"R4", "USA, regional carrier"}, {"V", "USA, Verizon"}, {"T", "USA, T-Mobile"}, {"A", "USA, AT&T"},
+};
+
+// Seeded FNV-1a with a murmur finalizer, so different seeds give unrelated
+// spreads; constexpr so the built-in table can be placed at compile time
+constexpr uint32_t CatalogHash(const char* key, size_t len, uint32_t seed) {
+    uint32_t h = 2166136261u ^ (seed * 0x9E3779B9u);
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+}
+
+constexpr size_t CatalogKeyLength(const char* key) {
+    size_t len = 0;
+    while (key[len]) len++;
+    return len;
+}
+
+// Hash-and-displace placement, shared by the compile-time table and
+// --build-catalog. key(i) returns the i-th key; disp gets one displacement
+// per bucket and slot the key index per slot (CATALOG_EMPTY if unused).
+// order (n entries) and start (buckets + 1) are scratch for grouping keys
+// by bucket. Buckets are placed largest first. Returns false if some
+// bucket can't be placed.
+template <typename KeyFn, typename Disp, typename Slots, typename Order, typename Start>
+constexpr bool PlacePerfectHash(KeyFn key, size_t n, size_t buckets, size_t slots,
+                                Disp& disp, Slots& slot, Order& order, Start& start) {
+    for (size_t b = 0; b <= buckets; b++) start[b] = 0;
+    for (size_t s = 0; s < slots; s++) slot[s] = CATALOG_EMPTY;
+    for (size_t i = 0; i < n; i++) {
+        const char* k = key(i);
+        start[CatalogHash(k, CatalogKeyLength(k), 0) % buckets + 1]++;
+    }
+    size_t largest = 0;
+    for (size_t b = 0; b < buckets; b++) {
+        if (start[b + 1] > largest) largest = start[b + 1];
+        start[b + 1] += start[b];
+        disp[b] = (uint32_t)start[b];   // fill cursor until placed
+    }
+    if (largest > CATALOG_MAX_BUCKET) return false;
+    for (size_t i = 0; i < n; i++) {
+        const char* k = key(i);
+        order[disp[CatalogHash(k, CatalogKeyLength(k), 0) % buckets]++] = i;
+    }
+    
+    for (size_t b = 0; b < buckets; b++) disp[b] = 0;
+    for (size_t size = largest; size > 0; size--) {
+        for (size_t b = 0; b < buckets; b++) {
+            if (start[b + 1] - start[b] != size) continue;
+            bool placed = false;
+            for (uint32_t d = 1; !placed && d < 1000000; d++) {
+                size_t taken[CATALOG_MAX_BUCKET] = {};
+                placed = true;
+                for (size_t m = 0; placed && m < size; m++) {
+                    const char* k = key(order[start[b] + m]);
+                    size_t s = CatalogHash(k, CatalogKeyLength(k), d) & (slots - 1);
+                    if (slot[s] != CATALOG_EMPTY) placed = false;
+                    for (size_t t = 0; t < m; t++) {
+                        if (taken[t] == s) placed = false;
+                    }
+                    taken[m] = s;
+                }
+                if (placed) {
+                    disp[b] = d;
+                    for (size_t m = 0; m < size; m++) slot[taken[m]] = (uint32_t)order[start[b] + m];
+                }
+            }
+            if (!placed) return false;
+        }
+    }
+    return true;
+}
+
+struct BuiltinCatalogTable {
+    uint32_t disp[CATALOG_BUILTIN_BUCKETS];
+    uint32_t slot[CATALOG_BUILTIN_SLOTS];
+    bool ok;
+};
+
+constexpr BuiltinCatalogTable BuildBuiltinCatalogTable() {
+    BuiltinCatalogTable table = {};
+    size_t order[CATALOG_BUILTIN_COUNT] = {};
+    size_t start[CATALOG_BUILTIN_BUCKETS + 1] = {};
+    table.ok = PlacePerfectHash([](size_t i) { return g_builtinCatalog[i].model; },
+        CATALOG_BUILTIN_COUNT, CATALOG_BUILTIN_BUCKETS, CATALOG_BUILTIN_SLOTS,
+        table.disp, table.slot, order, start);
+    return table;
+}
+
+static constexpr BuiltinCatalogTable g_builtinCatalogTable = BuildBuiltinCatalogTable();
+static_assert(g_builtinCatalogTable.ok, "built-in device catalogue has no perfect hash");
+static_assert((CATALOG_BUILTIN_SLOTS & (CATALOG_BUILTIN_SLOTS - 1)) == 0, "slot count must be a power of two");
+
+// A lookup result; strings point into the built-in table or the mapped file
+struct CatalogMatch {
+    CatalogRecord record;
+    std::string suffix;             // what followed the catalogued model code
+    const char* region;             // NULL if the suffix isn't a known region
+    bool fromFile;
 };
 
-DeviceModel s23_models[] = {
-    {"SM-S911B", "dm1q", "Galaxy S23 (Global)"},
-    {"SM-S911U", "dm1q", "Galaxy S23 (USA)"},
-    {"SM-S911W", "dm1q", "Galaxy S23 (Canada)"},
-    {"SM-S911N", "dm1q", "Galaxy S23 (Korea)"},
-    {"SM-S916B", "dm2q", "Galaxy S23+ (Global)"},
-    {"SM-S916U", "dm2q", "Galaxy S23+ (USA)"},
-    {"SM-S918B", "dm3q", "Galaxy S23 Ultra (Global)"},
-    {"SM-S918U", "dm3q", "Galaxy S23 Ultra (USA)"},
-    {"SM-S918N", "dm3q", "Galaxy S23 Ultra (Korea)"},
-    {nullptr, nullptr, nullptr}
+// devices.cat layout, all integers little-endian uint32:
+//   "S23CAT01" count buckets slots stringBytes
+//   disp[buckets] slot[slots] records[count] (model codename name chipset
+//   offsets into the strings, flags) strings (NUL-terminated)
+class DeviceCatalog {
+public:
+    DeviceCatalog() : file(INVALID_HANDLE_VALUE), mapping(NULL), view(NULL),
+                      count(0), buckets(0), slots(0), disp(NULL), slot(NULL), records(NULL), strings(NULL),
+                      stringBytes(0) {}
+    ~DeviceCatalog() { Close(); }
+    
+    // Maps a catalogue file; the built-in table stays in use if it's
+    // missing or malformed
+    bool Load(const std::string& path, std::string& error) {
+        Close();
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            error = "cannot open " + path;
+            return false;
+        }
+        LARGE_INTEGER size;
+        GetFileSizeEx(file, &size);
+        mapping = size.QuadPart > 28 ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+        view = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        if (!view || !Validate((uint64_t)size.QuadPart)) {
+            error = path + " is not a device catalogue";
+            Close();
+            return false;
+        }
+        return true;
+    }
+    
+    void Close() {
+        if (view) UnmapViewOfFile(view);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+        mapping = NULL;
+        view = NULL;
+        count = buckets = slots = 0;
+    }
+    
+    size_t FileEntries() const { return count; }
+    
+    // Exact model code first, then shorter prefixes for region variants
+    // ("SM-S911U1", "SM-S911B/DS")
+    bool Find(const std::string& model, CatalogMatch& match) const {
+        size_t len = model.find('/');
+        if (len == std::string::npos) len = model.size();
+        while (len > 0 && model[len - 1] == ' ') len--;
+        for (size_t keep = len; keep > 0 && len - keep <= 3; keep--) {
+            if (FindExact(model.data(), keep, match)) {
+                match.suffix = model.substr(keep, len - keep);
+                match.region = NULL;
+                for (size_t r = 0; r < sizeof(g_catalogRegions) / sizeof(g_catalogRegions[0]); r++) {
+                    if (match.suffix == g_catalogRegions[r][0]) match.region = g_catalogRegions[r][1];
+                }
+                if (model.compare(len, std::string::npos, "/DS") == 0) {
+                    match.suffix += "/DS";
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    HANDLE file, mapping;
+    const char* view;
+    uint32_t count, buckets, slots;
+    const uint32_t* disp;
+    const uint32_t* slot;
+    const uint32_t* records;        // 5 words each
+    const char* strings;
+    uint32_t stringBytes;
+    
+    static uint32_t Word(const char* p) {
+        return (unsigned char)p[0] | ((unsigned char)p[1] << 8) | ((unsigned char)p[2] << 16) |
+               ((uint32_t)(unsigned char)p[3] << 24);
+    }
+    
+    // Checks every offset once so lookups can trust the file
+    bool Validate(uint64_t size) {
+        if (memcmp(view, CATALOG_MAGIC, 8) != 0) return false;
+        count = Word(view + 8);
+        buckets = Word(view + 12);
+        slots = Word(view + 16);
+        stringBytes = Word(view + 20);
+        uint64_t words = (uint64_t)buckets + slots + (uint64_t)count * 5;
+        if (buckets == 0 || slots == 0 || (slots & (slots - 1)) || 24 + words * 4 + stringBytes != size ||
+            stringBytes == 0) {
+            return false;
+        }
+        disp = (const uint32_t*)(view + 24);
+        slot = disp + buckets;
+        records = slot + slots;
+        strings = (const char*)(records + (size_t)count * 5);
+        if (strings[stringBytes - 1] != '\0') return false;
+        for (uint32_t i = 0; i < slots; i++) {
+            if (slot[i] != CATALOG_EMPTY && slot[i] >= count) return false;
+        }
+        for (uint32_t i = 0; i < count * 5; i++) {
+            if (i % 5 != 4 && records[i] >= stringBytes) return false;
+        }
+        return true;
+    }
+    
+    bool FindExact(const char* key, size_t len, CatalogMatch& match) const {
+        if (count) {
+            uint32_t b = CatalogHash(key, len, 0) % buckets;
+            uint32_t i = slot[CatalogHash(key, len, disp[b]) & (slots - 1)];
+            if (i != CATALOG_EMPTY) {
+                const uint32_t* r = records + (size_t)i * 5;
+                if (strlen(strings + r[0]) == len && memcmp(strings + r[0], key, len) == 0) {
+                    CatalogRecord record = { strings + r[0], strings + r[1], strings + r[2], strings + r[3], r[4] };
+                    match.record = record;
+                    match.fromFile = true;
+                    return true;
+                }
+            }
+        }
+        uint32_t b = CatalogHash(key, len, 0) % CATALOG_BUILTIN_BUCKETS;
+        uint32_t i = g_builtinCatalogTable.slot[CatalogHash(key, len, g_builtinCatalogTable.disp[b]) &
+                                                (CATALOG_BUILTIN_SLOTS - 1)];
+        if (i == CATALOG_EMPTY) return false;
+        const CatalogRecord& r = g_builtinCatalog[i];
+        if (strlen(r.model) != len || memcmp(r.model, key, len) != 0) return false;
+        match.record = r;
+        match.fromFile = false;
+        return true;
+    }
 };
 
+DeviceCatalog g_catalog;
+
+static std::string FormatCatalogFlags(uint32_t flags) {
+    std::string text;
+    if (flags & CATALOG_AB) text += ", A/B";
+    if (flags & CATALOG_DYNAMIC) text += ", super";
+    if (flags & CATALOG_VENDOR_BOOT) text += ", vendor_boot";
+    if (flags & CATALOG_INIT_BOOT) text += ", init_boot";
+    return text.empty() ? "legacy" : text.substr(2);
+}
+
 // Global variables
 HWND g_hWnd = NULL;
 HWND g_hLog = NULL;
@@ -72,20 +482,65 @@ HWND g_hDeviceList = NULL;
 HWND g_hProgress = NULL;
 HWND g_hComboCmd = NULL;
 std::atomic<bool> g_running(false);
-std::mutex g_logMutex;
+std::atomic<bool> g_scanActive(false);
+int g_scanJob = 0;
+std::atomic<bool> g_logFlushPending(false);
 std::string g_adbPath;
 std::string g_fastbootPath;
 
 // Function prototypes
 LRESULT CALLBACK WndProc(HWND, UINT, WPARAM, LPARAM);
+LRESULT CALLBACK BroadcastWndProc(HWND, UINT, WPARAM, LPARAM);
+LRESULT CALLBACK LogcatWndProc(HWND, UINT, WPARAM, LPARAM);
 BOOL InitApplication(HINSTANCE);
 BOOL InitInstance(HINSTANCE, int);
 void AddLog(const std::string& msg);
+void ShowLog(const std::string& msg);
 void ClearLog();
 std::string ExecuteCommand(const char* cmd, bool wait = true);
+ProcessResult RunProcess(const std::string& cmdLine, const OutputCallback& onOutput, DWORD timeoutMs);
+ProcessResult RunProcess(const std::vector<std::string>& argv, const OutputCallback& onOutput, DWORD timeoutMs);
+std::string ResolveTool(const char* name);
+std::vector<std::string> ToolArgv(const std::string& cmd);
+void WriteReport(const std::string& text, const char* title);
+bool CurrentJobCancelled();
 void DetectDevices();
+void OnDeviceDetected(struct DetectedDevice* dev);
+void OnDeviceEvent(struct DeviceEvent* ev);
 void ExecuteADBCommand(const std::string& cmd);
+void SubmitADBCommand(const std::string& cmd);
+void SubmitFastbootCommand(const std::string& cmd);
+std::string CommandDeviceKey(const std::string& cmd);
+std::string SubmitDeviceKey(const std::string& cmd);
+std::string RunADBCommand(const std::string& args);
+int StreamADBCommand(const std::string& args, const OutputCallback& onOutput);
+int StreamCommand(const std::string& cmd, const OutputCallback& onOutput);
+DWORD DefaultCommandTimeout();
 void ExecuteFastbootCommand(const std::string& cmd);
+void SubmitPackageVerify(const std::string& path);
+std::string VerifyPackagesReport(const std::vector<std::string>& paths);
+void SubmitPackageIndex(const std::string& path);
+std::string PackageIndexReport(const std::vector<std::string>& paths);
+std::string ExtractMemberReport(const std::vector<std::string>& args);
+std::string DecodeLz4FileReport(const std::vector<std::string>& args);
+std::string BenchmarkLz4(uint64_t totalMB, size_t maxThreads);
+std::string SparseImageReport(const std::vector<std::string>& args);
+bool FlashRawImage(const std::string& cmd);
+int StreamFastbootCommand(const std::string& args, const OutputCallback& onOutput);
+std::string FormatFastbootInfo(const class FastbootVarTable& info);
+std::string FastbootInfoReport(const std::vector<std::string>& args);
+std::string FastbootStandInReport(const std::vector<std::string>& args);
+std::string BenchmarkFastboot(const std::vector<std::string>& args);
+std::string BenchmarkShell(const std::vector<std::string>& args);
+std::string AdbClientSelfTest();
+std::string ShellBatchReport(const std::vector<std::string>& args);
+std::string BroadcastReport(const std::vector<std::string>& args);
+std::string LogcatReport(const std::vector<std::string>& args);
+std::string AppInventoryReport(const std::vector<std::string>& args);
+std::string BenchmarkAppInventory(const std::vector<std::string>& args);
+std::string BuildCatalogReport(const std::vector<std::string>& args);
+std::string CatalogReport(const std::vector<std::string>& args);
+std::string BatchReport(const std::vector<std::string>& args);
 void DrawGradient(HDC hdc, RECT* rect, COLORREF start, COLORREF end);
 
 // Modern styling
@@ -97,6 +552,145 @@ void DrawGradient(HDC hdc, RECT* rect, COLORREF start, COLORREF end);
 #define COLOR_WARNING RGB(255, 180, 0)
 #define COLOR_ERROR RGB(255, 80, 80)
 
+// Rendering
+// GDI objects are made once and shared: buttons draw with brushes and pens
+// cached by colour and a single font, and the window background is a
+// gradient rendered into a bitmap that is redrawn only when the client size
+// changes. Each paint is composed off-screen and lands in one BitBlt, so
+// nothing is ever seen half-drawn. Paint counters keep the cost per frame;
+// "Paint statistics" on the system menu logs and resets them.
+#define IDM_PAINT_STATS 0x0010
+
+struct PaintCounter {
+    const char* name;
+    unsigned long long frames;
+    double totalUs, maxUs;
+    
+    explicit PaintCounter(const char* name) : name(name), frames(0), totalUs(0), maxUs(0) {}
+    
+    void Add(double us) {
+        frames++;
+        totalUs += us;
+        if (us > maxUs) maxUs = us;
+    }
+    
+    std::string Format() const {
+        std::ostringstream text;
+        text << std::fixed << std::setprecision(1) << "Paint " << name << ": " << frames << " frames";
+        if (frames) text << ", avg " << totalUs / frames << " us, max " << maxUs << " us";
+        return text.str();
+    }
+    
+    void Reset() {
+        frames = 0;
+        totalUs = maxUs = 0;
+    }
+};
+
+PaintCounter g_paintBackground("background");
+PaintCounter g_paintButtons("buttons");
+
+class GdiCache {
+public:
+    GdiCache() : font(NULL), gradientDC(NULL), gradient(NULL), gradientOld(NULL),
+                 gradientW(0), gradientH(0), gradientStart(0), gradientEnd(0),
+                 scratchDC(NULL), scratch(NULL), scratchOld(NULL), scratchW(0), scratchH(0) {}
+    ~GdiCache() { Release(); }
+    
+    HBRUSH Brush(COLORREF color) {
+        std::map<COLORREF, HBRUSH>::iterator it = brushes.find(color);
+        if (it == brushes.end()) it = brushes.insert(std::make_pair(color, CreateSolidBrush(color))).first;
+        return it->second;
+    }
+    
+    HPEN Pen(COLORREF color) {
+        std::map<COLORREF, HPEN>::iterator it = pens.find(color);
+        if (it == pens.end()) it = pens.insert(std::make_pair(color, CreatePen(PS_SOLID, 1, color))).first;
+        return it->second;
+    }
+    
+    HFONT ButtonFont() {
+        if (!font) {
+            font = CreateFont(14, 0, 0, 0, FW_SEMIBOLD, FALSE, FALSE, FALSE,
+                DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS,
+                CLEARTYPE_QUALITY, DEFAULT_PITCH | FF_SWISS, "Segoe UI");
+        }
+        return font;
+    }
+    
+    // Memory DC holding a w x h vertical gradient
+    HDC Gradient(HDC hdc, int w, int h, COLORREF start, COLORREF end) {
+        if (gradientDC && w == gradientW && h == gradientH && start == gradientStart && end == gradientEnd) {
+            return gradientDC;
+        }
+        Surface(hdc, w, h, gradientDC, gradient, gradientOld);
+        gradientW = w;
+        gradientH = h;
+        gradientStart = start;
+        gradientEnd = end;
+        RECT rect = { 0, 0, w, h };
+        DrawGradient(gradientDC, &rect, start, end);
+        return gradientDC;
+    }
+    
+    // Memory DC of at least w x h to compose a paint in
+    HDC Scratch(HDC hdc, int w, int h) {
+        if (!scratchDC || w > scratchW || h > scratchH) {
+            scratchW = std::max(w, scratchW);
+            scratchH = std::max(h, scratchH);
+            Surface(hdc, scratchW, scratchH, scratchDC, scratch, scratchOld);
+        }
+        return scratchDC;
+    }
+    
+    void Release() {
+        for (std::map<COLORREF, HBRUSH>::iterator it = brushes.begin(); it != brushes.end(); ++it) {
+            DeleteObject(it->second);
+        }
+        for (std::map<COLORREF, HPEN>::iterator it = pens.begin(); it != pens.end(); ++it) {
+            DeleteObject(it->second);
+        }
+        brushes.clear();
+        pens.clear();
+        if (font) DeleteObject(font);
+        font = NULL;
+        FreeSurface(gradientDC, gradient, gradientOld);
+        FreeSurface(scratchDC, scratch, scratchOld);
+        gradientW = gradientH = scratchW = scratchH = 0;
+    }
+
+private:
+    std::map<COLORREF, HBRUSH> brushes;
+    std::map<COLORREF, HPEN> pens;
+    HFONT font;
+    HDC gradientDC;
+    HBITMAP gradient, gradientOld;
+    int gradientW, gradientH;
+    COLORREF gradientStart, gradientEnd;
+    HDC scratchDC;
+    HBITMAP scratch, scratchOld;
+    int scratchW, scratchH;
+    
+    static void Surface(HDC hdc, int w, int h, HDC& dc, HBITMAP& bitmap, HBITMAP& old) {
+        FreeSurface(dc, bitmap, old);
+        dc = CreateCompatibleDC(hdc);
+        bitmap = CreateCompatibleBitmap(hdc, std::max(w, 1), std::max(h, 1));
+        old = (HBITMAP)SelectObject(dc, bitmap);
+    }
+    
+    static void FreeSurface(HDC& dc, HBITMAP& bitmap, HBITMAP& old) {
+        if (dc) {
+            SelectObject(dc, old);
+            DeleteDC(dc);
+        }
+        if (bitmap) DeleteObject(bitmap);
+        dc = NULL;
+        bitmap = old = NULL;
+    }
+};
+
+GdiCache g_gdi;
+
 // Custom button class
 class ModernButton {
 public:
@@ -117,39 +711,36 @@ public:
     }
     
     void Draw(LPDRAWITEMSTRUCT dis) {
-        HDC hdc = dis->hDC;
-        RECT rc = dis->rcItem;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        int w = dis->rcItem.right - dis->rcItem.left;
+        int h = dis->rcItem.bottom - dis->rcItem.top;
+        HDC hdc = g_gdi.Scratch(dis->hDC, w, h);
+        RECT rc = { 0, 0, w, h };
         
         // Background
         COLORREF fill = (dis->itemState & ODS_SELECTED) ? 
             RGB(0, 100, 180) : (isHover ? hoverColor : bgColor);
-        HBRUSH brush = CreateSolidBrush(fill);
-        FillRect(hdc, &rc, brush);
-        DeleteObject(brush);
+        FillRect(hdc, &rc, g_gdi.Brush(fill));
         
         // Border
-        HPEN pen = CreatePen(PS_SOLID, 1, RGB(0, 90, 160));
-        HPEN oldPen = (HPEN)SelectObject(hdc, pen);
+        HPEN oldPen = (HPEN)SelectObject(hdc, g_gdi.Pen(RGB(0, 90, 160)));
         HBRUSH oldBrush = (HBRUSH)SelectObject(hdc, GetStockObject(NULL_BRUSH));
         Rectangle(hdc, rc.left, rc.top, rc.right - 1, rc.bottom - 1);
         SelectObject(hdc, oldPen);
         SelectObject(hdc, oldBrush);
-        DeleteObject(pen);
         
         // Text
         SetBkMode(hdc, TRANSPARENT);
         SetTextColor(hdc, textColor);
-        HFONT font = CreateFont(14, 0, 0, 0, FW_SEMIBOLD, FALSE, FALSE, FALSE,
-            DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS,
-            CLEARTYPE_QUALITY, DEFAULT_PITCH | FF_SWISS, "Segoe UI");
-        HFONT oldFont = (HFONT)SelectObject(hdc, font);
+        HFONT oldFont = (HFONT)SelectObject(hdc, g_gdi.ButtonFont());
         
         char text[256];
         GetWindowText(hwnd, text, 256);
         DrawText(hdc, text, -1, &rc, DT_CENTER | DT_VCENTER | DT_SINGLELINE);
         
         SelectObject(hdc, oldFont);
-        DeleteObject(font);
+        BitBlt(dis->hDC, dis->rcItem.left, dis->rcItem.top, w, h, hdc, 0, 0, SRCCOPY);
+        g_paintButtons.Add(CoreMicrosecondsSince(start));
     }
 };
 
@@ -158,527 +749,8371 @@ inline LPCSTR str2lpcstr(const std::string& s) {
     return s.c_str();
 }
 
-// Main window procedure
-LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
-    static ModernButton btnDetect, btnShell, btnRecovery, btnDownload;
-    static ModernButton btnBootloader, btnUnlock, btnLock, btnFRP, btnFlash;
+// Bounded worker pool
+// Fixed set of threads draining a FIFO of tasks. Tasks may submit further
+// tasks; Wait() returns once the queue is empty and no task is running.
+class WorkerPool {
+public:
+    explicit WorkerPool(size_t threads) : pending(0), stopping(false) {
+        if (threads == 0) threads = 1;
+        for (size_t i = 0; i < threads; i++) {
+            workers.push_back(std::thread(&WorkerPool::Run, this));
+        }
+    }
     
-    switch (message) {
-        case WM_CREATE: {
-            // Initialize common controls
-            INITCOMMONCONTROLSEX icex;
-            icex.dwSize = sizeof(icex);
-            icex.dwICC = ICC_LISTVIEW_CLASSES | ICC_PROGRESS_CLASS;
-            InitCommonControlsEx(&icex);
-            
-            // Create fonts
-            HFONT hFont = CreateFont(14, 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE,
-                DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS,
-                CLEARTYPE_QUALITY, DEFAULT_PITCH | FF_SWISS, "Segoe UI");
-            
-            HFONT hTitleFont = CreateFont(20, 0, 0, 0, FW_BOLD, FALSE, FALSE, FALSE,
-                DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS,
-                CLEARTYPE_QUALITY, DEFAULT_PITCH | FF_SWISS, "Segoe UI");
-            
-            // Title label
-            HWND hTitle = CreateWindow("STATIC", "Samsung Galaxy S23 Device Manager",
-                WS_VISIBLE | WS_CHILD | SS_CENTER,
-                0, 10, 900, 30, hWnd, NULL, NULL, NULL);
-            SendMessage(hTitle, WM_SETFONT, (WPARAM)hTitleFont, TRUE);
-            
-            // Device list
-            CreateWindow("STATIC", "Connected Devices:",
-                WS_VISIBLE | WS_CHILD | SS_LEFT,
-                20, 50, 200, 20, hWnd, NULL, NULL, NULL);
-            
-            g_hDeviceList = CreateWindowEx(WS_EX_CLIENTEDGE, "LISTBOX", NULL,
-                WS_VISIBLE | WS_CHILD | LBS_NOTIFY | WS_VSCROLL | LBS_HASSTRINGS,
-                20, 75, 400, 150, hWnd, (HMENU)IDC_LIST_DEVICES, NULL, NULL);
-            SendMessage(g_hDeviceList, WM_SETFONT, (WPARAM)hFont, TRUE);
-            
-            // Log window
-            CreateWindow("STATIC", "Operation Log:",
-                WS_VISIBLE | WS_CHILD | SS_LEFT,
-                20, 235, 200, 20, hWnd, NULL, NULL, NULL);
-            
-            g_hLog = CreateWindowEx(WS_EX_CLIENTEDGE, "EDIT", NULL,
-                WS_VISIBLE | WS_CHILD | ES_MULTILINE | ES_AUTOVSCROLL | 
-                ES_READONLY | WS_VSCROLL,
-                20, 260, 860, 250, hWnd, (HMENU)IDC_EDIT_LOG, NULL, NULL);
-            SendMessage(g_hLog, WM_SETFONT, (WPARAM)hFont, TRUE);
-            
-            // Progress bar
-            g_hProgress = CreateWindowEx(0, PROGRESS_CLASS, NULL,
-                WS_VISIBLE | WS_CHILD | PBS_SMOOTH,
-                20, 520, 860, 20, hWnd, (HMENU)IDC_PROGRESS, NULL, NULL);
-            SendMessage(g_hProgress, PBM_SETRANGE, 0, MAKELPARAM(0, 100));
-            
-            // Command combo
-            CreateWindow("STATIC", "Quick Commands:",
-                WS_VISIBLE | WS_CHILD | SS_LEFT,
-                440, 50, 150, 20, hWnd, NULL, NULL, NULL);
-            
-            g_hComboCmd = CreateWindow("COMBOBOX", NULL,
-                WS_VISIBLE | WS_CHILD | CBS_DROPDOWNLIST | WS_VSCROLL,
-                440, 75, 300, 200, hWnd, (HMENU)IDC_COMBO_COMMANDS, NULL, NULL);
-            
-            const char* commands[] = {
-                "adb devices",
-                "adb shell getprop ro.product.model",
-                "adb shell getprop ro.build.version.release",
-                "adb reboot bootloader",
-                "adb reboot recovery",
-                "fastboot devices",
-                "fastboot oem device-info",
-                "fastboot getvar all",
-                "adb shell pm list packages",
-                "adb logcat -d",
-                nullptr
-            };
-            
-            for (int i = 0; commands[i]; i++) {
-                SendMessage(g_hComboCmd, CB_ADDSTRING, 0, (LPARAM)commands[i]);
-            }
-            SendMessage(g_hComboCmd, CB_SETCURSEL, 0, 0);
-            
-            // Buttons - Left column (Device Operations)
-            int btnX = 440, btnY = 110, btnW = 200, btnH = 35, btnGap = 40;
-            
-            btnDetect.Create(hWnd, IDC_BTN_DETECT, "Detect Devices", btnX, btnY, btnW, btnH);
-            btnShell.Create(hWnd, IDC_BTN_ADB_SHELL, "ADB Shell", btnX, btnY += btnGap, btnW, btnH);
-            btnRecovery.Create(hWnd, IDC_BTN_RECOVERY, "Reboot Recovery", btnX, btnY += btnGap, btnW, btnH);
-            btnDownload.Create(hWnd, IDC_BTN_DOWNLOAD, "Download Mode", btnX, btnY += btnGap, btnW, btnH);
-            
-            // Buttons - Right column (Advanced)
-            btnX = 660; btnY = 110;
-            btnBootloader.Create(hWnd, IDC_BTN_BOOTLOADER, "Bootloader", btnX, btnY, btnW, btnH);
-            btnUnlock.Create(hWnd, IDC_BTN_UNLOCK_BL, "Unlock BL", btnX, btnY += btnGap, btnW, btnH);
-            btnLock.Create(hWnd, IDC_BTN_LOCK_BL, "Lock BL", btnX, btnY += btnGap, btnW, btnH);
-            btnFRP.Create(hWnd, IDC_BTN_FRP_BYPASS, "FRP Bypass", btnX, btnY += btnGap, btnW, btnH);
-            
-            // Execute and Flash buttons
-            CreateWindow("BUTTON", "Execute Command",
-                WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
-                440, 270, 200, 35, hWnd, (HMENU)IDC_BTN_EXECUTE, NULL, NULL);
-            
-            btnFlash.Create(hWnd, IDC_BTN_FLASH, "Flash Firmware", 660, 270, 200, 35);
-            
-            // Clear log button
-            CreateWindow("BUTTON", "Clear Log",
-                WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
-                760, 520, 120, 25, hWnd, (HMENU)IDC_BTN_LOG_CLEAR, NULL, NULL);
-            
-            // Auto-detect checkbox
-            CreateWindow("BUTTON", "Auto-detect devices",
-                WS_VISIBLE | WS_CHILD | BS_AUTOCHECKBOX,
-                20, 550, 150, 20, hWnd, (HMENU)IDC_CHK_AUTO_DETECT, NULL, NULL);
-            
-            // Set default colors for buttons
-            btnUnlock.bgColor = COLOR_WARNING;
-            btnFRP.bgColor = RGB(200, 50, 50);
-            btnFlash.bgColor = RGB(100, 50, 150);
-            
-            AddLog("Samsung Galaxy S23 Device Manager v" APP_VERSION " initialized");
-            AddLog("Please ensure ADB drivers are installed and device is connected via USB");
-            AddLog("For S23 series: Enable Developer Options > USB Debugging first");
-            
-            // Check for ADB
-            WIN32_FIND_DATA findData;
-            HANDLE hFind = FindFirstFile("adb.exe", &findData);
-            if (hFind == INVALID_HANDLE_VALUE) {
-                AddLog("WARNING: adb.exe not found in current directory!");
-                AddLog("Please download Android SDK Platform Tools and place adb.exe here");
-            } else {
-                FindClose(hFind);
-                g_adbPath = "adb.exe";
-                g_fastbootPath = "fastboot.exe";
-            }
-            
-            return 0;
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
         }
-        
-        case WM_DRAWITEM: {
-            LPDRAWITEMSTRUCT dis = (LPDRAWITEMSTRUCT)lParam;
-            ModernButton* btn = (ModernButton*)GetWindowLongPtr(dis->hwndItem, GWLP_USERDATA);
-            if (btn) {
-                btn->Draw(dis);
-                return TRUE;
+        wake.notify_all();
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+        }
+    }
+    
+    void Submit(const std::function<void()>& task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(task);
+            pending++;
+        }
+        wake.notify_one();
+    }
+    
+    void Wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return pending == 0; });
+    }
+    
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()> > tasks;
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+    size_t pending;
+    bool stopping;
+    
+    void Run() {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) return;
+                task = tasks.front();
+                tasks.pop_front();
+            }
+            task();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--pending == 0) idle.notify_all();
             }
-            break;
         }
-        
-        case WM_COMMAND: {
-            int wmId = LOWORD(wParam);
-            switch (wmId) {
-                case IDC_BTN_DETECT:
-                    DetectDevices();
-                    break;
-                    
-                case IDC_BTN_ADB_SHELL: {
-                    AddLog("Opening ADB Shell...");
-                    ShellExecuteA(NULL, "open", "cmd.exe", 
-                        "/k adb shell", NULL, SW_SHOW);
+    }
+};
+
+// Job scheduler
+// Every device operation runs as a job so WndProc never blocks on device
+// I/O. Jobs targeting the same device key run one at a time in submission
+// order; jobs for different devices run concurrently on the workers.
+// Cancellation and timeouts are cooperative: job bodies (and the command
+// executors, via CurrentJobCancelled) poll JobContext::Cancelled(). Progress
+// and completion are marshalled to the window as WM_JOB_PROGRESS/WM_JOB_DONE.
+#define JOB_WORKERS 8
+#define JOB_DEFAULT_TIMEOUT_MS 120000
+#define JOB_STATUS_DONE 0
+#define JOB_STATUS_CANCELLED 1
+#define JOB_STATUS_TIMEOUT 2
+
+typedef std::function<void(class JobContext&)> JobFunc;
+
+struct Job {
+    int id;
+    std::string name;
+    std::string device;         // serialization key, e.g. "adb:R5CT..."
+    JobFunc fn;
+    std::atomic<bool> cancel;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point deadline;
+    
+    Job() : id(0), cancel(false) {}
+};
+
+// Posted with WM_JOB_DONE
+struct JobResult {
+    int id;
+    std::string name;
+    int status;
+    long long elapsedMs;
+};
+
+class JobContext {
+public:
+    explicit JobContext(Job* job) : job(job) {}
+    
+    int Id() const { return job->id; }
+    const std::string& Device() const { return job->device; }
+    
+    bool TimedOut() const { return std::chrono::steady_clock::now() > job->deadline; }
+    bool Cancelled() const { return job->cancel || TimedOut(); }
+    
+    void Progress(int percent) {
+        PostMessage(g_hWnd, WM_JOB_PROGRESS, (WPARAM)job->id, (LPARAM)percent);
+    }
+    
+    // Sleeps in small steps; returns false if the job was cancelled meanwhile
+    bool Sleep(DWORD ms) {
+        std::chrono::steady_clock::time_point until =
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+        while (!Cancelled() && std::chrono::steady_clock::now() < until) {
+            ::Sleep(50);
+        }
+        return !Cancelled();
+    }
+    
+private:
+    Job* job;
+};
+
+// Context of the job running on this thread, if any
+thread_local JobContext* t_currentJob = NULL;
+
+// Stop flag of a long-lived thread that is not a job (the device tracker's
+// watchers), so commands it runs are killed when it is asked to stop
+thread_local const std::atomic<bool>* t_threadStop = NULL;
+
+bool CurrentJobCancelled() {
+    return (t_currentJob && t_currentJob->Cancelled()) || (t_threadStop && *t_threadStop);
+}
+
+// Inside a job the job's own deadline applies; elsewhere (pool threads,
+// tracker probes) commands keep the classic 10 second limit
+DWORD DefaultCommandTimeout() {
+    return t_currentJob ? INFINITE : PROCESS_DEFAULT_TIMEOUT_MS;
+}
+
+class JobScheduler {
+public:
+    JobScheduler() : nextId(1), stopping(false) {}
+    
+    void Start(size_t threads) {
+        for (size_t i = 0; i < threads; i++) {
+            workers.push_back(std::thread(&JobScheduler::Run, this));
+        }
+    }
+    
+    // Cancels everything and waits for running jobs to notice
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            queue.clear();
+            for (std::map<int, std::shared_ptr<Job> >::iterator it = running.begin(); it != running.end(); ++it) {
+                it->second->cancel = true;
+            }
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+        }
+        workers.clear();
+        g_running = false;
+    }
+    
+    int Submit(const std::string& name, const std::string& device, const JobFunc& fn,
+               DWORD timeoutMs = JOB_DEFAULT_TIMEOUT_MS) {
+        std::shared_ptr<Job> job(new Job());
+        job->name = name;
+        job->device = device;
+        job->fn = fn;
+        job->start = std::chrono::steady_clock::now();
+        job->deadline = job->start + std::chrono::milliseconds(timeoutMs);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job->id = nextId++;
+            queue.push_back(job);
+            g_running = true;
+        }
+        wake.notify_all();
+        return job->id;
+    }
+    
+    void Cancel(int id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<int, std::shared_ptr<Job> >::iterator it = running.find(id);
+        if (it != running.end()) it->second->cancel = true;
+        for (size_t i = 0; i < queue.size(); i++) {
+            if (queue[i]->id == id) queue[i]->cancel = true;
+        }
+    }
+    
+    // Returns the number of jobs that were queued or running
+    size_t CancelAll() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (std::map<int, std::shared_ptr<Job> >::iterator it = running.begin(); it != running.end(); ++it) {
+            it->second->cancel = true;
+        }
+        for (size_t i = 0; i < queue.size(); i++) {
+            queue[i]->cancel = true;
+        }
+        return running.size() + queue.size();
+    }
+    
+private:
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::shared_ptr<Job> > queue;
+    std::map<int, std::shared_ptr<Job> > running;
+    std::set<std::string> busyDevices;
+    std::vector<std::thread> workers;
+    int nextId;
+    bool stopping;
+    
+    // First queued job whose device is idle (keeps per-device FIFO order)
+    std::shared_ptr<Job> TakeRunnable() {
+        for (size_t i = 0; i < queue.size(); i++) {
+            if (busyDevices.count(queue[i]->device) == 0) {
+                std::shared_ptr<Job> job = queue[i];
+                queue.erase(queue.begin() + i);
+                busyDevices.insert(job->device);
+                running[job->id] = job;
+                return job;
+            }
+        }
+        return std::shared_ptr<Job>();
+    }
+    
+    void Run() {
+        for (;;) {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || (job = TakeRunnable()) != NULL; });
+                if (!job) return;
+            }
+            
+            JobContext ctx(job.get());
+            if (!ctx.Cancelled()) {
+                ctx.Progress(0);
+                t_currentJob = &ctx;
+                job->fn(ctx);
+                t_currentJob = NULL;
+            }
+            
+            JobResult* result = new JobResult();
+            result->id = job->id;
+            result->name = job->name;
+            result->status = job->cancel ? JOB_STATUS_CANCELLED :
+                (ctx.TimedOut() ? JOB_STATUS_TIMEOUT : JOB_STATUS_DONE);
+            result->elapsedMs = CoreMillisecondsSince(job->start);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                running.erase(job->id);
+                busyDevices.erase(job->device);
+                g_running = !running.empty() || !queue.empty();
+            }
+            wake.notify_all();
+            PostMessage(g_hWnd, WM_JOB_DONE, 0, (LPARAM)result);
+        }
+    }
+};
+
+JobScheduler g_jobs;
+
+// UI-side view of job progress (UI thread only): job id -> percent
+std::map<int, int> g_jobProgress;
+
+// Device discovered by a scan, posted to the window with WM_DEVICE_DETECTED
+struct DetectedDevice {
+    std::string transport;      // "ADB" or "FASTBOOT"
+    std::string serial;
+    std::string state;
+    std::string model;
+    long long probeMs;          // time spent identifying this device
+    long long elapsedMs;        // time since the scan started
+};
+
+// Blocking socket helpers shared by the adb and fastboot clients
+static bool SocketSendAll(SOCKET s, const char* data, size_t len) {
+    while (len > 0) {
+        int n = send(s, data, (int)std::min<size_t>(len, 0x40000000), 0);
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool SocketReadExact(SOCKET s, char* data, size_t len) {
+    while (len > 0) {
+        int n = recv(s, data, (int)std::min<size_t>(len, 0x40000000), 0);
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// ADB server protocol client
+// Speaks the adb host protocol straight to the adb server (localhost:5037 by
+// default) instead of spawning cmd.exe + adb.exe for every query. Requests are
+// a 4-digit hex length followed by the service name; the server answers OKAY
+// or FAIL + hex-length message. ANDROID_ADB_SERVER_ADDRESS/PORT are honored the
+// same way adb.exe honors them, so a stand-in server can be used instead.
+#define ADB_DEFAULT_PORT 5037
+#define ADB_IO_TIMEOUT_MS 10000
+#define ADB_RETRY_DELAY_MS 5000
+
+// Shell protocol v2 packet ids
+#define ADB_SHELL_STDIN 0
+#define ADB_SHELL_STDOUT 1
+#define ADB_SHELL_STDERR 2
+#define ADB_SHELL_EXIT 3
+#define ADB_SHELL_CLOSE_STDIN 4
+
+class AdbClient {
+public:
+    std::string host;
+    int port;
+    
+    AdbClient() : host("127.0.0.1"), port(ADB_DEFAULT_PORT),
+                  serverVersion(0), retryAfter(0), startAttempted(false) {
+        char buf[256];
+        DWORD len = GetEnvironmentVariableA("ANDROID_ADB_SERVER_ADDRESS", buf, sizeof(buf));
+        if (len > 0 && len < sizeof(buf)) host = buf;
+        len = GetEnvironmentVariableA("ANDROID_ADB_SERVER_PORT", buf, sizeof(buf));
+        if (len > 0 && len < sizeof(buf) && atoi(buf) > 0) port = atoi(buf);
+    }
+    
+    // Checks (once, then cached) that an adb server is listening. Like adb.exe,
+    // starts the server if it is not running and adb.exe is available.
+    bool ServerAvailable() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (serverVersion > 0) return true;
+        if (GetTickCount64() < retryAfter) return false;
+        
+        std::string out;
+        if (!QueryVersion(out) && !startAttempted && !g_adbPath.empty()) {
+            startAttempted = true;
+            ExecuteCommand("adb start-server");
+            QueryVersion(out);
+        }
+        if (serverVersion == 0) {
+            retryAfter = GetTickCount64() + ADB_RETRY_DELAY_MS;
+            return false;
+        }
+        return true;
+    }
+    
+    // Forgets the cached server state, e.g. after the server was killed
+    void Reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        serverVersion = 0;
+        retryAfter = 0;
+        features.clear();
+    }
+    
+    // Runs a host service that answers with a single length-prefixed payload
+    // (host:version, host:devices-l, host-serial:<serial>:features, ...)
+    bool HostQuery(const std::string& service, std::string& out) {
+        SOCKET s = OpenSocket(out);
+        if (s == INVALID_SOCKET) return false;
+        bool ok = SendRequest(s, service, out) && ReadStatus(s, out) && ReadHexString(s, out);
+        closesocket(s);
+        return ok;
+    }
+    
+    // Switches a fresh connection to the device transport and opens a service
+    // on it. Returns the connected socket, or INVALID_SOCKET with error in out.
+    SOCKET OpenService(const std::string& serial, const std::string& service, std::string& out) {
+        SOCKET s = OpenSocket(out);
+        if (s == INVALID_SOCKET) return s;
+        
+        std::string transport = serial.empty() ? "host:transport-any" : "host:transport:" + serial;
+        if (!SendRequest(s, transport, out) || !ReadStatus(s, out) ||
+            !SendRequest(s, service, out) || !ReadStatus(s, out)) {
+            closesocket(s);
+            return INVALID_SOCKET;
+        }
+        return s;
+    }
+    
+    // Opens a host service that keeps streaming length-prefixed messages
+    // (host:track-devices-l). Read them with ReadMessage(); the socket has no
+    // receive timeout since the stream may stay idle indefinitely.
+    SOCKET OpenHostStream(const std::string& service, std::string& out) {
+        SOCKET s = OpenSocket(out);
+        if (s == INVALID_SOCKET) return s;
+        if (!SendRequest(s, service, out) || !ReadStatus(s, out)) {
+            closesocket(s);
+            return INVALID_SOCKET;
+        }
+        DWORD timeout = 0;
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+        return s;
+    }
+    
+    static bool ReadMessage(SOCKET s, std::string& out) {
+        return ReadHexString(s, out);
+    }
+    
+    std::vector<AdbDevice> ListDevices() {
+        std::string out;
+        if (!HostQuery("host:devices-l", out)) return std::vector<AdbDevice>();
+        return ParseAdbDevices(out);
+    }
+    
+    // Device features are negotiated once per serial and cached
+    bool HasFeature(const std::string& serial, const std::string& feature) {
+        std::string list;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::map<std::string, std::string>::iterator it = features.find(serial);
+            if (it != features.end()) list = it->second;
+        }
+        if (list.empty()) {
+            std::string service = serial.empty() ? "host:features" :
+                "host-serial:" + serial + ":features";
+            if (!HostQuery(service, list)) return false;
+            list = "," + list + ",";
+            std::lock_guard<std::mutex> lock(mutex);
+            features[serial] = list;
+        }
+        return list.find("," + feature + ",") != std::string::npos;
+    }
+    
+    void ForgetDevice(const std::string& serial) {
+        std::lock_guard<std::mutex> lock(mutex);
+        features.erase(serial);
+    }
+    
+    // Runs a shell command. Uses shell protocol v2 when the device supports it
+    // so stdout/stderr arrive framed and the exit status is reported; falls
+    // back to the legacy raw shell stream otherwise (exit code -1). With
+    // onOutput set, output is handed over as it arrives instead of collected.
+    bool Shell(const std::string& serial, const std::string& cmd, std::string& out, int* exitCode,
+               const OutputCallback* onOutput = NULL) {
+        if (exitCode) *exitCode = -1;
+        bool v2 = HasFeature(serial, "shell_v2");
+        SOCKET s = OpenService(serial, (v2 ? "shell,v2,raw:" : "shell:") + cmd, out);
+        if (s == INVALID_SOCKET) return false;
+        
+        bool ok = false;
+        out.clear();
+        std::string data;
+        if (v2) {
+            unsigned char header[5];
+            while (!CurrentJobCancelled() && SocketReadExact(s, (char*)header, sizeof(header))) {
+                unsigned int len = header[1] | (header[2] << 8) | (header[3] << 16) | ((unsigned int)header[4] << 24);
+                data.resize(len);
+                if (len > 0 && !SocketReadExact(s, &data[0], len)) break;
+                if (header[0] == ADB_SHELL_STDOUT || header[0] == ADB_SHELL_STDERR) {
+                    if (onOutput) (*onOutput)(data.data(), data.size());
+                    else out += data;
+                } else if (header[0] == ADB_SHELL_EXIT) {
+                    if (exitCode && len > 0) *exitCode = (unsigned char)data[0];
+                    ok = true;
                     break;
                 }
-                
-                case IDC_BTN_RECOVERY:
-                    AddLog("Rebooting to Recovery mode...");
-                    ExecuteADBCommand("reboot recovery");
-                    break;
-                    
-                case IDC_BTN_DOWNLOAD:
-                    AddLog("Rebooting to Download mode (Odin)...");
-                    ExecuteADBCommand("reboot download");
-                    break;
-                    
-                case IDC_BTN_BOOTLOADER:
-                    AddLog("Rebooting to Bootloader/Fastboot mode...");
-                    ExecuteADBCommand("reboot bootloader");
+            }
+            if (!ok) out += "\nerror: shell connection closed unexpectedly";
+        } else {
+            char buffer[4096];
+            int n;
+            while (!CurrentJobCancelled() && (n = recv(s, buffer, sizeof(buffer), 0)) > 0) {
+                if (onOutput) (*onOutput)(buffer, n);
+                else out.append(buffer, n);
+            }
+            ok = n == 0;
+        }
+        closesocket(s);
+        return ok;
+    }
+    
+    // Runs a one-shot service that streams its reply until close (reboot:, ...)
+    bool Service(const std::string& serial, const std::string& service, std::string& out) {
+        SOCKET s = OpenService(serial, service, out);
+        if (s == INVALID_SOCKET) return false;
+        out.clear();
+        bool ok = ReadToEnd(s, out);
+        closesocket(s);
+        return ok;
+    }
+    
+private:
+    std::mutex mutex;
+    int serverVersion;
+    ULONGLONG retryAfter;
+    bool startAttempted;
+    std::map<std::string, std::string> features;  // serial -> ",feat1,feat2,"
+    
+    bool QueryVersion(std::string& out) {
+        if (!HostQuery("host:version", out)) return false;
+        serverVersion = (int)strtol(out.c_str(), NULL, 16);
+        return serverVersion > 0;
+    }
+    
+    // Connects to the server; host may be a name, an IPv4 or an IPv6 address
+    SOCKET OpenSocket(std::string& err) {
+        addrinfo hints, *found = NULL;
+        ZeroMemory(&hints, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) != 0 || !found) {
+            err = "Error: cannot resolve adb server address " + host;
+            return INVALID_SOCKET;
+        }
+        
+        SOCKET s = INVALID_SOCKET;
+        for (addrinfo* a = found; a && s == INVALID_SOCKET; a = a->ai_next) {
+            s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (s == INVALID_SOCKET) continue;
+            
+            DWORD timeout = ADB_IO_TIMEOUT_MS;
+            setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+            setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+            BOOL noDelay = TRUE;
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+            
+            if (connect(s, a->ai_addr, (int)a->ai_addrlen) == SOCKET_ERROR) {
+                closesocket(s);
+                s = INVALID_SOCKET;
+            }
+        }
+        freeaddrinfo(found);
+        if (s == INVALID_SOCKET) err = "Error: cannot connect to adb server at " + host + ":" + std::to_string(port);
+        return s;
+    }
+    
+    static bool ReadToEnd(SOCKET s, std::string& out) {
+        char buffer[4096];
+        int n;
+        while ((n = recv(s, buffer, sizeof(buffer), 0)) > 0) {
+            out.append(buffer, n);
+        }
+        return n == 0;
+    }
+    
+    static bool SendRequest(SOCKET s, const std::string& service, std::string& err) {
+        char prefix[5];
+        snprintf(prefix, sizeof(prefix), "%04x", (unsigned int)service.size());
+        std::string request = prefix + service;
+        if (service.size() > 0xFFFF || !SocketSendAll(s, request.data(), request.size())) {
+            err = "Error: failed to send adb request";
+            return false;
+        }
+        return true;
+    }
+    
+    static bool ReadHexString(SOCKET s, std::string& out) {
+        char len[5] = {0};
+        if (!SocketReadExact(s, len, 4)) {
+            out = "Error: truncated adb reply";
+            return false;
+        }
+        size_t size = strtoul(len, NULL, 16);
+        out.assign(size, '\0');
+        if (size > 0 && !SocketReadExact(s, &out[0], size)) {
+            out = "Error: truncated adb reply";
+            return false;
+        }
+        return true;
+    }
+    
+    static bool ReadStatus(SOCKET s, std::string& err) {
+        char status[4];
+        if (!SocketReadExact(s, status, 4)) {
+            err = "Error: no reply from adb server";
+            return false;
+        }
+        if (memcmp(status, "OKAY", 4) == 0) return true;
+        if (memcmp(status, "FAIL", 4) == 0 && ReadHexString(s, err)) {
+            err = "error: " + err;
+        } else {
+            err = "Error: bad adb server reply";
+        }
+        return false;
+    }
+};
+
+AdbClient g_adb;
+
+// Persistent adb shell sessions
+// A one-shot "adb shell <cmd>" pays a transport switch and a fresh shell on
+// the device every time. A session keeps one "exec sh" open per device and
+// feeds it commands on stdin, each as
+//   sh -c '<cmd>' </dev/null 2>&1; echo "<marker>$?"
+// with every ' in the command written as '\''. The command reaches the inner
+// shell as one argument, so an unbalanced quote or a trailing backslash only
+// fails that command instead of eating the marker line; the child shell also
+// keeps cd/exit/exports from leaking into later commands, and stdin is
+// detached so a command can't swallow the ones queued behind it.
+// A command's output is everything before its marker, which carries a random
+// per-session token and the command's sequence number. A batch goes out in
+// one write and the results are read back in order. Shell protocol v2
+// packets carry stdin/stdout when the device supports them. Otherwise the
+// session runs on an exec: service, a raw stream without a PTY: a legacy
+// shell: service may get a PTY that echoes the script back, markers and all.
+#define ADB_SESSION_TIMEOUT_MS 60000
+#define ADB_SESSION_READ 65536
+
+struct ShellCommandResult {
+    std::string output;         // stdout and stderr interleaved
+    int exitCode;               // -1 when the session broke first
+    
+    ShellCommandResult() : exitCode(-1) {}
+};
+
+class AdbShellSession {
+public:
+    AdbShellSession(AdbClient& adb, const std::string& serial)
+        : adb(adb), serial(serial), s(INVALID_SOCKET), v2(false), sequence(0) {
+        unsigned long long seed = (GetTickCount64() << 20) ^ ((unsigned long long)(size_t)this) ^
+            GetCurrentProcessId();
+        char buf[24];
+        snprintf(buf, sizeof(buf), "%016llx", seed * 0x9E3779B97F4A7C15ull);
+        token = buf;
+    }
+    ~AdbShellSession() { Close(); }
+    
+    // Held by whoever drives the session for the length of one batch
+    std::mutex& Mutex() { return mutex; }
+    
+    bool Open(std::string& error) {
+        if (s != INVALID_SOCKET) return true;
+        v2 = adb.HasFeature(serial, "shell_v2");
+        s = adb.OpenService(serial, v2 ? "shell,v2,raw:exec sh" : "exec:sh", error);
+        if (s == INVALID_SOCKET) return false;
+        DWORD timeout = ADB_SESSION_TIMEOUT_MS;
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+        pending.clear();
+        return true;
+    }
+    
+    void Close() {
+        if (s != INVALID_SOCKET) closesocket(s);
+        s = INVALID_SOCKET;
+        pending.clear();
+    }
+    
+    // Runs commands in order, one result each. Returns false only when no
+    // session could be opened, so callers can fall back to one-shot shells
+    // without running anything twice; a session that breaks midway fails
+    // the remaining commands with the error instead. With onOutput set,
+    // output is handed over as it arrives instead of collected.
+    bool Run(const std::vector<std::string>& commands, std::vector<ShellCommandResult>& results,
+             std::string& error, const OutputCallback* onOutput = NULL) {
+        results.assign(commands.size(), ShellCommandResult());
+        if (!Open(error)) return false;
+        
+        unsigned long long first = sequence;
+        std::string script;
+        for (size_t i = 0; i < commands.size(); i++) {
+            script += "sh -c " + ShellQuote(commands[i]) + " </dev/null 2>&1; echo \"" + Marker(sequence++) + "$?\"\n";
+        }
+        bool ok = WriteStdin(script);
+        if (!ok) error = "error: shell session write failed";
+        for (size_t i = 0; ok && i < commands.size(); i++) {
+            ok = ReadResult(Marker(first + i), results[i], error, onOutput);
+        }
+        if (!ok) {
+            for (size_t i = 0; i < results.size(); i++) {
+                if (results[i].exitCode < 0) results[i].output += error;
+            }
+            Close();
+        }
+        return true;
+    }
+
+private:
+    AdbClient& adb;
+    std::string serial;
+    std::string token;
+    SOCKET s;
+    bool v2;
+    unsigned long long sequence;
+    std::string pending;        // stdout received but not yet claimed
+    std::mutex mutex;
+    
+    std::string Marker(unsigned long long seq) const {
+        return "__s23sh_" + token + "_" + std::to_string(seq) + ":";
+    }
+    
+    // Single-quotes text for sh; a ' becomes '\'' (close, escaped quote, reopen)
+    static std::string ShellQuote(const std::string& text) {
+        std::string quoted = "'";
+        for (size_t i = 0; i < text.size(); i++) {
+            if (text[i] == '\'') quoted += "'\\''";
+            else quoted += text[i];
+        }
+        return quoted + "'";
+    }
+    
+    bool WriteStdin(const std::string& data) {
+        if (!v2) return SocketSendAll(s, data.data(), data.size());
+        std::string packet(5, '\0');
+        packet[0] = ADB_SHELL_STDIN;
+        uint32_t len = (uint32_t)data.size();
+        for (int i = 0; i < 4; i++) packet[1 + i] = (char)(len >> (8 * i));
+        packet += data;
+        return SocketSendAll(s, packet.data(), packet.size());
+    }
+    
+    // Appends whatever the shell sends next to pending
+    bool Receive(std::string& error) {
+        if (v2) {
+            unsigned char header[5];
+            for (;;) {
+                if (!SocketReadExact(s, (char*)header, sizeof(header))) break;
+                unsigned int len = header[1] | (header[2] << 8) | (header[3] << 16) | ((unsigned int)header[4] << 24);
+                size_t old = pending.size();
+                pending.resize(old + len);
+                if (len > 0 && !SocketReadExact(s, &pending[old], len)) break;
+                if (header[0] == ADB_SHELL_STDOUT || header[0] == ADB_SHELL_STDERR) return true;
+                pending.resize(old);
+                if (header[0] == ADB_SHELL_EXIT) break;
+            }
+        } else {
+            char buffer[ADB_SESSION_READ];
+            int n = recv(s, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                pending.append(buffer, n);
+                return true;
+            }
+        }
+        error = "error: shell session closed unexpectedly";
+        return false;
+    }
+    
+    bool ReadResult(const std::string& marker, ShellCommandResult& result, std::string& error,
+                    const OutputCallback* onOutput) {
+        size_t from = 0;
+        for (;;) {
+            size_t pos = pending.find(marker, from);
+            size_t eol = pos == std::string::npos ? pos : pending.find('\n', pos + marker.size());
+            if (eol != std::string::npos) {
+                if (onOutput && pos > 0) (*onOutput)(pending.data(), pos);
+                else if (!onOutput) result.output.assign(pending, 0, pos);
+                result.exitCode = atoi(pending.c_str() + pos + marker.size());
+                pending.erase(0, eol + 1);
+                return true;
+            }
+            if (pos == std::string::npos) from = pending.size() > marker.size() ? pending.size() - marker.size() : 0;
+            else from = pos;
+            if (onOutput && from > 0) {
+                // Everything before a possible partial marker is final
+                (*onOutput)(pending.data(), from);
+                pending.erase(0, from);
+                from = 0;
+            }
+            if (CurrentJobCancelled()) {
+                error = "cancelled";
+                return false;
+            }
+            if (!Receive(error)) return false;
+        }
+    }
+};
+
+// One session per device serial
+class AdbShellSessions {
+public:
+    // Runs commands on serial's session; false if none could be opened
+    bool Run(const std::string& serial, const std::vector<std::string>& commands,
+             std::vector<ShellCommandResult>& results, std::string& error,
+             const OutputCallback* onOutput = NULL) {
+        std::shared_ptr<AdbShellSession> session;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::shared_ptr<AdbShellSession>& slot = sessions[serial];
+            if (!slot) slot = std::make_shared<AdbShellSession>(g_adb, serial);
+            session = slot;
+        }
+        std::lock_guard<std::mutex> lock(session->Mutex());
+        return session->Run(commands, results, error, onOutput);
+    }
+    
+    // Single command, same contract as AdbClient::Shell
+    bool Run(const std::string& serial, const std::string& cmd, std::string& out, int* exitCode,
+             const OutputCallback* onOutput = NULL) {
+        std::vector<ShellCommandResult> results;
+        std::string error;
+        if (!Run(serial, std::vector<std::string>(1, cmd), results, error, onOutput)) return false;
+        out = results[0].output;
+        if (exitCode) *exitCode = results[0].exitCode;
+        return true;
+    }
+    
+    // Drops a device's session (state change, reboot, detach); in-flight
+    // batches finish on their own reference
+    void Forget(const std::string& serial) {
+        std::lock_guard<std::mutex> lock(mutex);
+        sessions.erase(serial);
+    }
+    
+    void ForgetAll() {
+        std::lock_guard<std::mutex> lock(mutex);
+        sessions.clear();
+    }
+
+private:
+    std::mutex mutex;
+    std::map<std::string, std::shared_ptr<AdbShellSession> > sessions;
+};
+
+AdbShellSessions g_shellSessions;
+
+// Logcat store
+// Logcat is read in binary form ("exec:logcat -B", the same bytes as
+// "adb exec-out logcat -B"): each entry is a logger_entry header (payload
+// length, header size, pid, tid, sec, nsec, log id) followed by
+// <priority><tag>\0<message>\0. Entries are decoded straight out of the
+// received buffer into per-device columns: one vector per field, tags
+// interned to ids, messages appended to a single arena and referenced by
+// offset. Only an entry split across two reads is copied aside. Filters scan
+// the columns, cheapest test first, so the regex only sees entries that
+// already passed tag, priority and time. When a device's store outgrows its
+// limits the oldest half is dropped; entry numbers stay stable (Base() moves)
+// so views can tell which of their rows are gone.
+#define LOGCAT_ENTRY_V1_HEADER 20
+#define LOGCAT_MAX_PAYLOAD 65535
+#define LOGCAT_MAX_ENTRIES 1000000
+#define LOGCAT_MAX_ARENA (128u * 1024 * 1024)
+#define LOGCAT_READ_SIZE 65536
+#define LOGCAT_LIVE_RETRY_MS 2000
+
+// Binary buffers (events, stats, security) carry tag numbers, not text
+static bool LogcatBinaryBuffer(unsigned int lid) {
+    return lid == 2 || lid == 5 || lid == 6;
+}
+
+static char LogcatPriorityLetter(int priority) {
+    const char letters[] = "??VDIWEFS";
+    return priority >= 0 && priority <= 8 ? letters[priority] : '?';
+}
+
+// "W", "warn", "6" -> android_LogPriority; 0 if not a priority
+static int ParseLogcatPriority(const std::string& text) {
+    if (text.empty()) return 0;
+    if (text[0] >= '2' && text[0] <= '8' && text.size() == 1) return text[0] - '0';
+    const char* letters = "VDIWEFS";
+    const char* hit = strchr(letters, toupper((unsigned char)text[0]));
+    return hit && text[0] ? (int)(hit - letters) + 2 : 0;
+}
+
+struct LogcatQuery {
+    std::vector<std::string> tags;      // any of these; empty = all
+    int minPriority;
+    int pid;                            // 0 = any
+    uint64_t sinceNs, untilNs;          // device clock, ns since the epoch
+    int64_t lastNs;                     // > 0: only the newest N ns of the store
+    std::string pattern;                // ECMAScript regex over the message
+    bool ignoreCase;
+    
+    LogcatQuery() : minPriority(0), pid(0), sinceNs(0), untilNs(UINT64_MAX), lastNs(0), ignoreCase(false) {}
+};
+
+static std::regex::flag_type LogcatRegexFlags(const LogcatQuery& q) {
+    return std::regex::ECMAScript | std::regex::optimize | (q.ignoreCase ? std::regex::icase : std::regex::flag_type());
+}
+
+// Filter text as typed in the viewer or on the command line:
+//   tag:ActivityManager tag:Zygote prio:W pid:1234 since:<epoch s> until:<epoch s>
+//   last:<seconds> -i <regex words...>
+// A bare priority letter ("E") counts as prio:. Everything else is the regex.
+static bool ParseLogcatQuery(const std::string& spec, LogcatQuery& q, std::string& error) {
+    q = LogcatQuery();
+    std::istringstream stream(spec);
+    std::string word, pattern;
+    while (stream >> word) {
+        size_t colon = word.find(':');
+        std::string key = colon == std::string::npos ? "" : word.substr(0, colon);
+        std::string value = colon == std::string::npos ? "" : word.substr(colon + 1);
+        if (key == "tag") {
+            q.tags.push_back(value);
+        } else if (key == "prio" || key == "priority") {
+            q.minPriority = ParseLogcatPriority(value);
+            if (q.minPriority == 0) {
+                error = "bad priority: " + value;
+                return false;
+            }
+        } else if (key == "pid") {
+            q.pid = atoi(value.c_str());
+        } else if (key == "since" || key == "until") {
+            uint64_t ns = (uint64_t)(strtod(value.c_str(), NULL) * 1e9);
+            if (key == "since") q.sinceNs = ns;
+            else q.untilNs = ns;
+        } else if (key == "last") {
+            q.lastNs = (int64_t)(strtod(value.c_str(), NULL) * 1e9);
+        } else if (word == "-i") {
+            q.ignoreCase = true;
+        } else if (word.size() == 1 && ParseLogcatPriority(word) > 0 && isupper((unsigned char)word[0])) {
+            q.minPriority = ParseLogcatPriority(word);
+        } else {
+            pattern += (pattern.empty() ? "" : " ") + word;
+        }
+    }
+    q.pattern = pattern;
+    if (!pattern.empty()) {
+        try {
+            std::regex test(pattern, LogcatRegexFlags(q));
+        } catch (const std::regex_error& e) {
+            error = std::string("bad regex: ") + e.what();
+            return false;
+        }
+    }
+    return true;
+}
+
+// Message test for a query. A pattern without regex syntax, the usual
+// case, is a plain substring search, which is far cheaper per entry than
+// std::regex.
+class LogcatMatcher {
+public:
+    explicit LogcatMatcher(const LogcatQuery& q)
+        : active(!q.pattern.empty()), literal(q.pattern.find_first_of("\\^$.|?*+()[]{}") == std::string::npos),
+          icase(q.ignoreCase), needle(q.pattern) {
+        if (active && !literal) re = std::regex(q.pattern, LogcatRegexFlags(q));
+        if (icase) std::transform(needle.begin(), needle.end(), needle.begin(), ::tolower);
+    }
+    
+    bool Active() const { return active; }
+    
+    bool Match(const char* msg, size_t len) const {
+        if (!literal) return std::regex_search(msg, msg + len, re);
+        const char* end = msg + len;
+        if (!icase) return std::search(msg, end, needle.begin(), needle.end()) != end;
+        return std::search(msg, end, needle.begin(), needle.end(), [](char a, char b) {
+            return tolower((unsigned char)a) == b;
+        }) != end;
+    }
+
+private:
+    bool active, literal, icase;
+    std::string needle;
+    std::regex re;
+};
+
+class LogcatStore {
+public:
+    LogcatStore() : base(0), newest(0), skipped(0), corrupt(false) {}
+    
+    // Decodes a chunk of "logcat -B" output; returns the entries added.
+    // Chunks may split entries anywhere.
+    size_t Feed(const char* data, size_t len) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (corrupt) return 0;
+        size_t before = time.size();
+        // Finish an entry left over from the previous chunk
+        while (!partial.empty() && len > 0) {
+            size_t want = partial.size() < 4 ? 4 : EntrySize(partial.data());
+            if (want == 0) break;
+            size_t take = std::min(want - partial.size(), len);
+            partial.append(data, take);
+            data += take;
+            len -= take;
+            if (partial.size() >= 4 && partial.size() == EntrySize(partial.data())) {
+                Decode(partial.data(), partial.size());
+                partial.clear();
+            }
+        }
+        while (!corrupt && partial.empty() && len >= 4) {
+            size_t size = EntrySize(data);
+            if (size == 0 || size > len) break;
+            Decode(data, size);
+            data += size;
+            len -= size;
+        }
+        if (!corrupt && len > 0) partial.append(data, len);
+        size_t added = time.size() - before;
+        if (time.size() > LOGCAT_MAX_ENTRIES || arena.size() > LOGCAT_MAX_ARENA) DropOldest();
+        return added;
+    }
+    
+    // A stream that doesn't parse as logger entries (text logcat, a pty
+    // mangling newlines) stops ingestion rather than storing garbage
+    bool Corrupt() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return corrupt;
+    }
+    
+    void Clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        base += time.size();
+        time.clear(); pid.clear(); tid.clear(); priority.clear(); buffer.clear();
+        tag.clear(); msgOff.clear(); msgLen.clear();
+        arena.clear();
+        partial.clear();
+        newest = 0;
+        corrupt = false;
+    }
+    
+    // A new stream starts on an entry boundary
+    void Resync() {
+        std::lock_guard<std::mutex> lock(mutex);
+        partial.clear();
+        corrupt = false;
+    }
+    
+    // Time of the newest entry, 0 when empty
+    uint64_t NewestNs() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return newest;
+    }
+    
+    // Entry numbers run from Base() to End(); older ones were dropped
+    uint64_t Base() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return base;
+    }
+    
+    uint64_t End() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return base + time.size();
+    }
+    
+    size_t TagCount() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return tagNames.size();
+    }
+    
+    size_t ArenaBytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return arena.size();
+    }
+    
+    uint64_t Skipped() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return skipped;
+    }
+    
+    // Appends the numbers of entries in [from, to) matching q to out and
+    // returns where the scan stopped: at to, or earlier after maxScan
+    // entries so a caller on the UI thread can spread a long scan out.
+    uint64_t Filter(const LogcatQuery& q, const LogcatMatcher& matcher, uint64_t from, uint64_t to,
+                    size_t maxScan, std::vector<uint64_t>& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (from < base) from = base;
+        if (to > base + time.size()) to = base + time.size();
+        if (from >= to) return std::max(from, to);
+        size_t begin = (size_t)(from - base), end = (size_t)(to - base);
+        if (end - begin > maxScan) end = begin + maxScan;
+        
+        // Tag names -> a per-id mask; a tag never seen can't match
+        std::vector<char> tagMask;
+        if (!q.tags.empty()) {
+            tagMask.assign(tagNames.size(), 0);
+            for (size_t i = 0; i < q.tags.size(); i++) {
+                std::unordered_map<std::string, uint32_t>::const_iterator it = tagIds.find(q.tags[i]);
+                if (it != tagIds.end()) tagMask[it->second] = 1;
+            }
+        }
+        uint64_t since = q.sinceNs;
+        if (q.lastNs > 0 && newest > (uint64_t)q.lastNs) {
+            since = std::max(since, newest - (uint64_t)q.lastNs);
+        }
+        
+        for (size_t i = begin; i < end; i++) {
+            if (priority[i] < q.minPriority) continue;
+            if (time[i] < since || time[i] > q.untilNs) continue;
+            if (q.pid && pid[i] != q.pid) continue;
+            if (!tagMask.empty() && !tagMask[tag[i]]) continue;
+            if (matcher.Active() && !matcher.Match(arena.data() + msgOff[i], msgLen[i])) continue;
+            out.push_back(base + i);
+        }
+        return base + end;
+    }
+    
+    struct Entry {
+        uint64_t timeNs;
+        int pid, tid, priority, buffer;
+        std::string tag, message;
+    };
+    
+    // Copies one entry out; false if it was dropped
+    bool Get(uint64_t number, Entry& e) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (number < base || number >= base + time.size()) return false;
+        size_t i = (size_t)(number - base);
+        e.timeNs = time[i];
+        e.pid = pid[i];
+        e.tid = tid[i];
+        e.priority = priority[i];
+        e.buffer = buffer[i];
+        e.tag = tagNames[tag[i]];
+        e.message.assign(arena, msgOff[i], msgLen[i]);
+        return true;
+    }
+
+private:
+    std::mutex mutex;
+    uint64_t base;                      // number of the first stored entry
+    uint64_t newest;
+    std::vector<uint64_t> time;         // ns since the epoch, device clock
+    std::vector<int32_t> pid, tid;
+    std::vector<uint8_t> priority, buffer;
+    std::vector<uint32_t> tag;          // index into tagNames
+    std::vector<uint32_t> msgOff;
+    std::vector<uint16_t> msgLen;
+    std::string arena;                  // message bytes, back to back
+    std::vector<std::string> tagNames;
+    std::unordered_map<std::string, uint32_t> tagIds;
+    std::string partial;                // entry split across chunks
+    uint64_t skipped;                   // binary-buffer entries
+    bool corrupt;
+    
+    static uint16_t Read16(const char* p) { return (uint16_t)((unsigned char)p[0] | ((unsigned char)p[1] << 8)); }
+    static uint32_t Read32(const char* p) {
+        return (unsigned char)p[0] | ((unsigned char)p[1] << 8) | ((unsigned char)p[2] << 16) |
+               ((uint32_t)(unsigned char)p[3] << 24);
+    }
+    
+    // Total entry size from its first four bytes; 0 (and corrupt) if the
+    // header can't be a logger_entry
+    size_t EntrySize(const char* p) {
+        size_t payload = Read16(p), header = Read16(p + 2);
+        if (header == 0) header = LOGCAT_ENTRY_V1_HEADER;
+        if (header < LOGCAT_ENTRY_V1_HEADER || header > 64 || payload > LOGCAT_MAX_PAYLOAD) {
+            corrupt = true;
+            partial.clear();
+            return 0;
+        }
+        return header + payload;
+    }
+    
+    uint32_t Intern(const char* name, size_t len) {
+        std::string key(name, len);     // tags fit the small-string buffer
+        std::unordered_map<std::string, uint32_t>::const_iterator it = tagIds.find(key);
+        if (it != tagIds.end()) return it->second;
+        uint32_t id = (uint32_t)tagNames.size();
+        tagNames.push_back(key);
+        tagIds[key] = id;
+        return id;
+    }
+    
+    void Decode(const char* p, size_t size) {
+        size_t header = Read16(p + 2) ? Read16(p + 2) : LOGCAT_ENTRY_V1_HEADER;
+        unsigned int lid = header >= 24 ? Read32(p + 20) : 0;
+        if (LogcatBinaryBuffer(lid) || size - header < 2) {
+            skipped++;
+            return;
+        }
+        const char* payload = p + header;
+        const char* payloadEnd = p + size;
+        const char* tagStart = payload + 1;
+        const char* tagEnd = (const char*)memchr(tagStart, '\0', payloadEnd - tagStart);
+        if (!tagEnd) tagEnd = payloadEnd;
+        const char* msg = std::min(tagEnd + 1, payloadEnd);
+        const char* msgEnd = (const char*)memchr(msg, '\0', payloadEnd - msg);
+        if (!msgEnd) msgEnd = payloadEnd;
+        while (msgEnd > msg && (msgEnd[-1] == '\n' || msgEnd[-1] == '\r')) msgEnd--;
+        
+        time.push_back((uint64_t)Read32(p + 12) * 1000000000ull + Read32(p + 16));
+        newest = std::max(newest, time.back());
+        pid.push_back((int32_t)Read32(p + 4));
+        tid.push_back((int32_t)Read32(p + 8));
+        priority.push_back((uint8_t)payload[0]);
+        buffer.push_back((uint8_t)lid);
+        tag.push_back(Intern(tagStart, tagEnd - tagStart));
+        msgOff.push_back((uint32_t)arena.size());
+        msgLen.push_back((uint16_t)(msgEnd - msg));
+        arena.append(msg, msgEnd - msg);
+    }
+    
+    // Keeps the newer half; offsets are rebased onto the shrunken arena
+    void DropOldest() {
+        size_t drop = time.size() / 2;
+        if (drop == 0) {
+            arena.clear();
+            return;
+        }
+        uint32_t cut = msgOff[drop];
+        time.erase(time.begin(), time.begin() + drop);
+        pid.erase(pid.begin(), pid.begin() + drop);
+        tid.erase(tid.begin(), tid.begin() + drop);
+        priority.erase(priority.begin(), priority.begin() + drop);
+        buffer.erase(buffer.begin(), buffer.begin() + drop);
+        tag.erase(tag.begin(), tag.begin() + drop);
+        msgOff.erase(msgOff.begin(), msgOff.begin() + drop);
+        msgLen.erase(msgLen.begin(), msgLen.begin() + drop);
+        arena.erase(0, cut);
+        for (size_t i = 0; i < msgOff.size(); i++) msgOff[i] -= cut;
+        base += drop;
+    }
+};
+
+// One store per device, plus the live "logcat -B" readers feeding them
+class LogcatStores {
+public:
+    ~LogcatStores() { StopAll(); }
+    
+    std::shared_ptr<LogcatStore> Get(const std::string& serial) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<LogcatStore>& store = stores[serial];
+        if (!store) store = std::make_shared<LogcatStore>();
+        return store;
+    }
+    
+    // Reads the device's current buffers ("logcat -B -d") into its store.
+    // Returns false if adb couldn't be reached natively.
+    bool Dump(const std::string& serial, size_t& entries, std::string& error) {
+        std::shared_ptr<LogcatStore> store = Get(serial);
+        entries = 0;
+        if (!g_adb.ServerAvailable()) {
+            error = "adb server not available";
+            return false;
+        }
+        SOCKET s = g_adb.OpenService(serial, "exec:logcat -B -d", error);
+        if (s == INVALID_SOCKET) return false;
+        store->Clear();
+        std::vector<char> buffer(LOGCAT_READ_SIZE);
+        int n;
+        while (!CurrentJobCancelled() && (n = recv(s, &buffer[0], (int)buffer.size(), 0)) > 0) {
+            entries += store->Feed(&buffer[0], n);
+        }
+        closesocket(s);
+        if (store->Corrupt()) error = "logcat output is not in binary format";
+        return !store->Corrupt();
+    }
+    
+    // Starts following the device's log; no-op if already live
+    void StartLive(const std::string& serial) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<Live>& live = streams[serial];
+        if (live) return;
+        live = std::make_shared<Live>();
+        live->store = GetLocked(serial);
+        live->thread = std::thread(&LogcatStores::Follow, serial, live);
+    }
+    
+    void StopLive(const std::string& serial) {
+        std::shared_ptr<Live> live;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::map<std::string, std::shared_ptr<Live> >::iterator it = streams.find(serial);
+            if (it == streams.end()) return;
+            live = it->second;
+            streams.erase(it);
+        }
+        Halt(live);
+    }
+    
+    bool IsLive(const std::string& serial) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return streams.count(serial) != 0;
+    }
+    
+    void StopAll() {
+        std::map<std::string, std::shared_ptr<Live> > all;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            all.swap(streams);
+        }
+        for (std::map<std::string, std::shared_ptr<Live> >::iterator it = all.begin(); it != all.end(); ++it) {
+            Halt(it->second);
+        }
+    }
+
+private:
+    struct Live {
+        std::shared_ptr<LogcatStore> store;
+        std::thread thread;
+        std::mutex mutex;
+        SOCKET s;
+        bool stopping;
+        
+        Live() : s(INVALID_SOCKET), stopping(false) {}
+    };
+    
+    std::mutex mutex;
+    std::map<std::string, std::shared_ptr<LogcatStore> > stores;
+    std::map<std::string, std::shared_ptr<Live> > streams;
+    
+    std::shared_ptr<LogcatStore> GetLocked(const std::string& serial) {
+        std::shared_ptr<LogcatStore>& store = stores[serial];
+        if (!store) store = std::make_shared<LogcatStore>();
+        return store;
+    }
+    
+    static void Halt(const std::shared_ptr<Live>& live) {
+        {
+            std::lock_guard<std::mutex> lock(live->mutex);
+            live->stopping = true;
+            if (live->s != INVALID_SOCKET) shutdown(live->s, SD_BOTH);
+        }
+        if (live->thread.joinable()) live->thread.join();
+    }
+    
+    // Reader thread. Picks up after the newest stored entry (a dump or an
+    // earlier connection), so reconnects while the device comes and goes
+    // neither skip nor replay the backlog.
+    static void Follow(std::string serial, std::shared_ptr<Live> live) {
+        std::vector<char> buffer(LOGCAT_READ_SIZE);
+        for (;;) {
+            std::string error;
+            uint64_t newest = live->store->NewestNs();
+            char since[32];
+            if (newest) snprintf(since, sizeof(since), "%llu.%09llu", (newest + 1) / 1000000000ull, (newest + 1) % 1000000000ull);
+            else snprintf(since, sizeof(since), "1");
+            SOCKET s = g_adb.OpenService(serial, std::string("exec:logcat -B -T ") + since, error);
+            {
+                std::lock_guard<std::mutex> lock(live->mutex);
+                if (live->stopping) {
+                    if (s != INVALID_SOCKET) closesocket(s);
+                    return;
+                }
+                live->s = s;
+            }
+            if (s != INVALID_SOCKET) {
+                live->store->Resync();
+                DWORD timeout = 0;
+                setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+                int n;
+                while ((n = recv(s, &buffer[0], (int)buffer.size(), 0)) > 0) {
+                    live->store->Feed(&buffer[0], n);
+                }
+                std::lock_guard<std::mutex> lock(live->mutex);
+                closesocket(s);
+                live->s = INVALID_SOCKET;
+                if (live->stopping) return;
+            }
+            for (int waited = 0; waited < LOGCAT_LIVE_RETRY_MS; waited += 100) {
+                Sleep(100);
+                std::lock_guard<std::mutex> lock(live->mutex);
+                if (live->stopping) return;
+            }
+        }
+    }
+};
+
+LogcatStores g_logcat;
+
+// Device property cache
+// One full "getprop" dump per device is parsed into a PropertySnapshot, so
+// later lookups never touch the device. Only read-only (ro.*) properties are
+// served from it: they are fixed until the next boot, while runtime ones
+// such as sys.boot_completed or init.svc.* change under a live snapshot.
+// Snapshots are dropped when the device reboots or changes state.
+class PropertyCache {
+public:
+    PropertyCache() : generation(0) {}
+    
+    // Whether key can be answered from a snapshot
+    static bool Cacheable(const std::string& key) {
+        return key.compare(0, 3, "ro.") == 0;
+    }
+    
+    // Returns the cached snapshot for serial, fetching it with a single
+    // getprop dump on first use, over the device's shell session when one
+    // opens. Returns null if the device can't be read.
+    std::shared_ptr<const PropertySnapshot> Get(const std::string& serial) {
+        unsigned long long gen;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::map<std::string, std::shared_ptr<const PropertySnapshot> >::iterator it = snapshots.find(serial);
+            if (it != snapshots.end()) return it->second;
+            gen = generation;
+        }
+        
+        std::string dump;
+        int exitCode = -1;
+        if (g_shellSessions.Run(serial, "getprop", dump, &exitCode)) {
+            if (exitCode != 0) return std::shared_ptr<const PropertySnapshot>();
+        } else if (!g_adb.Shell(serial, "getprop", dump, &exitCode) || exitCode > 0) {
+            return std::shared_ptr<const PropertySnapshot>();
+        }
+        std::shared_ptr<PropertySnapshot> snapshot(new PropertySnapshot());
+        snapshot->Parse(dump);
+        if (snapshot->Size() == 0) return std::shared_ptr<const PropertySnapshot>();
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        // Don't install a dump that raced with an invalidation
+        if (gen == generation) snapshots[serial] = snapshot;
+        return snapshot;
+    }
+    
+    void Invalidate(const std::string& serial) {
+        std::lock_guard<std::mutex> lock(mutex);
+        snapshots.erase(serial);
+        generation++;
+    }
+    
+    void InvalidateAll() {
+        std::lock_guard<std::mutex> lock(mutex);
+        snapshots.clear();
+        generation++;
+    }
+    
+private:
+    std::mutex mutex;
+    unsigned long long generation;
+    std::map<std::string, std::shared_ptr<const PropertySnapshot> > snapshots;
+};
+
+PropertyCache g_props;
+
+// Fastboot variable cache
+// Each device's "getvar all" / "oem device-info" output is parsed into a
+// FastbootVarTable; tables are cached by serial and dropped when the
+// device's transport changes.
+class FastbootInfoCache {
+public:
+    FastbootInfoCache() : generation(0) {}
+    
+    // Returns the cached table for serial, fetching it with "getvar all" (and
+    // "oem device-info" when that leaves the lock state open) on first use.
+    // Returns null if the device can't be read.
+    std::shared_ptr<const FastbootVarTable> Get(const std::string& serial) {
+        unsigned long long gen;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::map<std::string, std::shared_ptr<const FastbootVarTable> >::iterator it = tables.find(serial);
+            if (it != tables.end()) return it->second;
+            gen = generation;
+        }
+        
+        std::shared_ptr<FastbootVarTable> table(new FastbootVarTable());
+        std::string out;
+        OutputCallback collect = [&out](const char* data, size_t len) { out.append(data, len); };
+        if (StreamFastbootCommand("-s " + serial + " getvar all", collect) != 0 ||
+            table->Parse(out.data(), out.size()) == 0) {
+            return std::shared_ptr<const FastbootVarTable>();
+        }
+        if (table->unlocked == FASTBOOT_UNKNOWN) {
+            out.clear();
+            if (StreamFastbootCommand("-s " + serial + " oem device-info", collect) == 0) {
+                table->Parse(out.data(), out.size());
+            }
+        }
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        // Don't install a table that raced with an invalidation
+        if (gen == generation) tables[serial] = table;
+        return table;
+    }
+    
+    // Folds output the user ran anyway (Quick Commands) into the device's
+    // table; a full "getvar all" (replace) starts a fresh one. Without a
+    // serial the device's own "serialno" decides. Returns the updated table,
+    // or null if the output held no variables.
+    std::shared_ptr<const FastbootVarTable> Ingest(std::string serial, const std::string& output, bool replace) {
+        std::shared_ptr<FastbootVarTable> table;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::map<std::string, std::shared_ptr<const FastbootVarTable> >::iterator it = tables.find(serial);
+            table.reset(it != tables.end() && !replace ?
+                new FastbootVarTable(*it->second) : new FastbootVarTable());
+        }
+        if (table->Parse(output.data(), output.size()) == 0) return std::shared_ptr<const FastbootVarTable>();
+        if (serial.empty()) serial = table->Value("serialno");
+        if (serial.empty()) return table;
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        tables[serial] = table;
+        return table;
+    }
+    
+    void Invalidate(const std::string& serial) {
+        std::lock_guard<std::mutex> lock(mutex);
+        tables.erase(serial);
+        generation++;
+    }
+    
+    void InvalidateAll() {
+        std::lock_guard<std::mutex> lock(mutex);
+        tables.clear();
+        generation++;
+    }
+
+private:
+    std::mutex mutex;
+    unsigned long long generation;
+    std::map<std::string, std::shared_ptr<const FastbootVarTable> > tables;
+};
+
+FastbootInfoCache g_fastbootInfo;
+
+// Splits "[-s <serial>] <verb> <rest>" adb arguments
+static void ParseAdbArgs(const std::string& args, std::string& serial, std::string& verb, std::string& rest) {
+    std::istringstream stream(args);
+    stream >> verb;
+    if (verb == "-s") {
+        stream >> serial >> verb;
+    }
+    std::getline(stream, rest);
+    rest.erase(0, rest.find_first_not_of(" \t"));
+}
+
+// Maps an adb.exe argument string onto native host services. Returns false
+// when the command is not covered or no server is reachable, in which case
+// the caller falls back to spawning adb.exe.
+bool AdbNativeCommand(const std::string& args, std::string& out, int* exitCode = NULL,
+                      const OutputCallback* onOutput = NULL) {
+    std::string serial, verb, rest;
+    ParseAdbArgs(args, serial, verb, rest);
+    
+    if (verb != "devices" && verb != "shell" && verb != "logcat" &&
+        verb != "reboot" && verb != "get-state" && verb != "get-serialno") {
+        return false;
+    }
+    if (!g_adb.ServerAvailable()) return false;
+    
+    std::string prefix = serial.empty() ? "host:" : "host-serial:" + serial + ":";
+    if (verb == "devices") {
+        std::string list;
+        bool ok = g_adb.HostQuery(rest == "-l" ? "host:devices-l" : "host:devices", list);
+        out = ok ? "List of devices attached\n" + list : list;
+    } else if (verb == "shell" && rest.compare(0, 8, "getprop ") == 0 &&
+               rest.find_first_of(" ;|&<>$`'\"", 8) == std::string::npos &&
+               PropertyCache::Cacheable(rest.substr(8))) {
+        // Single-key ro.* getprop: served from the device's property snapshot.
+        // Without -s, ask the server (no device round trip) which device
+        // adb would pick. With no single device, or no snapshot (offline,
+        // unauthorized, shell failure), fall back to adb.exe so the real
+        // error and exit code are reported.
+        if (serial.empty() && !g_adb.HostQuery("host:get-serialno", serial)) return false;
+        std::shared_ptr<const PropertySnapshot> snapshot = g_props.Get(serial);
+        if (!snapshot) return false;
+        std::string value;
+        out = snapshot->Get(rest.substr(8), value) ? value + "\n" : "\n";
+        if (exitCode) *exitCode = 0;
+    } else if (verb == "shell" && !rest.empty()) {
+        // On the device's persistent session; a one-shot shell if none opens
+        if (serial.empty() && !g_adb.HostQuery("host:get-serialno", serial)) serial.clear();
+        if (serial.empty() || !g_shellSessions.Run(serial, rest, out, exitCode, onOutput)) {
+            g_adb.Shell(serial, rest, out, exitCode, onOutput);
+        }
+    } else if (verb == "shell") {
+        return false;   // interactive shell needs a console
+    } else if (verb == "logcat") {
+        g_adb.Shell(serial, "exec logcat " + rest, out, exitCode, onOutput);
+    } else if (verb == "reboot") {
+        g_adb.Service(serial, "reboot:" + rest, out);
+    } else if (verb == "get-state") {
+        g_adb.HostQuery(prefix + "get-state", out);
+    } else {
+        g_adb.HostQuery(prefix + "get-serialno", out);
+    }
+    return true;
+}
+
+// Push-based device tracker
+// Follows the adb server's host:track-devices-l stream, which sends a fresh
+// device list whenever anything changes, and diffs each list against the
+// previous one. Fastboot has no such stream, so fastboot devices are only
+// re-listed when Windows reports a USB topology change (WM_DEVICECHANGE).
+// Probes that identify a device run on a small pool that outlives Stop(), so
+// turning auto-detect off never waits for one; probes queued before a Stop()
+// are skipped, and a result for a device that left meanwhile is dropped.
+#define DEVICE_EVENT_ATTACHED 0
+#define DEVICE_EVENT_DETACHED 1
+#define DEVICE_EVENT_CHANGED 2
+#define DEVICE_EVENT_PROBED 3       // model of a device already listed
+#define TRACKER_RECONNECT_MS 1000
+#define TRACKER_PROBE_WORKERS 2
+
+struct DeviceEvent {
+    int kind;
+    DetectedDevice device;
+    std::string previousState;
+};
+
+class DeviceTracker {
+public:
+    DeviceTracker() : stopping(false), probeGeneration(0), fastbootPending(false), trackSocket(INVALID_SOCKET) {}
+    ~DeviceTracker() {
+        Stop();
+        probes.reset();
+    }
+    
+    bool IsRunning() const { return adbThread.joinable(); }
+    
+    void Start() {
+        if (IsRunning()) return;
+        stopping = false;
+        fastbootPending = true;     // list fastboot devices once on start
+        adbKnown.clear();
+        fastbootKnown.clear();
+        if (!probes) probes.reset(new WorkerPool(TRACKER_PROBE_WORKERS));
+        adbThread = std::thread(&DeviceTracker::TrackAdb, this);
+        fastbootThread = std::thread(&DeviceTracker::WatchFastboot, this);
+    }
+    
+    // Quick enough for the UI thread: the watchers see stopping within one
+    // process poll (PROCESS_POLL_MS), killing whatever command they run
+    void Stop() {
+        if (!IsRunning()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            probeGeneration++;      // queued probes see this and skip
+            // Unblocks the recv() in TrackAdb
+            if (trackSocket != INVALID_SOCKET) shutdown(trackSocket, SD_BOTH);
+        }
+        wake.notify_all();
+        adbThread.join();
+        fastbootThread.join();
+    }
+    
+    // Called (debounced) on WM_DEVICECHANGE to re-list fastboot devices
+    void PokeFastboot() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            fastbootPending = true;
+        }
+        wake.notify_all();
+    }
+    
+private:
+    std::thread adbThread, fastbootThread;
+    std::unique_ptr<WorkerPool> probes;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::atomic<bool> stopping;
+    std::atomic<unsigned> probeGeneration;
+    bool fastbootPending;
+    SOCKET trackSocket;
+    std::map<std::string, std::string> adbKnown;        // serial -> state
+    std::map<std::string, std::string> fastbootKnown;   // serial -> state
+    
+    // Sleeps for ms unless stopped; returns false when stopping
+    bool Pause(int ms) {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait_for(lock, std::chrono::milliseconds(ms), [this] { return stopping.load(); });
+        return !stopping;
+    }
+    
+    void Post(int kind, const std::string& transport, const std::string& serial,
+              const std::string& state, const std::string& previousState) {
+        DeviceEvent* ev = new DeviceEvent();
+        ev->kind = kind;
+        ev->device.transport = transport;
+        ev->device.serial = serial;
+        ev->device.state = state;
+        ev->device.probeMs = 0;
+        ev->device.elapsedMs = 0;
+        ev->previousState = previousState;
+        Send(ev);
+    }
+    
+    // The UI thread deletes delivered events; undelivered ones are ours
+    static void Send(DeviceEvent* ev) {
+        if (!PostMessage(g_hWnd, WM_DEVICE_EVENT, 0, (LPARAM)ev)) delete ev;
+    }
+    
+    // Identifies a device that just became usable, off the tracking thread
+    void Probe(const std::string& serial) {
+        unsigned generation = probeGeneration;
+        probes->Submit([this, serial, generation]() {
+            if (generation != probeGeneration) return;      // stopped since
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            std::string model = RunADBCommand("-s " + serial + " shell getprop ro.product.model");
+            model.erase(model.find_last_not_of("\r\n") + 1);
+            if (generation != probeGeneration) return;
+            
+            DeviceEvent* ev = new DeviceEvent();
+            ev->kind = DEVICE_EVENT_PROBED;
+            ev->device.transport = "ADB";
+            ev->device.serial = serial;
+            ev->device.state = "device";
+            ev->device.model = model;
+            ev->device.probeMs = CoreMillisecondsSince(start);
+            ev->device.elapsedMs = 0;
+            ev->previousState = "device";
+            Send(ev);
+        });
+    }
+    
+    void Diff(const std::string& transport, std::map<std::string, std::string>& known,
+              const std::map<std::string, std::string>& current) {
+        for (std::map<std::string, std::string>::const_iterator it = current.begin(); it != current.end(); ++it) {
+            std::map<std::string, std::string>::iterator old = known.find(it->first);
+            if (old == known.end()) {
+                Post(DEVICE_EVENT_ATTACHED, transport, it->first, it->second, "");
+            } else if (old->second != it->second) {
+                Post(DEVICE_EVENT_CHANGED, transport, it->first, it->second, old->second);
+            } else {
+                continue;   // unchanged, nothing to re-probe
+            }
+            if (transport == "ADB" && it->second == "device") Probe(it->first);
+        }
+        for (std::map<std::string, std::string>::const_iterator it = known.begin(); it != known.end(); ++it) {
+            if (current.find(it->first) == current.end()) {
+                Post(DEVICE_EVENT_DETACHED, transport, it->first, "", it->second);
+            }
+        }
+        known = current;
+    }
+    
+    void TrackAdb() {
+        t_threadStop = &stopping;      // Stop() kills an "adb start-server" in flight
+        bool reported = false;
+        while (!stopping) {
+            std::string msg;
+            SOCKET s = g_adb.ServerAvailable() ?
+                g_adb.OpenHostStream("host:track-devices-l", msg) : INVALID_SOCKET;
+            if (s == INVALID_SOCKET) {
+                if (!reported) AddLog("Auto-detect: adb server not reachable, retrying...");
+                reported = true;
+                if (!Pause(TRACKER_RECONNECT_MS)) break;
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping) {
+                    closesocket(s);
+                    break;
+                }
+                trackSocket = s;
+            }
+            reported = false;
+            
+            while (AdbClient::ReadMessage(s, msg)) {
+                std::map<std::string, std::string> current;
+                std::vector<AdbDevice> devices = ParseAdbDevices(msg);
+                for (size_t i = 0; i < devices.size(); i++) {
+                    current[devices[i].serial] = devices[i].state;
+                }
+                Diff("ADB", adbKnown, current);
+            }
+            
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                trackSocket = INVALID_SOCKET;
+            }
+            closesocket(s);
+            if (!stopping) {
+                // Server went away (adb kill-server, crash); reconnect
+                g_adb.Reset();
+                g_shellSessions.ForgetAll();
+                Pause(TRACKER_RECONNECT_MS);
+            }
+        }
+    }
+    
+    void WatchFastboot() {
+        t_threadStop = &stopping;      // Stop() kills a "fastboot devices" in flight
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping.load() || fastbootPending; });
+                if (stopping) return;
+                fastbootPending = false;
+            }
+            if (g_fastbootPath.empty()) continue;
+            
+            std::map<std::string, std::string> current;
+            std::vector<AdbDevice> fbDevices = ParseFastbootDevices(ExecuteCommand("fastboot devices"));
+            for (size_t d = 0; d < fbDevices.size(); d++) current[fbDevices[d].serial] = "fastboot";
+            Diff("FASTBOOT", fastbootKnown, current);
+        }
+    }
+};
+
+DeviceTracker g_tracker;
+
+// Device list model (UI thread only): row i of g_hDeviceList shows g_deviceRows[i]
+std::vector<DetectedDevice> g_deviceRows;
+
+static std::string FormatDeviceRow(const DetectedDevice& dev) {
+    std::string entry = "[" + dev.transport + "] " + dev.serial;
+    if (dev.transport == "ADB" && dev.state != "device") {
+        entry += " (" + dev.state + ")";
+    } else if (!dev.model.empty()) {
+        entry += "  " + dev.model;
+    }
+    return entry;
+}
+
+int FindDeviceRow(const std::string& transport, const std::string& serial) {
+    for (size_t i = 0; i < g_deviceRows.size(); i++) {
+        if (g_deviceRows[i].serial == serial && g_deviceRows[i].transport == transport) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Inserts a device row, or updates an existing one in place
+void UpsertDeviceRow(const DetectedDevice& dev) {
+    if (g_deviceRows.empty()) {
+        SendMessage(g_hDeviceList, LB_RESETCONTENT, 0, 0);  // drop "No devices detected"
+    }
+    DetectedDevice row = dev;
+    int index = FindDeviceRow(dev.transport, dev.serial);
+    if (index < 0) {
+        g_deviceRows.push_back(row);
+        SendMessageA(g_hDeviceList, LB_ADDSTRING, 0, (LPARAM)FormatDeviceRow(row).c_str());
+        return;
+    }
+    
+    if (row.model.empty() && row.state == g_deviceRows[index].state) {
+        row.model = g_deviceRows[index].model;
+    }
+    g_deviceRows[index] = row;
+    int selected = (int)SendMessage(g_hDeviceList, LB_GETSEL, index, 0);
+    SendMessage(g_hDeviceList, LB_DELETESTRING, index, 0);
+    SendMessageA(g_hDeviceList, LB_INSERTSTRING, index, (LPARAM)FormatDeviceRow(row).c_str());
+    if (selected > 0) SendMessage(g_hDeviceList, LB_SETSEL, TRUE, index);
+}
+
+void RemoveDeviceRow(const std::string& transport, const std::string& serial) {
+    int index = FindDeviceRow(transport, serial);
+    if (index < 0) return;
+    g_deviceRows.erase(g_deviceRows.begin() + index);
+    SendMessage(g_hDeviceList, LB_DELETESTRING, index, 0);
+    if (g_deviceRows.empty()) {
+        SendMessageA(g_hDeviceList, LB_ADDSTRING, 0, (LPARAM)"No devices detected");
+    }
+}
+
+void ClearDeviceRows() {
+    g_deviceRows.clear();
+    SendMessage(g_hDeviceList, LB_RESETCONTENT, 0, 0);
+}
+
+// Log pipeline
+// AddLog may be called from any thread. Lines go into g_logQueue (see
+// devcore.h) and the UI thread drains it on a short one-shot timer, so a
+// burst of output costs one repaint instead of one message per line. Drained
+// records land in g_logRing, which backs the owner-data log ListView; the
+// control only asks for the rows it shows, so cost stays flat however long
+// the session runs.
+BoundedQueue<LogRecord> g_logQueue(LOG_QUEUE_CAPACITY);
+LogRing g_logRing;
+
+static unsigned long long CurrentFileTime() {
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    return ((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+// Moves everything queued into the ring and updates the ListView item count.
+// Keeps the view pinned to the newest line only if it was already there.
+void FlushLog() {
+    int total = (int)g_logRing.Size();
+    int top = ListView_GetTopIndex(g_hLog);
+    int perPage = ListView_GetCountPerPage(g_hLog);
+    bool follow = total == 0 || top + perPage >= total;
+    
+    size_t added = 0;
+    bool evicted = false;
+    LogRecord rec;
+    while (g_logQueue.Pop(rec)) {
+        evicted |= g_logRing.Append(rec);
+        added++;
+    }
+    size_t dropped = g_logQueue.TakeDropped();
+    if (dropped) {
+        rec.time = CurrentFileTime();
+        rec.text = "[" + std::to_string(dropped) + " log lines dropped]";
+        evicted |= g_logRing.Append(rec);
+        added++;
+    }
+    if (!added) return;
+    
+    // Eviction shifts every row index, so only then repaint the whole view
+    ListView_SetItemCountEx(g_hLog, (int)g_logRing.Size(),
+        evicted ? 0 : (LVSICF_NOINVALIDATEALL | LVSICF_NOSCROLL));
+    if (follow) ListView_EnsureVisible(g_hLog, (int)g_logRing.Size() - 1, FALSE);
+}
+
+// LVN_GETDISPINFO: format a single visible row on demand
+void FormatLogRow(int index, char* buffer, int size) {
+    if (size <= 0) return;
+    buffer[0] = '\0';
+    if (index < 0 || (size_t)index >= g_logRing.Size()) return;
+    const LogRecord& rec = g_logRing.At(index);
+    
+    FILETIME utc, local;
+    SYSTEMTIME st;
+    utc.dwLowDateTime = (DWORD)rec.time;
+    utc.dwHighDateTime = (DWORD)(rec.time >> 32);
+    FileTimeToLocalFileTime(&utc, &local);
+    FileTimeToSystemTime(&local, &st);
+    snprintf(buffer, size, "[%02d:%02d:%02d] %s",
+        st.wHour, st.wMinute, st.wSecond, rec.text.c_str());
+}
+
+// Session journal
+// Every log line and every command (its output, exit code and duration) is
+// appended to a binary journal next to the executable, in journal\. The
+// journal is a series of preallocated, memory-mapped segment files; records
+// are queued lock-free by producers and copied into the mapping by a writer
+// thread. Sealing a segment appends an index (time, offset, serial) so the
+// exporter can skip whole segments and seek within them.
+#define JOURNAL_SEGMENT_SIZE (16 * 1024 * 1024)
+#define JOURNAL_QUEUE_CAPACITY 65536
+#define JOURNAL_MAX_TEXT (1024 * 1024)
+#define JOURNAL_OUTPUT_CHUNK 4096
+#define JOURNAL_WRITER_IDLE_MS 100
+#define JOURNAL_MAGIC 0x4A333253        // "S23J"
+#define JOURNAL_VERSION 1
+#define JOURNAL_EXTENSION ".s23j"
+
+// Record types
+#define JOURNAL_LOG 1                   // AddLog line
+#define JOURNAL_COMMAND 2               // command line about to run
+#define JOURNAL_OUTPUT 3                // command output, cut at line ends
+#define JOURNAL_RESULT 4                // exit code and duration
+
+// Segment file layout: header, records (8-byte aligned), then once sealed
+// the serial table (uint16 length + bytes each) and the index entries.
+struct JournalSegmentHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t firstTime;                 // UTC FILETIME ticks
+    uint64_t lastTime;
+    uint64_t dataEnd;                   // end of the record area
+    uint64_t indexOffset;               // 0 until sealed
+    uint32_t indexCount;
+    uint32_t serialCount;
+    uint32_t recordCount;
+    uint32_t sealed;
+    uint64_t reserved;
+};
+
+struct JournalRecordHeader {
+    uint32_t size;                      // header + serial + text, padded to 8
+    uint16_t type;
+    uint16_t serialLen;
+    uint64_t time;
+    int32_t job;
+    int32_t exitCode;
+    uint32_t durationMs;
+    uint32_t textLen;
+};
+
+struct JournalIndexEntry {
+    uint64_t time;                      // clamped to be non-decreasing
+    uint32_t offset;
+    uint16_t serial;                    // into the serial table; 0 is ""
+    uint16_t type;
+};
+
+static_assert(sizeof(JournalSegmentHeader) == 64, "journal header layout");
+static_assert(sizeof(JournalRecordHeader) == 32, "journal record layout");
+static_assert(sizeof(JournalIndexEntry) == 16, "journal index layout");
+
+static size_t JournalAlign(size_t n) { return (n + 7) & ~(size_t)7; }
+
+// Queued between producers and the writer thread
+struct JournalEntry {
+    uint16_t type;
+    uint64_t time;
+    int job;
+    int exitCode;
+    uint32_t durationMs;
+    std::string serial;
+    std::string text;
+    
+    JournalEntry() : type(0), time(0), job(0), exitCode(0), durationMs(0) {}
+};
+
+class SessionJournal {
+public:
+    SessionJournal() : queue(JOURNAL_QUEUE_CAPACITY), active(false), stopping(false),
+        file(INVALID_HANDLE_VALUE), mapping(NULL), base(NULL), used(0), serialBytes(0),
+        lastIndexTime(0), segmentNumber(0), failed(false) {}
+    
+    bool Start(const std::string& directory) {
+        CreateDirectoryA(directory.c_str(), NULL);
+        DWORD attr = GetFileAttributesA(directory.c_str());
+        if (attr == INVALID_FILE_ATTRIBUTES || !(attr & FILE_ATTRIBUTE_DIRECTORY)) return false;
+        
+        SYSTEMTIME st;
+        GetLocalTime(&st);
+        char session[32];
+        snprintf(session, sizeof(session), "%04d%02d%02d-%02d%02d%02d",
+            st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+        prefix = directory + "\\" + session;
+        
+        stopping = false;
+        active = true;
+        writer = std::thread(&SessionJournal::Run, this);
+        return true;
+    }
+    
+    // Drains what is queued and seals the open segment
+    void Stop() {
+        if (!writer.joinable()) return;
+        active = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        writer.join();
+    }
+    
+    bool IsActive() const { return active; }
+    
+    // Never blocks: a full queue drops the record (counted, reported later)
+    void Write(uint16_t type, const std::string& serial, const char* text, size_t len,
+               int job = 0, int exitCode = 0, uint32_t durationMs = 0) {
+        if (!active) return;
+        if (len > JOURNAL_MAX_TEXT) len = JOURNAL_MAX_TEXT;
+        uint64_t now = CurrentFileTime();
+        queue.Push([&](JournalEntry& e) {
+            e.type = type;
+            e.time = now;
+            e.job = job;
+            e.exitCode = exitCode;
+            e.durationMs = durationMs;
+            e.serial = serial;
+            e.text.assign(text, len);
+        });
+    }
+    
+private:
+    BoundedQueue<JournalEntry> queue;
+    std::atomic<bool> active;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+    std::thread writer;
+    std::string prefix;
+    
+    // Open segment (writer thread only)
+    HANDLE file;
+    HANDLE mapping;
+    char* base;
+    size_t used;
+    std::vector<JournalIndexEntry> index;
+    std::vector<std::string> serials;
+    std::map<std::string, uint16_t> serialIds;
+    size_t serialBytes;
+    uint64_t lastIndexTime;
+    int segmentNumber;
+    bool failed;
+    
+    void Run() {
+        JournalEntry entry;
+        for (;;) {
+            while (queue.Pop(entry)) Append(entry);
+            size_t dropped = queue.TakeDropped();
+            if (dropped) {
+                entry.type = JOURNAL_LOG;
+                entry.time = CurrentFileTime();
+                entry.job = entry.exitCode = 0;
+                entry.durationMs = 0;
+                entry.serial.clear();
+                entry.text = "[" + std::to_string(dropped) + " journal records dropped]";
+                Append(entry);
+            }
+            
+            std::unique_lock<std::mutex> lock(mutex);
+            if (stopping) break;
+            wake.wait_for(lock, std::chrono::milliseconds(JOURNAL_WRITER_IDLE_MS));
+        }
+        while (queue.Pop(entry)) Append(entry);
+        Seal();
+    }
+    
+    JournalSegmentHeader* Header() { return (JournalSegmentHeader*)base; }
+    
+    bool OpenSegment() {
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), "-%03d", ++segmentNumber);
+        std::string path = prefix + suffix + JOURNAL_EXTENSION;
+        file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+            NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, JOURNAL_SEGMENT_SIZE, NULL);
+        base = mapping ? (char*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0) : NULL;
+        if (!base) {
+            if (mapping) CloseHandle(mapping);
+            CloseHandle(file);
+            mapping = NULL;
+            file = INVALID_HANDLE_VALUE;
+            return false;
+        }
+        
+        // Fresh mappings are zero-filled; a zero record size marks the end
+        JournalSegmentHeader* hdr = Header();
+        hdr->magic = JOURNAL_MAGIC;
+        hdr->version = JOURNAL_VERSION;
+        used = sizeof(JournalSegmentHeader);
+        hdr->dataEnd = used;
+        index.clear();
+        serials.assign(1, std::string());
+        serialIds.clear();
+        serialIds[std::string()] = 0;
+        serialBytes = sizeof(uint16_t);
+        lastIndexTime = 0;
+        return true;
+    }
+    
+    // Writes the serial table and index behind the records, then trims the
+    // file to its used length
+    void Seal() {
+        if (!base) return;
+        JournalSegmentHeader* hdr = Header();
+        size_t pos = JournalAlign(used);
+        size_t tableStart = pos;
+        for (size_t i = 0; i < serials.size(); i++) {
+            uint16_t len = (uint16_t)serials[i].size();
+            memcpy(base + pos, &len, sizeof(len));
+            memcpy(base + pos + sizeof(len), serials[i].data(), len);
+            pos += sizeof(len) + len;
+        }
+        pos = JournalAlign(pos);
+        if (!index.empty()) {
+            memcpy(base + pos, &index[0], index.size() * sizeof(JournalIndexEntry));
+        }
+        size_t end = pos + index.size() * sizeof(JournalIndexEntry);
+        hdr->indexOffset = tableStart;
+        hdr->serialCount = (uint32_t)serials.size();
+        hdr->indexCount = (uint32_t)index.size();
+        hdr->sealed = 1;
+        
+        FlushViewOfFile(base, 0);
+        UnmapViewOfFile(base);
+        CloseHandle(mapping);
+        LARGE_INTEGER size;
+        size.QuadPart = (LONGLONG)end;
+        SetFilePointerEx(file, size, NULL, FILE_BEGIN);
+        SetEndOfFile(file);
+        CloseHandle(file);
+        base = NULL;
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+    }
+    
+    void Append(const JournalEntry& e) {
+        if (failed) return;
+        size_t serialLen = std::min(e.serial.size(), (size_t)0xFFFF);
+        size_t recordSize = JournalAlign(sizeof(JournalRecordHeader) + serialLen + e.text.size());
+        
+        // Room for the record plus the index this segment will need at seal
+        bool newSerial = serialIds.find(e.serial) == serialIds.end();
+        size_t projected = JournalAlign(used + recordSize) +
+            JournalAlign(serialBytes + (newSerial ? sizeof(uint16_t) + serialLen : 0)) +
+            (index.size() + 1) * sizeof(JournalIndexEntry);
+        if (base && projected > JOURNAL_SEGMENT_SIZE) Seal();
+        if (!base && !OpenSegment()) {
+            failed = true;      // disk full or not writable; stop journaling
+            active = false;
+            return;
+        }
+        
+        uint16_t serialId;
+        std::map<std::string, uint16_t>::iterator it = serialIds.find(e.serial);
+        if (it != serialIds.end()) {
+            serialId = it->second;
+        } else {
+            serialId = (uint16_t)serials.size();
+            serials.push_back(e.serial.substr(0, serialLen));
+            serialIds[e.serial] = serialId;
+            serialBytes += sizeof(uint16_t) + serialLen;
+        }
+        
+        JournalRecordHeader rec;
+        rec.size = (uint32_t)recordSize;
+        rec.type = e.type;
+        rec.serialLen = (uint16_t)serialLen;
+        rec.time = e.time;
+        rec.job = e.job;
+        rec.exitCode = e.exitCode;
+        rec.durationMs = e.durationMs;
+        rec.textLen = (uint32_t)e.text.size();
+        char* dst = base + used;
+        memcpy(dst, &rec, sizeof(rec));
+        memcpy(dst + sizeof(rec), e.serial.data(), serialLen);
+        memcpy(dst + sizeof(rec) + serialLen, e.text.data(), e.text.size());
+        
+        JournalIndexEntry entry;
+        lastIndexTime = std::max(lastIndexTime, e.time);
+        entry.time = lastIndexTime;
+        entry.offset = (uint32_t)used;
+        entry.serial = serialId;
+        entry.type = e.type;
+        index.push_back(entry);
+        
+        used += recordSize;
+        JournalSegmentHeader* hdr = Header();
+        if (hdr->recordCount == 0) hdr->firstTime = lastIndexTime;
+        hdr->lastTime = lastIndexTime;
+        hdr->recordCount++;
+        hdr->dataEnd = used;
+    }
+};
+
+SessionJournal g_journal;
+
+// Serial of the device the current job targets ("adb:R5CT..." -> "R5CT...")
+static std::string CurrentJobSerial() {
+    if (!t_currentJob) return "";
+    const std::string& key = t_currentJob->Device();
+    size_t colon = key.find(':');
+    return colon == std::string::npos ? "" : key.substr(colon + 1);
+}
+
+// Journals one command run: the command line, its output in line-aligned
+// chunks, and the result. Exit() records the exit code; a scope left without
+// calling it records -1. The run is also one g_commandStats sample; the
+// process executor fills in spawn time and timeouts.
+class JournalCommand {
+public:
+    JournalCommand(const std::string& serial, const std::string& command)
+        : serial(serial), job(t_currentJob ? t_currentJob->Id() : 0),
+          start(std::chrono::steady_clock::now()), finished(false), outerSample(t_commandSample) {
+        g_journal.Write(JOURNAL_COMMAND, serial, command.data(), command.size(), job);
+        sample.command = command;
+        sample.serial = serial;
+        t_commandSample = &sample;
+    }
+    ~JournalCommand() { if (!finished) Exit(-1); }
+    
+    // Wraps onOutput so every chunk is also journaled
+    OutputCallback Tee(const OutputCallback& onOutput) {
+        return [this, &onOutput](const char* data, size_t len) {
+            onOutput(data, len);
+            Output(data, len);
+        };
+    }
+    
+    int Exit(int exitCode) {
+        FlushOutput(pending.size());
+        finished = true;
+        g_journal.Write(JOURNAL_RESULT, serial, "", 0, job, exitCode,
+            (uint32_t)CoreMillisecondsSince(start));
+        sample.totalUs = CoreMicrosecondsSince(start);
+        sample.failed = exitCode != 0 || sample.timedOut;
+        g_commandStats.Record(sample);
+        t_commandSample = outerSample;
+        return exitCode;
+    }
+    
+private:
+    std::string serial;
+    int job;
+    std::chrono::steady_clock::time_point start;
+    bool finished;
+    std::string pending;
+    CommandSample sample;
+    CommandSample* outerSample;
+    
+    void Output(const char* data, size_t len) {
+        if (sample.firstByteUs < 0) sample.firstByteUs = CoreMicrosecondsSince(start);
+        sample.bytes += len;
+        if (!g_journal.IsActive()) return;
+        pending.append(data, len);
+        if (pending.size() < JOURNAL_OUTPUT_CHUNK) return;
+        size_t eol = pending.rfind('\n');
+        FlushOutput(eol == std::string::npos ? pending.size() : eol + 1);
+    }
+    
+    void FlushOutput(size_t len) {
+        if (len == 0) return;
+        g_journal.Write(JOURNAL_OUTPUT, serial, pending.data(), len, job);
+        pending.erase(0, len);
+    }
+};
+
+std::string JournalDirectory() {
+    char self[MAX_PATH];
+    DWORD len = GetModuleFileNameA(NULL, self, MAX_PATH);
+    std::string dir(self, len);
+    size_t slash = dir.find_last_of("\\/");
+    return (slash == std::string::npos ? std::string(".") : dir.substr(0, slash)) + "\\journal";
+}
+
+// Journal export:
+//   frpunlock.exe --export-journal <output> [--json] [--serial S]
+//                 [--since "YYYY-MM-DD HH:MM:SS"] [--until ...] [--dir D]
+// Writes text, or JSON lines with --json (or a .json/.jsonl output name).
+// Times are local; sealed segments are filtered through their index.
+struct JournalQuery {
+    std::string serial;
+    bool filterSerial;
+    uint64_t since;
+    uint64_t until;
+    bool json;
+    
+    JournalQuery() : filterSerial(false), since(0), until(~(uint64_t)0), json(false) {}
+};
+
+static std::string FormatJournalTime(uint64_t time, char separator) {
+    FILETIME utc, local;
+    SYSTEMTIME st;
+    utc.dwLowDateTime = (DWORD)time;
+    utc.dwHighDateTime = (DWORD)(time >> 32);
+    FileTimeToLocalFileTime(&utc, &local);
+    FileTimeToSystemTime(&local, &st);
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%04d-%02d-%02d%c%02d:%02d:%02d.%03d",
+        st.wYear, st.wMonth, st.wDay, separator, st.wHour, st.wMinute, st.wSecond,
+        st.wMilliseconds);
+    return buf;
+}
+
+// Local "YYYY-MM-DD[ T]HH:MM[:SS]" to UTC FILETIME ticks; 0 when malformed
+static uint64_t ParseJournalTime(const std::string& text) {
+    int year, month, day, hour = 0, minute = 0, second = 0;
+    if (sscanf(text.c_str(), "%d-%d-%d%*c%d:%d:%d", &year, &month, &day,
+               &hour, &minute, &second) < 3) {
+        return 0;
+    }
+    SYSTEMTIME st;
+    memset(&st, 0, sizeof(st));
+    st.wYear = (WORD)year;
+    st.wMonth = (WORD)month;
+    st.wDay = (WORD)day;
+    st.wHour = (WORD)hour;
+    st.wMinute = (WORD)minute;
+    st.wSecond = (WORD)second;
+    FILETIME local, utc;
+    if (!SystemTimeToFileTime(&st, &local) || !LocalFileTimeToFileTime(&local, &utc)) return 0;
+    return ((uint64_t)utc.dwHighDateTime << 32) | utc.dwLowDateTime;
+}
+
+static void ExportJournalRecord(std::ostream& out, const JournalRecordHeader* rec, bool json) {
+    static const char* typeNames[] = { "", "log", "command", "output", "result" };
+    const char* serialData = (const char*)(rec + 1);
+    std::string serial(serialData, rec->serialLen);
+    std::string text(serialData + rec->serialLen, rec->textLen);
+    const char* type = rec->type <= JOURNAL_RESULT ? typeNames[rec->type] : "";
+    
+    if (json) {
+        out << "{\"time\":\"" << FormatJournalTime(rec->time, 'T') << "\",\"type\":\"" << type
+            << "\",\"serial\":\"" << JsonEscape(serial) << "\",\"job\":" << rec->job;
+        if (rec->type == JOURNAL_RESULT) {
+            out << ",\"exitCode\":" << rec->exitCode << ",\"durationMs\":" << rec->durationMs;
+        } else {
+            out << ",\"text\":\"" << JsonEscape(text) << "\"";
+        }
+        out << "}\n";
+        return;
+    }
+    
+    std::string prefix = FormatJournalTime(rec->time, ' ') +
+        (serial.empty() ? " " : " [" + serial + "] ");
+    switch (rec->type) {
+        case JOURNAL_COMMAND:
+            out << prefix << "$ " << text << "\n";
+            break;
+        case JOURNAL_OUTPUT: {
+            size_t start = 0;
+            while (start < text.size()) {
+                size_t eol = text.find('\n', start);
+                if (eol == std::string::npos) eol = text.size();
+                size_t end = (eol > start && text[eol - 1] == '\r') ? eol - 1 : eol;
+                out << prefix << "| " << text.substr(start, end - start) << "\n";
+                start = eol + 1;
+            }
+            break;
+        }
+        case JOURNAL_RESULT:
+            out << prefix << "exit " << rec->exitCode << " (" << rec->durationMs << " ms)\n";
+            break;
+        default:
+            out << prefix << text << "\n";
+    }
+}
+
+// Record at offset, or NULL if it does not fit inside [0, end)
+static const JournalRecordHeader* JournalRecordAt(const char* base, size_t offset, size_t end) {
+    if (offset + sizeof(JournalRecordHeader) > end) return NULL;
+    const JournalRecordHeader* rec = (const JournalRecordHeader*)(base + offset);
+    if (rec->size < sizeof(JournalRecordHeader) || offset + rec->size > end ||
+        sizeof(JournalRecordHeader) + rec->serialLen + (size_t)rec->textLen > rec->size) {
+        return NULL;
+    }
+    return rec;
+}
+
+static size_t ExportIndexedSegment(const char* base, size_t size, const JournalQuery& q,
+                                   std::ostream& out) {
+    const JournalSegmentHeader* hdr = (const JournalSegmentHeader*)base;
+    size_t pos = (size_t)hdr->indexOffset;
+    int wanted = -1;
+    for (uint32_t i = 0; i < hdr->serialCount; i++) {
+        if (pos + sizeof(uint16_t) > size) return 0;
+        uint16_t len;
+        memcpy(&len, base + pos, sizeof(len));
+        pos += sizeof(len);
+        if (pos + len > size) return 0;
+        if (q.filterSerial && q.serial.compare(0, std::string::npos, base + pos, len) == 0) {
+            wanted = (int)i;
+        }
+        pos += len;
+    }
+    if (q.filterSerial && wanted < 0) return 0;     // device never seen here
+    
+    pos = JournalAlign(pos);
+    if (pos + (size_t)hdr->indexCount * sizeof(JournalIndexEntry) > size) return 0;
+    const JournalIndexEntry* first = (const JournalIndexEntry*)(base + pos);
+    const JournalIndexEntry* last = first + hdr->indexCount;
+    const JournalIndexEntry* it = std::lower_bound(first, last, q.since,
+        [](const JournalIndexEntry& e, uint64_t t) { return e.time < t; });
+    
+    size_t count = 0;
+    for (; it != last && it->time <= q.until; ++it) {
+        if (q.filterSerial && it->serial != wanted) continue;
+        const JournalRecordHeader* rec = JournalRecordAt(base, it->offset, (size_t)hdr->dataEnd);
+        if (!rec) continue;
+        ExportJournalRecord(out, rec, q.json);
+        count++;
+    }
+    return count;
+}
+
+// Segments still open (or left behind by a crash) have no index yet
+static size_t ExportScannedSegment(const char* base, size_t size, const JournalQuery& q,
+                                   std::ostream& out) {
+    const JournalSegmentHeader* hdr = (const JournalSegmentHeader*)base;
+    size_t end = std::min((size_t)hdr->dataEnd, size);
+    size_t pos = sizeof(JournalSegmentHeader);
+    size_t count = 0;
+    const JournalRecordHeader* rec;
+    while ((rec = JournalRecordAt(base, pos, end)) != NULL) {
+        bool match = rec->time >= q.since && rec->time <= q.until &&
+            (!q.filterSerial ||
+             q.serial.compare(0, std::string::npos, (const char*)(rec + 1), rec->serialLen) == 0);
+        if (match) {
+            ExportJournalRecord(out, rec, q.json);
+            count++;
+        }
+        pos += rec->size;
+    }
+    return count;
+}
+
+// Returns the records exported from one segment, or -1 if it is unreadable
+static long long ExportJournalSegment(const std::string& path, const JournalQuery& q,
+                                      std::ostream& out) {
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return -1;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || (size_t)size.QuadPart < sizeof(JournalSegmentHeader)) {
+        CloseHandle(file);
+        return -1;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    const char* base = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    
+    long long count = -1;
+    const JournalSegmentHeader* hdr = (const JournalSegmentHeader*)base;
+    if (base && hdr->magic == JOURNAL_MAGIC && hdr->version == JOURNAL_VERSION) {
+        count = 0;
+        bool overlaps = hdr->recordCount == 0 ||
+            (hdr->lastTime >= q.since && hdr->firstTime <= q.until);
+        if (hdr->recordCount > 0 && overlaps) {
+            count = hdr->sealed ?
+                (long long)ExportIndexedSegment(base, (size_t)size.QuadPart, q, out) :
+                (long long)ExportScannedSegment(base, (size_t)size.QuadPart, q, out);
+        }
+    }
+    
+    if (base) UnmapViewOfFile(base);
+    if (mapping) CloseHandle(mapping);
+    CloseHandle(file);
+    return count;
+}
+
+std::string ExportJournal(const std::vector<std::string>& args) {
+    if (args.size() < 2) {
+        return "Usage: --export-journal <output> [--json] [--serial S] "
+               "[--since TIME] [--until TIME] [--dir DIR]\n";
+    }
+    std::string output = args[1];
+    std::string dir = JournalDirectory();
+    JournalQuery q;
+    size_t dot = output.find_last_of('.');
+    std::string ext = dot == std::string::npos ? "" : output.substr(dot);
+    q.json = ext == ".json" || ext == ".jsonl";
+    for (size_t i = 2; i < args.size(); i++) {
+        bool hasValue = i + 1 < args.size();
+        if (args[i] == "--json") {
+            q.json = true;
+        } else if (args[i] == "--serial" && hasValue) {
+            q.serial = args[++i];
+            q.filterSerial = true;
+        } else if ((args[i] == "--since" || args[i] == "--until") && hasValue) {
+            uint64_t t = ParseJournalTime(args[i + 1]);
+            if (!t) return "Error: bad time '" + args[i + 1] + "' (use YYYY-MM-DD HH:MM:SS)\n";
+            if (args[i] == "--since") q.since = t;
+            else q.until = t;
+            i++;
+        } else if (args[i] == "--dir" && hasValue) {
+            dir = args[++i];
+        } else {
+            return "Error: unknown option '" + args[i] + "'\n";
+        }
+    }
+    
+    // Segment names start with the session time, so name order is time order
+    std::vector<std::string> segments;
+    WIN32_FIND_DATAA fd;
+    HANDLE find = FindFirstFileA((dir + "\\*" JOURNAL_EXTENSION).c_str(), &fd);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            segments.push_back(dir + "\\" + fd.cFileName);
+        } while (FindNextFileA(find, &fd));
+        FindClose(find);
+    }
+    std::sort(segments.begin(), segments.end());
+    if (segments.empty()) return "Error: no journal segments in " + dir + "\n";
+    
+    std::ofstream out(output.c_str(), std::ios::binary);
+    if (!out) return "Error: cannot write " + output + "\n";
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    size_t records = 0, skipped = 0;
+    for (size_t i = 0; i < segments.size(); i++) {
+        long long n = ExportJournalSegment(segments[i], q, out);
+        if (n < 0) skipped++;
+        else records += (size_t)n;
+    }
+    out.close();
+    
+    std::ostringstream report;
+    report << "Exported " << records << " records from " << segments.size() << " segments to "
+           << output << " in " << CoreMillisecondsSince(start) << " ms";
+    if (skipped) report << " (" << skipped << " unreadable)";
+    report << "\n";
+    return report.str();
+}
+
+// Forwards streamed output to the log one complete line at a time. Display
+// only: the output is already journaled by the command that produced it.
+class LogLineSink {
+public:
+    explicit LogLineSink(const std::string& prefix = "") : prefix(prefix) {}
+    ~LogLineSink() { Flush(); }
+    
+    void Write(const char* data, size_t len) {
+        partial.append(data, len);
+        size_t start = 0, eol;
+        while ((eol = partial.find('\n', start)) != std::string::npos) {
+            size_t end = (eol > start && partial[eol - 1] == '\r') ? eol - 1 : eol;
+            ShowLog(prefix + partial.substr(start, end - start));
+            start = eol + 1;
+        }
+        partial.erase(0, start);
+    }
+    
+    void Flush() {
+        if (!partial.empty()) ShowLog(prefix + partial);
+        partial.clear();
+    }
+    
+    OutputCallback Callback() {
+        return [this](const char* data, size_t len) { Write(data, len); };
+    }
+    
+private:
+    std::string prefix;
+    std::string partial;
+};
+
+// Installed package inventory
+// One persistent-shell round trip per refresh lists every package with its
+// versionCode, plus the third-party and disabled subsets for flags. Package
+// names are interned once for the whole fleet, so a snapshot is just a
+// vector of (name id, flags, versionCode) sorted by id, and diffing two
+// snapshots is a single merge over integers. A refresh whose raw listing
+// hashes the same as the last one reuses the previous snapshot outright.
+//
+// A golden baseline is the same "pm list packages --show-versioncode" text
+// (a versionCode of 0 or none matches any version); the GUI picks up
+// packages-baseline.txt next to the executable.
+#define APP_THIRD_PARTY 1
+#define APP_DISABLED 2
+#define APP_BASELINE_FILE "packages-baseline.txt"
+
+// Package names, shared by every device's snapshots
+class AppNamePool {
+public:
+    uint32_t Intern(const char* name, size_t len) {
+        std::string key(name, len);
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unordered_map<std::string, uint32_t>::const_iterator it = ids.find(key);
+        if (it != ids.end()) return it->second;
+        uint32_t id = (uint32_t)names.size();
+        names.push_back(key);
+        ids[key] = id;
+        return id;
+    }
+    
+    std::string Name(uint32_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return id < names.size() ? names[id] : std::string();
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<std::string> names;     // stable: ids index it
+    std::unordered_map<std::string, uint32_t> ids;
+};
+
+AppNamePool g_appNames;
+
+struct AppRecord {
+    uint32_t name;
+    uint32_t flags;
+    int64_t versionCode;
+};
+
+struct AppSnapshot {
+    std::vector<AppRecord> apps;        // sorted by name id
+    uint64_t hash;                      // of the raw listing
+    
+    AppSnapshot() : hash(0) {}
+    
+    const AppRecord* Find(uint32_t name) const {
+        std::vector<AppRecord>::const_iterator it = std::lower_bound(apps.begin(), apps.end(), name,
+            [](const AppRecord& r, uint32_t n) { return r.name < n; });
+        return it != apps.end() && it->name == name ? &*it : NULL;
+    }
+};
+
+struct AppDiff {
+    std::vector<AppRecord> added;       // in the new snapshot only
+    std::vector<AppRecord> removed;     // in the old one only
+    std::vector<std::pair<AppRecord, AppRecord> > changed;     // old, new
+    
+    bool Empty() const { return added.empty() && removed.empty() && changed.empty(); }
+};
+
+static uint64_t HashListing(const std::string& text) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < text.size(); i++) {
+        h ^= (unsigned char)text[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Calls fn(name, len, versionCode) for each "package:<name>[ versionCode:<n>]"
+// line; "-f" style "package:<path>=<name>" lines work too
+template <typename Fn>
+static void ForEachListedPackage(const std::string& text, Fn fn) {
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t eol = text.find('\n', pos);
+        if (eol == std::string::npos) eol = text.size();
+        size_t end = eol;
+        while (end > pos && (text[end - 1] == '\r' || text[end - 1] == ' ')) end--;
+        if (text.compare(pos, 8, "package:") == 0) {
+            size_t name = pos + 8;
+            size_t nameEnd = text.find(' ', name);
+            if (nameEnd == std::string::npos || nameEnd > end) nameEnd = end;
+            // Searches stay within the line; the listing can be megabytes
+            const char* line = text.data();
+            size_t eq = 0;
+            for (size_t i = name; i < nameEnd; i++) {
+                if (line[i] == '=') eq = i;
+            }
+            if (eq) name = eq + 1;
+            int64_t version = 0;
+            const char* key = "versionCode:";
+            const char* vc = std::search(line + nameEnd, line + end, key, key + 12);
+            if (vc < line + end) version = strtoll(vc + 12, NULL, 10);
+            if (nameEnd > name) fn(text.data() + name, nameEnd - name, version);
+        }
+        pos = eol + 1;
+    }
+}
+
+// Builds a snapshot from the versioned listing and the optional -3 / -d
+// listings that only contribute flags
+static void ParseAppListing(const std::string& versions, const std::string& thirdParty,
+                            const std::string& disabled, AppSnapshot& snapshot) {
+    snapshot.apps.clear();
+    ForEachListedPackage(versions, [&](const char* name, size_t len, int64_t version) {
+        AppRecord r = { g_appNames.Intern(name, len), 0, version };
+        snapshot.apps.push_back(r);
+    });
+    std::sort(snapshot.apps.begin(), snapshot.apps.end(),
+        [](const AppRecord& a, const AppRecord& b) { return a.name < b.name; });
+    snapshot.apps.erase(std::unique(snapshot.apps.begin(), snapshot.apps.end(),
+        [](const AppRecord& a, const AppRecord& b) { return a.name == b.name; }), snapshot.apps.end());
+    
+    const std::string* subsets[] = { &thirdParty, &disabled };
+    const uint32_t flags[] = { APP_THIRD_PARTY, APP_DISABLED };
+    for (int s = 0; s < 2; s++) {
+        ForEachListedPackage(*subsets[s], [&](const char* name, size_t len, int64_t) {
+            AppRecord* r = (AppRecord*)snapshot.Find(g_appNames.Intern(name, len));
+            if (r) r->flags |= flags[s];
+        });
+    }
+}
+
+// Merge over the two id-sorted vectors. With versionWildcard, a 0 version
+// on the old side (a baseline entry without one) matches any version.
+static void DiffApps(const AppSnapshot& before, const AppSnapshot& after, AppDiff& diff,
+                     bool versionWildcard = false) {
+    diff = AppDiff();
+    size_t i = 0, j = 0;
+    const std::vector<AppRecord>& a = before.apps;
+    const std::vector<AppRecord>& b = after.apps;
+    while (i < a.size() || j < b.size()) {
+        if (j == b.size() || (i < a.size() && a[i].name < b[j].name)) {
+            diff.removed.push_back(a[i++]);
+        } else if (i == a.size() || b[j].name < a[i].name) {
+            diff.added.push_back(b[j++]);
+        } else {
+            if (a[i].versionCode != b[j].versionCode && !(versionWildcard && a[i].versionCode == 0)) {
+                diff.changed.push_back(std::make_pair(a[i], b[j]));
+            }
+            i++;
+            j++;
+        }
+    }
+}
+
+// One "  + name", "  - name" or "  ~ name old -> new" line per difference,
+// sorted by package name
+static std::string FormatAppDiff(const AppDiff& diff) {
+    std::vector<std::string> lines;
+    for (size_t i = 0; i < diff.added.size(); i++) {
+        lines.push_back("  + " + g_appNames.Name(diff.added[i].name) +
+            " (" + std::to_string(diff.added[i].versionCode) +
+            (diff.added[i].flags & APP_THIRD_PARTY ? ", third-party" : "") + ")");
+    }
+    for (size_t i = 0; i < diff.removed.size(); i++) {
+        lines.push_back("  - " + g_appNames.Name(diff.removed[i].name));
+    }
+    for (size_t i = 0; i < diff.changed.size(); i++) {
+        lines.push_back("  ~ " + g_appNames.Name(diff.changed[i].first.name) + " " +
+            std::to_string(diff.changed[i].first.versionCode) + " -> " +
+            std::to_string(diff.changed[i].second.versionCode));
+    }
+    std::sort(lines.begin(), lines.end(), [](const std::string& x, const std::string& y) {
+        return x.compare(4, std::string::npos, y, 4, std::string::npos) < 0;
+    });
+    std::string text;
+    for (size_t i = 0; i < lines.size(); i++) text += lines[i] + "\n";
+    return text;
+}
+
+static bool LoadAppBaseline(const std::string& path, AppSnapshot& baseline) {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in) return false;
+    std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    ParseAppListing(text, "", "", baseline);
+    baseline.hash = HashListing(text);
+    return true;
+}
+
+// Per-device snapshots plus the fleet baseline
+class AppInventories {
+public:
+    AppInventories() : baselineTime(0) {}
+    
+    // Lists the device's packages and diffs them against the last refresh
+    // (empty on the first one). Returns null if the device can't be read.
+    std::shared_ptr<const AppSnapshot> Refresh(const std::string& serial, AppDiff& sinceLast,
+                                               bool& unchanged, std::string& error) {
+        std::vector<std::string> commands;
+        commands.push_back("pm list packages --show-versioncode");
+        commands.push_back("pm list packages -3");
+        commands.push_back("pm list packages -d");
+        // Journaled like any other command; they run as one batch, so each
+        // is recorded with the batch's round trip
+        std::unique_ptr<JournalCommand> journal[3];
+        for (size_t i = 0; i < 3; i++) journal[i].reset(new JournalCommand(serial, "adb -s " + serial + " shell " + commands[i]));
+        std::vector<ShellCommandResult> results;
+        bool ran = g_shellSessions.Run(serial, commands, results, error);
+        OutputCallback discard = [](const char*, size_t) {};
+        for (size_t i = 3; i-- > 0;) {      // last first: each restores the sample it shadowed
+            const std::string& output = ran ? results[i].output : error;
+            journal[i]->Tee(discard)(output.data(), output.size());
+            journal[i]->Exit(ran ? results[i].exitCode : -1);
+        }
+        if (!ran) return std::shared_ptr<const AppSnapshot>();
+        if (results[0].exitCode != 0) {
+            error = results[0].output.empty() ? "pm list packages failed" : results[0].output;
+            return std::shared_ptr<const AppSnapshot>();
+        }
+        
+        std::shared_ptr<const AppSnapshot> previous;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            previous = snapshots[serial];
+        }
+        uint64_t hash = HashListing(results[0].output + '\0' + results[1].output + '\0' + results[2].output);
+        unchanged = previous && previous->hash == hash;
+        sinceLast = AppDiff();
+        if (unchanged) return previous;
+        
+        std::shared_ptr<AppSnapshot> snapshot(new AppSnapshot());
+        ParseAppListing(results[0].output, results[1].output, results[2].output, *snapshot);
+        snapshot->hash = hash;
+        if (previous) DiffApps(*previous, *snapshot, sinceLast);
+        std::lock_guard<std::mutex> lock(mutex);
+        snapshots[serial] = snapshot;
+        return snapshot;
+    }
+    
+    // The baseline at path, reloaded when the file changes; null if absent
+    std::shared_ptr<const AppSnapshot> Baseline(const std::string& path) {
+        WIN32_FILE_ATTRIBUTE_DATA attr;
+        if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attr)) {
+            return std::shared_ptr<const AppSnapshot>();
+        }
+        uint64_t mtime = ((uint64_t)attr.ftLastWriteTime.dwHighDateTime << 32) | attr.ftLastWriteTime.dwLowDateTime;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!baseline || baselinePath != path || baselineTime != mtime) {
+            std::shared_ptr<AppSnapshot> loaded(new AppSnapshot());
+            if (!LoadAppBaseline(path, *loaded)) return std::shared_ptr<const AppSnapshot>();
+            baseline = loaded;
+            baselinePath = path;
+            baselineTime = mtime;
+        }
+        return baseline;
+    }
+
+private:
+    std::mutex mutex;
+    std::map<std::string, std::shared_ptr<const AppSnapshot> > snapshots;
+    std::shared_ptr<const AppSnapshot> baseline;
+    std::string baselinePath;
+    uint64_t baselineTime;
+};
+
+AppInventories g_apps;
+
+static std::string AppBaselinePath() {
+    std::string dir = JournalDirectory();
+    return dir.substr(0, dir.find_last_of('\\')) + "\\" APP_BASELINE_FILE;
+}
+
+// "adb [-s <serial>] shell pm list packages": refreshes the device's
+// inventory and reports what changed instead of dumping the list. Returns
+// false when no shell session can be opened, so the caller can fall back
+// to the text listing.
+bool RefreshAppInventory(const std::string& args, const OutputCallback& onOutput) {
+    std::string serial, verb, rest;
+    ParseAdbArgs(args, serial, verb, rest);
+    if (verb != "shell" || rest != "pm list packages") return false;
+    if (!g_adb.ServerAvailable()) return false;
+    if (serial.empty() && !g_adb.HostQuery("host:get-serialno", serial)) return false;
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    AppDiff sinceLast;
+    bool unchanged;
+    std::string error;
+    std::shared_ptr<const AppSnapshot> snapshot = g_apps.Refresh(serial, sinceLast, unchanged, error);
+    if (!snapshot) return false;
+    long long listMs = CoreMillisecondsSince(start);
+    
+    size_t thirdParty = 0, disabled = 0;
+    for (size_t i = 0; i < snapshot->apps.size(); i++) {
+        if (snapshot->apps[i].flags & APP_THIRD_PARTY) thirdParty++;
+        if (snapshot->apps[i].flags & APP_DISABLED) disabled++;
+    }
+    std::ostringstream out;
+    out << serial << ": " << snapshot->apps.size() << " packages (" << thirdParty << " third-party, "
+        << disabled << " disabled), listed in " << listMs << " ms\n";
+    if (unchanged) {
+        out << "Unchanged since the last refresh\n";
+    } else if (!sinceLast.Empty()) {
+        out << "Since the last refresh: +" << sinceLast.added.size() << " -" << sinceLast.removed.size()
+            << " ~" << sinceLast.changed.size() << "\n" << FormatAppDiff(sinceLast);
+    }
+    
+    std::shared_ptr<const AppSnapshot> baseline = g_apps.Baseline(AppBaselinePath());
+    if (baseline) {
+        AppDiff vsBaseline;
+        start = std::chrono::steady_clock::now();
+        DiffApps(*baseline, *snapshot, vsBaseline, true);
+        double diffUs = CoreMicrosecondsSince(start);
+        out << "Against " APP_BASELINE_FILE ": " << vsBaseline.added.size() << " unexpected, "
+            << vsBaseline.removed.size() << " missing, " << vsBaseline.changed.size()
+            << " other versions (diff " << std::fixed << std::setprecision(1) << diffUs << " us)\n"
+            << FormatAppDiff(vsBaseline);
+    }
+    std::string text = out.str();
+    onOutput(text.data(), text.size());
+    return true;
+}
+
+// Command line fleet check: saved listings against a golden baseline
+std::string AppInventoryReport(const std::vector<std::string>& args) {
+    if (args.size() < 3) return "Usage: --packages <baseline.txt> <listing.txt>...\n";
+    AppSnapshot baseline;
+    if (!LoadAppBaseline(args[1], baseline)) return "Error: cannot read " + args[1] + "\n";
+    std::ostringstream report;
+    report << std::fixed << std::setprecision(1);
+    for (size_t i = 2; i < args.size(); i++) {
+        AppSnapshot listing;
+        if (!LoadAppBaseline(args[i], listing)) {
+            report << args[i] << ": cannot read\n";
+            continue;
+        }
+        AppDiff diff;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        DiffApps(baseline, listing, diff, true);
+        double us = CoreMicrosecondsSince(start);
+        report << args[i] << ": " << listing.apps.size() << " packages, " << diff.added.size() << " unexpected, "
+               << diff.removed.size() << " missing, " << diff.changed.size() << " other versions ("
+               << us << " us)\n" << FormatAppDiff(diff);
+    }
+    return report.str();
+}
+
+// Synthetic fleet: every device is the baseline with a few apps added,
+// removed and updated; reports parse and per-device diff cost
+std::string BenchmarkAppInventory(const std::vector<std::string>& args) {
+    size_t packages = args.size() > 1 ? (size_t)std::max(atoi(args[1].c_str()), 1) : 3000;
+    size_t devices = args.size() > 2 ? (size_t)std::max(atoi(args[2].c_str()), 1) : 50;
+    
+    std::string golden;
+    for (size_t i = 0; i < packages; i++) {
+        golden += "package:com.vendor" + std::to_string(i % 97) + ".app" + std::to_string(i) +
+                  " versionCode:" + std::to_string(1000 + i) + "\n";
+    }
+    AppSnapshot baseline;
+    ParseAppListing(golden, "", "", baseline);
+    
+    std::vector<AppSnapshot> fleet(devices);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t d = 0; d < devices; d++) {
+        std::string listing = golden;
+        listing += "package:com.unexpected.d" + std::to_string(d) + " versionCode:1\n";
+        size_t cut = listing.find("package:", (d * 7919) % golden.size());
+        if (cut != std::string::npos) listing.erase(cut, listing.find('\n', cut) - cut + 1);
+        size_t bump = listing.find("versionCode:", (d * 104729) % golden.size());
+        if (bump != std::string::npos) listing.insert(bump + 12, "9");
+        ParseAppListing(listing, "", "", fleet[d]);
+    }
+    double parseMs = CoreMicrosecondsSince(start) / 1000.0;
+    
+    start = std::chrono::steady_clock::now();
+    size_t differences = 0;
+    AppDiff diff;
+    for (size_t d = 0; d < devices; d++) {
+        DiffApps(baseline, fleet[d], diff, true);
+        differences += diff.added.size() + diff.removed.size() + diff.changed.size();
+    }
+    double diffUs = CoreMicrosecondsSince(start);
+    
+    std::ostringstream report;
+    report << std::fixed << std::setprecision(2)
+           << packages << " packages x " << devices << " devices\n"
+           << "  parse:  " << parseMs << " ms total, " << parseMs * 1000 / devices << " us per device\n"
+           << "  diff:   " << diffUs << " us total, " << diffUs / devices << " us per device, "
+           << differences << " differences\n";
+    return report.str();
+}
+
+// Device catalogue files
+//   frpunlock.exe --build-catalog <models.csv> <devices.cat>
+// CSV lines are model,codename,name,chipset,flags with flags joined by "+"
+// (ab, super, vendor_boot, init_boot); blank lines, "#" comments and a
+// "model,..." header are skipped. Names can't contain commas. Models are
+// entered without their region suffix.
+static std::string CatalogPath() {
+    std::string dir = JournalDirectory();
+    return dir.substr(0, dir.find_last_of('\\')) + "\\" CATALOG_FILE;
+}
+
+static void AppendCatalogWord(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) out += (char)((value >> (i * 8)) & 0xFF);
+}
+
+static bool ParseCatalogFlags(const std::string& text, uint32_t& flags) {
+    flags = 0;
+    std::istringstream in(text);
+    std::string flag;
+    while (std::getline(in, flag, '+')) {
+        if (flag == "ab") flags |= CATALOG_AB;
+        else if (flag == "super") flags |= CATALOG_DYNAMIC;
+        else if (flag == "vendor_boot") flags |= CATALOG_VENDOR_BOOT;
+        else if (flag == "init_boot") flags |= CATALOG_INIT_BOOT;
+        else if (!flag.empty()) return false;
+    }
+    return true;
+}
+
+std::string BuildCatalogReport(const std::vector<std::string>& args) {
+    if (args.size() != 3) {
+        return "Usage: --build-catalog <models.csv> <devices.cat>\n";
+    }
+    std::ifstream in(args[1].c_str());
+    if (!in) return "Error: cannot open " + args[1] + "\n";
+    
+    std::vector<std::string> fields;     // 4 per entry
+    std::vector<uint32_t> flags;
+    std::set<std::string> models;
+    std::string line;
+    for (int number = 1; std::getline(in, line); number++) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#' || line.compare(0, 6, "model,") == 0) continue;
+        std::vector<std::string> columns;
+        std::istringstream split(line);
+        std::string column;
+        while (std::getline(split, column, ',')) columns.push_back(column);
+        uint32_t entryFlags = 0;
+        if (columns.size() < 4 || columns.size() > 5 || columns[0].empty() ||
+            (columns.size() == 5 && !ParseCatalogFlags(columns[4], entryFlags))) {
+            return "Error: " + args[1] + " line " + std::to_string(number) + ": expected model,codename,name,chipset,flags\n";
+        }
+        if (!models.insert(columns[0]).second) {
+            return "Error: " + args[1] + " line " + std::to_string(number) + ": duplicate model " + columns[0] + "\n";
+        }
+        fields.insert(fields.end(), columns.begin(), columns.begin() + 4);
+        flags.push_back(entryFlags);
+    }
+    size_t count = flags.size();
+    if (count == 0) return "Error: " + args[1] + " has no entries\n";
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    size_t buckets = count;
+    size_t slots = 1;
+    while (slots < count + count / 2) slots <<= 1;
+    std::vector<uint32_t> disp(buckets), slot;
+    std::vector<size_t> order(count), bucketStart(buckets + 1);
+    bool placed = false;
+    for (int attempt = 0; attempt < 4; attempt++, slots <<= 1) {
+        slot.assign(slots, CATALOG_EMPTY);
+        placed = PlacePerfectHash([&](size_t i) { return fields[i * 4].c_str(); },
+            count, buckets, slots, disp, slot, order, bucketStart);
+        if (placed) break;
+    }
+    if (!placed) return "Error: no perfect hash found for " + std::to_string(count) + " models\n";
+    double buildMs = CoreMicrosecondsSince(start) / 1000.0;
+    
+    std::string strings, records;
+    for (size_t i = 0; i < count; i++) {
+        for (int f = 0; f < 4; f++) {
+            AppendCatalogWord(records, (uint32_t)strings.size());
+            strings += fields[i * 4 + f];
+            strings += '\0';
+        }
+        AppendCatalogWord(records, flags[i]);
+    }
+    std::string image(CATALOG_MAGIC);
+    AppendCatalogWord(image, (uint32_t)count);
+    AppendCatalogWord(image, (uint32_t)buckets);
+    AppendCatalogWord(image, (uint32_t)slots);
+    AppendCatalogWord(image, (uint32_t)strings.size());
+    for (size_t b = 0; b < buckets; b++) AppendCatalogWord(image, disp[b]);
+    for (size_t s = 0; s < slots; s++) AppendCatalogWord(image, slot[s]);
+    image += records;
+    image += strings;
+    
+    std::ofstream out(args[2].c_str(), std::ios::binary | std::ios::trunc);
+    out.write(image.data(), image.size());
+    if (!out) return "Error: cannot write " + args[2] + "\n";
+    
+    std::ostringstream report;
+    report << std::fixed << std::setprecision(2)
+           << args[2] << ": " << count << " models, " << slots << " slots, "
+           << image.size() << " bytes, hash built in " << buildMs << " ms\n";
+    return report.str();
+}
+
+//   frpunlock.exe --catalog <model>... [--file devices.cat]
+// Looks models up the way device detection does, with load and lookup cost
+std::string CatalogReport(const std::vector<std::string>& args) {
+    std::string path = CatalogPath();
+    std::vector<std::string> models;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (args[i] == "--file" && i + 1 < args.size()) path = args[++i];
+        else models.push_back(args[i]);
+    }
+    
+    std::ostringstream report;
+    report << std::fixed << std::setprecision(2);
+    DeviceCatalog catalog;
+    std::string error;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (catalog.Load(path, error)) {
+        report << path << ": " << catalog.FileEntries() << " models, mapped in "
+               << CoreMicrosecondsSince(start) << " us\n";
+    } else {
+        report << error << "; built-in catalogue only\n";
+    }
+    report << CATALOG_BUILTIN_COUNT << " built-in models\n\n";
+    
+    for (size_t i = 0; i < models.size(); i++) {
+        CatalogMatch match;
+        if (!catalog.Find(models[i], match)) {
+            report << models[i] << ": not catalogued\n";
+            continue;
+        }
+        report << models[i] << ": " << match.record.name << " (" << match.record.codename << "), "
+               << match.record.chipset << ", " << FormatCatalogFlags(match.record.flags);
+        if (!match.suffix.empty()) {
+            report << ", variant " << match.suffix;
+            if (match.region) report << " " << match.region;
+        }
+        report << (match.fromFile ? " [file]\n" : " [built-in]\n");
+    }
+    
+    if (!models.empty()) {
+        const int rounds = 1000000;
+        size_t found = 0;
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++) {
+            CatalogMatch match;
+            found += catalog.Find(models[r % models.size()], match);
+        }
+        report << "\n" << rounds << " lookups: " << CoreMicrosecondsSince(start) * 1000.0 / rounds
+               << " ns each (" << found << " found)\n";
+    }
+    return report.str();
+}
+
+// Logcat viewer
+// One window per device over its LogcatStore. The list is owner-data, so
+// only visible rows are ever formatted, and it holds entry numbers, not
+// text. Filtering runs on a timer in time-boxed slices that pick up where
+// the last one stopped: typing a new filter restarts the scan from the
+// oldest entry, and a live stream only costs a scan of what arrived since
+// the last tick, however many devices are streaming.
+#define LOGCAT_CLASS "S23LogcatClass"
+#define IDC_LOGCAT_FILTER 2101
+#define IDC_LOGCAT_LIVE 2102
+#define IDC_LOGCAT_LIST 2103
+#define IDT_LOGCAT_REFRESH 1
+#define IDT_LOGCAT_FILTER 2
+#define LOGCAT_REFRESH_MS 100
+#define LOGCAT_FILTER_DELAY_MS 300
+#define LOGCAT_SLICE_MS 15
+#define LOGCAT_SLICE_ENTRIES 16384
+
+struct LogcatView {
+    std::string serial;
+    std::shared_ptr<LogcatStore> store;
+    HWND filter, live, list, status;
+    LogcatQuery query;
+    std::unique_ptr<LogcatMatcher> matcher;
+    std::string error;                  // filter text that didn't parse
+    std::vector<uint64_t> rows;         // matching entry numbers, ascending
+    uint64_t scanned;                   // entries before this are filtered
+    uint64_t cached;                    // entry in cache, for LVN_GETDISPINFO
+    LogcatStore::Entry cache;
+    bool hasCache;
+};
+
+// Open viewers (UI thread only), by serial
+std::map<std::string, HWND> g_logcatViews;
+
+static void FormatLogcatTime(uint64_t ns, char* out, size_t size) {
+    time_t sec = (time_t)(ns / 1000000000ull);
+    struct tm* t = localtime(&sec);
+    if (!t) {
+        snprintf(out, size, "%llu", (unsigned long long)sec);
+        return;
+    }
+    snprintf(out, size, "%02d-%02d %02d:%02d:%02d.%03d", t->tm_mon + 1, t->tm_mday,
+             t->tm_hour, t->tm_min, t->tm_sec, (int)(ns / 1000000ull % 1000));
+}
+
+static void ApplyLogcatFilter(LogcatView* view) {
+    char text[1024];
+    GetWindowTextA(view->filter, text, sizeof(text));
+    view->error.clear();
+    if (!ParseLogcatQuery(text, view->query, view->error)) {
+        view->query = LogcatQuery();
+    }
+    view->matcher.reset(new LogcatMatcher(view->query));
+    view->rows.clear();
+    view->scanned = 0;
+    view->hasCache = false;
+    ListView_SetItemCountEx(view->list, 0, 0);
+}
+
+// Timer tick: forgets dropped entries and filters new ones, for at most
+// LOGCAT_SLICE_MS
+static void RefreshLogcatView(LogcatView* view) {
+    uint64_t base = view->store->Base();
+    std::vector<uint64_t>::iterator gone = std::lower_bound(view->rows.begin(), view->rows.end(), base);
+    size_t dropped = gone - view->rows.begin();
+    if (dropped) view->rows.erase(view->rows.begin(), gone);
+    
+    size_t before = view->rows.size();
+    uint64_t end = view->store->End();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (view->scanned < end && CoreMillisecondsSince(start) < LOGCAT_SLICE_MS) {
+        view->scanned = view->store->Filter(view->query, *view->matcher, view->scanned, end,
+                                            LOGCAT_SLICE_ENTRIES, view->rows);
+    }
+    
+    if (dropped || view->rows.size() != before) {
+        // Follow the tail only if the user hasn't scrolled away from it
+        int top = ListView_GetTopIndex(view->list);
+        bool atEnd = top + ListView_GetCountPerPage(view->list) >= (int)before;
+        view->hasCache = false;
+        ListView_SetItemCountEx(view->list, (int)view->rows.size(), dropped ? 0 : LVSICF_NOSCROLL | LVSICF_NOINVALIDATEALL);
+        if (atEnd && !view->rows.empty()) ListView_EnsureVisible(view->list, (int)view->rows.size() - 1, FALSE);
+    }
+    
+    std::ostringstream status;
+    uint64_t stored = end - base;
+    if (!view->error.empty()) status << view->error << " - ";
+    status << view->rows.size() << " of " << stored << " entries, " << view->store->TagCount() << " tags, "
+           << view->store->ArenaBytes() / 1024 << " KB of messages";
+    if (view->scanned < end && stored > 0) {
+        status << ", filtering " << (int)(100 * (view->scanned > base ? view->scanned - base : 0) / stored) << "%";
+    }
+    if (view->store->Corrupt()) status << " - stream is not binary logcat";
+    SetWindowTextA(view->status, status.str().c_str());
+}
+
+static void LogcatViewCell(LogcatView* view, int row, int column, char* out, int size) {
+    out[0] = '\0';
+    if (row < 0 || row >= (int)view->rows.size()) return;
+    uint64_t number = view->rows[row];
+    if (!view->hasCache || view->cached != number) {
+        view->hasCache = view->store->Get(number, view->cache);
+        view->cached = number;
+        if (!view->hasCache) return;
+    }
+    const LogcatStore::Entry& e = view->cache;
+    switch (column) {
+        case 0: FormatLogcatTime(e.timeNs, out, size); break;
+        case 1: snprintf(out, size, "%d", e.pid); break;
+        case 2: snprintf(out, size, "%d", e.tid); break;
+        case 3: snprintf(out, size, "%c", LogcatPriorityLetter(e.priority)); break;
+        case 4: snprintf(out, size, "%s", e.tag.c_str()); break;
+        default: snprintf(out, size, "%s", e.message.c_str()); break;
+    }
+}
+
+LRESULT CALLBACK LogcatWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
+    LogcatView* view = (LogcatView*)GetWindowLongPtr(hWnd, GWLP_USERDATA);
+    
+    switch (message) {
+        case WM_CREATE: {
+            CREATESTRUCTA* cs = (CREATESTRUCTA*)lParam;
+            view = (LogcatView*)cs->lpCreateParams;
+            SetWindowLongPtr(hWnd, GWLP_USERDATA, (LONG_PTR)view);
+            HFONT font = (HFONT)GetStockObject(DEFAULT_GUI_FONT);
+            
+            view->filter = CreateWindowExA(WS_EX_CLIENTEDGE, "EDIT", NULL,
+                WS_VISIBLE | WS_CHILD | ES_AUTOHSCROLL,
+                0, 0, 0, 0, hWnd, (HMENU)IDC_LOGCAT_FILTER, NULL, NULL);
+            SendMessage(view->filter, WM_SETFONT, (WPARAM)font, TRUE);
+            view->live = CreateWindowA("BUTTON", "Live", WS_VISIBLE | WS_CHILD | BS_AUTOCHECKBOX,
+                0, 0, 0, 0, hWnd, (HMENU)IDC_LOGCAT_LIVE, NULL, NULL);
+            SendMessage(view->live, WM_SETFONT, (WPARAM)font, TRUE);
+            if (g_logcat.IsLive(view->serial)) SendMessage(view->live, BM_SETCHECK, BST_CHECKED, 0);
+            
+            view->list = CreateWindowExA(WS_EX_CLIENTEDGE, WC_LISTVIEWA, NULL,
+                WS_VISIBLE | WS_CHILD | LVS_REPORT | LVS_OWNERDATA | LVS_SHOWSELALWAYS,
+                0, 0, 0, 0, hWnd, (HMENU)IDC_LOGCAT_LIST, NULL, NULL);
+            SendMessage(view->list, WM_SETFONT, (WPARAM)GetStockObject(ANSI_FIXED_FONT), TRUE);
+            ListView_SetExtendedListViewStyle(view->list, LVS_EX_FULLROWSELECT | LVS_EX_DOUBLEBUFFER);
+            const char* titles[] = { "Time", "PID", "TID", "P", "Tag", "Message" };
+            const int widths[] = { 130, 55, 55, 25, 140, 1200 };
+            for (int i = 0; i < 6; i++) {
+                LVCOLUMNA col;
+                col.mask = LVCF_WIDTH | LVCF_TEXT;
+                col.cx = widths[i];
+                col.pszText = (LPSTR)titles[i];
+                ListView_InsertColumn(view->list, i, &col);
+            }
+            
+            view->status = CreateWindowA("STATIC", "", WS_VISIBLE | WS_CHILD | SS_LEFT,
+                0, 0, 0, 0, hWnd, NULL, NULL, NULL);
+            SendMessage(view->status, WM_SETFONT, (WPARAM)font, TRUE);
+            
+            ApplyLogcatFilter(view);
+            RefreshLogcatView(view);
+            SetTimer(hWnd, IDT_LOGCAT_REFRESH, LOGCAT_REFRESH_MS, NULL);
+            return 0;
+        }
+        
+        case WM_SIZE: {
+            int w = LOWORD(lParam), h = HIWORD(lParam);
+            MoveWindow(view->filter, 8, 8, w - 90, 22, TRUE);
+            MoveWindow(view->live, w - 74, 10, 66, 20, TRUE);
+            MoveWindow(view->list, 8, 38, w - 16, h - 70, TRUE);
+            MoveWindow(view->status, 8, h - 26, w - 16, 20, TRUE);
+            return 0;
+        }
+        
+        case WM_COMMAND:
+            if (LOWORD(wParam) == IDC_LOGCAT_FILTER && HIWORD(wParam) == EN_CHANGE) {
+                // Wait for a pause in typing before rescanning
+                SetTimer(hWnd, IDT_LOGCAT_FILTER, LOGCAT_FILTER_DELAY_MS, NULL);
+            } else if (LOWORD(wParam) == IDC_LOGCAT_LIVE) {
+                if (SendMessage(view->live, BM_GETCHECK, 0, 0) == BST_CHECKED) g_logcat.StartLive(view->serial);
+                else g_logcat.StopLive(view->serial);
+            }
+            return 0;
+        
+        case WM_TIMER:
+            if (wParam == IDT_LOGCAT_FILTER) {
+                KillTimer(hWnd, IDT_LOGCAT_FILTER);
+                ApplyLogcatFilter(view);
+            }
+            RefreshLogcatView(view);
+            return 0;
+        
+        case WM_NOTIFY: {
+            NMHDR* hdr = (NMHDR*)lParam;
+            if (hdr->hwndFrom == view->list && hdr->code == LVN_GETDISPINFOA) {
+                NMLVDISPINFOA* info = (NMLVDISPINFOA*)lParam;
+                if (info->item.mask & LVIF_TEXT) {
+                    LogcatViewCell(view, info->item.iItem, info->item.iSubItem,
+                                   info->item.pszText, info->item.cchTextMax);
+                }
+            }
+            return 0;
+        }
+        
+        case WM_DESTROY:
+            KillTimer(hWnd, IDT_LOGCAT_REFRESH);
+            g_logcat.StopLive(view->serial);
+            g_logcatViews.erase(view->serial);
+            delete view;
+            SetWindowLongPtr(hWnd, GWLP_USERDATA, 0);
+            return 0;
+    }
+    return DefWindowProc(hWnd, message, wParam, lParam);
+}
+
+// Shows the device's store, reusing its window if one is open (UI thread)
+void OpenLogcatView(const std::string& serial) {
+    std::map<std::string, HWND>::iterator it = g_logcatViews.find(serial);
+    if (it != g_logcatViews.end()) {
+        SetForegroundWindow(it->second);
+        return;
+    }
+    LogcatView* view = new LogcatView();
+    view->serial = serial;
+    view->store = g_logcat.Get(serial);
+    view->filter = view->live = view->list = view->status = NULL;
+    view->scanned = view->cached = 0;
+    view->hasCache = false;
+    HWND hView = CreateWindowExA(0, LOGCAT_CLASS, ("Logcat: " + serial).c_str(),
+        WS_OVERLAPPEDWINDOW | WS_VISIBLE, CW_USEDEFAULT, 0, 1000, 600,
+        NULL, NULL, GetModuleHandle(NULL), view);
+    if (!hView) {
+        delete view;
+        AddLog("Error: cannot open the logcat viewer");
+        return;
+    }
+    g_logcatViews[serial] = hView;
+}
+
+// "adb [-s <serial>] logcat -d": loads the device's buffers into its store
+// and opens the viewer instead of pushing the dump through the log. Returns
+// false when binary logcat isn't available, so the caller can fall back to
+// the text dump.
+bool LoadLogcatDump(const std::string& args, const OutputCallback& onOutput) {
+    std::string serial, verb, rest;
+    ParseAdbArgs(args, serial, verb, rest);
+    if (verb != "logcat" || rest != "-d") return false;
+    std::string error;
+    if (serial.empty() && (!g_adb.ServerAvailable() || !g_adb.HostQuery("host:get-serialno", serial))) {
+        return false;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    // The binary dump goes to the store; the journal gets the summary line
+    JournalCommand journal(serial, "adb -s " + serial + " exec-out logcat -B -d");
+    OutputCallback output = journal.Tee(onOutput);
+    size_t entries;
+    if (!g_logcat.Dump(serial, entries, error)) {
+        journal.Exit(-1);
+        return false;
+    }
+    std::shared_ptr<LogcatStore> store = g_logcat.Get(serial);
+    std::string line = "Loaded " + std::to_string(entries) + " logcat entries (" +
+        std::to_string(store->TagCount()) + " tags) from " + serial + " in " +
+        std::to_string(CoreMillisecondsSince(start)) + " ms\n";
+    output(line.data(), line.size());
+    journal.Exit(0);
+    PostMessage(g_hWnd, WM_LOGCAT_OPEN, 0, (LPARAM)new std::string(serial));
+    return true;
+}
+
+// Command line filter over a saved "adb exec-out logcat -B -d" dump
+std::string LogcatReport(const std::vector<std::string>& args) {
+    if (args.size() < 2) return "Usage: --logcat <dump.bin> [filter...]\n";
+    std::ifstream in(args[1].c_str(), std::ios::binary);
+    if (!in) return "Error: cannot read " + args[1] + "\n";
+    std::string spec;
+    for (size_t i = 2; i < args.size(); i++) spec += (i > 2 ? " " : "") + args[i];
+    LogcatQuery q;
+    std::string error;
+    if (!ParseLogcatQuery(spec, q, error)) return "Error: " + error + "\n";
+    
+    LogcatStore store;
+    std::vector<char> buffer(LOGCAT_READ_SIZE);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    size_t bytes = 0;
+    while (in.read(&buffer[0], buffer.size()) || in.gcount() > 0) {
+        store.Feed(&buffer[0], (size_t)in.gcount());
+        bytes += (size_t)in.gcount();
+    }
+    long long ingestMs = CoreMillisecondsSince(start);
+    if (store.Corrupt()) return "Error: " + args[1] + " is not binary logcat (use logcat -B)\n";
+    
+    start = std::chrono::steady_clock::now();
+    LogcatMatcher matcher(q);
+    std::vector<uint64_t> rows;
+    store.Filter(q, matcher, store.Base(), store.End(), (size_t)-1, rows);
+    long long filterMs = CoreMillisecondsSince(start);
+    
+    std::ostringstream report;
+    LogcatStore::Entry e;
+    char when[32];
+    for (size_t i = 0; i < rows.size(); i++) {
+        if (!store.Get(rows[i], e)) continue;
+        FormatLogcatTime(e.timeNs, when, sizeof(when));
+        report << when << " " << std::setw(5) << e.pid << " " << std::setw(5) << e.tid << " "
+               << LogcatPriorityLetter(e.priority) << " " << e.tag << ": " << e.message << "\n";
+    }
+    report << rows.size() << " of " << store.End() - store.Base() << " entries (" << store.TagCount()
+           << " tags, " << store.Skipped() << " binary skipped); ingest " << bytes / 1024 << " KB in "
+           << ingestMs << " ms, filter " << filterMs << " ms\n";
+    return report.str();
+}
+
+// Command statistics view
+// Opened from "Command statistics" on the system menu: one row per command
+// key and per device from g_commandStats, rebuilt once a second while open,
+// with CSV and JSON lines export. The list shows milliseconds; the exports
+// keep microseconds and, for JSON, the histogram buckets.
+#define STATS_CLASS "S23StatsClass"
+#define IDM_COMMAND_STATS 0x0020
+#define IDC_STATS_LIST 2201
+#define IDC_STATS_CSV 2202
+#define IDC_STATS_JSON 2203
+#define IDC_STATS_RESET 2204
+#define IDT_STATS_REFRESH 1
+#define STATS_REFRESH_MS 1000
+
+HWND g_statsView = NULL;
+
+static std::string FormatStatsTime(uint64_t us, uint64_t count) {
+    if (count == 0) return "-";
+    char text[32];
+    snprintf(text, sizeof(text), "%.2f", us / 1000.0);
+    return text;
+}
+
+static void RefreshStatsView(HWND list) {
+    std::vector<CommandStatsRow> rows = g_commandStats.Rows();
+    int top = ListView_GetTopIndex(list);
+    SendMessage(list, WM_SETREDRAW, FALSE, 0);
+    ListView_DeleteAllItems(list);
+    for (size_t i = 0; i < rows.size(); i++) {
+        const CommandStatsRow& r = rows[i];
+        std::string cells[] = {
+            r.scope, r.key, std::to_string(r.count),
+            FormatStatsTime(r.total.Percentile(0.5), r.total.Count()),
+            FormatStatsTime(r.total.Percentile(0.9), r.total.Count()),
+            FormatStatsTime(r.total.Percentile(0.99), r.total.Count()),
+            FormatStatsTime(r.total.Max(), r.total.Count()),
+            FormatStatsTime(r.firstByte.Percentile(0.5), r.firstByte.Count()),
+            FormatStatsTime(r.spawn.Percentile(0.5), r.spawn.Count()),
+            std::to_string(r.timeouts), std::to_string(r.failures), std::to_string(r.bytes)
+        };
+        LVITEMA item;
+        ZeroMemory(&item, sizeof(item));
+        item.mask = LVIF_TEXT;
+        item.iItem = (int)i;
+        item.pszText = (LPSTR)cells[0].c_str();
+        ListView_InsertItem(list, &item);
+        for (int c = 1; c < 12; c++) ListView_SetItemText(list, (int)i, c, (LPSTR)cells[c].c_str());
+    }
+    // Keep the user's scroll position across the rebuild
+    if (top > 0 && !rows.empty()) {
+        ListView_EnsureVisible(list, (int)rows.size() - 1, FALSE);
+        ListView_EnsureVisible(list, std::min(top, (int)rows.size() - 1), FALSE);
+    }
+    SendMessage(list, WM_SETREDRAW, TRUE, 0);
+}
+
+static void ExportStats(HWND owner, bool csv) {
+    char fileName[MAX_PATH] = "";
+    strcpy(fileName, csv ? "command-stats.csv" : "command-stats.jsonl");
+    OPENFILENAMEA ofn;
+    ZeroMemory(&ofn, sizeof(ofn));
+    ofn.lStructSize = sizeof(ofn);
+    ofn.hwndOwner = owner;
+    ofn.lpstrFilter = csv ? "CSV Files\0*.csv\0All Files\0*.*\0" : "JSON Lines\0*.jsonl;*.json\0All Files\0*.*\0";
+    ofn.lpstrFile = fileName;
+    ofn.nMaxFile = sizeof(fileName);
+    ofn.lpstrDefExt = csv ? "csv" : "jsonl";
+    ofn.Flags = OFN_OVERWRITEPROMPT | OFN_EXPLORER;
+    if (!GetSaveFileNameA(&ofn)) return;
+    std::string error;
+    if (g_commandStats.Export(fileName, error)) AddLog("Command statistics exported to " + std::string(fileName));
+    else AddLog("Error: " + error);
+}
+
+LRESULT CALLBACK StatsWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
+    HWND list = GetDlgItem(hWnd, IDC_STATS_LIST);
+    
+    switch (message) {
+        case WM_CREATE: {
+            HFONT font = (HFONT)GetStockObject(DEFAULT_GUI_FONT);
+            list = CreateWindowExA(WS_EX_CLIENTEDGE, WC_LISTVIEWA, NULL,
+                WS_VISIBLE | WS_CHILD | LVS_REPORT | LVS_SHOWSELALWAYS,
+                0, 0, 0, 0, hWnd, (HMENU)IDC_STATS_LIST, NULL, NULL);
+            SendMessage(list, WM_SETFONT, (WPARAM)font, TRUE);
+            ListView_SetExtendedListViewStyle(list, LVS_EX_FULLROWSELECT | LVS_EX_DOUBLEBUFFER);
+            const char* titles[] = { "Scope", "Command / device", "Count", "p50 ms", "p90 ms", "p99 ms",
+                                     "Max ms", "1st byte ms", "Spawn ms", "Timeouts", "Failed", "Bytes" };
+            const int widths[] = { 65, 210, 55, 60, 60, 60, 60, 75, 65, 65, 55, 75 };
+            for (int i = 0; i < 12; i++) {
+                LVCOLUMNA col;
+                col.mask = LVCF_WIDTH | LVCF_TEXT;
+                col.cx = widths[i];
+                col.pszText = (LPSTR)titles[i];
+                ListView_InsertColumn(list, i, &col);
+            }
+            const char* buttons[] = { "Export CSV...", "Export JSON...", "Reset" };
+            for (int i = 0; i < 3; i++) {
+                HWND button = CreateWindowA("BUTTON", buttons[i], WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+                    0, 0, 0, 0, hWnd, (HMENU)(INT_PTR)(IDC_STATS_CSV + i), NULL, NULL);
+                SendMessage(button, WM_SETFONT, (WPARAM)font, TRUE);
+            }
+            RefreshStatsView(list);
+            SetTimer(hWnd, IDT_STATS_REFRESH, STATS_REFRESH_MS, NULL);
+            return 0;
+        }
+        
+        case WM_SIZE: {
+            int w = LOWORD(lParam), h = HIWORD(lParam);
+            MoveWindow(list, 8, 8, w - 16, h - 50, TRUE);
+            for (int i = 0; i < 3; i++) {
+                MoveWindow(GetDlgItem(hWnd, IDC_STATS_CSV + i), 8 + i * 110, h - 34, 100, 26, TRUE);
+            }
+            return 0;
+        }
+        
+        case WM_COMMAND:
+            if (LOWORD(wParam) == IDC_STATS_CSV || LOWORD(wParam) == IDC_STATS_JSON) {
+                ExportStats(hWnd, LOWORD(wParam) == IDC_STATS_CSV);
+            } else if (LOWORD(wParam) == IDC_STATS_RESET) {
+                g_commandStats.Reset();
+                RefreshStatsView(list);
+            }
+            return 0;
+        
+        case WM_TIMER:
+            RefreshStatsView(list);
+            return 0;
+        
+        case WM_DESTROY:
+            KillTimer(hWnd, IDT_STATS_REFRESH);
+            g_statsView = NULL;
+            return 0;
+    }
+    return DefWindowProc(hWnd, message, wParam, lParam);
+}
+
+void OpenStatsView() {
+    if (g_statsView) {
+        SetForegroundWindow(g_statsView);
+        return;
+    }
+    g_statsView = CreateWindowExA(0, STATS_CLASS, "Command statistics",
+        WS_OVERLAPPEDWINDOW | WS_VISIBLE, CW_USEDEFAULT, 0, 920, 420,
+        NULL, NULL, GetModuleHandle(NULL), NULL);
+    if (!g_statsView) AddLog("Error: cannot open the statistics view");
+}
+
+// Runs a Quick Commands line, streaming its output. fastboot getvar/oem
+// output also refreshes the device's variable table; summary, if given,
+// receives the decoded table when the output held one.
+int RunQuickCommand(const std::string& command, const OutputCallback& onOutput, std::string* summary) {
+    if (command.compare(0, 9, "fastboot ") == 0) {
+        std::string output;
+        int exitCode = StreamFastbootCommand(command.substr(9), [&](const char* data, size_t len) {
+            onOutput(data, len);
+            output.append(data, len);
+        });
+        std::string key = CommandDeviceKey(command);
+        std::shared_ptr<const FastbootVarTable> info = g_fastbootInfo.Ingest(
+            key.substr(key.find(':') + 1), output, command.find("getvar all") != std::string::npos);
+        if (info && summary) *summary = FormatFastbootInfo(*info);
+        return exitCode;
+    }
+    if (command.compare(0, 4, "adb ") == 0 &&
+        (LoadLogcatDump(command.substr(4), onOutput) || RefreshAppInventory(command.substr(4), onOutput))) {
+        return 0;
+    }
+    return command.compare(0, 4, "adb ") == 0 ?
+        StreamADBCommand(command.substr(4), onOutput) :
+        StreamCommand(command, onOutput);
+}
+
+// Broadcast execution
+// With "Broadcast to selected" checked, Execute Command runs the Quick
+// Command on every selected device at once. Each device gets its own job
+// keyed by its serial, so the scheduler runs them side by side, with
+// "-s <serial>" inserted after the tool. Output streams into one pane per
+// device in a results window; when the last device finishes the window and
+// the log get the wall time next to the per-device min/median/max.
+#define BROADCAST_CLASS "S23BroadcastClass"
+#define IDC_BROADCAST_TABS 2001
+#define IDC_BROADCAST_OUTPUT 2002
+
+struct BroadcastTarget {
+    std::string serial;
+    std::string command;        // with -s <serial>
+    std::string output;
+    int exitCode;
+    long long elapsedMs;        // -1 until the device finishes
+    bool notified;              // an update is posted and not yet read
+    
+    BroadcastTarget() : exitCode(-1), elapsedMs(-1), notified(false) {}
+};
+
+class Broadcast {
+public:
+    // Called from any thread when target i has news; at most once per Read
+    typedef std::function<void(size_t)> UpdateFunc;
+    
+    Broadcast(const std::string& command, const std::vector<std::string>& serials)
+        : command(command), remaining(serials.size()), wallMs(-1), start(std::chrono::steady_clock::now()) {
+        for (size_t i = 0; i < serials.size(); i++) {
+            BroadcastTarget target;
+            target.serial = serials[i];
+            target.command = WithSerial(command, serials[i]);
+            targets.push_back(target);
+        }
+    }
+    
+    // "adb shell ls" -> "adb -s <serial> shell ls"
+    static std::string WithSerial(const std::string& command, const std::string& serial) {
+        size_t space = command.find(' ');
+        if (space == std::string::npos) return command + " -s " + serial;
+        return command.substr(0, space) + " -s " + serial + command.substr(space);
+    }
+    
+    const std::string& Command() const { return command; }
+    size_t Size() const { return targets.size(); }
+    const std::string& Serial(size_t i) const { return targets[i].serial; }
+    const std::string& TargetCommand(size_t i) const { return targets[i].command; }
+    
+    void SetUpdate(const UpdateFunc& fn) {
+        std::lock_guard<std::mutex> lock(mutex);
+        onUpdate = fn;
+    }
+    
+    // Runs target i on the calling thread
+    void Run(size_t i) {
+        std::chrono::steady_clock::time_point began = std::chrono::steady_clock::now();
+        std::string summary;
+        int exitCode = RunQuickCommand(targets[i].command,
+            [this, i](const char* data, size_t len) { Append(i, data, len); }, &summary);
+        if (!summary.empty()) {
+            summary = "\n" + summary + "\n";
+            Append(i, summary.data(), summary.size());
+        }
+        Finish(i, exitCode, CoreMillisecondsSince(began), "");
+    }
+    
+    // Marks a target that never ran (cancelled while queued, timed out) as
+    // finished; no-op once it has finished on its own
+    void Abandon(size_t i, const std::string& reason) {
+        Finish(i, -1, CoreMillisecondsSince(start), reason + "\n");
+    }
+    
+    // Copies target i's output from offset on, whole lines only until the
+    // device finishes. Returns false while it is still running.
+    bool Read(size_t i, size_t offset, std::string& text, int& exitCode, long long& elapsedMs) {
+        std::lock_guard<std::mutex> lock(mutex);
+        BroadcastTarget& t = targets[i];
+        t.notified = false;
+        size_t end = t.output.size();
+        if (t.elapsedMs < 0) {
+            size_t eol = t.output.rfind('\n');
+            end = eol == std::string::npos ? 0 : eol + 1;
+        }
+        text.assign(t.output, std::min(offset, end), end - std::min(offset, end));
+        exitCode = t.exitCode;
+        elapsedMs = t.elapsedMs;
+        return t.elapsedMs >= 0;
+    }
+    
+    bool Finished() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return remaining == 0;
+    }
+    
+    // One line: wall time, per-device spread and how much the devices overlapped
+    std::string Summary() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<long long> times;
+        long long sum = 0;
+        size_t failed = 0;
+        for (size_t i = 0; i < targets.size(); i++) {
+            if (targets[i].elapsedMs < 0) continue;
+            times.push_back(targets[i].elapsedMs);
+            sum += targets[i].elapsedMs;
+            if (targets[i].exitCode != 0) failed++;
+        }
+        std::ostringstream line;
+        line << "Broadcast \"" << command << "\": " << times.size() << "/" << targets.size() << " device(s)";
+        if (times.empty()) return line.str();
+        std::sort(times.begin(), times.end());
+        long long wall = wallMs >= 0 ? wallMs : CoreMillisecondsSince(start);
+        line << " in " << wall << " ms wall; per device min/median/max "
+             << times.front() << "/" << times[times.size() / 2] << "/" << times.back() << " ms";
+        if (wall > 0) {
+            line << ", " << std::fixed << std::setprecision(1) << (double)sum / wall << "x overlap";
+        }
+        if (failed) line << ", " << failed << " failed";
+        return line.str();
+    }
+
+private:
+    std::string command;
+    std::vector<BroadcastTarget> targets;
+    size_t remaining;
+    long long wallMs;
+    std::chrono::steady_clock::time_point start;
+    UpdateFunc onUpdate;
+    std::mutex mutex;
+    
+    void Append(size_t i, const char* data, size_t len) {
+        std::lock_guard<std::mutex> lock(mutex);
+        targets[i].output.append(data, len);
+        Notify(i);
+    }
+    
+    void Finish(size_t i, int exitCode, long long elapsedMs, const std::string& note) {
+        std::lock_guard<std::mutex> lock(mutex);
+        BroadcastTarget& t = targets[i];
+        if (t.elapsedMs >= 0) return;
+        t.output += note;
+        t.exitCode = exitCode;
+        t.elapsedMs = elapsedMs;
+        if (--remaining == 0) wallMs = CoreMillisecondsSince(start);
+        Notify(i);
+    }
+    
+    void Notify(size_t i) {
+        if (targets[i].notified || !onUpdate) return;
+        targets[i].notified = true;
+        onUpdate(i);
+    }
+};
+
+// Broadcast jobs in flight (UI thread only): job id -> device index, so
+// WM_JOB_DONE can settle devices whose job never got to run
+struct BroadcastJob {
+    std::shared_ptr<Broadcast> broadcast;
+    size_t index;
+};
+std::map<int, BroadcastJob> g_broadcastJobs;
+
+// Results window state, owned by the window (GWLP_USERDATA)
+struct BroadcastView {
+    std::shared_ptr<Broadcast> broadcast;
+    HWND tabs, output, status;
+    std::vector<std::string> panes;     // CRLF text shown so far, per device
+    std::vector<size_t> consumed;       // raw output bytes already in panes
+    bool reported;
+};
+
+static std::string BroadcastTabLabel(const std::string& serial, bool finished, int exitCode, long long elapsedMs) {
+    if (!finished) return serial + " ...";
+    std::string label = serial + "  " + std::to_string(elapsedMs) + " ms";
+    if (exitCode != 0) label += " (exit " + std::to_string(exitCode) + ")";
+    return label;
+}
+
+static void SetBroadcastTab(HWND tabs, size_t index, const std::string& label) {
+    TCITEMA item;
+    item.mask = TCIF_TEXT;
+    item.pszText = (LPSTR)label.c_str();
+    SendMessageA(tabs, TCM_SETITEMA, (WPARAM)index, (LPARAM)&item);
+}
+
+// Pulls device i's new output into its pane (UI thread)
+static void UpdateBroadcastPane(BroadcastView* view, size_t i) {
+    std::string text;
+    int exitCode;
+    long long elapsedMs;
+    bool finished = view->broadcast->Read(i, view->consumed[i], text, exitCode, elapsedMs);
+    view->consumed[i] += text.size();
+    std::string& pane = view->panes[i];
+    size_t shown = pane.size();
+    AppendNormalized(pane, text.data(), text.size(), pane.empty() ? 0 : pane[pane.size() - 1]);
+    if (pane.size() > shown && (int)i == TabCtrl_GetCurSel(view->tabs)) {
+        int end = GetWindowTextLengthA(view->output);
+        SendMessageA(view->output, EM_SETSEL, (WPARAM)end, (LPARAM)end);
+        SendMessageA(view->output, EM_REPLACESEL, FALSE, (LPARAM)(pane.c_str() + shown));
+    }
+    if (finished) {
+        SetBroadcastTab(view->tabs, i, BroadcastTabLabel(view->broadcast->Serial(i), true, exitCode, elapsedMs));
+    }
+    
+    std::string summary = view->broadcast->Summary();
+    SetWindowTextA(view->status, summary.c_str());
+    if (!view->reported && view->broadcast->Finished()) {
+        view->reported = true;
+        AddLog(summary);
+    }
+}
+
+LRESULT CALLBACK BroadcastWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
+    BroadcastView* view = (BroadcastView*)GetWindowLongPtr(hWnd, GWLP_USERDATA);
+    
+    switch (message) {
+        case WM_CREATE: {
+            CREATESTRUCTA* cs = (CREATESTRUCTA*)lParam;
+            view = (BroadcastView*)cs->lpCreateParams;
+            SetWindowLongPtr(hWnd, GWLP_USERDATA, (LONG_PTR)view);
+            HFONT font = (HFONT)GetStockObject(DEFAULT_GUI_FONT);
+            
+            view->tabs = CreateWindowExA(0, WC_TABCONTROLA, NULL,
+                WS_VISIBLE | WS_CHILD | WS_CLIPSIBLINGS,
+                0, 0, 0, 0, hWnd, (HMENU)IDC_BROADCAST_TABS, NULL, NULL);
+            SendMessage(view->tabs, WM_SETFONT, (WPARAM)font, TRUE);
+            view->output = CreateWindowExA(WS_EX_CLIENTEDGE, "EDIT", NULL,
+                WS_VISIBLE | WS_CHILD | WS_VSCROLL | WS_HSCROLL | ES_MULTILINE |
+                ES_READONLY | ES_AUTOVSCROLL | ES_AUTOHSCROLL,
+                0, 0, 0, 0, hWnd, (HMENU)IDC_BROADCAST_OUTPUT, NULL, NULL);
+            SendMessage(view->output, WM_SETFONT, (WPARAM)GetStockObject(ANSI_FIXED_FONT), TRUE);
+            SendMessage(view->output, EM_SETLIMITTEXT, 0, 0);
+            view->status = CreateWindowA("STATIC", "", WS_VISIBLE | WS_CHILD | SS_LEFT,
+                0, 0, 0, 0, hWnd, NULL, NULL, NULL);
+            SendMessage(view->status, WM_SETFONT, (WPARAM)font, TRUE);
+            
+            for (size_t i = 0; i < view->broadcast->Size(); i++) {
+                std::string label = BroadcastTabLabel(view->broadcast->Serial(i), false, 0, 0);
+                TCITEMA item;
+                item.mask = TCIF_TEXT;
+                item.pszText = (LPSTR)label.c_str();
+                SendMessageA(view->tabs, TCM_INSERTITEMA, (WPARAM)i, (LPARAM)&item);
+            }
+            view->panes.assign(view->broadcast->Size(), std::string());
+            view->consumed.assign(view->broadcast->Size(), 0);
+            return 0;
+        }
+        
+        case WM_SIZE: {
+            int w = LOWORD(lParam), h = HIWORD(lParam);
+            MoveWindow(view->tabs, 8, 8, w - 16, h - 40, TRUE);
+            RECT rc = { 8, 8, w - 8, h - 32 };
+            TabCtrl_AdjustRect(view->tabs, FALSE, &rc);
+            MoveWindow(view->output, rc.left, rc.top, rc.right - rc.left, rc.bottom - rc.top, TRUE);
+            SetWindowPos(view->output, HWND_TOP, 0, 0, 0, 0, SWP_NOMOVE | SWP_NOSIZE);
+            MoveWindow(view->status, 8, h - 26, w - 16, 20, TRUE);
+            return 0;
+        }
+        
+        case WM_NOTIFY: {
+            NMHDR* hdr = (NMHDR*)lParam;
+            if (hdr->hwndFrom == view->tabs && hdr->code == TCN_SELCHANGE) {
+                int sel = TabCtrl_GetCurSel(view->tabs);
+                if (sel >= 0) SetWindowTextA(view->output, view->panes[sel].c_str());
+            }
+            return 0;
+        }
+        
+        case WM_BROADCAST_UPDATE:
+            UpdateBroadcastPane(view, (size_t)wParam);
+            return 0;
+        
+        case WM_DESTROY:
+            // Jobs still running keep the broadcast alive but stop posting here
+            view->broadcast->SetUpdate(Broadcast::UpdateFunc());
+            delete view;
+            SetWindowLongPtr(hWnd, GWLP_USERDATA, 0);
+            return 0;
+    }
+    return DefWindowProc(hWnd, message, wParam, lParam);
+}
+
+// Devices selected in g_hDeviceList that the command's tool can reach
+std::vector<std::string> SelectedBroadcastSerials(const std::string& command) {
+    std::vector<std::string> serials;
+    std::string transport = command.compare(0, 4, "adb ") == 0 ? "ADB" :
+        command.compare(0, 9, "fastboot ") == 0 ? "FASTBOOT" : "";
+    int count = (int)SendMessage(g_hDeviceList, LB_GETSELCOUNT, 0, 0);
+    if (transport.empty() || count <= 0) return serials;
+    std::vector<int> rows(count);
+    count = (int)SendMessage(g_hDeviceList, LB_GETSELITEMS, (WPARAM)count, (LPARAM)&rows[0]);
+    for (int i = 0; i < count; i++) {
+        if (rows[i] < 0 || rows[i] >= (int)g_deviceRows.size()) continue;   // placeholder row
+        const DetectedDevice& dev = g_deviceRows[rows[i]];
+        if (dev.transport == transport && (transport != "ADB" || dev.state == "device")) {
+            serials.push_back(dev.serial);
+        }
+    }
+    return serials;
+}
+
+// Opens a results window and submits one job per device
+void StartBroadcast(const std::string& command, const std::vector<std::string>& serials) {
+    std::shared_ptr<Broadcast> broadcast = std::make_shared<Broadcast>(command, serials);
+    BroadcastView* view = new BroadcastView();
+    view->broadcast = broadcast;
+    view->tabs = view->output = view->status = NULL;
+    view->reported = false;
+    HWND hResults = CreateWindowExA(0, BROADCAST_CLASS, ("Broadcast: " + command).c_str(),
+        WS_OVERLAPPEDWINDOW | WS_VISIBLE, CW_USEDEFAULT, 0, 760, 520,
+        NULL, NULL, GetModuleHandle(NULL), view);
+    if (!hResults) {
+        delete view;
+        AddLog("Error: cannot open the broadcast results window");
+        return;
+    }
+    broadcast->SetUpdate([hResults](size_t i) {
+        PostMessage(hResults, WM_BROADCAST_UPDATE, (WPARAM)i, 0);
+    });
+    
+    AddLog("Broadcasting to " + std::to_string(serials.size()) + " device(s): " + command);
+    for (size_t i = 0; i < broadcast->Size(); i++) {
+        const std::string& cmd = broadcast->TargetCommand(i);
+        int id = g_jobs.Submit(cmd, CommandDeviceKey(cmd), [broadcast, i](JobContext&) {
+            broadcast->Run(i);
+        });
+        BroadcastJob job = { broadcast, i };
+        g_broadcastJobs[id] = job;
+    }
+}
+
+// Command line broadcast: one thread per device, panes printed in order
+std::string BroadcastReport(const std::vector<std::string>& args) {
+    if (args.size() < 3) return "Usage: --broadcast <serial>[,<serial>...] <command...>\n";
+    std::vector<std::string> serials;
+    std::istringstream list(args[1]);
+    std::string serial;
+    while (std::getline(list, serial, ',')) {
+        if (!serial.empty()) serials.push_back(serial);
+    }
+    std::string command;
+    for (size_t i = 2; i < args.size(); i++) command += (i > 2 ? " " : "") + args[i];
+    if (command.compare(0, 4, "adb ") != 0 && command.compare(0, 9, "fastboot ") != 0) {
+        return "Error: only adb and fastboot commands can be broadcast\n";
+    }
+    
+    Broadcast broadcast(command, serials);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < broadcast.Size(); i++) {
+        threads.push_back(std::thread(&Broadcast::Run, &broadcast, i));
+    }
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+    
+    std::ostringstream report;
+    for (size_t i = 0; i < broadcast.Size(); i++) {
+        std::string text;
+        int exitCode;
+        long long elapsedMs;
+        broadcast.Read(i, 0, text, exitCode, elapsedMs);
+        report << "== " << broadcast.Serial(i) << " (exit " << exitCode << ", " << elapsedMs << " ms) ==\n"
+               << text;
+        if (!text.empty() && text[text.size() - 1] != '\n') report << "\n";
+    }
+    report << broadcast.Summary() << "\n";
+    return report.str();
+}
+
+// Main window procedure
+LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
+    static ModernButton btnDetect, btnShell, btnRecovery, btnDownload;
+    static ModernButton btnBootloader, btnUnlock, btnLock, btnFRP, btnFlash;
+    
+    switch (message) {
+        case WM_CREATE: {
+            // CreateWindow has not returned yet; AddLog posts to g_hWnd
+            g_hWnd = hWnd;
+            
+            HMENU systemMenu = GetSystemMenu(hWnd, FALSE);
+            AppendMenuA(systemMenu, MF_SEPARATOR, 0, NULL);
+            AppendMenuA(systemMenu, MF_STRING, IDM_PAINT_STATS, "Paint statistics");
+            AppendMenuA(systemMenu, MF_STRING, IDM_COMMAND_STATS, "Command statistics");
+            
+            // Initialize common controls
+            INITCOMMONCONTROLSEX icex;
+            icex.dwSize = sizeof(icex);
+            icex.dwICC = ICC_LISTVIEW_CLASSES | ICC_PROGRESS_CLASS;
+            InitCommonControlsEx(&icex);
+            
+            // Create fonts
+            HFONT hFont = CreateFont(14, 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE,
+                DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS,
+                CLEARTYPE_QUALITY, DEFAULT_PITCH | FF_SWISS, "Segoe UI");
+            
+            HFONT hTitleFont = CreateFont(20, 0, 0, 0, FW_BOLD, FALSE, FALSE, FALSE,
+                DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS,
+                CLEARTYPE_QUALITY, DEFAULT_PITCH | FF_SWISS, "Segoe UI");
+            
+            // Title label
+            HWND hTitle = CreateWindow("STATIC", "Samsung Galaxy S23 Device Manager",
+                WS_VISIBLE | WS_CHILD | SS_CENTER,
+                0, 10, 900, 30, hWnd, NULL, NULL, NULL);
+            SendMessage(hTitle, WM_SETFONT, (WPARAM)hTitleFont, TRUE);
+            
+            // Device list
+            CreateWindow("STATIC", "Connected Devices:",
+                WS_VISIBLE | WS_CHILD | SS_LEFT,
+                20, 50, 200, 20, hWnd, NULL, NULL, NULL);
+            
+            g_hDeviceList = CreateWindowEx(WS_EX_CLIENTEDGE, "LISTBOX", NULL,
+                WS_VISIBLE | WS_CHILD | LBS_NOTIFY | WS_VSCROLL | LBS_HASSTRINGS | LBS_EXTENDEDSEL,
+                20, 75, 400, 150, hWnd, (HMENU)IDC_LIST_DEVICES, NULL, NULL);
+            SendMessage(g_hDeviceList, WM_SETFONT, (WPARAM)hFont, TRUE);
+            
+            // Log window
+            CreateWindow("STATIC", "Operation Log:",
+                WS_VISIBLE | WS_CHILD | SS_LEFT,
+                20, 235, 200, 20, hWnd, NULL, NULL, NULL);
+            
+            g_hLog = CreateWindowEx(WS_EX_CLIENTEDGE, WC_LISTVIEW, NULL,
+                WS_VISIBLE | WS_CHILD | LVS_REPORT | LVS_OWNERDATA |
+                LVS_NOCOLUMNHEADER | LVS_SHOWSELALWAYS,
+                20, 260, 860, 250, hWnd, (HMENU)IDC_EDIT_LOG, NULL, NULL);
+            SendMessage(g_hLog, WM_SETFONT, (WPARAM)hFont, TRUE);
+            ListView_SetExtendedListViewStyle(g_hLog, LVS_EX_FULLROWSELECT | LVS_EX_DOUBLEBUFFER);
+            {
+                LVCOLUMNA col;
+                col.mask = LVCF_WIDTH;
+                col.cx = 2000;
+                ListView_InsertColumn(g_hLog, 0, &col);
+            }
+            
+            // Progress bar
+            g_hProgress = CreateWindowEx(0, PROGRESS_CLASS, NULL,
+                WS_VISIBLE | WS_CHILD | PBS_SMOOTH,
+                20, 520, 860, 20, hWnd, (HMENU)IDC_PROGRESS, NULL, NULL);
+            SendMessage(g_hProgress, PBM_SETRANGE, 0, MAKELPARAM(0, 100));
+            
+            // Command combo
+            CreateWindow("STATIC", "Quick Commands:",
+                WS_VISIBLE | WS_CHILD | SS_LEFT,
+                440, 50, 150, 20, hWnd, NULL, NULL, NULL);
+            
+            g_hComboCmd = CreateWindow("COMBOBOX", NULL,
+                WS_VISIBLE | WS_CHILD | CBS_DROPDOWNLIST | WS_VSCROLL,
+                440, 75, 300, 200, hWnd, (HMENU)IDC_COMBO_COMMANDS, NULL, NULL);
+            
+            const char* commands[] = {
+                "adb devices",
+                "adb shell getprop ro.product.model",
+                "adb shell getprop ro.build.version.release",
+                "adb reboot bootloader",
+                "adb reboot recovery",
+                "fastboot devices",
+                "fastboot oem device-info",
+                "fastboot getvar all",
+                "adb shell pm list packages",
+                "adb logcat -d",
+                nullptr
+            };
+            
+            for (int i = 0; commands[i]; i++) {
+                SendMessage(g_hComboCmd, CB_ADDSTRING, 0, (LPARAM)commands[i]);
+            }
+            SendMessage(g_hComboCmd, CB_SETCURSEL, 0, 0);
+            
+            // Buttons - Left column (Device Operations)
+            int btnX = 440, btnY = 110, btnW = 200, btnH = 35, btnGap = 40;
+            
+            btnDetect.Create(hWnd, IDC_BTN_DETECT, "Detect Devices", btnX, btnY, btnW, btnH);
+            btnShell.Create(hWnd, IDC_BTN_ADB_SHELL, "ADB Shell", btnX, btnY += btnGap, btnW, btnH);
+            btnRecovery.Create(hWnd, IDC_BTN_RECOVERY, "Reboot Recovery", btnX, btnY += btnGap, btnW, btnH);
+            btnDownload.Create(hWnd, IDC_BTN_DOWNLOAD, "Download Mode", btnX, btnY += btnGap, btnW, btnH);
+            
+            // Buttons - Right column (Advanced)
+            btnX = 660; btnY = 110;
+            btnBootloader.Create(hWnd, IDC_BTN_BOOTLOADER, "Bootloader", btnX, btnY, btnW, btnH);
+            btnUnlock.Create(hWnd, IDC_BTN_UNLOCK_BL, "Unlock BL", btnX, btnY += btnGap, btnW, btnH);
+            btnLock.Create(hWnd, IDC_BTN_LOCK_BL, "Lock BL", btnX, btnY += btnGap, btnW, btnH);
+            btnFRP.Create(hWnd, IDC_BTN_FRP_BYPASS, "FRP Bypass", btnX, btnY += btnGap, btnW, btnH);
+            
+            // Execute and Flash buttons
+            CreateWindow("BUTTON", "Execute Command",
+                WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+                440, 270, 200, 35, hWnd, (HMENU)IDC_BTN_EXECUTE, NULL, NULL);
+            
+            btnFlash.Create(hWnd, IDC_BTN_FLASH, "Flash Firmware", 660, 270, 200, 35);
+            
+            // Clear log button
+            CreateWindow("BUTTON", "Clear Log",
+                WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+                760, 520, 120, 25, hWnd, (HMENU)IDC_BTN_LOG_CLEAR, NULL, NULL);
+            
+            // Cancel running/queued jobs
+            CreateWindow("BUTTON", "Cancel Jobs",
+                WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+                630, 550, 120, 25, hWnd, (HMENU)IDC_BTN_CANCEL, NULL, NULL);
+            
+            // Auto-detect checkbox
+            CreateWindow("BUTTON", "Auto-detect devices",
+                WS_VISIBLE | WS_CHILD | BS_AUTOCHECKBOX,
+                20, 550, 150, 20, hWnd, (HMENU)IDC_CHK_AUTO_DETECT, NULL, NULL);
+            
+            // Run Quick Commands on every selected device
+            CreateWindow("BUTTON", "Broadcast to selected",
+                WS_VISIBLE | WS_CHILD | BS_AUTOCHECKBOX,
+                180, 550, 170, 20, hWnd, (HMENU)IDC_CHK_BROADCAST, NULL, NULL);
+            
+            // Set default colors for buttons
+            btnUnlock.bgColor = COLOR_WARNING;
+            btnFRP.bgColor = RGB(200, 50, 50);
+            btnFlash.bgColor = RGB(100, 50, 150);
+            
+            g_jobs.Start(JOB_WORKERS);
+            
+            AddLog("Samsung Galaxy S23 Device Manager v" APP_VERSION " initialized");
+            AddLog("Please ensure ADB drivers are installed and device is connected via USB");
+            AddLog("For S23 series: Enable Developer Options > USB Debugging first");
+            
+            // Locate the platform tools once; commands launch them by full path
+            g_adbPath = ResolveTool("adb.exe");
+            g_fastbootPath = ResolveTool("fastboot.exe");
+            if (g_adbPath.empty()) {
+                AddLog("WARNING: adb.exe not found in current directory or PATH!");
+                AddLog("Please download Android SDK Platform Tools and place adb.exe here");
+            } else {
+                AddLog("Using " + g_adbPath);
+            }
+            if (g_fastbootPath.empty()) {
+                AddLog("WARNING: fastboot.exe not found in current directory or PATH!");
+            }
+            
+            return 0;
+        }
+        
+        case WM_DRAWITEM: {
+            LPDRAWITEMSTRUCT dis = (LPDRAWITEMSTRUCT)lParam;
+            ModernButton* btn = (ModernButton*)GetWindowLongPtr(dis->hwndItem, GWLP_USERDATA);
+            if (btn) {
+                btn->Draw(dis);
+                return TRUE;
+            }
+            break;
+        }
+        
+        case WM_COMMAND: {
+            int wmId = LOWORD(wParam);
+            switch (wmId) {
+                case IDC_BTN_DETECT:
+                    DetectDevices();
+                    break;
+                    
+                case IDC_BTN_ADB_SHELL: {
+                    AddLog("Opening ADB Shell...");
+                    ShellExecuteA(NULL, "open", "cmd.exe", 
+                        "/k adb shell", NULL, SW_SHOW);
+                    break;
+                }
+                
+                case IDC_BTN_RECOVERY:
+                    AddLog("Rebooting to Recovery mode...");
+                    SubmitADBCommand("reboot recovery");
+                    break;
+                    
+                case IDC_BTN_DOWNLOAD:
+                    AddLog("Rebooting to Download mode (Odin)...");
+                    SubmitADBCommand("reboot download");
+                    break;
+                    
+                case IDC_BTN_BOOTLOADER:
+                    AddLog("Rebooting to Bootloader/Fastboot mode...");
+                    SubmitADBCommand("reboot bootloader");
+                    break;
+                    
+                case IDC_BTN_UNLOCK_BL: {
+                    int result = MessageBoxA(hWnd, 
+                        "WARNING: Unlocking bootloader will WIPE ALL DATA!\n\n"
+                        "Samsung Knox will be tripped (permanent).\n"
+                        "OEM Unlock must be enabled in Developer Options first.\n\n"
+                        "Continue?", "Critical Warning", MB_YESNO | MB_ICONWARNING);
+                    if (result == IDYES) {
+                        AddLog("Initiating bootloader unlock sequence...");
+                        SubmitFastbootCommand("flashing unlock");
+                    }
+                    break;
+                }
+                
+                case IDC_BTN_LOCK_BL: {
+                    int result = MessageBoxA(hWnd, 
+                        "WARNING: Locking bootloader will WIPE ALL DATA!\n\n"
+                        "Continue?", "Critical Warning", MB_YESNO | MB_ICONWARNING);
+                    if (result == IDYES) {
+                        AddLog("Locking bootloader...");
+                        SubmitFastbootCommand("flashing lock");
+                    }
+                    break;
+                }
+                
+                case IDC_BTN_FRP_BYPASS: {
+                    int result = MessageBoxA(hWnd, 
+                        "FRP Bypass Methods:\n\n"
+                        "1. ADB Method (requires USB debugging enabled before reset)\n"
+                        "2. Combination File Method (requires specific firmware)\n\n"
+                        "Note: This is for legitimate device recovery only.\n"
+                        "Proceed with ADB FRP bypass?", "FRP Bypass", MB_YESNO | MB_ICONQUESTION);
+                    if (result == IDYES) {
+                        AddLog("Attempting FRP bypass via ADB...");
+                        // FRP bypass sequence for Samsung
+                        g_jobs.Submit("FRP bypass", SubmitDeviceKey("adb shell"), [](JobContext& ctx) {
+                            ExecuteADBCommand("shell am start -n com.google.android.gsf.login/");
+                            ctx.Progress(33);
+                            if (!ctx.Sleep(1000)) return;
+                            ExecuteADBCommand("shell am start -n com.google.android.gsf.login.LoginActivity");
+                            ctx.Progress(66);
+                            if (!ctx.Sleep(1000)) return;
+                            ExecuteADBCommand("shell content insert --uri content://settings/secure --bind name:s:user_setup_complete --bind value:s:1");
+                            AddLog("FRP bypass commands executed. Check device screen.");
+                        });
+                    }
+                    break;
+                }
+                
+                case IDC_BTN_FLASH: {
+                    OPENFILENAMEA ofn;
+                    char fileName[8192] = "";
+                    char params[MAX_PATH + 20] = "";
+                    ZeroMemory(&ofn, sizeof(ofn));
+                    ofn.lStructSize = sizeof(ofn);
+                    ofn.hwndOwner = hWnd;
+                    ofn.lpstrFilter = "Tar/MD5 Files\0*.tar;*.md5;*.tar.md5\0All Files\0*.*\0";
+                    ofn.lpstrFile = fileName;
+                    ofn.nMaxFile = sizeof(fileName);
+                    ofn.Flags = OFN_FILEMUSTEXIST | OFN_ALLOWMULTISELECT | OFN_EXPLORER;
+                    
+                    if (GetOpenFileNameA(&ofn)) {
+                        // Multi-select returns "dir\0name\0name\0\0", single "path\0\0"
+                        std::vector<std::string> files;
+                        const char* name = fileName + strlen(fileName) + 1;
+                        if (*name == '\0') files.push_back(fileName);
+                        for (; *name; name += strlen(name) + 1) {
+                            files.push_back(std::string(fileName) + "\\" + name);
+                        }
+                        for (size_t i = 0; i < files.size(); i++) {
+                            AddLog("Selected firmware: " + files[i]);
+                            SubmitPackageIndex(files[i]);
+                            SubmitPackageVerify(files[i]);
+                        }
+                        AddLog("Use Odin3 to flash this firmware!");
+                        
+                        // Build parameter string safely
+                        int ret = snprintf(params, sizeof(params), "/select,\"%s\"", files[0].c_str());
+                        if (ret > 0 && ret < (int)sizeof(params)) {
+                            ShellExecuteA(NULL, "open", "explorer.exe", 
+                                params, NULL, SW_SHOW);
+                        }
+                    }
+                    break;
+                }
+                
+                case IDC_BTN_EXECUTE: {
+                    int sel = (int)SendMessage(g_hComboCmd, CB_GETCURSEL, 0, 0);
+                    if (sel != CB_ERR) {
+                        char cmd[256];
+                        SendMessage(g_hComboCmd, CB_GETLBTEXT, sel, (LPARAM)cmd);
+                        std::string command(cmd);
+                        if (IsDlgButtonChecked(hWnd, IDC_CHK_BROADCAST) == BST_CHECKED) {
+                            std::vector<std::string> serials = SelectedBroadcastSerials(command);
+                            if (!serials.empty()) {
+                                StartBroadcast(command, serials);
+                                break;
+                            }
+                            AddLog("Broadcast: no selected device can run \"" + command + "\"; using the default device");
+                        }
+                        AddLog("Executing: " + command);
+                        g_jobs.Submit(command, SubmitDeviceKey(command), [command](JobContext&) {
+                            AddLog("Result:");
+                            LogLineSink sink;
+                            std::string summary;
+                            int exitCode = RunQuickCommand(command, sink.Callback(), &summary);
+                            sink.Flush();
+                            if (exitCode > 0) AddLog("Exit code: " + std::to_string(exitCode));
+                            if (!summary.empty()) AddLog(summary);
+                        });
+                    }
+                    break;
+                }
+                
+                case IDC_BTN_LOG_CLEAR:
+                    ClearLog();
+                    break;
+                    
+                case IDC_BTN_CANCEL: {
+                    size_t count = g_jobs.CancelAll();
+                    AddLog(count ? "Cancelling " + std::to_string(count) + " job(s)..." :
+                        std::string("No running jobs"));
+                    break;
+                }
+                    
+                case IDC_CHK_AUTO_DETECT:
+                    if (IsDlgButtonChecked(hWnd, IDC_CHK_AUTO_DETECT) == BST_CHECKED) {
+                        AddLog("Auto-detect enabled: tracking device attach/detach");
+                        g_tracker.Start();
+                    } else {
+                        g_tracker.Stop();
+                        AddLog("Auto-detect disabled");
+                    }
+                    break;
+                    
+                case IDC_LIST_DEVICES:
+                    if (HIWORD(wParam) == LBN_DBLCLK) {
+                        int sel = (int)SendMessage(g_hDeviceList, LB_GETCARETINDEX, 0, 0);
+                        if (sel != LB_ERR) {
+                            char device[256];
+                            SendMessage(g_hDeviceList, LB_GETTEXT, sel, (LPARAM)device);
+                            AddLog("Selected device: " + std::string(device));
+                        }
+                    }
+                    break;
+            }
+            break;
+        }
+        
+        case WM_UPDATE_LOG:
+            // First line after a flush; give the burst a moment to build up
+            SetTimer(hWnd, IDT_LOG_FLUSH, LOG_FLUSH_DELAY_MS, NULL);
+            return 0;
+        
+        case WM_NOTIFY: {
+            NMHDR* hdr = (NMHDR*)lParam;
+            if (hdr->hwndFrom == g_hLog && hdr->code == LVN_GETDISPINFOA) {
+                NMLVDISPINFOA* info = (NMLVDISPINFOA*)lParam;
+                if (info->item.mask & LVIF_TEXT) {
+                    FormatLogRow(info->item.iItem, info->item.pszText, info->item.cchTextMax);
+                }
+                return 0;
+            }
+            break;
+        }
+        
+        case WM_DEVICE_DETECTED: {
+            DetectedDevice* dev = (DetectedDevice*)lParam;
+            if (dev) {
+                OnDeviceDetected(dev);
+                delete dev;
+            }
+            return 0;
+        }
+        
+        case WM_DEVICE_SCAN_DONE: {
+            if (g_deviceRows.empty()) {
+                AddLog("No devices found. Check USB connection and drivers.");
+                SendMessageA(g_hDeviceList, LB_ADDSTRING, 0, (LPARAM)"No devices detected");
+            } else {
+                AddLog("Device scan complete: " + std::to_string((int)wParam) +
+                    " device(s) in " + std::to_string((long long)lParam) + " ms");
+            }
+            return 0;
+        }
+        
+        case WM_JOB_PROGRESS: {
+            g_jobProgress[(int)wParam] = (int)lParam;
+            // Average over active jobs
+            int total = 0;
+            for (std::map<int, int>::iterator it = g_jobProgress.begin(); it != g_jobProgress.end(); ++it) {
+                total += it->second;
+            }
+            KillTimer(hWnd, IDT_PROGRESS_RESET);
+            SendMessage(g_hProgress, PBM_SETPOS, total / (int)g_jobProgress.size(), 0);
+            return 0;
+        }
+        
+        case WM_JOB_DONE: {
+            JobResult* result = (JobResult*)lParam;
+            if (result) {
+                if (result->status == JOB_STATUS_CANCELLED) {
+                    AddLog("Cancelled: " + result->name);
+                } else if (result->status == JOB_STATUS_TIMEOUT) {
+                    AddLog("Timed out: " + result->name + " (" +
+                        std::to_string(result->elapsedMs) + " ms)");
+                }
+                if (result->id == g_scanJob) g_scanActive = false;
+                std::map<int, BroadcastJob>::iterator bc = g_broadcastJobs.find(result->id);
+                if (bc != g_broadcastJobs.end()) {
+                    if (result->status != JOB_STATUS_DONE) {
+                        bc->second.broadcast->Abandon(bc->second.index,
+                            result->status == JOB_STATUS_CANCELLED ? "Cancelled" : "Timed out");
+                    }
+                    g_broadcastJobs.erase(bc);
+                }
+                g_jobProgress.erase(result->id);
+                delete result;
+            }
+            if (g_jobProgress.empty()) {
+                SendMessage(g_hProgress, PBM_SETPOS, 100, 0);
+                SetTimer(hWnd, IDT_PROGRESS_RESET, 500, NULL);
+            }
+            return 0;
+        }
+        
+        case WM_LOGCAT_OPEN: {
+            std::string* serial = (std::string*)lParam;
+            if (serial) {
+                OpenLogcatView(*serial);
+                delete serial;
+            }
+            return 0;
+        }
+        
+        case WM_DEVICE_EVENT: {
+            DeviceEvent* ev = (DeviceEvent*)lParam;
+            if (ev) {
+                OnDeviceEvent(ev);
+                delete ev;
+            }
+            return 0;
+        }
+        
+        case WM_DEVICECHANGE:
+            // USB topology changed; coalesce bursts before re-listing fastboot
+            if (g_tracker.IsRunning()) {
+                SetTimer(hWnd, IDT_FASTBOOT_WATCH, 300, NULL);
+            }
+            return TRUE;
+        
+        case WM_TIMER:
+            if (wParam == IDT_PROGRESS_RESET) {
+                KillTimer(hWnd, IDT_PROGRESS_RESET);
+                SendMessage(g_hProgress, PBM_SETPOS, 0, 0);
+            } else if (wParam == IDT_FASTBOOT_WATCH) {
+                KillTimer(hWnd, IDT_FASTBOOT_WATCH);
+                g_tracker.PokeFastboot();
+            } else if (wParam == IDT_LOG_FLUSH) {
+                KillTimer(hWnd, IDT_LOG_FLUSH);
+                // Clear before draining so lines queued meanwhile re-arm the timer
+                g_logFlushPending = false;
+                FlushLog();
+            }
+            return 0;
+        
+        case WM_PAINT: {
+            PAINTSTRUCT ps;
+            HDC hdc = BeginPaint(hWnd, &ps);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            
+            // Copy the invalid part of the cached background
+            RECT rect;
+            GetClientRect(hWnd, &rect);
+            HDC background = g_gdi.Gradient(hdc, rect.right, rect.bottom, COLOR_BG, RGB(20, 20, 25));
+            BitBlt(hdc, ps.rcPaint.left, ps.rcPaint.top, ps.rcPaint.right - ps.rcPaint.left,
+                ps.rcPaint.bottom - ps.rcPaint.top, background, ps.rcPaint.left, ps.rcPaint.top, SRCCOPY);
+            g_paintBackground.Add(CoreMicrosecondsSince(start));
+            
+            EndPaint(hWnd, &ps);
+            break;
+        }
+        
+        case WM_ERASEBKGND:
+            return 1;   // WM_PAINT covers the whole client area
+        
+        case WM_SYSCOMMAND:
+            if ((wParam & 0xFFF0) == IDM_PAINT_STATS) {
+                AddLog(g_paintBackground.Format());
+                AddLog(g_paintButtons.Format());
+                g_paintBackground.Reset();
+                g_paintButtons.Reset();
+                return 0;
+            }
+            if ((wParam & 0xFFF0) == IDM_COMMAND_STATS) {
+                OpenStatsView();
+                return 0;
+            }
+            return DefWindowProc(hWnd, message, wParam, lParam);
+
+        case WM_CTLCOLORSTATIC: {
+            HDC hdcStatic = (HDC)wParam;
+            SetTextColor(hdcStatic, COLOR_TEXT);
+            SetBkMode(hdcStatic, TRANSPARENT);
+            return (LRESULT)GetStockObject(NULL_BRUSH);
+        }
+        
+        case WM_DESTROY:
+            g_tracker.Stop();
+            g_logcat.StopAll();
+            g_jobs.Stop();
+            g_running = false;
+            AddLog(g_paintBackground.Format());
+            AddLog(g_paintButtons.Format());
+            g_gdi.Release();
+            PostQuitMessage(0);
+            break;
+            
+        default:
+            return DefWindowProc(hWnd, message, wParam, lParam);
+    }
+    return 0;
+}
+
+// Streaming process executor
+// The child's stdout/stderr go to an overlapped named pipe that is read while
+// the child runs, so output is delivered in chunks as it arrives and a chatty
+// child can never fill the pipe and stall. The child runs inside a job object:
+// on timeout or cancellation the whole tree (cmd.exe, adb.exe, ...) is
+// terminated, and closing the job kills anything left behind. Helpers that
+// detach on purpose (the adb server) may break away from the job.
+static std::atomic<unsigned int> g_pipeSerial(0);
+
+static ProcessResult LaunchAndStream(const char* appName, const std::string& cmdLine,
+                                     const OutputCallback& onOutput, DWORD timeoutMs) {
+    ProcessResult result;
+    if (cmdLine.size() >= MAX_COMMAND_LINE) {
+        result.error = "Error: Command too long";
+        return result;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    
+    char pipeName[64];
+    snprintf(pipeName, sizeof(pipeName), "\\\\.\\pipe\\s23mgr.%lu.%u",
+        GetCurrentProcessId(), g_pipeSerial++);
+    HANDLE hRead = CreateNamedPipeA(pipeName, PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED |
+        FILE_FLAG_FIRST_PIPE_INSTANCE, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+        1, PROCESS_PIPE_BUFFER, PROCESS_PIPE_BUFFER, 0, NULL);
+    if (hRead == INVALID_HANDLE_VALUE) {
+        result.error = "Error: Failed to create pipe";
+        return result;
+    }
+    
+    SECURITY_ATTRIBUTES sa;
+    sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+    sa.bInheritHandle = TRUE;
+    sa.lpSecurityDescriptor = NULL;
+    HANDLE hWrite = CreateFileA(pipeName, GENERIC_WRITE, 0, &sa, OPEN_EXISTING, 0, NULL);
+    if (hWrite == INVALID_HANDLE_VALUE) {
+        CloseHandle(hRead);
+        result.error = "Error: Failed to create pipe";
+        return result;
+    }
+    
+    HANDLE hJob = CreateJobObjectA(NULL, NULL);
+    if (hJob) {
+        JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+        ZeroMemory(&limits, sizeof(limits));
+        limits.BasicLimitInformation.LimitFlags =
+            JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE | JOB_OBJECT_LIMIT_BREAKAWAY_OK;
+        SetInformationJobObject(hJob, JobObjectExtendedLimitInformation, &limits, sizeof(limits));
+    }
+    
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    si.hStdError = hWrite;
+    si.hStdOutput = hWrite;
+    si.dwFlags |= STARTF_USESTDHANDLES | STARTF_USESHOWWINDOW;
+    si.wShowWindow = SW_HIDE;
+    ZeroMemory(&pi, sizeof(pi));
+    
+    std::vector<char> cmdBuf(cmdLine.begin(), cmdLine.end());
+    cmdBuf.push_back('\0');
+    
+    if (!CreateProcessA(appName, &cmdBuf[0], NULL, NULL, TRUE, CREATE_SUSPENDED,
+            NULL, NULL, &si, &pi)) {
+        CloseHandle(hWrite);
+        CloseHandle(hRead);
+        if (hJob) CloseHandle(hJob);
+        result.error = "Error: Failed to execute command";
+        RecordProcessSample(cmdLine, -1, -1, CoreMicrosecondsSince(start), 0, false, true);
+        return result;
+    }
+    if (hJob) AssignProcessToJobObject(hJob, pi.hProcess);
+    ResumeThread(pi.hThread);
+    long long spawnUs = CoreMicrosecondsSince(start), firstByteUs = -1;
+    CloseHandle(pi.hThread);
+    // Only the child holds the write end now, so EOF means it is done writing
+    CloseHandle(hWrite);
+    result.started = true;
+    
+    OVERLAPPED ov;
+    ZeroMemory(&ov, sizeof(ov));
+    ov.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    PooledChunk buffer;
+    
+    bool eof = false, exited = false, killed = false, pending = false;
+    std::chrono::steady_clock::time_point drainDeadline;
+    while (!eof) {
+        if (!pending) {
+            ResetEvent(ov.hEvent);
+            if (!ReadFile(hRead, buffer.Data(), (DWORD)buffer.Size(), NULL, &ov) &&
+                GetLastError() != ERROR_IO_PENDING) {
+                break;  // broken pipe: every writer has gone away
+            }
+            pending = true;
+        }
+        
+        HANDLE handles[2] = { ov.hEvent, pi.hProcess };
+        DWORD wait = WaitForMultipleObjects(exited ? 1 : 2, handles, FALSE, PROCESS_POLL_MS);
+        if (wait == WAIT_OBJECT_0) {
+            pending = false;
+            DWORD bytesRead = 0;
+            if (!GetOverlappedResult(hRead, &ov, &bytesRead, FALSE)) {
+                eof = true;
+            } else if (bytesRead > 0) {
+                if (result.bytes == 0) {
+                    firstByteUs = CoreMicrosecondsSince(start);
+                    result.firstByteMs = firstByteUs / 1000;
+                }
+                result.bytes += bytesRead;
+                if (onOutput) onOutput(buffer.Data(), bytesRead);
+            }
+        } else if (wait == WAIT_OBJECT_0 + 1) {
+            // Grandchildren may still hold the pipe; give them a moment to
+            // flush, then stop reading.
+            exited = true;
+            drainDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(PROCESS_DRAIN_MS);
+        } else if (wait != WAIT_TIMEOUT) {
+            break;
+        }
+        
+        // Checked on every pass: a child (or grandchild) that writes more
+        // often than PROCESS_POLL_MS never lets the wait time out
+        if (exited && std::chrono::steady_clock::now() > drainDeadline) break;
+        if (!killed && !exited) {
+            bool timedOut = timeoutMs != INFINITE && (DWORD)CoreMillisecondsSince(start) > timeoutMs;
+            if (timedOut || CurrentJobCancelled()) {
+                result.timedOut = timedOut;
+                result.cancelled = !timedOut;
+                killed = true;
+                if (hJob) TerminateJobObject(hJob, 1);
+                else TerminateProcess(pi.hProcess, 1);
+            }
+        }
+    }
+    
+    if (pending) {
+        DWORD ignored;
+        CancelIoEx(hRead, &ov);
+        GetOverlappedResult(hRead, &ov, &ignored, TRUE);
+    }
+    
+    if (WaitForSingleObject(pi.hProcess, killed ? 1000 : 0) == WAIT_OBJECT_0) {
+        GetExitCodeProcess(pi.hProcess, &result.exitCode);
+    }
+    long long totalUs = CoreMicrosecondsSince(start);
+    result.totalMs = totalUs / 1000;
+    RecordProcessSample(cmdLine, spawnUs, firstByteUs, totalUs, result.bytes, result.timedOut,
+        result.timedOut || result.cancelled || result.exitCode != 0);
+    
+    CloseHandle(ov.hEvent);
+    CloseHandle(pi.hProcess);
+    CloseHandle(hRead);
+    if (hJob) CloseHandle(hJob);  // kills whatever is left of the tree
+    return result;
+}
+
+// Runs a raw command line (used for the cmd.exe shim)
+ProcessResult RunProcess(const std::string& cmdLine, const OutputCallback& onOutput, DWORD timeoutMs) {
+    return LaunchAndStream(NULL, cmdLine, onOutput, timeoutMs);
+}
+
+// Launches argv[0] directly, without cmd.exe; a full path in argv[0] skips
+// the executable search entirely
+ProcessResult RunProcess(const std::vector<std::string>& argv, const OutputCallback& onOutput, DWORD timeoutMs) {
+    if (argv.empty()) {
+        ProcessResult result;
+        result.error = "Error: Empty command";
+        return result;
+    }
+    bool isPath = argv[0].find_first_of("\\/:") != std::string::npos;
+    return LaunchAndStream(isPath ? argv[0].c_str() : NULL, BuildCommandLine(argv), onOutput, timeoutMs);
+}
+
+// Finds a platform tool in the current directory, next to this executable
+// or on PATH. Done once at startup; commands then launch the full path.
+std::string ResolveTool(const char* name) {
+    char path[MAX_PATH];
+    DWORD len = GetFullPathNameA(name, MAX_PATH, path, NULL);
+    if (len > 0 && len < MAX_PATH && GetFileAttributesA(path) != INVALID_FILE_ATTRIBUTES) {
+        return path;
+    }
+    len = SearchPathA(NULL, name, NULL, MAX_PATH, path, NULL);
+    if (len > 0 && len < MAX_PATH) {
+        return path;
+    }
+    return "";
+}
+
+// Maps "adb ..."/"fastboot ..." onto the resolved tool; returns an empty
+// vector for anything else, which still goes through cmd.exe
+std::vector<std::string> ToolArgv(const std::string& cmd) {
+    std::vector<std::string> argv = SplitCommandLine(cmd);
+    if (argv.empty()) return argv;
+    if (argv[0] == "adb" && !g_adbPath.empty()) {
+        argv[0] = g_adbPath;
+    } else if (argv[0] == "fastboot" && !g_fastbootPath.empty()) {
+        argv[0] = g_fastbootPath;
+    } else {
+        argv.clear();
+    }
+    return argv;
+}
+
+// Spawn latency benchmark:
+//   frpunlock.exe --bench-spawn [iterations] [stand-in.exe]
+// Compares the old cmd.exe shim against direct launch. The stand-in defaults
+// to this executable started with --noop, which exits immediately.
+static std::string SpawnStats(const char* label, std::vector<double>& samples) {
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (size_t i = 0; i < samples.size(); i++) sum += samples[i];
+    char line[256];
+    snprintf(line, sizeof(line), "%-14s min %7.2f  median %7.2f  p95 %7.2f  mean %7.2f ms\r\n",
+        label, samples.front(), samples[samples.size() / 2],
+        samples[(samples.size() * 95) / 100 < samples.size() ? (samples.size() * 95) / 100 : samples.size() - 1],
+        sum / samples.size());
+    return line;
+}
+
+std::string BenchmarkSpawn(int iterations, std::string standIn) {
+    if (iterations < 1) iterations = 1;
+    if (standIn.empty()) {
+        char self[MAX_PATH];
+        GetModuleFileNameA(NULL, self, MAX_PATH);
+        standIn = self;
+    }
+    std::vector<std::string> argv;
+    argv.push_back(standIn);
+    argv.push_back("--noop");
+    std::string shimLine = "cmd.exe /c " + BuildCommandLine(argv);
+    
+    std::vector<double> viaShell, direct;
+    for (int i = 0; i < iterations; i++) {
+        // Interleave so both paths see the same cache/AV conditions
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        ProcessResult a = RunProcess(shimLine, OutputCallback(), PROCESS_DEFAULT_TIMEOUT_MS);
+        std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+        ProcessResult b = RunProcess(argv, OutputCallback(), PROCESS_DEFAULT_TIMEOUT_MS);
+        std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+        if (!a.started || !b.started) {
+            return "Spawn benchmark failed: " + (a.started ? b.error : a.error) + "\r\n";
+        }
+        viaShell.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+        direct.push_back(std::chrono::duration<double, std::milli>(t2 - t1).count());
+    }
+    
+    std::string report = "Spawn latency, " + std::to_string(iterations) + " runs of " + standIn + "\r\n";
+    double shimMedian, directMedian;
+    report += SpawnStats("cmd.exe /c", viaShell);
+    report += SpawnStats("direct", direct);
+    shimMedian = viaShell[viaShell.size() / 2];
+    directMedian = direct[direct.size() / 2];
+    char speedup[64];
+    snprintf(speedup, sizeof(speedup), "speedup (median) %.2fx\r\n",
+        directMedian > 0 ? shimMedian / directMedian : 0.0);
+    return report + speedup;
+}
+
+// Helper function to execute shell commands
+std::string ExecuteCommand(const char* cmd, bool wait) {
+    std::vector<std::string> argv = ToolArgv(cmd);
+    std::string cmdLine = argv.empty() ? std::string("cmd.exe /c ") + cmd : BuildCommandLine(argv);
+    
+    if (!wait) {
+        // Fire and forget: not tied to a job object, so it outlives us
+        STARTUPINFOA si;
+        PROCESS_INFORMATION pi;
+        ZeroMemory(&si, sizeof(si));
+        si.cb = sizeof(si);
+        si.dwFlags = STARTF_USESHOWWINDOW;
+        si.wShowWindow = SW_HIDE;
+        std::vector<char> cmdBuf(cmdLine.begin(), cmdLine.end());
+        cmdBuf.push_back('\0');
+        if (!CreateProcessA(argv.empty() ? NULL : argv[0].c_str(), &cmdBuf[0], NULL, NULL,
+                FALSE, 0, NULL, NULL, &si, &pi)) {
+            return "Error: Failed to execute command";
+        }
+        CloseHandle(pi.hProcess);
+        CloseHandle(pi.hThread);
+        return "";
+    }
+    
+    OutputCollector output;
+    ProcessResult pr = argv.empty() ? RunProcess(cmdLine, output.Callback(), DefaultCommandTimeout()) :
+        RunProcess(argv, output.Callback(), DefaultCommandTimeout());
+    if (!pr.started) return pr.error;
+    
+    return output.Normalized();
+}
+
+void AddLog(const std::string& msg) {
+    g_journal.Write(JOURNAL_LOG, CurrentJobSerial(), msg.data(), msg.size(),
+        t_currentJob ? t_currentJob->Id() : 0);
+    ShowLog(msg);
+}
+
+// Log view only, not journaled
+void ShowLog(const std::string& msg) {
+    unsigned long long now = CurrentFileTime();
+    
+    // One record per line; the log view has no notion of embedded newlines
+    size_t start = 0;
+    do {
+        size_t eol = msg.find('\n', start);
+        if (eol == std::string::npos) eol = msg.size();
+        size_t end = (eol > start && msg[eol - 1] == '\r') ? eol - 1 : eol;
+        g_logQueue.Push([&](LogRecord& rec) {
+            rec.time = now;
+            rec.text.assign(msg.data() + start, end - start);
+        });
+        start = eol + 1;
+    } while (start < msg.size());
+    
+    // A failed post (no window yet, queue full) must not leave the flag set,
+    // or no later line would ever schedule a flush
+    if (!g_logFlushPending.exchange(true) && !PostMessage(g_hWnd, WM_UPDATE_LOG, 0, 0)) {
+        g_logFlushPending = false;
+    }
+}
+
+void ClearLog() {
+    // Drop anything still queued along with the ring
+    LogRecord rec;
+    while (g_logQueue.Pop(rec)) {}
+    g_logQueue.TakeDropped();
+    g_logRing.Clear();
+    ListView_SetItemCountEx(g_hLog, 0, 0);
+    AddLog("Log cleared");
+}
+
+// Scan worker: lists ADB and fastboot transports concurrently, then probes
+// every ADB device on the pool. Each device is posted to the window as soon
+// as it is identified, so the scan takes as long as the slowest device.
+static void DiscoverDevices(JobContext& ctx) {
+    std::chrono::steady_clock::time_point scanStart = std::chrono::steady_clock::now();
+    std::atomic<int> found(0);
+    std::atomic<int> probesQueued(0), probesDone(0);
+    unsigned int cores = std::thread::hardware_concurrency();
+    WorkerPool pool(cores > 0 && cores < DISCOVERY_MAX_WORKERS ? cores : DISCOVERY_MAX_WORKERS);
+    
+    auto post = [&](DetectedDevice* dev) {
+        dev->elapsedMs = CoreMillisecondsSince(scanStart);
+        found++;
+        PostMessage(g_hWnd, WM_DEVICE_DETECTED, 0, (LPARAM)dev);
+    };
+    
+    // Check ADB devices
+    pool.Submit([&]() {
+        std::vector<AdbDevice> adbDevices = ParseAdbDevices(RunADBCommand("devices -l"));
+        ctx.Progress(50);
+        
+        for (size_t d = 0; d < adbDevices.size(); d++) {
+            DetectedDevice* dev = new DetectedDevice();
+            dev->transport = "ADB";
+            dev->serial = adbDevices[d].serial;
+            dev->state = adbDevices[d].state;
+            dev->probeMs = 0;
+            if (dev->state != "device") {
+                g_props.Invalidate(dev->serial);
+                post(dev);  // unauthorized/offline devices cannot be queried
+                continue;
+            }
+            probesQueued++;
+            pool.Submit([dev, &post, &ctx, &probesQueued, &probesDone]() {
+                if (ctx.Cancelled()) {
+                    delete dev;
+                    return;
+                }
+                std::chrono::steady_clock::time_point probeStart = std::chrono::steady_clock::now();
+                std::string model = RunADBCommand("-s " + dev->serial + " shell getprop ro.product.model");
+                // Trim newlines
+                model.erase(model.find_last_not_of("\r\n") + 1);
+                dev->model = model;
+                dev->probeMs = CoreMillisecondsSince(probeStart);
+                CommandSample probe;
+                probe.command = "probe";
+                probe.serial = dev->serial;
+                probe.totalUs = CoreMicrosecondsSince(probeStart);
+                probe.failed = model.empty();
+                g_commandStats.Record(probe);
+                post(dev);
+                ctx.Progress(50 + 50 * ++probesDone / probesQueued);
+            });
+        }
+    });
+    
+    // Check Fastboot devices
+    pool.Submit([&]() {
+        std::vector<AdbDevice> fbDevices = ParseFastbootDevices(ExecuteCommand("fastboot devices"));
+        for (size_t d = 0; d < fbDevices.size(); d++) {
+            DetectedDevice* dev = new DetectedDevice();
+            dev->transport = "FASTBOOT";
+            dev->serial = fbDevices[d].serial;
+            dev->state = fbDevices[d].state;
+            dev->probeMs = 0;
+            post(dev);
+        }
+    });
+    
+    pool.Wait();
+    PostMessage(g_hWnd, WM_DEVICE_SCAN_DONE, (WPARAM)found.load(), (LPARAM)CoreMillisecondsSince(scanStart));
+}
+
+// Starts a device scan job; results stream in via WM_DEVICE_DETECTED
+void DetectDevices() {
+    if (g_scanActive.exchange(true)) {
+        AddLog("Device scan already in progress");
+        return;
+    }
+    AddLog("Scanning for devices...");
+    
+    // Clear list
+    ClearDeviceRows();
+    
+    g_scanJob = g_jobs.Submit("Detect devices", "scan", [](JobContext& ctx) {
+        ctx.Progress(10);
+        DiscoverDevices(ctx);
+    });
+}
+
+static void LogIdentifiedDevice(const DetectedDevice& dev, const std::string& timing) {
+    AddLog("Found device: " + dev.model + " (" + timing + ")");
+    
+    CatalogMatch match;
+    if (g_catalog.Find(dev.model, match)) {
+        std::string variant = match.suffix;
+        if (match.region) variant += std::string(" ") + match.region;
+        AddLog(std::string(match.record.name) + " (" + match.record.codename + ", " +
+            match.record.chipset + ")" + (variant.empty() ? "" : ", variant " + variant) +
+            "; partitions: " + FormatCatalogFlags(match.record.flags));
+    }
+}
+
+// Adds a scanned device to the list (UI thread)
+void OnDeviceDetected(DetectedDevice* dev) {
+    if (dev->transport == "FASTBOOT") {
+        AddLog("Device in fastboot mode: " + dev->serial);
+    } else if (dev->state != "device") {
+        AddLog("Device " + dev->serial + " is " + dev->state);
+    } else {
+        LogIdentifiedDevice(*dev, "probe " + std::to_string(dev->probeMs) +
+            " ms, +" + std::to_string(dev->elapsedMs) + " ms");
+    }
+    UpsertDeviceRow(*dev);
+}
+
+// Applies a tracker event to the list (UI thread)
+void OnDeviceEvent(DeviceEvent* ev) {
+    const DetectedDevice& dev = ev->device;
+    std::string name = "[" + dev.transport + "] " + dev.serial;
+    switch (ev->kind) {
+        case DEVICE_EVENT_ATTACHED:
+            AddLog("Device attached: " + name + " (" + dev.state + ")");
+            UpsertDeviceRow(dev);
+            break;
+            
+        case DEVICE_EVENT_CHANGED:
+            if (dev.state != ev->previousState) {
+                AddLog("Device " + name + ": " + ev->previousState + " -> " + dev.state);
+                g_props.Invalidate(dev.serial);
+                g_shellSessions.Forget(dev.serial);
+                g_fastbootInfo.Invalidate(dev.serial);
+            }
+            UpsertDeviceRow(dev);
+            break;
+            
+        case DEVICE_EVENT_PROBED: {
+            // The device may have left or changed state while it was probed
+            int index = FindDeviceRow(dev.transport, dev.serial);
+            if (index < 0 || g_deviceRows[index].state != dev.state) break;
+            if (!dev.model.empty()) LogIdentifiedDevice(dev, "probe " + std::to_string(dev.probeMs) + " ms");
+            UpsertDeviceRow(dev);
+            break;
+        }
+            
+        case DEVICE_EVENT_DETACHED:
+            AddLog("Device detached: " + name);
+            RemoveDeviceRow(dev.transport, dev.serial);
+            g_adb.ForgetDevice(dev.serial);
+            g_props.Invalidate(dev.serial);
+            g_fastbootInfo.Invalidate(dev.serial);
+            g_shellSessions.Forget(dev.serial);
+            break;
+    }
+}
+
+// Runs an adb command line (without the leading "adb"), natively through the
+// adb server when possible, otherwise by spawning adb.exe
+std::string RunADBCommand(const std::string& args) {
+    OutputCollector output;
+    StreamADBCommand(args, output.Callback());
+    return output.Normalized();
+}
+
+// Same as RunADBCommand, but output is delivered as it arrives. Returns the
+// command's exit code, or -1 when it is unknown.
+int StreamADBCommand(const std::string& args, const OutputCallback& onOutput) {
+    std::string serial, verb, rest;
+    ParseAdbArgs(args, serial, verb, rest);
+    if (verb == "reboot" || verb == "root" || verb == "unroot") {
+        // Properties change across a reboot; adbd restarts for root/unroot
+        if (serial.empty()) {
+            g_props.InvalidateAll();
+            g_shellSessions.ForgetAll();
+        } else {
+            g_props.Invalidate(serial);
+            g_shellSessions.Forget(serial);
+        }
+    }
+    
+    JournalCommand journal(serial, "adb " + args);
+    OutputCallback output = journal.Tee(onOutput);
+    
+    std::string result;
+    int exitCode = -1;
+    if (AdbNativeCommand(args, result, &exitCode, &output)) {
+        if (!result.empty()) output(result.data(), result.size());
+        return journal.Exit(exitCode);
+    }
+    if (g_adbPath.empty()) {
+        static const char notFound[] = "ERROR: ADB not found!";
+        output(notFound, sizeof(notFound) - 1);
+        return journal.Exit(-1);
+    }
+    std::vector<std::string> argv = SplitCommandLine(args);
+    argv.insert(argv.begin(), g_adbPath);
+    ProcessResult pr = RunProcess(argv, output, DefaultCommandTimeout());
+    if (!pr.started) {
+        output(pr.error.data(), pr.error.size());
+        return journal.Exit(-1);
+    }
+    return journal.Exit((int)pr.exitCode);
+}
+
+// Runs a command line, streaming its output. adb/fastboot are launched
+// directly; anything else goes through cmd.exe.
+int StreamCommand(const std::string& cmd, const OutputCallback& onOutput) {
+    std::string key = CommandDeviceKey(cmd);
+    JournalCommand journal(key.substr(key.find(':') + 1), cmd);
+    OutputCallback output = journal.Tee(onOutput);
+    
+    std::vector<std::string> argv = ToolArgv(cmd);
+    ProcessResult pr = argv.empty() ?
+        RunProcess("cmd.exe /c " + cmd, output, DefaultCommandTimeout()) :
+        RunProcess(argv, output, DefaultCommandTimeout());
+    if (!pr.started) {
+        output(pr.error.data(), pr.error.size());
+        return journal.Exit(-1);
+    }
+    return journal.Exit((int)pr.exitCode);
+}
+
+void ExecuteADBCommand(const std::string& cmd) {
+    LogLineSink sink;
+    StreamADBCommand(cmd, sink.Callback());
+}
+
+// Job serialization key for a command line: one queue per targeted device
+std::string CommandDeviceKey(const std::string& cmd) {
+    std::istringstream stream(cmd);
+    std::string tool, flag, serial;
+    stream >> tool >> flag;
+    if (flag == "-s") stream >> serial;
+    return tool + ":" + serial;
+}
+
+// Key for a job submitted from the UI thread. adb without -s runs on the
+// only attached device, so when the device list shows exactly one adb device
+// the job is keyed by its serial and queues behind that device's -s jobs.
+// Reads the list only; no device I/O on the UI thread.
+std::string SubmitDeviceKey(const std::string& cmd) {
+    std::string key = CommandDeviceKey(cmd);
+    if (key != "adb:") return key;
+    std::string serial;
+    for (size_t i = 0; i < g_deviceRows.size(); i++) {
+        if (g_deviceRows[i].transport != "ADB" || g_deviceRows[i].state != "device") continue;
+        if (!serial.empty()) return key;        // several: adb would refuse anyway
+        serial = g_deviceRows[i].serial;
+    }
+    return key + serial;
+}
+
+void SubmitADBCommand(const std::string& cmd) {
+    g_jobs.Submit("adb " + cmd, SubmitDeviceKey("adb " + cmd), [cmd](JobContext&) {
+        ExecuteADBCommand(cmd);
+    });
+}
+
+void SubmitFastbootCommand(const std::string& cmd) {
+    g_jobs.Submit("fastboot " + cmd, SubmitDeviceKey("fastboot " + cmd), [cmd](JobContext&) {
+        ExecuteFastbootCommand(cmd);
+    });
+}
+
+void ExecuteFastbootCommand(const std::string& cmd) {
+    if (cmd.compare(0, 6, "reboot") == 0 || cmd.compare(0, 8, "flashing") == 0) {
+        // The device comes back in adb with fresh properties
+        g_props.InvalidateAll();
+        g_fastbootInfo.InvalidateAll();
+    }
+    if (cmd.find("flash ") != std::string::npos && FlashRawImage(cmd)) return;
+    LogLineSink sink;
+    StreamFastbootCommand(cmd, sink.Callback());
+}
+
+// Firmware package verification
+// Samsung .tar.md5 packages are a tar archive followed by one text line,
+// "<md5 hex>  <name>\n", whose MD5 covers everything before that line.
+// The verifier reads the package unbuffered through a small ring of aligned
+// overlapped reads, so the disk stays busy while the previous chunk is
+// hashed. Each package is its own job, so picking BL/AP/CP/CSC together
+// verifies them concurrently on separate workers.
+#define VERIFY_CHUNK_SIZE (4 * 1024 * 1024)
+#define VERIFY_QUEUE_DEPTH 4
+#define VERIFY_TIMEOUT_MS (30 * 60 * 1000)
+#define VERIFY_TRAILER_MAX 4096
+
+struct VerifyResult {
+    std::string path;
+    bool ok;
+    bool hasChecksum;           // false for a plain .tar; actual is still filled
+    std::string expected;
+    std::string actual;
+    uint64_t bytes;             // bytes hashed
+    long long elapsedMs;
+    std::string error;
+    
+    VerifyResult() : ok(false), hasChecksum(false), bytes(0), elapsedMs(0) {}
+};
+
+static bool IsHexDigest(const char* p, size_t len) {
+    if (len < 32) return false;
+    for (size_t i = 0; i < 32; i++) {
+        if (!isxdigit((unsigned char)p[i])) return false;
+    }
+    return len == 32 || p[32] == ' ' || p[32] == '\t' || p[32] == '\r' || p[32] == '\n';
+}
+
+// Locates the "<md5>  <name>" line at the end of the package. Tar archives
+// are 512-byte aligned, so the line normally starts at the last 512 boundary;
+// otherwise fall back to the start of the last line.
+static bool ReadPackageTrailer(const std::string& path, uint64_t size,
+                               uint64_t& hashedLen, std::string& expected) {
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    size_t tailLen = (size_t)std::min<uint64_t>(size, VERIFY_TRAILER_MAX);
+    std::string tail(tailLen, '\0');
+    LARGE_INTEGER offset;
+    offset.QuadPart = (LONGLONG)(size - tailLen);
+    DWORD got = 0;
+    bool read = SetFilePointerEx(file, offset, NULL, FILE_BEGIN) &&
+        ReadFile(file, &tail[0], (DWORD)tailLen, &got, NULL) && got == tailLen;
+    CloseHandle(file);
+    if (!read) return false;
+    
+    uint64_t tailStart = size - tailLen;
+    uint64_t aligned = size & ~(uint64_t)511;
+    size_t start;
+    if (aligned >= tailStart && aligned < size &&
+        IsHexDigest(tail.data() + (aligned - tailStart), (size_t)(size - aligned))) {
+        start = (size_t)(aligned - tailStart);
+    } else {
+        size_t end = tail.find_last_not_of("\r\n");
+        if (end == std::string::npos) return false;
+        size_t eol = tail.rfind('\n', end);
+        start = eol == std::string::npos ? 0 : eol + 1;
+        if (!IsHexDigest(tail.data() + start, tailLen - start)) return false;
+    }
+    hashedLen = tailStart + start;
+    expected = tail.substr(start, 32);
+    std::transform(expected.begin(), expected.end(), expected.begin(), ::tolower);
+    return true;
+}
+
+// Hashes the package through VERIFY_QUEUE_DEPTH overlapped reads in flight.
+// ctx (may be NULL) supplies cancellation and progress.
+VerifyResult VerifyPackage(const std::string& path, JobContext* ctx) {
+    VerifyResult r;
+    r.path = path;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    
+    // Unbuffered reads skip the cache copy; some network shares refuse them
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+            FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    }
+    if (file == INVALID_HANDLE_VALUE) {
+        r.error = "cannot open (error " + std::to_string(GetLastError()) + ")";
+        return r;
+    }
+    LARGE_INTEGER size;
+    GetFileSizeEx(file, &size);
+    
+    uint64_t hashedLen = (uint64_t)size.QuadPart;
+    r.hasChecksum = ReadPackageTrailer(path, hashedLen, hashedLen, r.expected);
+    
+    // VirtualAlloc is page aligned, which satisfies unbuffered I/O
+    char* buffers = (char*)VirtualAlloc(NULL, (SIZE_T)VERIFY_CHUNK_SIZE * VERIFY_QUEUE_DEPTH,
+        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    OVERLAPPED ov[VERIFY_QUEUE_DEPTH];
+    bool pending[VERIFY_QUEUE_DEPTH];
+    for (int i = 0; i < VERIFY_QUEUE_DEPTH; i++) {
+        ZeroMemory(&ov[i], sizeof(OVERLAPPED));
+        ov[i].hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+        pending[i] = false;
+    }
+    
+    uint64_t nextOffset = 0;
+    auto issue = [&](int slot) -> bool {
+        if (nextOffset >= hashedLen) return true;
+        ov[slot].Offset = (DWORD)nextOffset;
+        ov[slot].OffsetHigh = (DWORD)(nextOffset >> 32);
+        ResetEvent(ov[slot].hEvent);
+        nextOffset += VERIFY_CHUNK_SIZE;
+        if (!ReadFile(file, buffers + (size_t)slot * VERIFY_CHUNK_SIZE, VERIFY_CHUNK_SIZE, NULL, &ov[slot]) &&
+            GetLastError() != ERROR_IO_PENDING) {
+            return false;
+        }
+        pending[slot] = true;
+        return true;
+    };
+    
+    Md5 md5;
+    bool ioOk = buffers != NULL;
+    for (int i = 0; ioOk && i < VERIFY_QUEUE_DEPTH; i++) ioOk = issue(i);
+    
+    // Completions are consumed in issue order, so the hash sees the file in order
+    int lastPercent = -1;
+    for (int slot = 0; ioOk && r.bytes < hashedLen; slot = (slot + 1) % VERIFY_QUEUE_DEPTH) {
+        if (ctx && ctx->Cancelled()) {
+            r.error = "cancelled";
+            break;
+        }
+        DWORD got = 0;
+        BOOL done = GetOverlappedResult(file, &ov[slot], &got, TRUE);
+        pending[slot] = false;
+        if (!done || got == 0) {
+            r.error = "read failed at offset " + std::to_string(r.bytes);
+            break;
+        }
+        size_t use = (size_t)std::min<uint64_t>(got, hashedLen - r.bytes);
+        md5.Update(buffers + (size_t)slot * VERIFY_CHUNK_SIZE, use);
+        r.bytes += use;
+        ioOk = issue(slot);
+        
+        int percent = (int)(r.bytes * 100 / hashedLen);
+        if (ctx && percent != lastPercent) {
+            ctx->Progress(percent);
+            lastPercent = percent;
+        }
+    }
+    if (!ioOk && r.error.empty()) {
+        r.error = "read failed (error " + std::to_string(GetLastError()) + ")";
+    }
+    
+    // Outstanding reads must finish before their buffers go away
+    CancelIo(file);
+    for (int i = 0; i < VERIFY_QUEUE_DEPTH; i++) {
+        DWORD got;
+        if (pending[i]) GetOverlappedResult(file, &ov[i], &got, TRUE);
+        CloseHandle(ov[i].hEvent);
+    }
+    if (buffers) VirtualFree(buffers, 0, MEM_RELEASE);
+    CloseHandle(file);
+    
+    r.elapsedMs = CoreMillisecondsSince(start);
+    if (r.error.empty()) {
+        r.actual = md5.HexDigest();
+        r.ok = r.hasChecksum && r.actual == r.expected;
+    }
+    return r;
+}
+
+static std::string FileBaseName(const std::string& path) {
+    size_t slash = path.find_last_of("\\/");
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+std::string FormatVerifyResult(const VerifyResult& r) {
+    std::ostringstream out;
+    out << FileBaseName(r.path) << ": ";
+    if (!r.error.empty()) {
+        out << "ERROR " << r.error;
+        return out.str();
+    }
+    if (!r.hasChecksum) out << "no embedded MD5, computed " << r.actual;
+    else if (r.ok) out << "MD5 OK";
+    else out << "MD5 MISMATCH (expected " << r.expected << ", got " << r.actual << ")";
+    double seconds = r.elapsedMs / 1000.0;
+    out << std::fixed << std::setprecision(1) << " - " << r.bytes / (1024.0 * 1024.0)
+        << " MB in " << seconds << " s";
+    if (seconds > 0) out << ", " << r.bytes / (1024.0 * 1024.0) / seconds << " MB/s";
+    return out.str();
+}
+
+void SubmitPackageVerify(const std::string& path) {
+    g_jobs.Submit("Verify " + FileBaseName(path), "verify:" + path, [path](JobContext& ctx) {
+        AddLog("Verifying " + FileBaseName(path) + "...");
+        AddLog(FormatVerifyResult(VerifyPackage(path, &ctx)));
+    }, VERIFY_TIMEOUT_MS);
+}
+
+// Command line: --verify <package>... verifies all packages concurrently
+std::string VerifyPackagesReport(const std::vector<std::string>& paths) {
+    if (paths.empty()) return "Usage: --verify <package.tar.md5>...\n";
+    std::vector<VerifyResult> results(paths.size());
+    std::vector<std::thread> threads;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < paths.size(); i++) {
+        threads.push_back(std::thread([&results, &paths, i] {
+            results[i] = VerifyPackage(paths[i], NULL);
+        }));
+    }
+    uint64_t total = 0;
+    std::string report;
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+        total += results[i].bytes;
+        report += FormatVerifyResult(results[i]) + "\n";
+    }
+    long long ms = CoreMillisecondsSince(start);
+    if (paths.size() > 1 && ms > 0) {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1) << "Total: " << total / (1024.0 * 1024.0)
+            << " MB in " << ms / 1000.0 << " s, " << total / (1024.0 * 1024.0) / (ms / 1000.0)
+            << " MB/s\n";
+        report += out.str();
+    }
+    return report;
+}
+
+// Firmware package index
+// Lists the members of a tar package by walking only its 512-byte headers
+// through a sliding memory-mapped window; member data is never read. Indexes
+// are cached in cache\ next to the executable, keyed by the package's size
+// and modification time, so reopening the same package skips the scan.
+#define TAR_WINDOW_SIZE (16 * 1024 * 1024)
+#define TAR_MAP_GRANULARITY 65536       // Windows allocation granularity
+#define PACKAGE_INDEX_MAGIC 0x49333253  // "S23I"
+#define PACKAGE_INDEX_VERSION 1
+
+struct PackageIndex {
+    std::string path;
+    uint64_t fileSize;
+    uint64_t mtime;             // FILETIME ticks of the last write
+    std::vector<TarMember> members;
+    bool fromCache;
+    long long elapsedMs;
+    
+    PackageIndex() : fileSize(0), mtime(0), fromCache(false), elapsedMs(0) {}
+    
+    const TarMember* Find(const std::string& name) const {
+        for (size_t i = 0; i < members.size(); i++) {
+            if (members[i].name == name) return &members[i];
+        }
+        return NULL;
+    }
+};
+
+// Read-only view onto [offset, offset + len) of a file, remapped on demand
+class FileWindow {
+public:
+    FileWindow() : file(INVALID_HANDLE_VALUE), mapping(NULL), view(NULL),
+                   viewStart(0), viewLen(0), fileSize(0) {}
+    ~FileWindow() { Close(); }
+    
+    bool Open(const std::string& path) {
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER size;
+        GetFileSizeEx(file, &size);
+        fileSize = (uint64_t)size.QuadPart;
+        mapping = fileSize ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+        return mapping != NULL;
+    }
+    
+    void Close() {
+        if (view) UnmapViewOfFile(view);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        view = NULL;
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+    }
+    
+    uint64_t Size() const { return fileSize; }
+    
+    // NULL when the range runs past the end of the file
+    const char* Map(uint64_t offset, size_t len) {
+        if (offset + len > fileSize) return NULL;
+        if (view && offset >= viewStart && offset + len <= viewStart + viewLen) {
+            return view + (offset - viewStart);
+        }
+        if (view) UnmapViewOfFile(view);
+        viewStart = offset & ~(uint64_t)(TAR_MAP_GRANULARITY - 1);
+        size_t want = std::max((size_t)TAR_WINDOW_SIZE, (size_t)(offset - viewStart) + len);
+        viewLen = (size_t)std::min<uint64_t>(want, fileSize - viewStart);
+        view = (const char*)MapViewOfFile(mapping, FILE_MAP_READ,
+            (DWORD)(viewStart >> 32), (DWORD)viewStart, viewLen);
+        return view ? view + (offset - viewStart) : NULL;
+    }
+    
+private:
+    HANDLE file;
+    HANDLE mapping;
+    const char* view;
+    uint64_t viewStart;
+    size_t viewLen;
+    uint64_t fileSize;
+};
+
+static bool ScanPackage(const std::string& path, PackageIndex& index, std::string& error) {
+    FileWindow window;
+    if (!window.Open(path)) {
+        error = "cannot open (error " + std::to_string(GetLastError()) + ")";
+        return false;
+    }
+    
+    return ScanTarHeaders([&](uint64_t offset, size_t len) { return window.Map(offset, len); },
+                          index.members, error);
+}
+
+static bool PackageFileInfo(const std::string& path, uint64_t& size, uint64_t& mtime) {
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &info)) return false;
+    size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    mtime = ((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+    return true;
+}
+
+// cache\<FNV-1a of the lowercased full path>.idx
+static std::string PackageIndexCachePath(const std::string& path) {
+    char full[MAX_PATH];
+    DWORD len = GetFullPathNameA(path.c_str(), MAX_PATH, full, NULL);
+    std::string key = (len > 0 && len < MAX_PATH) ? std::string(full, len) : path;
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < key.size(); i++) {
+        h ^= (unsigned char)tolower((unsigned char)key[i]);
+        h *= 1099511628211ull;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.idx", (unsigned long long)h);
+    std::string dir = JournalDirectory();
+    dir = dir.substr(0, dir.find_last_of('\\')) + "\\cache";
+    CreateDirectoryA(dir.c_str(), NULL);
+    return dir + "\\" + name;
+}
+
+template <typename T>
+static void WritePod(std::ostream& out, const T& value) {
+    out.write((const char*)&value, sizeof(value));
+}
+
+template <typename T>
+static bool ReadPod(std::istream& in, T& value) {
+    return (bool)in.read((char*)&value, sizeof(value));
+}
+
+static bool LoadPackageIndex(const std::string& cachePath, PackageIndex& index) {
+    std::ifstream in(cachePath.c_str(), std::ios::binary);
+    uint32_t magic = 0, version = 0, count = 0;
+    uint64_t size = 0, mtime = 0;
+    if (!ReadPod(in, magic) || !ReadPod(in, version) || !ReadPod(in, size) ||
+        !ReadPod(in, mtime) || !ReadPod(in, count)) {
+        return false;
+    }
+    if (magic != PACKAGE_INDEX_MAGIC || version != PACKAGE_INDEX_VERSION ||
+        size != index.fileSize || mtime != index.mtime) {
+        return false;                                   // package changed
+    }
+    index.members.resize(count);
+    for (uint32_t i = 0; i < count; i++) {
+        TarMember& m = index.members[i];
+        uint16_t nameLen;
+        if (!ReadPod(in, m.offset) || !ReadPod(in, m.size) || !ReadPod(in, m.type) ||
+            !ReadPod(in, nameLen)) {
+            return false;
+        }
+        m.name.resize(nameLen);
+        if (nameLen && !in.read(&m.name[0], nameLen)) return false;
+    }
+    return true;
+}
+
+static void SavePackageIndex(const std::string& cachePath, const PackageIndex& index) {
+    // Write then rename, so a concurrent reader never sees half a file
+    std::string temp = cachePath + ".tmp";
+    {
+        std::ofstream out(temp.c_str(), std::ios::binary | std::ios::trunc);
+        WritePod(out, (uint32_t)PACKAGE_INDEX_MAGIC);
+        WritePod(out, (uint32_t)PACKAGE_INDEX_VERSION);
+        WritePod(out, index.fileSize);
+        WritePod(out, index.mtime);
+        WritePod(out, (uint32_t)index.members.size());
+        for (size_t i = 0; i < index.members.size(); i++) {
+            const TarMember& m = index.members[i];
+            uint16_t nameLen = (uint16_t)std::min(m.name.size(), (size_t)0xFFFF);
+            WritePod(out, m.offset);
+            WritePod(out, m.size);
+            WritePod(out, m.type);
+            WritePod(out, nameLen);
+            out.write(m.name.data(), nameLen);
+        }
+        if (!out) {
+            out.close();
+            DeleteFileA(temp.c_str());
+            return;
+        }
+    }
+    MoveFileExA(temp.c_str(), cachePath.c_str(), MOVEFILE_REPLACE_EXISTING);
+}
+
+// Cached index when the package is unchanged, otherwise a fresh header scan
+bool OpenPackageIndex(const std::string& path, PackageIndex& index, std::string& error) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    index = PackageIndex();
+    index.path = path;
+    if (!PackageFileInfo(path, index.fileSize, index.mtime)) {
+        error = "cannot stat (error " + std::to_string(GetLastError()) + ")";
+        return false;
+    }
+    std::string cachePath = PackageIndexCachePath(path);
+    if (LoadPackageIndex(cachePath, index)) {
+        index.fromCache = true;
+    } else {
+        index.members.clear();
+        if (!ScanPackage(path, index, error)) return false;
+        SavePackageIndex(cachePath, index);
+    }
+    index.elapsedMs = CoreMillisecondsSince(start);
+    return true;
+}
+
+// Random access to one member's bytes without extracting it
+class TarMemberReader {
+public:
+    TarMemberReader() : file(INVALID_HANDLE_VALUE), offset(0), size(0) {}
+    ~TarMemberReader() { if (file != INVALID_HANDLE_VALUE) CloseHandle(file); }
+    
+    bool Open(const PackageIndex& index, const std::string& name) {
+        const TarMember* member = index.Find(name);
+        if (!member) return false;
+        file = CreateFileA(index.path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        offset = member->offset;
+        size = member->size;
+        return true;
+    }
+    
+    uint64_t Size() const { return size; }
+    
+    // Positional read; safe to call from several threads on one reader.
+    // Returns bytes read (short only at the end of the member).
+    size_t Read(uint64_t pos, void* buffer, size_t len) {
+        if (pos >= size) return 0;
+        len = (size_t)std::min<uint64_t>(len, size - pos);
+        size_t total = 0;
+        while (total < len) {
+            OVERLAPPED ov;
+            ZeroMemory(&ov, sizeof(ov));
+            uint64_t at = offset + pos + total;
+            ov.Offset = (DWORD)at;
+            ov.OffsetHigh = (DWORD)(at >> 32);
+            DWORD want = (DWORD)std::min<size_t>(len - total, 64 * 1024 * 1024);
+            DWORD got = 0;
+            if (!ReadFile(file, (char*)buffer + total, want, &got, &ov) || got == 0) break;
+            total += got;
+        }
+        return total;
+    }
+    
+private:
+    HANDLE file;
+    uint64_t offset;
+    uint64_t size;
+};
+
+static std::string FormatSize(uint64_t bytes) {
+    char buf[32];
+    if (bytes >= 1024ull * 1024 * 1024) snprintf(buf, sizeof(buf), "%.2f GB", bytes / (1024.0 * 1024 * 1024));
+    else if (bytes >= 1024 * 1024) snprintf(buf, sizeof(buf), "%.1f MB", bytes / (1024.0 * 1024));
+    else snprintf(buf, sizeof(buf), "%.1f KB", bytes / 1024.0);
+    return buf;
+}
+
+// Partition manifest: one line per image, e.g. "boot.img.lz4  64.0 MB"
+std::string FormatPackageManifest(const PackageIndex& index) {
+    std::ostringstream out;
+    uint64_t total = 0;
+    size_t files = 0;
+    for (size_t i = 0; i < index.members.size(); i++) {
+        if (index.members[i].type != '0') continue;
+        total += index.members[i].size;
+        files++;
+    }
+    out << FileBaseName(index.path) << ": " << files << " images, " << FormatSize(total)
+        << (index.fromCache ? " (cached index, " : " (indexed in ") << index.elapsedMs << " ms)\n";
+    for (size_t i = 0; i < index.members.size(); i++) {
+        const TarMember& m = index.members[i];
+        if (m.type != '0') continue;
+        out << "  " << m.name << "  " << FormatSize(m.size) << "\n";
+    }
+    return out.str();
+}
+
+void SubmitPackageIndex(const std::string& path) {
+    g_jobs.Submit("Index " + FileBaseName(path), "index:" + path, [path](JobContext&) {
+        PackageIndex index;
+        std::string error;
+        if (OpenPackageIndex(path, index, error)) {
+            AddLog(FormatPackageManifest(index));
+        } else {
+            AddLog(FileBaseName(path) + ": cannot index: " + error);
+        }
+    });
+}
+
+// Command line: --index <package>... prints each manifest
+std::string PackageIndexReport(const std::vector<std::string>& paths) {
+    if (paths.empty()) return "Usage: --index <package.tar.md5>...\n";
+    std::string report;
+    for (size_t i = 0; i < paths.size(); i++) {
+        PackageIndex index;
+        std::string error;
+        report += OpenPackageIndex(paths[i], index, error) ? FormatPackageManifest(index) :
+            FileBaseName(paths[i]) + ": cannot index: " + error + "\n";
+    }
+    return report;
+}
+
+// LZ4 frame decoding
+// Decodes LZ4 frames (and the legacy format older packages use) so .img.lz4
+// members can be unpacked without external tools. Independent blocks are
+// decoded in parallel on a worker pool and written out strictly in order, with
+// a bounded number in flight, so memory stays at a few blocks regardless of
+// image size. Block and content checksums (xxHash32) are verified when the
+// frame carries them. Linked-block frames decode sequentially with a 64 KB
+// history window.
+#define LZ4_FRAME_MAGIC 0x184D2204
+#define LZ4_LEGACY_MAGIC 0x184C2102
+#define LZ4_SKIPPABLE_MASK 0xFFFFFFF0
+#define LZ4_SKIPPABLE_MAGIC 0x184D2A50
+#define LZ4_LEGACY_BLOCK (8 * 1024 * 1024)
+#define LZ4_HISTORY 65536
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+#define LZ4_INFLIGHT_PER_THREAD 2
+
+#define XXH_PRIME32_1 2654435761u
+#define XXH_PRIME32_2 2246822519u
+#define XXH_PRIME32_3 3266489917u
+#define XXH_PRIME32_4 668265263u
+#define XXH_PRIME32_5 374761393u
+
+static inline uint32_t Rotl32(uint32_t x, int r) { return (x << r) | (x >> (32 - r)); }
+
+static inline uint32_t ReadLE32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void WriteLE32(uint8_t* p, uint32_t v) { memcpy(p, &v, sizeof(v)); }
+
+// Streaming xxHash32
+class Xxh32 {
+public:
+    explicit Xxh32(uint32_t seed = 0) : total(0), memSize(0), seed(seed) {
+        v[0] = seed + XXH_PRIME32_1 + XXH_PRIME32_2;
+        v[1] = seed + XXH_PRIME32_2;
+        v[2] = seed;
+        v[3] = seed - XXH_PRIME32_1;
+    }
+    
+    static uint32_t Hash(const void* data, size_t len, uint32_t seed = 0) {
+        Xxh32 h(seed);
+        h.Update(data, len);
+        return h.Digest();
+    }
+    
+    void Update(const void* data, size_t len) {
+        const uint8_t* p = (const uint8_t*)data;
+        const uint8_t* end = p + len;
+        total += len;
+        if (memSize + len < 16) {
+            memcpy(mem + memSize, p, len);
+            memSize += len;
+            return;
+        }
+        if (memSize) {
+            memcpy(mem + memSize, p, 16 - memSize);
+            p += 16 - memSize;
+            Stripe(mem);
+            memSize = 0;
+        }
+        uint32_t v1 = v[0], v2 = v[1], v3 = v[2], v4 = v[3];
+        for (; p + 16 <= end; p += 16) {
+            v1 = Round(v1, ReadLE32(p));
+            v2 = Round(v2, ReadLE32(p + 4));
+            v3 = Round(v3, ReadLE32(p + 8));
+            v4 = Round(v4, ReadLE32(p + 12));
+        }
+        v[0] = v1; v[1] = v2; v[2] = v3; v[3] = v4;
+        memSize = end - p;
+        memcpy(mem, p, memSize);
+    }
+    
+    uint32_t Digest() const {
+        uint32_t h = total >= 16 ?
+            Rotl32(v[0], 1) + Rotl32(v[1], 7) + Rotl32(v[2], 12) + Rotl32(v[3], 18) :
+            seed + XXH_PRIME32_5;
+        h += (uint32_t)total;
+        size_t i = 0;
+        for (; i + 4 <= memSize; i += 4) {
+            h += ReadLE32(mem + i) * XXH_PRIME32_3;
+            h = Rotl32(h, 17) * XXH_PRIME32_4;
+        }
+        for (; i < memSize; i++) {
+            h += mem[i] * XXH_PRIME32_5;
+            h = Rotl32(h, 11) * XXH_PRIME32_1;
+        }
+        h ^= h >> 15;
+        h *= XXH_PRIME32_2;
+        h ^= h >> 13;
+        h *= XXH_PRIME32_3;
+        h ^= h >> 16;
+        return h;
+    }
+    
+private:
+    uint32_t v[4];
+    uint64_t total;
+    uint8_t mem[16];
+    size_t memSize;
+    uint32_t seed;
+    
+    static uint32_t Round(uint32_t acc, uint32_t input) {
+        return Rotl32(acc + input * XXH_PRIME32_2, 13) * XXH_PRIME32_1;
+    }
+    
+    void Stripe(const uint8_t* p) {
+        for (int i = 0; i < 4; i++) v[i] = Round(v[i], ReadLE32(p + 4 * i));
+    }
+};
+
+static inline bool Lz4ReadLength(const uint8_t*& ip, const uint8_t* iend, size_t& len) {
+    unsigned b;
+    do {
+        if (ip >= iend) return false;
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decodes one LZ4 block into dst. Matches may reach back to historyStart,
+// which is dst itself for independent blocks. Returns the decoded size or
+// -1 on malformed input; never reads or writes out of bounds.
+static long long Lz4DecodeBlock(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstCap,
+                                const uint8_t* historyStart) {
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + srcLen;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + dstCap;
+    
+    for (;;) {
+        if (ip >= iend) return -1;
+        unsigned token = *ip++;
+        
+        size_t lit = token >> 4;
+        if (lit == 15 && !Lz4ReadLength(ip, iend, lit)) return -1;
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        if (lit <= 16 && iend - ip >= 16 && oend - op >= 16) {
+            memcpy(op, ip, 16);                 // short literal run, one wide copy
+        } else {
+            memcpy(op, ip, lit);
+        }
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;                  // last sequence is literals only
+        
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - historyStart)) return -1;
+        
+        size_t mlen = token & 15;
+        if (mlen == 15 && !Lz4ReadLength(ip, iend, mlen)) return -1;
+        mlen += LZ4_MIN_MATCH;
+        if (mlen > (size_t)(oend - op)) return -1;
+        
+        const uint8_t* match = op - offset;
+        if (offset >= 16 && (size_t)(oend - op) >= mlen + 16) {
+            // 16-byte steps; each step's source lies wholly before its destination
+            for (size_t i = 0; i < mlen; i += 16) memcpy(op + i, match + i, 16);
+        } else if (offset == 1) {
+            memset(op, *match, mlen);
+        } else {
+            for (size_t i = 0; i < mlen; i++) op[i] = match[i];
+        }
+        op += mlen;
+    }
+    return op - dst;
+}
+
+static uint8_t* Lz4WriteLength(uint8_t* op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Worst-case encoded size of a block of len bytes
+static size_t Lz4EncodeBound(size_t len) { return len + len / 255 + 16; }
+
+// Greedy single-pass LZ4 block encoder (hash of 4-byte sequences, last
+// occurrence only). Fast rather than tight; used to build benchmark input
+// and by the command-line encoder.
+static size_t Lz4EncodeBlock(const uint8_t* src, size_t len, uint8_t* dst) {
+    std::vector<int32_t> table(1 << 16, -1);
+    uint8_t* op = dst;
+    size_t anchor = 0, ip = 0;
+    size_t mfLimit = len > LZ4_MF_LIMIT ? len - LZ4_MF_LIMIT : 0;
+    size_t matchLimit = len > LZ4_LAST_LITERALS ? len - LZ4_LAST_LITERALS : 0;
+    
+    while (ip < mfLimit) {
+        uint32_t seq = ReadLE32(src + ip);
+        uint32_t h = (seq * XXH_PRIME32_1) >> 16;
+        int32_t ref = table[h];
+        table[h] = (int32_t)ip;
+        if (ref < 0 || ip - (size_t)ref > 65535 || ReadLE32(src + ref) != seq) {
+            ip++;
+            continue;
+        }
+        size_t mlen = LZ4_MIN_MATCH;
+        while (ip + mlen < matchLimit && src[ref + mlen] == src[ip + mlen]) mlen++;
+        
+        size_t lit = ip - anchor;
+        size_t mcode = mlen - LZ4_MIN_MATCH;
+        uint8_t* token = op++;
+        *token = (uint8_t)((std::min(lit, (size_t)15) << 4) | std::min(mcode, (size_t)15));
+        if (lit >= 15) op = Lz4WriteLength(op, lit - 15);
+        memcpy(op, src + anchor, lit);
+        op += lit;
+        size_t offset = ip - ref;
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        if (mcode >= 15) op = Lz4WriteLength(op, mcode - 15);
+        ip += mlen;
+        anchor = ip;
+    }
+    
+    size_t lit = len - anchor;
+    *op++ = (uint8_t)(std::min(lit, (size_t)15) << 4);
+    if (lit >= 15) op = Lz4WriteLength(op, lit - 15);
+    memcpy(op, src + anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+// Positional input and in-order output for the frame decoder
+typedef std::function<size_t(uint64_t pos, void* buffer, size_t len)> ReadAtFunc;
+typedef std::function<bool(const uint8_t* data, size_t len)> WriteFunc;
+
+struct Lz4DecodeStats {
+    uint64_t inBytes;
+    uint64_t outBytes;
+    size_t blocks;
+    size_t frames;
+    size_t threads;
+    bool contentChecked;        // at least one frame carried a content checksum
+    long long elapsedMs;
+    std::string error;
+    
+    Lz4DecodeStats() : inBytes(0), outBytes(0), blocks(0), frames(0), threads(0),
+                       contentChecked(false), elapsedMs(0) {}
+};
+
+class Lz4FrameDecoder {
+public:
+    Lz4FrameDecoder(const ReadAtFunc& read, uint64_t inputSize, const WriteFunc& write, size_t threads)
+        : read(read), inputSize(inputSize), write(write),
+          threads(threads ? threads : 1), pool(threads ? threads : 1) {}
+    
+    // Decodes every frame in the input; cancel (may be NULL) is polled per block
+    bool Run(Lz4DecodeStats& stats, const std::function<bool()>& cancelled) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        stats.threads = threads;
+        uint64_t pos = 0;
+        bool ok = true;
+        while (ok && pos < inputSize) {
+            uint8_t magic[4];
+            if (!ReadExactAt(pos, magic, 4)) {
+                stats.error = "truncated frame header";
+                ok = false;
+                break;
+            }
+            uint32_t m = ReadLE32(magic);
+            if (m == LZ4_FRAME_MAGIC) {
+                ok = DecodeFrame(pos, stats, cancelled);
+                stats.frames++;
+            } else if (m == LZ4_LEGACY_MAGIC) {
+                ok = DecodeLegacy(pos, stats, cancelled);
+                stats.frames++;
+            } else if ((m & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC) {
+                uint8_t size[4];
+                if (!ReadExactAt(pos + 4, size, 4)) break;
+                pos += 8 + ReadLE32(size);
+            } else if (stats.frames > 0) {
+                break;                          // trailing padding after the last frame
+            } else {
+                stats.error = "not an LZ4 stream";
+                ok = false;
+            }
+        }
+        stats.inBytes = std::min(pos, inputSize);
+        stats.elapsedMs = CoreMillisecondsSince(start);
+        return ok;
+    }
+    
+private:
+    struct Task {
+        std::vector<uint8_t> src;
+        std::vector<uint8_t> dst;
+        size_t srcLen;
+        size_t outLen;
+        bool compressed;
+        bool hasChecksum;
+        uint32_t checksum;
+        bool failed;
+        bool done;
+        std::string error;
+    };
+    
+    ReadAtFunc read;
+    uint64_t inputSize;
+    WriteFunc write;
+    size_t threads;
+    WorkerPool pool;
+    std::mutex mutex;
+    std::condition_variable doneCv;
+    std::vector<std::shared_ptr<Task> > spare;
+    
+    bool ReadExactAt(uint64_t pos, void* buffer, size_t len) {
+        return pos + len <= inputSize && read(pos, buffer, len) == len;
+    }
+    
+    std::shared_ptr<Task> NewTask(size_t blockMax) {
+        std::shared_ptr<Task> task;
+        if (!spare.empty()) {
+            task = spare.back();
+            spare.pop_back();
+        } else {
+            task.reset(new Task());
+        }
+        if (task->dst.size() < blockMax) task->dst.resize(blockMax);
+        task->failed = task->done = false;
+        task->error.clear();
+        return task;
+    }
+    
+    static void Decode(Task& t) {
+        if (t.hasChecksum && Xxh32::Hash(&t.src[0], t.srcLen) != t.checksum) {
+            t.failed = true;
+            t.error = "block checksum mismatch";
+            return;
+        }
+        if (!t.compressed) {
+            if (t.srcLen > t.dst.size()) {
+                t.failed = true;
+                t.error = "stored block larger than block size";
+                return;
+            }
+            memcpy(&t.dst[0], &t.src[0], t.srcLen);
+            t.outLen = t.srcLen;
+            return;
+        }
+        long long n = Lz4DecodeBlock(&t.src[0], t.srcLen, &t.dst[0], t.dst.size(), &t.dst[0]);
+        if (n < 0) {
+            t.failed = true;
+            t.error = "corrupt block";
+            return;
+        }
+        t.outLen = (size_t)n;
+    }
+    
+    // Waits for the oldest in-flight block and hands its output on in order
+    bool Retire(std::deque<std::shared_ptr<Task> >& inflight, Xxh32* content,
+                Lz4DecodeStats& stats) {
+        std::shared_ptr<Task> task = inflight.front();
+        inflight.pop_front();
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            doneCv.wait(lock, [&task] { return task->done; });
+        }
+        bool ok = !task->failed;
+        if (ok) {
+            if (content) content->Update(&task->dst[0], task->outLen);
+            stats.outBytes += task->outLen;
+            stats.blocks++;
+            if (!write(&task->dst[0], task->outLen)) {
+                stats.error = "output write failed";
+                ok = false;
+            }
+        } else if (stats.error.empty()) {
+            stats.error = task->error + " (block " + std::to_string(stats.blocks) + ")";
+        }
+        spare.push_back(task);
+        return ok;
+    }
+    
+    void Dispatch(const std::shared_ptr<Task>& task) {
+        pool.Submit([this, task] {
+            Decode(*task);
+            std::lock_guard<std::mutex> lock(mutex);
+            task->done = true;
+            doneCv.notify_all();
+        });
+    }
+    
+    // Retires everything still in flight; after an error the remaining
+    // blocks are only waited for, never written
+    bool Drain(std::deque<std::shared_ptr<Task> >& inflight, Xxh32* content,
+               Lz4DecodeStats& stats, bool ok) {
+        while (!inflight.empty()) {
+            if (!ok) {
+                std::shared_ptr<Task> task = inflight.front();
+                inflight.pop_front();
+                std::unique_lock<std::mutex> lock(mutex);
+                doneCv.wait(lock, [&task] { return task->done; });
+                spare.push_back(task);
+            } else if (!Retire(inflight, content, stats)) {
+                ok = false;
+            }
+        }
+        return ok;
+    }
+    
+    bool DecodeFrame(uint64_t& pos, Lz4DecodeStats& stats, const std::function<bool()>& cancelled) {
+        uint8_t desc[15];
+        if (!ReadExactAt(pos + 4, desc, 2)) {
+            stats.error = "truncated frame descriptor";
+            return false;
+        }
+        uint8_t flg = desc[0], bd = desc[1];
+        if ((flg >> 6) != 1) {
+            stats.error = "unsupported LZ4 frame version";
+            return false;
+        }
+        bool independent = (flg & 0x20) != 0;
+        bool blockChecksum = (flg & 0x10) != 0;
+        bool hasContentSize = (flg & 0x08) != 0;
+        bool contentChecksum = (flg & 0x04) != 0;
+        bool hasDictId = (flg & 0x01) != 0;
+        int bsid = (bd >> 4) & 7;
+        if (bsid < 4) {
+            stats.error = "invalid block size id";
+            return false;
+        }
+        if (hasDictId) {
+            stats.error = "dictionary frames are not supported";
+            return false;
+        }
+        size_t blockMax = (size_t)1 << (8 + 2 * bsid);     // 64 KB .. 4 MB
+        size_t descLen = 2 + (hasContentSize ? 8 : 0);
+        if (!ReadExactAt(pos + 4, desc, descLen + 1)) {
+            stats.error = "truncated frame descriptor";
+            return false;
+        }
+        if (((Xxh32::Hash(desc, descLen) >> 8) & 0xFF) != desc[descLen]) {
+            stats.error = "frame header checksum mismatch";
+            return false;
+        }
+        uint64_t contentSize = 0;
+        if (hasContentSize) memcpy(&contentSize, desc + 2, 8);
+        pos += 4 + descLen + 1;
+        
+        Xxh32 content;
+        uint64_t frameOut = stats.outBytes;
+        bool ok = independent ?
+            DecodeIndependent(pos, blockMax, blockChecksum, contentChecksum ? &content : NULL,
+                stats, cancelled) :
+            DecodeLinked(pos, blockMax, blockChecksum, contentChecksum ? &content : NULL,
+                stats, cancelled);
+        if (!ok) return false;
+        
+        if (contentChecksum) {
+            uint8_t sum[4];
+            if (!ReadExactAt(pos, sum, 4)) {
+                stats.error = "truncated content checksum";
+                return false;
+            }
+            pos += 4;
+            if (ReadLE32(sum) != content.Digest()) {
+                stats.error = "content checksum mismatch";
+                return false;
+            }
+            stats.contentChecked = true;
+        }
+        if (hasContentSize && stats.outBytes - frameOut != contentSize) {
+            stats.error = "content size mismatch";
+            return false;
+        }
+        return true;
+    }
+    
+    // Reads the next block header; false at the end mark or on error
+    bool NextBlock(uint64_t& pos, size_t blockMax, bool& compressed, size_t& len,
+                   bool& endMark, Lz4DecodeStats& stats) {
+        uint8_t hdr[4];
+        endMark = false;
+        if (!ReadExactAt(pos, hdr, 4)) {
+            stats.error = "truncated block header";
+            return false;
+        }
+        pos += 4;
+        uint32_t word = ReadLE32(hdr);
+        if (word == 0) {
+            endMark = true;
+            return false;
+        }
+        compressed = (word & 0x80000000u) == 0;
+        len = word & 0x7FFFFFFFu;
+        if (len > blockMax) {
+            stats.error = "block larger than the declared block size";
+            return false;
+        }
+        return true;
+    }
+    
+    bool DecodeIndependent(uint64_t& pos, size_t blockMax, bool blockChecksum, Xxh32* content,
+                           Lz4DecodeStats& stats, const std::function<bool()>& cancelled) {
+        std::deque<std::shared_ptr<Task> > inflight;
+        for (;;) {
+            if (cancelled && cancelled()) {
+                stats.error = "cancelled";
+                return Drain(inflight, NULL, stats, false);
+            }
+            bool compressed, endMark;
+            size_t len;
+            if (!NextBlock(pos, blockMax, compressed, len, endMark, stats)) {
+                return Drain(inflight, content, stats, endMark);
+            }
+            std::shared_ptr<Task> task = NewTask(blockMax);
+            if (task->src.size() < len + 4) task->src.resize(len + 4);
+            task->srcLen = len;
+            task->compressed = compressed;
+            task->hasChecksum = blockChecksum;
+            uint8_t sum[4] = { 0, 0, 0, 0 };
+            if (!ReadExactAt(pos, &task->src[0], len) ||
+                (blockChecksum && !ReadExactAt(pos + len, sum, 4))) {
+                stats.error = "truncated block";
+                spare.push_back(task);
+                return Drain(inflight, content, stats, false);
+            }
+            task->checksum = ReadLE32(sum);
+            pos += len + (blockChecksum ? 4 : 0);
+            
+            inflight.push_back(task);
+            Dispatch(task);
+            if (inflight.size() >= threads * LZ4_INFLIGHT_PER_THREAD &&
+                !Retire(inflight, content, stats)) {
+                return Drain(inflight, NULL, stats, false);
+            }
+        }
+    }
+    
+    // Blocks may reference the previous 64 KB of output: decode in place after
+    // a history prefix, then slide the tail of the output down
+    bool DecodeLinked(uint64_t& pos, size_t blockMax, bool blockChecksum, Xxh32* content,
+                      Lz4DecodeStats& stats, const std::function<bool()>& cancelled) {
+        std::vector<uint8_t> window(LZ4_HISTORY + blockMax);
+        std::vector<uint8_t> src(blockMax + 4);
+        size_t history = 0;
+        for (;;) {
+            if (cancelled && cancelled()) {
+                stats.error = "cancelled";
+                return false;
+            }
+            bool compressed, endMark;
+            size_t len;
+            if (!NextBlock(pos, blockMax, compressed, len, endMark, stats)) return endMark;
+            if (!ReadExactAt(pos, &src[0], len + (blockChecksum ? 4 : 0))) {
+                stats.error = "truncated block";
+                return false;
+            }
+            if (blockChecksum && Xxh32::Hash(&src[0], len) != ReadLE32(&src[len])) {
+                stats.error = "block checksum mismatch (block " + std::to_string(stats.blocks) + ")";
+                return false;
+            }
+            pos += len + (blockChecksum ? 4 : 0);
+            
+            uint8_t* out = &window[LZ4_HISTORY];
+            long long n;
+            if (compressed) {
+                n = Lz4DecodeBlock(&src[0], len, out, blockMax, out - history);
+            } else {
+                memcpy(out, &src[0], len);
+                n = (long long)len;
+            }
+            if (n < 0) {
+                stats.error = "corrupt block (block " + std::to_string(stats.blocks) + ")";
+                return false;
+            }
+            if (content) content->Update(out, (size_t)n);
+            stats.outBytes += n;
+            stats.blocks++;
+            if (!write(out, (size_t)n)) {
+                stats.error = "output write failed";
+                return false;
+            }
+            
+            size_t keep = std::min((size_t)LZ4_HISTORY, history + (size_t)n);
+            memmove(&window[LZ4_HISTORY - keep], out + n - keep, keep);
+            history = keep;
+        }
+    }
+    
+    // Legacy format: 8 MB independent blocks, no checksums, no end mark
+    bool DecodeLegacy(uint64_t& pos, Lz4DecodeStats& stats, const std::function<bool()>& cancelled) {
+        pos += 4;
+        std::deque<std::shared_ptr<Task> > inflight;
+        for (;;) {
+            if (cancelled && cancelled()) {
+                stats.error = "cancelled";
+                return Drain(inflight, NULL, stats, false);
+            }
+            uint8_t hdr[4];
+            if (!ReadExactAt(pos, hdr, 4)) return Drain(inflight, NULL, stats, true);
+            uint32_t len = ReadLE32(hdr);
+            if (len == 0 || len == LZ4_LEGACY_MAGIC || len > Lz4EncodeBound(LZ4_LEGACY_BLOCK)) {
+                return Drain(inflight, NULL, stats, true);  // next frame or trailer
+            }
+            pos += 4;
+            std::shared_ptr<Task> task = NewTask(LZ4_LEGACY_BLOCK);
+            if (task->src.size() < len) task->src.resize(len);
+            task->srcLen = len;
+            task->compressed = true;
+            task->hasChecksum = false;
+            if (!ReadExactAt(pos, &task->src[0], len)) {
+                stats.error = "truncated block";
+                spare.push_back(task);
+                return Drain(inflight, NULL, stats, false);
+            }
+            pos += len;
+            inflight.push_back(task);
+            Dispatch(task);
+            if (inflight.size() >= threads * LZ4_INFLIGHT_PER_THREAD &&
+                !Retire(inflight, NULL, stats)) {
+                return Drain(inflight, NULL, stats, false);
+            }
+        }
+    }
+};
+
+// Sequential output file for decoded images
+class OutputFile {
+public:
+    OutputFile() : file(INVALID_HANDLE_VALUE) {}
+    ~OutputFile() { Close(); }
+    
+    bool Open(const std::string& path) {
+        file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        return file != INVALID_HANDLE_VALUE;
+    }
+    
+    bool Write(const uint8_t* data, size_t len) {
+        while (len > 0) {
+            DWORD chunk = (DWORD)std::min<size_t>(len, 64 * 1024 * 1024);
+            DWORD written = 0;
+            if (!WriteFile(file, data, chunk, &written, NULL) || written == 0) return false;
+            data += written;
+            len -= written;
+        }
+        return true;
+    }
+    
+    void Close() {
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+    }
+    
+private:
+    HANDLE file;
+};
+
+static size_t DefaultDecodeThreads() {
+    unsigned int cores = std::thread::hardware_concurrency();
+    return cores ? cores : 1;
+}
+
+std::string FormatLz4Stats(const std::string& name, const Lz4DecodeStats& stats) {
+    std::ostringstream out;
+    out << name << ": ";
+    if (!stats.error.empty()) out << "ERROR " << stats.error << " after ";
+    double seconds = stats.elapsedMs / 1000.0;
+    out << std::fixed << std::setprecision(1) << stats.inBytes / (1024.0 * 1024.0) << " MB -> "
+        << stats.outBytes / (1024.0 * 1024.0) << " MB, " << stats.blocks << " blocks, "
+        << stats.threads << " threads, " << seconds << " s";
+    if (seconds > 0) out << ", " << stats.outBytes / (1024.0 * 1024.0) / seconds << " MB/s";
+    if (stats.error.empty()) out << (stats.contentChecked ? ", checksum OK" : ", no content checksum");
+    return out.str();
+}
+
+// Unpacks one package member to outPath: .lz4 members are decoded, anything
+// else is copied
+bool ExtractPackageMember(const std::string& package, const std::string& member,
+                          const std::string& outPath, JobContext* ctx, std::string& report) {
+    PackageIndex index;
+    std::string error;
+    if (!OpenPackageIndex(package, index, error)) {
+        report = FileBaseName(package) + ": cannot index: " + error;
+        return false;
+    }
+    TarMemberReader reader;
+    if (!reader.Open(index, member)) {
+        report = FileBaseName(package) + ": no member " + member;
+        return false;
+    }
+    OutputFile out;
+    if (!out.Open(outPath)) {
+        report = "cannot create " + outPath;
+        return false;
+    }
+    
+    uint64_t total = reader.Size();
+    std::function<bool()> cancelled = [ctx] { return ctx && ctx->Cancelled(); };
+    int lastPercent = -1;
+    ReadAtFunc read = [&](uint64_t pos, void* buffer, size_t len) -> size_t {
+        int percent = total ? (int)(pos * 100 / total) : 100;
+        if (ctx && percent != lastPercent) {
+            ctx->Progress(percent);
+            lastPercent = percent;
+        }
+        return reader.Read(pos, buffer, len);
+    };
+    
+    size_t nameLen = member.size();
+    if (nameLen > 4 && member.compare(nameLen - 4, 4, ".lz4") == 0) {
+        Lz4FrameDecoder decoder(read, total, [&out](const uint8_t* data, size_t len) {
+            return out.Write(data, len);
+        }, DefaultDecodeThreads());
+        Lz4DecodeStats stats;
+        bool ok = decoder.Run(stats, cancelled);
+        report = FormatLz4Stats(member, stats);
+        return ok;
+    }
+    
+    std::vector<uint8_t> buffer(4 * 1024 * 1024);
+    for (uint64_t pos = 0; pos < total; ) {
+        if (cancelled()) {
+            report = member + ": cancelled";
+            return false;
+        }
+        size_t got = read(pos, &buffer[0], buffer.size());
+        if (got == 0 || !out.Write(&buffer[0], got)) {
+            report = member + ": copy failed at offset " + std::to_string(pos);
+            return false;
+        }
+        pos += got;
+    }
+    report = member + ": copied " + FormatSize(total);
+    return true;
+}
+
+// Command line: --lz4 <input.lz4> <output> [threads]
+std::string DecodeLz4FileReport(const std::vector<std::string>& args) {
+    if (args.size() < 3) return "Usage: --lz4 <input.lz4> <output> [threads]\n";
+    HANDLE in = CreateFileA(args[1].c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (in == INVALID_HANDLE_VALUE) return "Error: cannot open " + args[1] + "\n";
+    LARGE_INTEGER size;
+    GetFileSizeEx(in, &size);
+    OutputFile out;
+    if (!out.Open(args[2])) {
+        CloseHandle(in);
+        return "Error: cannot create " + args[2] + "\n";
+    }
+    
+    ReadAtFunc read = [in](uint64_t pos, void* buffer, size_t len) -> size_t {
+        OVERLAPPED ov;
+        ZeroMemory(&ov, sizeof(ov));
+        ov.Offset = (DWORD)pos;
+        ov.OffsetHigh = (DWORD)(pos >> 32);
+        DWORD got = 0;
+        return ReadFile(in, buffer, (DWORD)len, &got, &ov) ? got : 0;
+    };
+    size_t threads = args.size() > 3 ? (size_t)atoi(args[3].c_str()) : DefaultDecodeThreads();
+    Lz4FrameDecoder decoder(read, (uint64_t)size.QuadPart, [&out](const uint8_t* data, size_t len) {
+        return out.Write(data, len);
+    }, threads);
+    Lz4DecodeStats stats;
+    decoder.Run(stats, std::function<bool()>());
+    CloseHandle(in);
+    return FormatLz4Stats(FileBaseName(args[1]), stats) + "\n";
+}
+
+// Command line: --extract <package> <member> <output>
+std::string ExtractMemberReport(const std::vector<std::string>& args) {
+    if (args.size() < 4) return "Usage: --extract <package.tar.md5> <member> <output>\n";
+    std::string report;
+    ExtractPackageMember(args[1], args[2], args[3], NULL, report);
+    return report + "\n";
+}
+
+// LZ4 decode benchmark:
+//   frpunlock.exe --bench-lz4 [total-MB] [max-threads]
+// Builds a virtual multi-GB frame from 16 distinct 4 MB blocks (zero runs,
+// repeated records and noise, roughly like a system image) compressed with
+// the in-tree encoder, with block and content checksums, and decodes it into
+// a discarding sink at 1, 2, 4, ... threads. Only the 16 blocks are held in
+// memory.
+#define LZ4_BENCH_BLOCK (4 * 1024 * 1024)
+#define LZ4_BENCH_DISTINCT 16
+
+class SyntheticLz4Frame {
+public:
+    explicit SyntheticLz4Frame(uint64_t totalBytes) {
+        uint64_t state = 0x9E3779B97F4A7C15ull;
+        std::vector<uint8_t> raw(LZ4_BENCH_BLOCK);
+        std::vector<uint8_t> packed(Lz4EncodeBound(LZ4_BENCH_BLOCK));
+        for (int b = 0; b < LZ4_BENCH_DISTINCT; b++) {
+            FillBlock(raw, state);
+            rawBlocks.push_back(raw);
+            size_t n = Lz4EncodeBlock(&raw[0], raw.size(), &packed[0]);
+            std::string entry(4, '\0');
+            WriteLE32((uint8_t*)&entry[0], (uint32_t)n);
+            entry.append((const char*)&packed[0], n);
+            uint8_t sum[4];
+            WriteLE32(sum, Xxh32::Hash(&packed[0], n));
+            entry.append((const char*)sum, 4);
+            entries.push_back(entry);
+        }
+        
+        blocks = std::max<uint64_t>(1, totalBytes / LZ4_BENCH_BLOCK);
+        period = 0;
+        for (size_t i = 0; i < entries.size(); i++) {
+            offsets.push_back(period);
+            period += entries[i].size();
+        }
+        
+        // Frame header: version 1, independent blocks, block + content checksums, 4 MB
+        header.resize(7);
+        WriteLE32((uint8_t*)&header[0], LZ4_FRAME_MAGIC);
+        header[4] = (char)(0x40 | 0x20 | 0x10 | 0x04);
+        header[5] = (char)(7 << 4);
+        header[6] = (char)((Xxh32::Hash(&header[4], 2) >> 8) & 0xFF);
+        
+        Xxh32 content;
+        for (uint64_t i = 0; i < blocks; i++) {
+            const std::vector<uint8_t>& r = rawBlocks[i % LZ4_BENCH_DISTINCT];
+            content.Update(&r[0], r.size());
+        }
+        trailer.assign(8, '\0');
+        WriteLE32((uint8_t*)&trailer[4], content.Digest());
+        rawBlocks.clear();
+    }
+    
+    uint64_t Size() const { return header.size() + FullPeriods() * period + TailBytes() + trailer.size(); }
+    uint64_t RawSize() const { return blocks * LZ4_BENCH_BLOCK; }
+    
+    size_t Read(uint64_t pos, void* buffer, size_t len) {
+        char* out = (char*)buffer;
+        size_t done = 0;
+        while (done < len) {
+            size_t n = Segment(pos + done, out + done, len - done);
+            if (n == 0) break;
+            done += n;
+        }
+        return done;
+    }
+    
+private:
+    std::vector<std::string> entries;
+    std::vector<uint64_t> offsets;
+    std::vector<std::vector<uint8_t> > rawBlocks;      // only while building
+    std::string header;
+    std::string trailer;
+    uint64_t blocks;
+    uint64_t period;
+    
+    uint64_t FullPeriods() const { return blocks / LZ4_BENCH_DISTINCT; }
+    uint64_t TailBytes() const {
+        uint64_t rest = blocks % LZ4_BENCH_DISTINCT;
+        return rest ? offsets[rest - 1] + entries[rest - 1].size() : 0;
+    }
+    
+    static void FillBlock(std::vector<uint8_t>& raw, uint64_t& state) {
+        size_t pos = 0;
+        while (pos < raw.size()) {
+            state = state * 6364136223846793005ull + 1442695040888963407ull;
+            uint32_t r = (uint32_t)(state >> 33);
+            size_t run = std::min<size_t>(raw.size() - pos, 64 + (r % 16384));
+            switch (r % 4) {
+                case 0:                                 // zeroed space
+                    memset(&raw[pos], 0, run);
                     break;
-                    
-                case IDC_BTN_UNLOCK_BL: {
-                    int result = MessageBoxA(hWnd, 
-                        "WARNING: Unlocking bootloader will WIPE ALL DATA!\n\n"
-                        "Samsung Knox will be tripped (permanent).\n"
-                        "OEM Unlock must be enabled in Developer Options first.\n\n"
-                        "Continue?", "Critical Warning", MB_YESNO | MB_ICONWARNING);
-                    if (result == IDYES) {
-                        AddLog("Initiating bootloader unlock sequence...");
-                        ExecuteFastbootCommand("flashing unlock");
-                    }
+                case 1:                                 // repeated record
+                case 2:
+                    for (size_t i = 0; i < run; i++) raw[pos + i] = (uint8_t)("record:" [i % 7] + (r >> 8) % 3);
                     break;
-                }
-                
-                case IDC_BTN_LOCK_BL: {
-                    int result = MessageBoxA(hWnd, 
-                        "WARNING: Locking bootloader will WIPE ALL DATA!\n\n"
-                        "Continue?", "Critical Warning", MB_YESNO | MB_ICONWARNING);
-                    if (result == IDYES) {
-                        AddLog("Locking bootloader...");
-                        ExecuteFastbootCommand("flashing lock");
+                default:                                // incompressible noise
+                    for (size_t i = 0; i < run; i++) {
+                        state = state * 6364136223846793005ull + 1442695040888963407ull;
+                        raw[pos + i] = (uint8_t)(state >> 56);
                     }
-                    break;
+            }
+            pos += run;
+        }
+    }
+    
+    // Copies from the single piece of the virtual file containing pos
+    size_t Segment(uint64_t pos, char* out, size_t len) {
+        if (pos < header.size()) {
+            size_t n = std::min<size_t>(len, header.size() - (size_t)pos);
+            memcpy(out, &header[(size_t)pos], n);
+            return n;
+        }
+        pos -= header.size();
+        uint64_t body = FullPeriods() * period + TailBytes();
+        if (pos >= body) {
+            pos -= body;
+            if (pos >= trailer.size()) return 0;
+            size_t n = std::min<size_t>(len, trailer.size() - (size_t)pos);
+            memcpy(out, &trailer[(size_t)pos], n);
+            return n;
+        }
+        uint64_t within = pos % period;
+        size_t e = std::upper_bound(offsets.begin(), offsets.end(), within) - offsets.begin() - 1;
+        size_t at = (size_t)(within - offsets[e]);
+        size_t n = std::min<size_t>(len, entries[e].size() - at);
+        memcpy(out, &entries[e][at], n);
+        return n;
+    }
+};
+
+std::string BenchmarkLz4(uint64_t totalMB, size_t maxThreads) {
+    if (totalMB == 0) totalMB = 2048;
+    if (maxThreads == 0) maxThreads = DefaultDecodeThreads();
+    SyntheticLz4Frame frame(totalMB * 1024 * 1024);
+    
+    std::ostringstream report;
+    report << std::fixed << std::setprecision(2);
+    report << "LZ4 decode: " << frame.RawSize() / (1024 * 1024) << " MB raw, "
+           << frame.Size() / (1024 * 1024) << " MB compressed\n";
+    double single = 0;
+    for (size_t threads = 1; ; threads = std::min(threads * 2, maxThreads)) {
+        uint64_t sunk = 0;
+        Lz4FrameDecoder decoder([&frame](uint64_t pos, void* buffer, size_t len) {
+            return frame.Read(pos, buffer, len);
+        }, frame.Size(), [&sunk](const uint8_t*, size_t len) {
+            sunk += len;
+            return true;
+        }, threads);
+        Lz4DecodeStats stats;
+        decoder.Run(stats, std::function<bool()>());
+        
+        double seconds = std::max(stats.elapsedMs, 1LL) / 1000.0;
+        double gbps = sunk / (1024.0 * 1024.0 * 1024.0) / seconds;
+        if (threads == 1) single = gbps;
+        report << std::setw(3) << threads << " threads: " << gbps << " GB/s";
+        if (threads > 1 && single > 0) report << " (" << gbps / single / threads * 100 << "% per-core efficiency)";
+        if (!stats.error.empty()) report << "  ERROR " << stats.error;
+        report << "\n";
+        if (threads >= maxThreads) break;
+    }
+    return report.str();
+}
+
+// Android sparse images
+// Converts raw partition images to the sparse format fastboot flashes,
+// splitting them into pieces no larger than the device's max-download-size.
+// Like fastboot's own resparse, every piece spans the whole image and covers
+// what it does not carry with DONT_CARE chunks, so each piece flashes on its
+// own. Three stages overlap: a scanner thread reads and classifies 4 KB
+// blocks (SSE2 compare against the block's first word finds zero and fill
+// blocks), the caller's thread writes pieces, and a transfer thread hands
+// finished pieces on (e.g. to fastboot flash) while later ones are produced.
+#define SPARSE_MAGIC 0xED26FF3A
+#define SPARSE_BLOCK 4096
+#define SPARSE_FILE_HEADER 28
+#define SPARSE_CHUNK_HEADER 12
+#define SPARSE_CHUNK_RAW 0xCAC1
+#define SPARSE_CHUNK_FILL 0xCAC2
+#define SPARSE_CHUNK_DONT_CARE 0xCAC3
+#define SPARSE_CHUNK_CRC32 0xCAC4
+#define SPARSE_READ_SIZE (4 * 1024 * 1024)
+#define SPARSE_QUEUE_DEPTH 8
+#define SPARSE_PIECES_AHEAD 2
+#define SPARSE_MIN_DOWNLOAD (64 * 1024)
+
+// Blocking bounded FIFO between pipeline stages. Close() wakes everyone;
+// Pop() then drains what is left and returns false once empty.
+template <typename T>
+class BlockingQueue {
+public:
+    explicit BlockingQueue(size_t capacity) : capacity(capacity), closed(false) {}
+    
+    bool Push(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+        if (closed) return false;
+        items.push_back(T());
+        std::swap(items.back(), item);
+        notEmpty.notify_one();
+        return true;
+    }
+    
+    bool Pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty()) return false;
+        std::swap(item, items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+    
+    void Close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+    
+private:
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+    std::mutex mutex;
+    std::condition_variable notFull, notEmpty;
+};
+
+// True when every 32-bit word of the block equals the first one
+static bool SparseFillBlock(const uint8_t* block, uint32_t& fill) {
+    fill = ReadLE32(block);
+#if defined(__SSE2__) || defined(_M_X64)
+    __m128i pattern = _mm_set1_epi32((int)fill);
+    for (size_t i = 0; i < SPARSE_BLOCK; i += 64) {
+        __m128i a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(block + i)), pattern);
+        __m128i b = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(block + i + 16)), pattern);
+        __m128i c = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(block + i + 32)), pattern);
+        __m128i d = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(block + i + 48)), pattern);
+        if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), _mm_and_si128(c, d))) != 0xFFFF) {
+            return false;
+        }
+    }
+    return true;
+#else
+    for (size_t i = 4; i < SPARSE_BLOCK; i += 4) {
+        if (ReadLE32(block + i) != fill) return false;
+    }
+    return true;
+#endif
+}
+
+// A run of same-kind blocks, scanner -> writer
+struct SparseRun {
+    uint16_t type;              // SPARSE_CHUNK_RAW or SPARSE_CHUNK_FILL
+    uint32_t fill;
+    uint32_t blocks;
+    std::vector<uint8_t> data;  // RAW only
+    
+    SparseRun() : type(0), fill(0), blocks(0) {}
+};
+
+struct SparseStats {
+    uint64_t rawBytes;
+    uint64_t sparseBytes;
+    uint64_t rawBlocks;         // blocks carried as data
+    uint64_t fillBlocks;        // blocks carried as a 4-byte pattern
+    std::vector<std::string> pieces;
+    long long elapsedMs;
+    std::string error;
+    
+    SparseStats() : rawBytes(0), sparseBytes(0), rawBlocks(0), fillBlocks(0), elapsedMs(0) {}
+};
+
+// Called on the transfer thread for each finished piece; false aborts
+typedef std::function<bool(const std::string& path, size_t index)> SparsePieceFunc;
+
+class SparseConverter {
+public:
+    SparseConverter(const std::string& rawPath, const std::string& outPrefix, uint64_t maxDownload)
+        : rawPath(rawPath), outPrefix(outPrefix),
+          limit(std::max<uint64_t>(maxDownload, SPARSE_MIN_DOWNLOAD)),
+          totalBlocks(0), nextBlock(0), pieceBytes(0), pieceChunks(0), inPiece(false),
+          runs(SPARSE_QUEUE_DEPTH), finished(SPARSE_PIECES_AHEAD), failed(false) {}
+    
+    bool Run(SparseStats& stats, const SparsePieceFunc& onPiece, const std::function<bool()>& cancelled) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::ifstream in(rawPath.c_str(), std::ios::binary);
+        if (!in) {
+            stats.error = "cannot open " + rawPath;
+            return false;
+        }
+        in.seekg(0, std::ios::end);
+        stats.rawBytes = (uint64_t)in.tellg();
+        in.seekg(0);
+        totalBlocks = (stats.rawBytes + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+        if (totalBlocks > 0xFFFFFFFFull) {
+            stats.error = "image too large for the sparse format";
+            return false;
+        }
+        
+        std::thread scanner(&SparseConverter::Scan, this, std::ref(in), std::cref(cancelled));
+        std::thread transfer([this, &onPiece] {
+            std::string path;
+            for (size_t index = 0; finished.Pop(path); index++) {
+                if (!failed && onPiece && !onPiece(path, index)) Fail("transfer failed");
+            }
+        });
+        
+        SparseRun run;
+        while (runs.Pop(run)) {
+            if (failed) continue;                       // drain so the scanner can exit
+            if (cancelled && cancelled()) Fail("cancelled");
+            else Add(run, stats);
+        }
+        // The scanner stops early on cancel or a read error
+        if (!failed && cancelled && cancelled()) Fail("cancelled");
+        if (!failed && nextBlock != totalBlocks) Fail("read failed at block " + std::to_string(nextBlock));
+        if (!failed) EndPiece(stats);
+        finished.Close();
+        scanner.join();
+        transfer.join();
+        
+        stats.elapsedMs = CoreMillisecondsSince(start);
+        if (failed) stats.error = error;
+        return !failed;
+    }
+    
+private:
+    std::string rawPath;
+    std::string outPrefix;
+    uint64_t limit;
+    uint64_t totalBlocks;
+    
+    // Writer state
+    uint64_t nextBlock;         // first block not yet written to any piece
+    uint64_t pieceBytes;
+    uint32_t pieceChunks;
+    bool inPiece;
+    std::ofstream piece;
+    std::string piecePath;
+    
+    BlockingQueue<SparseRun> runs;
+    BlockingQueue<std::string> finished;
+    std::atomic<bool> failed;
+    std::mutex errorMutex;
+    std::string error;
+    
+    void Fail(const std::string& why) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        if (!failed) error = why;
+        failed = true;
+        runs.Close();
+    }
+    
+    // Scanner thread: classify blocks and coalesce them into runs
+    void Scan(std::ifstream& in, const std::function<bool()>& cancelled) {
+        std::vector<uint8_t> buffer(SPARSE_READ_SIZE);
+        SparseRun run;
+        for (;;) {
+            if (failed || (cancelled && cancelled())) break;
+            in.read((char*)&buffer[0], buffer.size());
+            size_t got = (size_t)in.gcount();
+            if (got == 0) break;
+            if (got % SPARSE_BLOCK) {
+                // Last block is zero-padded, as fastboot does
+                size_t padded = (got + SPARSE_BLOCK - 1) / SPARSE_BLOCK * SPARSE_BLOCK;
+                memset(&buffer[got], 0, padded - got);
+                got = padded;
+            }
+            for (size_t off = 0; off < got; off += SPARSE_BLOCK) {
+                uint32_t fill;
+                bool isFill = SparseFillBlock(&buffer[off], fill);
+                uint16_t type = isFill ? SPARSE_CHUNK_FILL : SPARSE_CHUNK_RAW;
+                bool extend = run.blocks > 0 && run.type == type &&
+                    (isFill ? run.fill == fill : run.data.size() < SPARSE_READ_SIZE);
+                if (!extend && run.blocks > 0 && !runs.Push(run)) return;
+                if (!extend) {
+                    run.type = type;
+                    run.fill = fill;
+                    run.blocks = 0;
+                    run.data.clear();
                 }
-                
-                case IDC_BTN_FRP_BYPASS: {
-                    int result = MessageBoxA(hWnd, 
-                        "FRP Bypass Methods:\n\n"
-                        "1. ADB Method (requires USB debugging enabled before reset)\n"
-                        "2. Combination File Method (requires specific firmware)\n\n"
-                        "Note: This is for legitimate device recovery only.\n"
-                        "Proceed with ADB FRP bypass?", "FRP Bypass", MB_YESNO | MB_ICONQUESTION);
-                    if (result == IDYES) {
-                        AddLog("Attempting FRP bypass via ADB...");
-                        // FRP bypass sequence for Samsung
-                        ExecuteADBCommand("shell am start -n com.google.android.gsf.login/");
-                        Sleep(1000);
-                        ExecuteADBCommand("shell am start -n com.google.android.gsf.login.LoginActivity");
-                        Sleep(1000);
-                        ExecuteADBCommand("shell content insert --uri content://settings/secure --bind name:s:user_setup_complete --bind value:s:1");
-                        AddLog("FRP bypass commands executed. Check device screen.");
-                    }
-                    break;
+                run.blocks++;
+                if (!isFill) run.data.insert(run.data.end(), &buffer[off], &buffer[off] + SPARSE_BLOCK);
+            }
+            if (!in) break;
+        }
+        if (run.blocks > 0) runs.Push(run);
+        runs.Close();
+    }
+    
+    bool WriteChunk(uint16_t type, uint32_t blocks, const void* data, size_t len) {
+        uint8_t hdr[SPARSE_CHUNK_HEADER];
+        uint32_t total = (uint32_t)(SPARSE_CHUNK_HEADER + len);
+        memcpy(hdr, &type, 2);
+        memset(hdr + 2, 0, 2);
+        memcpy(hdr + 4, &blocks, 4);
+        memcpy(hdr + 8, &total, 4);
+        piece.write((const char*)hdr, sizeof(hdr));
+        if (len) piece.write((const char*)data, len);
+        pieceBytes += total;
+        pieceChunks++;
+        return (bool)piece;
+    }
+    
+    void WriteFileHeader() {
+        uint8_t hdr[SPARSE_FILE_HEADER];
+        uint32_t magic = SPARSE_MAGIC, blockSize = SPARSE_BLOCK, blocks = (uint32_t)totalBlocks;
+        uint16_t major = 1, minor = 0, fileHdr = SPARSE_FILE_HEADER, chunkHdr = SPARSE_CHUNK_HEADER;
+        uint32_t checksum = 0;
+        memcpy(hdr, &magic, 4);
+        memcpy(hdr + 4, &major, 2);
+        memcpy(hdr + 6, &minor, 2);
+        memcpy(hdr + 8, &fileHdr, 2);
+        memcpy(hdr + 10, &chunkHdr, 2);
+        memcpy(hdr + 12, &blockSize, 4);
+        memcpy(hdr + 16, &blocks, 4);
+        memcpy(hdr + 20, &pieceChunks, 4);
+        memcpy(hdr + 24, &checksum, 4);
+        piece.write((const char*)hdr, sizeof(hdr));
+    }
+    
+    bool BeginPiece(SparseStats& stats) {
+        piecePath = outPrefix + "." + std::to_string(stats.pieces.size()) + ".simg";
+        piece.open(piecePath.c_str(), std::ios::binary | std::ios::trunc);
+        if (!piece) {
+            Fail("cannot create " + piecePath);
+            return false;
+        }
+        pieceChunks = 0;
+        WriteFileHeader();                  // chunk count patched in EndPiece
+        pieceBytes = SPARSE_FILE_HEADER;
+        inPiece = true;
+        if (nextBlock > 0) WriteChunk(SPARSE_CHUNK_DONT_CARE, (uint32_t)nextBlock, NULL, 0);
+        return true;
+    }
+    
+    void EndPiece(SparseStats& stats) {
+        if (!inPiece && nextBlock == 0 && !BeginPiece(stats)) return;   // empty image
+        if (!inPiece) return;
+        if (nextBlock < totalBlocks) {
+            WriteChunk(SPARSE_CHUNK_DONT_CARE, (uint32_t)(totalBlocks - nextBlock), NULL, 0);
+        }
+        piece.seekp(0);
+        WriteFileHeader();
+        piece.close();
+        inPiece = false;
+        if (piece.fail()) {
+            Fail("write failed: " + piecePath);
+            return;
+        }
+        stats.sparseBytes += pieceBytes;
+        stats.pieces.push_back(piecePath);
+        std::string path = piecePath;
+        finished.Push(path);                // blocks while the transfer is behind
+    }
+    
+    // Room left in the current piece, keeping space for a closing DONT_CARE
+    uint64_t Room() const {
+        uint64_t used = pieceBytes + SPARSE_CHUNK_HEADER + SPARSE_CHUNK_HEADER;
+        return used < limit ? limit - used : 0;
+    }
+    
+    void Add(const SparseRun& run, SparseStats& stats) {
+        if (run.type == SPARSE_CHUNK_FILL) {
+            if (inPiece && Room() < 4) EndPiece(stats);
+            if (!inPiece && !BeginPiece(stats)) return;
+            WriteChunk(SPARSE_CHUNK_FILL, run.blocks, &run.fill, 4);
+            nextBlock += run.blocks;
+            stats.fillBlocks += run.blocks;
+            return;
+        }
+        uint32_t done = 0;
+        while (done < run.blocks && !failed) {
+            if (inPiece && Room() < SPARSE_BLOCK) EndPiece(stats);
+            if (!inPiece && !BeginPiece(stats)) return;
+            uint32_t n = (uint32_t)std::min<uint64_t>(run.blocks - done, Room() / SPARSE_BLOCK);
+            if (!WriteChunk(SPARSE_CHUNK_RAW, n, &run.data[(size_t)done * SPARSE_BLOCK],
+                            (size_t)n * SPARSE_BLOCK)) {
+                Fail("write failed: " + piecePath);
+                return;
+            }
+            done += n;
+            nextBlock += n;
+            stats.rawBlocks += n;
+        }
+    }
+};
+
+// Round-trip check: expands every piece against the raw image and requires
+// each block to be carried exactly once, with identical content
+bool VerifySparsePieces(const std::string& rawPath, const std::vector<std::string>& pieces,
+                        std::string& error) {
+    std::ifstream raw(rawPath.c_str(), std::ios::binary);
+    if (!raw) {
+        error = "cannot open " + rawPath;
+        return false;
+    }
+    raw.seekg(0, std::ios::end);
+    uint64_t rawSize = (uint64_t)raw.tellg();
+    uint64_t totalBlocks = (rawSize + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+    std::vector<uint8_t> covered((size_t)totalBlocks, 0);
+    std::vector<uint8_t> expect(SPARSE_READ_SIZE), actual(SPARSE_READ_SIZE);
+    
+    // Reads raw image blocks, zero-padding past the end like the converter
+    auto readRaw = [&](uint64_t block, size_t len) {
+        memset(&expect[0], 0, len);
+        uint64_t offset = block * SPARSE_BLOCK;
+        if (offset < rawSize) {
+            raw.clear();
+            raw.seekg((std::streamoff)offset);
+            raw.read((char*)&expect[0], (std::streamsize)std::min<uint64_t>(len, rawSize - offset));
+        }
+    };
+    
+    for (size_t p = 0; p < pieces.size(); p++) {
+        std::ifstream in(pieces[p].c_str(), std::ios::binary);
+        uint8_t hdr[SPARSE_FILE_HEADER];
+        if (!in.read((char*)hdr, sizeof(hdr)) || ReadLE32(hdr) != SPARSE_MAGIC ||
+            ReadLE32(hdr + 12) != SPARSE_BLOCK || ReadLE32(hdr + 16) != totalBlocks) {
+            error = pieces[p] + ": bad sparse header";
+            return false;
+        }
+        uint32_t chunks = ReadLE32(hdr + 20);
+        uint64_t block = 0;
+        for (uint32_t c = 0; c < chunks; c++) {
+            uint8_t ch[SPARSE_CHUNK_HEADER];
+            if (!in.read((char*)ch, sizeof(ch))) {
+                error = pieces[p] + ": truncated";
+                return false;
+            }
+            uint16_t type = (uint16_t)(ch[0] | (ch[1] << 8));
+            uint32_t blocks = ReadLE32(ch + 4);
+            if (block + blocks > totalBlocks) {
+                error = pieces[p] + ": chunk runs past the image";
+                return false;
+            }
+            if (type == SPARSE_CHUNK_RAW || type == SPARSE_CHUNK_FILL) {
+                uint32_t fill = 0;
+                if (type == SPARSE_CHUNK_FILL && !in.read((char*)&fill, 4)) {
+                    error = pieces[p] + ": truncated";
+                    return false;
                 }
-                
-                case IDC_BTN_FLASH: {
-                    OPENFILENAMEA ofn;
-                    char fileName[MAX_PATH] = "";
-                    char params[MAX_PATH + 20] = "";
-                    ZeroMemory(&ofn, sizeof(ofn));
-                    ofn.lStructSize = sizeof(ofn);
-                    ofn.hwndOwner = hWnd;
-                    ofn.lpstrFilter = "Tar/MD5 Files\0*.tar;*.md5;*.tar.md5\0All Files\0*.*\0";
-                    ofn.lpstrFile = fileName;
-                    ofn.nMaxFile = MAX_PATH;
-                    ofn.Flags = OFN_FILEMUSTEXIST;
-                    
-                    if (GetOpenFileNameA(&ofn)) {
-                        std::string fileStr = std::string(fileName);
-                        AddLog("Selected firmware: " + fileStr);
-                        AddLog("Use Odin3 to flash this firmware!");
-                        
-                        // Build parameter string safely
-                        int ret = snprintf(params, sizeof(params), "/select,\"%s\"", fileName);
-                        if (ret > 0 && ret < (int)sizeof(params)) {
-                            ShellExecuteA(NULL, "open", "explorer.exe", 
-                                params, NULL, SW_SHOW);
+                for (uint32_t done = 0; done < blocks; ) {
+                    size_t n = std::min<size_t>(blocks - done, SPARSE_READ_SIZE / SPARSE_BLOCK);
+                    size_t len = n * SPARSE_BLOCK;
+                    readRaw(block + done, len);
+                    if (type == SPARSE_CHUNK_RAW) {
+                        if (!in.read((char*)&actual[0], len)) {
+                            error = pieces[p] + ": truncated";
+                            return false;
                         }
+                    } else {
+                        for (size_t i = 0; i < len; i += 4) memcpy(&actual[i], &fill, 4);
                     }
-                    break;
-                }
-                
-                case IDC_BTN_EXECUTE: {
-                    int sel = (int)SendMessage(g_hComboCmd, CB_GETCURSEL, 0, 0);
-                    if (sel != CB_ERR) {
-                        char cmd[256];
-                        SendMessage(g_hComboCmd, CB_GETLBTEXT, sel, (LPARAM)cmd);
-                        AddLog("Executing: " + std::string(cmd));
-                        std::string result = ExecuteCommand(cmd);
-                        AddLog("Result:\n" + result);
+                    if (memcmp(&expect[0], &actual[0], len) != 0) {
+                        error = pieces[p] + ": content differs near block " + std::to_string(block + done);
+                        return false;
                     }
-                    break;
-                }
-                
-                case IDC_BTN_LOG_CLEAR:
-                    ClearLog();
-                    break;
-                    
-                case IDC_LIST_DEVICES:
-                    if (HIWORD(wParam) == LBN_DBLCLK) {
-                        int sel = (int)SendMessage(g_hDeviceList, LB_GETCURSEL, 0, 0);
-                        if (sel != LB_ERR) {
-                            char device[256];
-                            SendMessage(g_hDeviceList, LB_GETTEXT, sel, (LPARAM)device);
-                            AddLog("Selected device: " + std::string(device));
+                    for (size_t i = 0; i < n; i++) {
+                        if (covered[(size_t)(block + done + i)]++) {
+                            error = "block " + std::to_string(block + done + i) + " carried twice";
+                            return false;
                         }
                     }
-                    break;
+                    done += (uint32_t)n;
+                }
+            } else if (type == SPARSE_CHUNK_CRC32) {
+                in.ignore(4);
+            } else if (type != SPARSE_CHUNK_DONT_CARE) {
+                error = pieces[p] + ": unknown chunk type";
+                return false;
             }
-            break;
+            block += blocks;
+        }
+        if (block != totalBlocks) {
+            error = pieces[p] + ": chunks do not span the image";
+            return false;
+        }
+    }
+    for (size_t i = 0; i < covered.size(); i++) {
+        if (!covered[i]) {
+            error = "block " + std::to_string(i) + " missing from every piece";
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string FormatSparseStats(const std::string& name, const SparseStats& stats) {
+    std::ostringstream out;
+    out << name << ": ";
+    if (!stats.error.empty()) out << "ERROR " << stats.error << " - ";
+    double seconds = stats.elapsedMs / 1000.0;
+    out << std::fixed << std::setprecision(1) << FormatSize(stats.rawBytes) << " raw -> "
+        << FormatSize(stats.sparseBytes) << " sparse in " << stats.pieces.size() << " piece(s), "
+        << stats.rawBlocks << " data / " << stats.fillBlocks << " fill blocks, " << seconds << " s";
+    if (seconds > 0) out << ", " << stats.rawBytes / (1024.0 * 1024.0) / seconds << " MB/s";
+    return out.str();
+}
+
+// Command line: --sparse <raw.img> <out-prefix> [max-download-size] [--verify]
+std::string SparseImageReport(const std::vector<std::string>& args) {
+    if (args.size() < 3) {
+        return "Usage: --sparse <raw.img> <out-prefix> [max-download-size] [--verify]\n";
+    }
+    uint64_t maxDownload = 256ull * 1024 * 1024;
+    bool verify = false;
+    for (size_t i = 3; i < args.size(); i++) {
+        if (args[i] == "--verify") verify = true;
+        else maxDownload = strtoull(args[i].c_str(), NULL, 0);
+    }
+    
+    SparseConverter converter(args[1], args[2], maxDownload);
+    SparseStats stats;
+    bool ok = converter.Run(stats, SparsePieceFunc(), std::function<bool()>());
+    std::string report = FormatSparseStats(FileBaseName(args[1]), stats) + "\n";
+    if (ok && verify) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::string error;
+        report += VerifySparsePieces(args[1], stats.pieces, error) ?
+            "Round trip OK (" + std::to_string(CoreMillisecondsSince(start)) + " ms)\n" :
+            "Round trip FAILED: " + error + "\n";
+    }
+    return report;
+}
+
+// Largest single download the device accepts ("max-download-size: 0x10000000")
+uint64_t FastbootMaxDownloadSize(const std::string& serialArgs) {
+    if (serialArgs.size() > 4) {
+        std::shared_ptr<const FastbootVarTable> info =
+            g_fastbootInfo.Get(serialArgs.substr(3, serialArgs.size() - 4));
+        if (info && info->maxDownloadSize) return info->maxDownloadSize;
+    }
+    std::string out;
+    StreamFastbootCommand(serialArgs + "getvar max-download-size",
+        [&out](const char* data, size_t len) { out.append(data, len); });
+    size_t pos = out.find("max-download-size:");
+    if (pos == std::string::npos) return 0;
+    return strtoull(out.c_str() + pos + 18, NULL, 0);
+}
+
+// "[-s serial] flash <partition> <image>"; serialArgs keeps "-s X " for reuse
+static bool ParseFlashCommand(const std::string& cmd, std::string& serialArgs,
+                              std::string& partition, std::string& image) {
+    std::vector<std::string> argv = SplitCommandLine(cmd);
+    size_t i = 0;
+    serialArgs.clear();
+    if (argv.size() > 1 && argv[0] == "-s") {
+        serialArgs = "-s " + argv[1] + " ";
+        i = 2;
+    }
+    if (argv.size() != i + 3 || argv[i] != "flash") return false;
+    partition = argv[i + 1];
+    image = argv[i + 2];
+    return true;
+}
+
+// Raw images bigger than one download are sparsed and split here, each piece
+// flashed as soon as it is written. Returns false to leave the command to
+// fastboot as-is (already sparse, small enough, or unreadable).
+bool FlashRawImage(const std::string& cmd) {
+    std::string serialArgs, partition, image;
+    if (!ParseFlashCommand(cmd, serialArgs, partition, image)) return false;
+    std::ifstream in(image.c_str(), std::ios::binary);
+    uint8_t magic[4];
+    if (!in.read((char*)magic, 4) || ReadLE32(magic) == SPARSE_MAGIC) return false;
+    in.seekg(0, std::ios::end);
+    uint64_t size = (uint64_t)in.tellg();
+    in.close();
+    
+    uint64_t maxDownload = FastbootMaxDownloadSize(serialArgs);
+    if (maxDownload == 0 || size <= maxDownload) return false;
+    
+    char temp[MAX_PATH];
+    GetTempPathA(MAX_PATH, temp);
+    std::string prefix = std::string(temp) + "s23mgr-" + std::to_string(GetCurrentProcessId()) +
+        "-" + partition;
+    AddLog("Sparsing " + FileBaseName(image) + " (" + FormatSize(size) + ") into pieces of at most " +
+        FormatSize(maxDownload));
+    
+    // The converter's scanner and transfer threads act for this job: pieces
+    // are flashed under its deadline rather than the 10 s default, and a
+    // cancel reaches both threads
+    JobContext* job = t_currentJob;
+    SparseConverter converter(image, prefix, maxDownload);
+    SparseStats stats;
+    bool ok = converter.Run(stats, [&](const std::string& path, size_t index) {
+        AddLog("Flashing " + partition + " piece " + std::to_string(index + 1) + "...");
+        JobContext* outer = t_currentJob;
+        t_currentJob = job;
+        LogLineSink sink;
+        int exitCode = StreamFastbootCommand(serialArgs + "flash " + partition + " " +
+            QuoteArgument(path), sink.Callback());
+        sink.Flush();
+        t_currentJob = outer;
+        DeleteFileA(path.c_str());
+        return exitCode == 0;
+    }, [job] { return job && job->Cancelled(); });
+    
+    // Pieces that were never transferred (abort or cancel)
+    for (size_t i = 0; i < stats.pieces.size(); i++) DeleteFileA(stats.pieces[i].c_str());
+    AddLog(FormatSparseStats("flash " + partition, stats));
+    if (!ok) AddLog("Flash of " + partition + " did not complete");
+    return true;
+}
+
+// Native fastboot over TCP
+// Speaks the fastboot protocol directly to devices reachable as
+// tcp:<host>[:port] (fastbootd and network-capable bootloaders) instead of
+// spawning fastboot.exe per command. The TCP transport opens with an "FB01"
+// handshake, after which every message in either direction is framed by an
+// 8-byte big-endian length. One session per device stays open across
+// commands. getvar batches are pipelined: all queries go out in one send and
+// the replies are read back in order. Downloads are read ahead on a second
+// thread into a few large pooled buffers, each sent as a single frame, so the
+// link never waits on the disk. USB devices still go through fastboot.exe.
+#define FASTBOOT_TCP_PORT 5554
+#define FASTBOOT_HANDSHAKE "FB01"
+#define FASTBOOT_FRAME_HEADER 8
+#define FASTBOOT_MAX_REPLY 65536
+#define FASTBOOT_IO_TIMEOUT_MS 30000
+#define FASTBOOT_WRITE_TIMEOUT_MS (10 * 60 * 1000)  // flash/erase of large partitions
+#define FASTBOOT_CHUNK_SIZE (4 * 1024 * 1024)
+#define FASTBOOT_CHUNKS_AHEAD 3
+#define FASTBOOT_SOCKET_BUFFER (4 * 1024 * 1024)
+
+static void WriteBE64(uint8_t* p, uint64_t v) {
+    for (int i = 7; i >= 0; i--, v >>= 8) p[i] = (uint8_t)v;
+}
+
+static uint64_t ReadBE64(const uint8_t* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = (v << 8) | p[i];
+    return v;
+}
+
+// Time spent per protocol phase
+struct FastbootTimings {
+    long long commandMs;        // command round trips (getvar, oem, download: handshake...)
+    long long downloadMs;       // download data until the device acknowledges it
+    long long writeMs;          // flash:/erase: until the device reports the write done
+    uint64_t downloadBytes;
+    size_t commands;
+    
+    FastbootTimings() : commandMs(0), downloadMs(0), writeMs(0), downloadBytes(0), commands(0) {}
+};
+
+struct FastbootVar {
+    std::string name;
+    std::string value;          // the FAIL message when !found
+    bool found;
+    
+    explicit FastbootVar(const std::string& name = "") : name(name), found(false) {}
+};
+
+typedef std::function<void(const std::string& line)> FastbootInfoFunc;
+
+class FastbootTcpSession {
+public:
+    FastbootTcpSession(const std::string& host, int port)
+        : host(host), port(port), s(INVALID_SOCKET), maxDownload(0),
+          chunkSize(FASTBOOT_CHUNK_SIZE), chunksAhead(FASTBOOT_CHUNKS_AHEAD) {}
+    ~FastbootTcpSession() { Close(); }
+    
+    // Held by whoever drives the session for the length of one command
+    std::mutex& Mutex() { return mutex; }
+    
+    std::string Endpoint() const { return host + ":" + std::to_string(port); }
+    bool Connected() const { return s != INVALID_SOCKET; }
+    
+    // Download buffer size and read-ahead depth (benchmarks vary these)
+    void SetDownloadBuffers(size_t size, size_t ahead) {
+        chunkSize = std::max<size_t>(size, 4096);
+        chunksAhead = std::max<size_t>(ahead, 1);
+    }
+    
+    bool Connect(std::string& error) {
+        if (Connected()) return true;
+        addrinfo hints, *found = NULL;
+        ZeroMemory(&hints, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) != 0 || !found) {
+            error = "Error: cannot resolve " + host;
+            return false;
+        }
+        for (addrinfo* a = found; a && s == INVALID_SOCKET; a = a->ai_next) {
+            s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (s == INVALID_SOCKET) continue;
+            SetTimeout(FASTBOOT_IO_TIMEOUT_MS);
+            BOOL noDelay = TRUE;
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+            int buffer = FASTBOOT_SOCKET_BUFFER;
+            setsockopt(s, SOL_SOCKET, SO_SNDBUF, (const char*)&buffer, sizeof(buffer));
+            if (connect(s, a->ai_addr, (int)a->ai_addrlen) == SOCKET_ERROR) {
+                closesocket(s);
+                s = INVALID_SOCKET;
+            }
+        }
+        freeaddrinfo(found);
+        
+        if (s == INVALID_SOCKET) {
+            error = "Error: cannot connect to fastboot at " + Endpoint();
+            return false;
+        }
+        char reply[4];
+        if (!SocketSendAll(s, FASTBOOT_HANDSHAKE, 4) || !SocketReadExact(s, reply, 4)) {
+            error = "Error: no fastboot handshake from " + Endpoint();
+        } else if (reply[0] != 'F' || reply[1] != 'B' || atoi(std::string(reply + 2, 2).c_str()) < 1) {
+            error = "Error: unsupported fastboot transport version from " + Endpoint();
+        } else {
+            return true;
+        }
+        Close();
+        return false;
+    }
+    
+    void Close() {
+        if (s != INVALID_SOCKET) closesocket(s);
+        s = INVALID_SOCKET;
+        maxDownload = 0;
+    }
+    
+    // Sends one command and waits for its final reply; INFO/TEXT messages go
+    // to onInfo. True on OKAY (reply = its payload). On FAIL reply holds the
+    // device's message; transport errors close the session and start with
+    // "Error:".
+    bool Command(const std::string& cmd, std::string& reply, const FastbootInfoFunc& onInfo,
+                 long long& elapsedMs, DWORD timeoutMs = FASTBOOT_IO_TIMEOUT_MS) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::string tag;
+        bool ok = Connect(reply) && Send(cmd, reply) &&
+                  ReadResponse(tag, reply, onInfo, timeoutMs) && tag == "OKAY";
+        elapsedMs = CoreMillisecondsSince(start);
+        if (ok || tag == "FAIL") return ok;
+        if (tag == "DATA") reply = "Error: unexpected DATA reply to " + cmd;
+        Close();
+        return false;
+    }
+    
+    // Pipelined getvar: every query is sent before the first reply is read
+    bool GetVars(std::vector<FastbootVar>& vars, FastbootTimings& timings, std::string& error) {
+        if (vars.empty()) return true;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (!Connect(error)) return false;
+        std::string batch;
+        for (size_t i = 0; i < vars.size(); i++) {
+            std::string cmd = "getvar:" + vars[i].name;
+            uint8_t header[FASTBOOT_FRAME_HEADER];
+            WriteBE64(header, cmd.size());
+            batch.append((const char*)header, sizeof(header));
+            batch += cmd;
+        }
+        bool ok = SocketSendAll(s, batch.data(), batch.size());
+        if (!ok) error = "Error: send to " + Endpoint() + " failed";
+        for (size_t i = 0; ok && i < vars.size(); i++) {
+            std::string tag;
+            ok = ReadResponse(tag, vars[i].value, FastbootInfoFunc(), FASTBOOT_IO_TIMEOUT_MS) &&
+                 (tag == "OKAY" || tag == "FAIL");
+            vars[i].found = tag == "OKAY";
+            if (!ok) error = tag.empty() ? vars[i].value : "Error: unexpected " + tag + " reply to getvar";
+        }
+        timings.commandMs += CoreMillisecondsSince(start);
+        timings.commands += vars.size();
+        if (!ok) Close();
+        return ok;
+    }
+    
+    // max-download-size, queried once per session
+    uint64_t MaxDownloadSize(FastbootTimings& timings) {
+        if (maxDownload == 0) {
+            std::vector<FastbootVar> vars(1, FastbootVar("max-download-size"));
+            std::string error;
+            if (GetVars(vars, timings, error) && vars[0].found) {
+                maxDownload = strtoull(vars[0].value.c_str(), NULL, 0);
+            }
+        }
+        return maxDownload;
+    }
+    
+    // download:<size>, then the data as chunkSize frames filled ahead of the
+    // socket by a reader thread through a small pool of buffers
+    bool Download(const ReadAtFunc& read, uint64_t size, FastbootTimings& timings, std::string& error) {
+        if (size == 0 || size > 0xFFFFFFFFull) {
+            error = "image size " + std::to_string(size) + " cannot be downloaded";
+            return false;
+        }
+        char cmd[32];
+        snprintf(cmd, sizeof(cmd), "download:%08x", (unsigned int)size);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::string tag;
+        bool ok = Connect(error) && Send(cmd, error) &&
+                  ReadResponse(tag, error, FastbootInfoFunc(), FASTBOOT_IO_TIMEOUT_MS);
+        timings.commandMs += CoreMillisecondsSince(start);
+        timings.commands++;
+        if (!ok || tag != "DATA") {
+            if (tag != "FAIL") Close();
+            if (ok && tag != "FAIL") error = "Error: unexpected " + tag + " reply to download";
+            return false;
         }
-        
-        case WM_UPDATE_LOG: {
-            std::string* msg = (std::string*)lParam;
-            if (msg) {
-                std::lock_guard<std::mutex> lock(g_logMutex);
-                int len = GetWindowTextLength(g_hLog);
-                SendMessage(g_hLog, EM_SETSEL, len, len);
-                SendMessage(g_hLog, EM_REPLACESEL, 0, (LPARAM)(msg->c_str()));
-                SendMessage(g_hLog, EM_REPLACESEL, 0, (LPARAM)("\r\n"));
-                SendMessage(g_hLog, EM_SCROLLCARET, 0, 0);
-                delete msg;
-            }
-            return 0;
+        if (strtoull(error.c_str(), NULL, 16) != size) {
+            error = "Error: device accepted " + error + " bytes instead of " + std::to_string(size);
+            Close();
+            return false;
         }
+        error.clear();
         
-        case WM_PAINT: {
-            PAINTSTRUCT ps;
-            HDC hdc = BeginPaint(hWnd, &ps);
-            
-            // Draw modern background
-            RECT rect;
-            GetClientRect(hWnd, &rect);
-            DrawGradient(hdc, &rect, COLOR_BG, RGB(20, 20, 25));
-            
-            EndPaint(hWnd, &ps);
-            break;
+        start = std::chrono::steady_clock::now();
+        BlockingQueue<std::vector<uint8_t> > filled(chunksAhead), empty(chunksAhead + 1);
+        for (size_t i = 0; i < chunksAhead + 1; i++) {
+            std::vector<uint8_t> buffer(FASTBOOT_FRAME_HEADER + chunkSize);
+            empty.Push(buffer);
         }
+        std::thread reader([&] {
+            std::vector<uint8_t> buffer;
+            for (uint64_t pos = 0; pos < size && empty.Pop(buffer); ) {
+                buffer.resize(FASTBOOT_FRAME_HEADER + chunkSize);
+                size_t got = read(pos, &buffer[FASTBOOT_FRAME_HEADER],
+                    (size_t)std::min<uint64_t>(chunkSize, size - pos));
+                if (got == 0) break;                    // short read: the sender sees the gap
+                buffer.resize(FASTBOOT_FRAME_HEADER + got);
+                WriteBE64(&buffer[0], got);
+                pos += got;
+                if (!filled.Push(buffer)) break;
+            }
+            filled.Close();
+        });
         
-        case WM_CTLCOLORSTATIC: {
-            HDC hdcStatic = (HDC)wParam;
-            SetTextColor(hdcStatic, COLOR_TEXT);
-            SetBkMode(hdcStatic, TRANSPARENT);
-            return (LRESULT)GetStockObject(NULL_BRUSH);
+        uint64_t sent = 0;
+        int lastPercent = -1;
+        std::vector<uint8_t> buffer;
+        while (ok && filled.Pop(buffer)) {
+            if (CurrentJobCancelled()) {
+                error = "cancelled";
+                ok = false;
+            } else if (!SocketSendAll(s, (const char*)&buffer[0], buffer.size())) {
+                error = "Error: send to " + Endpoint() + " failed";
+                ok = false;
+            } else {
+                sent += buffer.size() - FASTBOOT_FRAME_HEADER;
+                int percent = (int)(sent * 100 / size);
+                if (t_currentJob && percent != lastPercent) t_currentJob->Progress(percent);
+                lastPercent = percent;
+                empty.Push(buffer);
+            }
         }
-        
-        case WM_DESTROY:
-            g_running = false;
-            PostQuitMessage(0);
-            break;
-            
-        default:
-            return DefWindowProc(hWnd, message, wParam, lParam);
+        empty.Close();
+        filled.Close();
+        reader.join();
+        if (ok && sent != size) {
+            error = "read failed at offset " + std::to_string(sent);
+            ok = false;
+        }
+        ok = ok && ReadResponse(tag, error, FastbootInfoFunc(), FASTBOOT_IO_TIMEOUT_MS) && tag == "OKAY";
+        timings.downloadMs += CoreMillisecondsSince(start);
+        timings.downloadBytes += sent;
+        // The device is left mid-transfer unless it answered
+        if (!ok && tag != "FAIL") Close();
+        return ok;
+    }
+    
+    // flash:/erase: and friends that write storage; timed as the write phase
+    bool Write(const std::string& cmd, std::string& reply, const FastbootInfoFunc& onInfo,
+               FastbootTimings& timings) {
+        long long elapsed = 0;
+        bool ok = Command(cmd, reply, onInfo, elapsed, FASTBOOT_WRITE_TIMEOUT_MS);
+        timings.writeMs += elapsed;
+        timings.commands++;
+        return ok;
     }
-    return 0;
-}
 
-// Helper function to execute shell commands
-std::string ExecuteCommand(const char* cmd, bool wait) {
-    SECURITY_ATTRIBUTES sa;
-    sa.nLength = sizeof(SECURITY_ATTRIBUTES);
-    sa.bInheritHandle = TRUE;
-    sa.lpSecurityDescriptor = NULL;
+private:
+    std::string host;
+    int port;
+    SOCKET s;
+    uint64_t maxDownload;
+    size_t chunkSize;
+    size_t chunksAhead;
+    std::mutex mutex;
     
-    HANDLE hRead = NULL, hWrite = NULL;
-    if (!CreatePipe(&hRead, &hWrite, &sa, 0)) {
-        return "Error: Failed to create pipe";
+    void SetTimeout(DWORD ms) {
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&ms, sizeof(ms));
+        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char*)&ms, sizeof(ms));
     }
     
-    STARTUPINFOA si;
-    PROCESS_INFORMATION pi;
-    ZeroMemory(&si, sizeof(si));
-    si.cb = sizeof(si);
-    si.hStdError = hWrite;
-    si.hStdOutput = hWrite;
-    si.dwFlags |= STARTF_USESTDHANDLES | STARTF_USESHOWWINDOW;
-    si.wShowWindow = SW_HIDE;
+    bool Send(const std::string& cmd, std::string& error) {
+        std::string frame(FASTBOOT_FRAME_HEADER, '\0');
+        WriteBE64((uint8_t*)&frame[0], cmd.size());
+        frame += cmd;
+        if (SocketSendAll(s, frame.data(), frame.size())) return true;
+        error = "Error: send to " + Endpoint() + " failed";
+        return false;
+    }
     
-    ZeroMemory(&pi, sizeof(pi));
+    // Reads messages until a final one (OKAY/FAIL/DATA); tag is empty and
+    // payload holds the error when the transport fails
+    bool ReadResponse(std::string& tag, std::string& payload, const FastbootInfoFunc& onInfo,
+                      DWORD timeoutMs) {
+        if (timeoutMs != FASTBOOT_IO_TIMEOUT_MS) SetTimeout(timeoutMs);
+        bool ok;
+        for (;;) {
+            tag.clear();
+            uint8_t header[FASTBOOT_FRAME_HEADER];
+            ok = SocketReadExact(s, (char*)header, sizeof(header));
+            uint64_t len = ok ? ReadBE64(header) : 0;
+            if (!ok || len < 4 || len > FASTBOOT_MAX_REPLY) {
+                payload = "Error: " + std::string(ok ? "malformed reply" : "no reply") + " from " + Endpoint();
+                ok = false;
+                break;
+            }
+            std::string message((size_t)len, '\0');
+            if (!SocketReadExact(s, &message[0], message.size())) {
+                payload = "Error: truncated reply from " + Endpoint();
+                ok = false;
+                break;
+            }
+            tag = message.substr(0, 4);
+            payload = message.substr(4);
+            if (tag == "INFO" || tag == "TEXT") {
+                if (onInfo) onInfo(payload);
+                continue;
+            }
+            if (tag != "OKAY" && tag != "FAIL" && tag != "DATA") {
+                payload = "Error: unknown reply " + tag + " from " + Endpoint();
+                tag.clear();
+                ok = false;
+            }
+            break;
+        }
+        if (timeoutMs != FASTBOOT_IO_TIMEOUT_MS) SetTimeout(FASTBOOT_IO_TIMEOUT_MS);
+        return ok;
+    }
+};
+
+// Open sessions by serial ("tcp:192.168.1.20" or "tcp:192.168.1.20:5554")
+class FastbootSessions {
+public:
+    static bool IsTcpSerial(const std::string& serial) { return serial.compare(0, 4, "tcp:") == 0; }
     
-    char cmdLine[1024];
-    int ret = snprintf(cmdLine, sizeof(cmdLine), "cmd.exe /c %s", cmd);
-    if (ret < 0 || ret >= (int)sizeof(cmdLine)) {
-        CloseHandle(hRead);
-        CloseHandle(hWrite);
-        return "Error: Command too long";
+    std::shared_ptr<FastbootTcpSession> Get(const std::string& serial) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<FastbootTcpSession>& session = sessions[serial];
+        if (!session) {
+            std::string endpoint = serial.substr(4);
+            size_t colon = endpoint.rfind(':');
+            int port = colon == std::string::npos ? FASTBOOT_TCP_PORT : atoi(endpoint.c_str() + colon + 1);
+            session = std::make_shared<FastbootTcpSession>(endpoint.substr(0, colon), port);
+        }
+        return session;
     }
     
-    std::string result;
-    if (CreateProcessA(NULL, cmdLine, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi)) {
-        if (wait) {
-            WaitForSingleObject(pi.hProcess, 10000); // 10 second timeout
-            
-            CloseHandle(hWrite);
-            hWrite = NULL;
-            
-            char buffer[4096];
-            DWORD bytesRead = 0;
-            while (ReadFile(hRead, buffer, sizeof(buffer)-1, &bytesRead, NULL) && bytesRead > 0) {
-                buffer[bytesRead] = '\0';
-                result += buffer;
-            }
-        } else {
-            CloseHandle(hWrite);
-            hWrite = NULL;
+    // Drops the connection; fastboot.exe needs the device's single TCP slot
+    void Close(const std::string& serial) {
+        std::shared_ptr<FastbootTcpSession> session;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::map<std::string, std::shared_ptr<FastbootTcpSession> >::iterator it = sessions.find(serial);
+            if (it == sessions.end()) return;
+            session = it->second;
+            sessions.erase(it);
         }
-        CloseHandle(pi.hProcess);
-        CloseHandle(pi.hThread);
-    } else {
-        CloseHandle(hWrite);
-        hWrite = NULL;
-        result = "Error: Failed to execute command";
+        std::lock_guard<std::mutex> lock(session->Mutex());
+        session->Close();
+    }
+
+private:
+    std::mutex mutex;
+    std::map<std::string, std::shared_ptr<FastbootTcpSession> > sessions;
+};
+
+FastbootSessions g_fastbootSessions;
+
+// "OKAY [  0.012s]", as fastboot.exe prints it
+static std::string FastbootStatus(bool ok, const std::string& reply, long long ms) {
+    if (!ok) {
+        return reply.compare(0, 6, "Error:") == 0 ? "FAILED (" + reply.substr(7) + ")\n" :
+            "FAILED (remote: '" + reply + "')\n";
+    }
+    char line[64];
+    snprintf(line, sizeof(line), "OKAY [%7.3fs]\n", ms / 1000.0);
+    return line;
+}
+
+std::string FormatFastbootTimings(const FastbootTimings& t) {
+    std::ostringstream out;
+    out << "Timing: " << t.commands << " command(s) " << t.commandMs << " ms, download "
+        << t.downloadMs << " ms";
+    if (t.downloadBytes > 0) {
+        out << " (" << FormatSize(t.downloadBytes);
+        if (t.downloadMs > 0) {
+            out << ", " << std::fixed << std::setprecision(1)
+                << t.downloadBytes / (1024.0 * 1024.0) / (t.downloadMs / 1000.0) << " MB/s";
+        }
+        out << ")";
+    }
+    out << ", write " << t.writeMs << " ms";
+    return out.str();
+}
+
+static const char* FastbootFlag(int value) {
+    return value == FASTBOOT_UNKNOWN ? "?" : value ? "yes" : "no";
+}
+
+// "R5CW... (dm1q, bootloader): unlocked no, secure yes, slot a of 2, ..."
+// followed by one line per slot and partition
+std::string FormatFastbootInfo(const FastbootVarTable& info) {
+    std::ostringstream out;
+    std::string serial = info.Value("serialno"), product = info.Value("product");
+    out << (serial.empty() ? "fastboot device" : serial) << " (" << (product.empty() ? "?" : product)
+        << (info.userspace == 1 ? ", fastbootd" : info.userspace == 0 ? ", bootloader" : "") << "): "
+        << "unlocked " << FastbootFlag(info.unlocked);
+    if (info.criticalUnlocked != FASTBOOT_UNKNOWN) out << ", critical unlocked " << FastbootFlag(info.criticalUnlocked);
+    if (info.tampered != FASTBOOT_UNKNOWN) out << ", tampered " << FastbootFlag(info.tampered);
+    out << ", secure " << FastbootFlag(info.secure);
+    if (info.currentSlot) out << ", slot " << info.currentSlot << " of " << info.slotCount;
+    if (info.maxDownloadSize) out << ", max download " << FormatSize(info.maxDownloadSize);
+    out << ", " << info.Size() << " variables";
+    for (size_t i = 0; i < info.slots.size(); i++) {
+        const FastbootVarTable::Slot& slot = info.slots[i];
+        out << "\n  slot " << slot.name << ": successful " << FastbootFlag(slot.successful)
+            << ", unbootable " << FastbootFlag(slot.unbootable);
+        if (slot.retryCount != FASTBOOT_UNKNOWN) out << ", retries " << slot.retryCount;
+    }
+    for (size_t i = 0; i < info.partitions.size(); i++) {
+        const FastbootVarTable::Partition& p = info.partitions[i];
+        out << "\n  " << std::left << std::setw(20) << info.PartitionName(p) << std::setw(8)
+            << (p.typeLen ? info.PartitionType(p) : "?") << (p.size ? FormatSize(p.size) : "?")
+            << (p.logical == 1 ? "  logical" : "");
+    }
+    return out.str();
+}
+
+// Command line: --getvar <output.txt>... parses saved getvar all / oem
+// device-info output into one table and prints it
+std::string FastbootInfoReport(const std::vector<std::string>& args) {
+    if (args.size() < 2) return "Usage: --getvar <output.txt>...\n";
+    FastbootVarTable info;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 1; i < args.size(); i++) {
+        std::ifstream in(args[i].c_str(), std::ios::binary);
+        if (!in) return "Error: cannot open " + args[i] + "\n";
+        std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        info.Parse(text.data(), text.size());
+    }
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+    return FormatFastbootInfo(info) + "\nParsed in " +
+        std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()) + " us\n";
+}
+
+// Maps a fastboot argument string for a tcp: device onto its session.
+// Returns false for USB devices and for commands not covered here (anything
+// that needs host-side image handling, e.g. sparse images bigger than one
+// download), which fastboot.exe then runs.
+bool FastbootNativeCommand(const std::string& args, const OutputCallback& onOutput, int& exitCode) {
+    std::vector<std::string> argv = SplitCommandLine(args);
+    if (argv.size() < 3 || argv[0] != "-s" || !FastbootSessions::IsTcpSerial(argv[1])) return false;
+    std::string verb = argv[2];
+    std::vector<std::string> rest(argv.begin() + 3, argv.end());
+    
+    std::string cmd;
+    if (verb == "oem" || verb == "flashing") {
+        cmd = verb;
+        for (size_t i = 0; i < rest.size(); i++) cmd += " " + rest[i];
+    } else if (verb == "reboot" && rest.size() <= 1) {
+        cmd = rest.empty() ? "reboot" : "reboot-" + rest[0];
+    } else if ((verb == "erase" || verb == "set_active") && rest.size() == 1) {
+        cmd = verb + ":" + rest[0];
+    } else if (verb != "getvar" && verb != "flash") {
+        return false;
+    }
+    if (verb == "getvar" && rest.empty()) return false;
+    if (verb == "flash" && rest.size() != 2) return false;
+    
+    HANDLE image = INVALID_HANDLE_VALUE;
+    LARGE_INTEGER imageSize;
+    imageSize.QuadPart = 0;
+    if (verb == "flash") {
+        image = CreateFileA(rest[1].c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (image == INVALID_HANDLE_VALUE) return false;    // fastboot.exe reports it
+        GetFileSizeEx(image, &imageSize);
     }
     
-    if (hRead) CloseHandle(hRead);
-    if (hWrite) CloseHandle(hWrite);
+    std::shared_ptr<FastbootTcpSession> session = g_fastbootSessions.Get(argv[1]);
+    std::unique_lock<std::mutex> lock(session->Mutex());
+    std::string unreachable;
+    if (!session->Connect(unreachable)) {
+        // Unresolvable or unreachable: fastboot.exe tries and reports it
+        if (image != INVALID_HANDLE_VALUE) CloseHandle(image);
+        return false;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    FastbootTimings timings;
+    std::string reply, text;
+    bool ok = true;
+    FastbootInfoFunc onInfo = [&onOutput](const std::string& line) {
+        std::string out = "(bootloader) " + line + "\n";
+        onOutput(out.data(), out.size());
+    };
     
-    // Clean up result - convert single \n to \r\n for Windows edit control
-    std::string cleaned;
-    cleaned.reserve(result.size());
-    for (size_t i = 0; i < result.size(); i++) {
-        if (result[i] == '\n' && (i == 0 || result[i-1] != '\r')) {
-            cleaned += '\r';
-            cleaned += '\n';
+    if (verb == "flash") {
+        uint64_t maxDownload = session->MaxDownloadSize(timings);
+        if (!session->Connected() || (maxDownload && (uint64_t)imageSize.QuadPart > maxDownload)) {
+            // Unreachable, or needs resparsing: leave it to fastboot.exe
+            CloseHandle(image);
+            return false;
+        }
+        ReadAtFunc read = [image](uint64_t pos, void* buffer, size_t len) -> size_t {
+            OVERLAPPED ov;
+            ZeroMemory(&ov, sizeof(ov));
+            ov.Offset = (DWORD)pos;
+            ov.OffsetHigh = (DWORD)(pos >> 32);
+            DWORD got = 0;
+            return ReadFile(image, buffer, (DWORD)len, &got, &ov) ? got : 0;
+        };
+        text = "Sending '" + rest[0] + "' (" + std::to_string(imageSize.QuadPart / 1024) + " KB)  ";
+        onOutput(text.data(), text.size());
+        long long before = timings.commandMs + timings.downloadMs;
+        ok = session->Download(read, (uint64_t)imageSize.QuadPart, timings, reply);
+        text = FastbootStatus(ok, reply, timings.commandMs + timings.downloadMs - before);
+        onOutput(text.data(), text.size());
+        CloseHandle(image);
+        if (ok) {
+            text = "Writing '" + rest[0] + "'  ";
+            onOutput(text.data(), text.size());
+            ok = session->Write("flash:" + rest[0], reply, onInfo, timings);
+            text = FastbootStatus(ok, reply, timings.writeMs);
+            onOutput(text.data(), text.size());
+        }
+    } else if (verb == "getvar" && rest.size() == 1 && rest[0] == "all") {
+        long long elapsed = 0;
+        ok = session->Command("getvar:all", reply, onInfo, elapsed);
+        timings.commandMs += elapsed;
+        timings.commands++;
+        if (!ok) {
+            text = "getvar:all " + FastbootStatus(false, reply, elapsed);
+            onOutput(text.data(), text.size());
+        }
+    } else if (verb == "getvar") {
+        // fastboot.exe takes one variable; several are batched into one round trip
+        std::vector<FastbootVar> vars;
+        for (size_t i = 0; i < rest.size(); i++) vars.push_back(FastbootVar(rest[i]));
+        ok = session->GetVars(vars, timings, reply);
+        for (size_t i = 0; ok && i < vars.size(); i++) {
+            text = vars[i].found ? vars[i].name + ": " + vars[i].value + "\n" :
+                "getvar:" + vars[i].name + " " + FastbootStatus(false, vars[i].value, 0);
+            onOutput(text.data(), text.size());
+            if (!vars[i].found) ok = false;
+        }
+        if (!ok && !reply.empty()) {
+            text = FastbootStatus(false, reply, 0);
+            onOutput(text.data(), text.size());
+        }
+    } else {
+        long long elapsed = 0;
+        if (verb == "erase") {
+            ok = session->Write(cmd, reply, onInfo, timings);
+            elapsed = timings.writeMs;
         } else {
-            cleaned += result[i];
+            ok = session->Command(cmd, reply, onInfo, elapsed);
+            timings.commandMs += elapsed;
+            timings.commands++;
         }
+        text = FastbootStatus(ok, reply, elapsed);
+        onOutput(text.data(), text.size());
     }
     
-    return cleaned;
+    if (verb == "reboot" || (verb == "flashing" && ok)) {
+        // The device drops the connection; the next command reconnects
+        session->Close();
+    }
+    lock.unlock();
+    
+    char finished[64];
+    snprintf(finished, sizeof(finished), "Finished. Total time: %.3fs\n",
+        CoreMillisecondsSince(start) / 1000.0);
+    text = FormatFastbootTimings(timings) + "\n" + finished;
+    onOutput(text.data(), text.size());
+    exitCode = ok ? 0 : 1;
+    return true;
 }
 
-void AddLog(const std::string& msg) {
-    SYSTEMTIME st;
-    GetLocalTime(&st);
-    char timestamp[32];
-    snprintf(timestamp, sizeof(timestamp), "[%02d:%02d:%02d] ", 
-        st.wHour, st.wMinute, st.wSecond);
+// Runs a fastboot command line (without the leading "fastboot"), natively for
+// tcp: devices when possible, otherwise by spawning fastboot.exe
+int StreamFastbootCommand(const std::string& args, const OutputCallback& onOutput) {
+    std::string key = CommandDeviceKey("fastboot " + args);
+    std::string serial = key.substr(key.find(':') + 1);
+    JournalCommand journal(serial, "fastboot " + args);
+    OutputCallback output = journal.Tee(onOutput);
     
-    std::string* fullMsg = new std::string(timestamp + msg);
-    PostMessage(g_hWnd, WM_UPDATE_LOG, 0, (LPARAM)fullMsg);
+    int exitCode = -1;
+    if (FastbootNativeCommand(args, output, exitCode)) return journal.Exit(exitCode);
+    if (FastbootSessions::IsTcpSerial(serial)) g_fastbootSessions.Close(serial);
+    if (g_fastbootPath.empty()) {
+        static const char notFound[] = "ERROR: Fastboot not found!";
+        output(notFound, sizeof(notFound) - 1);
+        return journal.Exit(-1);
+    }
+    std::vector<std::string> argv = SplitCommandLine(args);
+    argv.insert(argv.begin(), g_fastbootPath);
+    ProcessResult pr = RunProcess(argv, output, DefaultCommandTimeout());
+    if (!pr.started) {
+        output(pr.error.data(), pr.error.size());
+        return journal.Exit(-1);
+    }
+    return journal.Exit((int)pr.exitCode);
 }
 
-void ClearLog() {
-    SetWindowTextA(g_hLog, "");
-    AddLog("Log cleared");
-}
+// Local stand-in for a fastboot device on the TCP transport: answers getvar
+// from a fixed table, accepts downloads into a discarding sink and
+// acknowledges flash/erase/oem/reboot. One client at a time, on loopback.
+class FastbootStandIn {
+public:
+    FastbootStandIn() : listener(INVALID_SOCKET), client(INVALID_SOCKET), stopping(false), received(0) {}
+    ~FastbootStandIn() { Stop(); }
+    
+    // Returns the bound port (port 0 picks a free one), or 0 on failure
+    int Start(int port) {
+        listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listener == INVALID_SOCKET) return 0;
+        sockaddr_in addr;
+        ZeroMemory(&addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((u_short)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int len = sizeof(addr);
+        if (bind(listener, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+            listen(listener, 1) == SOCKET_ERROR ||
+            getsockname(listener, (sockaddr*)&addr, &len) == SOCKET_ERROR) {
+            closesocket(listener);
+            listener = INVALID_SOCKET;
+            return 0;
+        }
+        server = std::thread(&FastbootStandIn::Serve, this);
+        return ntohs(addr.sin_port);
+    }
+    
+    void Stop() {
+        stopping = true;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (client != INVALID_SOCKET) shutdown(client, SD_BOTH);
+        }
+        if (listener != INVALID_SOCKET) {
+            shutdown(listener, SD_BOTH);            // wakes accept() where closing alone doesn't
+            closesocket(listener);
+        }
+        listener = INVALID_SOCKET;
+        if (server.joinable()) server.join();
+    }
+    
+    uint64_t BytesReceived() const { return received; }
+    
+    // Variables the stand-in reports, in "getvar all" order
+    static const char* const* Vars() {
+        static const char* const vars[] = {
+            "version", "0.4",
+            "product", "dm1q",
+            "serialno", "R5CW10STANDIN",
+            "secure", "yes",
+            "unlocked", "no",
+            "is-userspace", "yes",
+            "max-download-size", "0x10000000",
+            "slot-count", "2",
+            "current-slot", "a",
+            "slot-successful:a", "yes",
+            "slot-unbootable:b", "no",
+            "partition-type:boot", "raw",
+            "partition-size:boot", "0x4000000",
+            "partition-type:vendor_boot", "raw",
+            "partition-size:vendor_boot", "0x4000000",
+            "partition-type:super", "raw",
+            "partition-size:super", "0x2A0000000",
+            "partition-type:userdata", "f2fs",
+            "partition-size:userdata", "0x3800000000",
+            NULL
+        };
+        return vars;
+    }
 
-void DetectDevices() {
-    AddLog("Scanning for devices...");
-    SendMessage(g_hProgress, PBM_SETPOS, 10, 0);
+private:
+    SOCKET listener, client;
+    std::atomic<bool> stopping;
+    std::atomic<uint64_t> received;
+    std::mutex mutex;
+    std::thread server;
     
-    // Clear list
-    SendMessage(g_hDeviceList, LB_RESETCONTENT, 0, 0);
+    void Serve() {
+        while (!stopping) {
+            SOCKET s = accept(listener, NULL, NULL);
+            if (s == INVALID_SOCKET) break;
+            BOOL noDelay = TRUE;       // replies are small; don't hold them for ACKs
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                client = s;
+            }
+            if (stopping) shutdown(s, SD_BOTH);
+            Session(s);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                client = INVALID_SOCKET;
+            }
+            closesocket(s);
+        }
+    }
     
-    // Check ADB devices
-    std::string adbResult = ExecuteCommand("adb devices -l");
-    SendMessage(g_hProgress, PBM_SETPOS, 50, 0);
+    static bool Reply(SOCKET s, const std::string& message) {
+        std::string frame(FASTBOOT_FRAME_HEADER, '\0');
+        WriteBE64((uint8_t*)&frame[0], message.size());
+        frame += message;
+        return SocketSendAll(s, frame.data(), frame.size());
+    }
     
-    std::istringstream adbStream(adbResult);
-    std::string line;
-    bool foundADB = false;
-    
-    while (std::getline(adbStream, line)) {
-        if (line.find("device ") != std::string::npos && line.find("List of") == std::string::npos) {
-            size_t pos = line.find("device ");
-            if (pos != std::string::npos) {
-                std::string device = "[ADB] " + line.substr(0, pos);
-                SendMessageA(g_hDeviceList, LB_ADDSTRING, 0, (LPARAM)device.c_str());
-                foundADB = true;
-                
-                // Get device info
-                std::string serial = line.substr(0, pos);
-                // Trim whitespace
-                size_t start = serial.find_first_not_of(" \t\r\n");
-                size_t end = serial.find_last_not_of(" \t\r\n");
-                if (start != std::string::npos && end != std::string::npos) {
-                    serial = serial.substr(start, end - start + 1);
+    void Session(SOCKET s) {
+        char hello[4];
+        if (!SocketReadExact(s, hello, 4) || memcmp(hello, "FB", 2) != 0 ||
+            !SocketSendAll(s, FASTBOOT_HANDSHAKE, 4)) {
+            return;
+        }
+        const char* const* vars = Vars();
+        uint64_t maxDownload = 0x10000000, downloaded = 0;
+        std::vector<char> sink(1024 * 1024);
+        for (;;) {
+            uint8_t header[FASTBOOT_FRAME_HEADER];
+            if (!SocketReadExact(s, (char*)header, sizeof(header))) return;
+            uint64_t len = ReadBE64(header);
+            if (len > 4096) return;
+            std::string cmd((size_t)len, '\0');
+            if (len > 0 && !SocketReadExact(s, &cmd[0], cmd.size())) return;
+            
+            bool ok = true;
+            if (cmd == "getvar:all") {
+                for (size_t i = 0; vars[i] && ok; i += 2) ok = Reply(s, std::string("INFO") + vars[i] + ":" + vars[i + 1]);
+                ok = ok && Reply(s, "OKAY");
+            } else if (cmd.compare(0, 7, "getvar:") == 0) {
+                size_t i = 0;
+                while (vars[i] && cmd.compare(7, std::string::npos, vars[i]) != 0) i += 2;
+                ok = Reply(s, vars[i] ? std::string("OKAY") + vars[i + 1] : "FAILGetVar Variable Not found");
+            } else if (cmd.compare(0, 9, "download:") == 0) {
+                uint64_t size = strtoull(cmd.c_str() + 9, NULL, 16);
+                if (size == 0 || size > maxDownload) {
+                    ok = Reply(s, "FAILRequested download size is too large");
+                    continue;
                 }
-                
-                if (!serial.empty()) {
-                    std::string modelCmd = "adb -s " + serial + " shell getprop ro.product.model";
-                    std::string model = ExecuteCommand(modelCmd.c_str());
-                    // Trim newlines
-                    model.erase(model.find_last_not_of("\r\n") + 1);
-                    AddLog("Found device: " + model);
-                    
-                    // Check if it's S23 series
-                    for (int i = 0; s23_models[i].model; i++) {
-                        if (model.find(s23_models[i].model) != std::string::npos) {
-                            AddLog("Samsung Galaxy S23 series detected: " + 
-                                std::string(s23_models[i].description));
-                            break;
-                        }
+                ok = Reply(s, "DATA" + cmd.substr(9));
+                // The data arrives as frames of any size, discarded as it comes
+                for (uint64_t left = size; ok && left > 0; ) {
+                    ok = SocketReadExact(s, (char*)header, sizeof(header));
+                    uint64_t frame = ok ? ReadBE64(header) : 0;
+                    if (frame > left) return;
+                    for (left -= frame; ok && frame > 0; ) {
+                        size_t n = (size_t)std::min<uint64_t>(frame, sink.size());
+                        ok = SocketReadExact(s, &sink[0], n);
+                        frame -= n;
+                        received += n;
                     }
                 }
+                downloaded = size;
+                ok = ok && Reply(s, "OKAY");
+            } else if (cmd.compare(0, 6, "flash:") == 0) {
+                ok = Reply(s, downloaded ? "OKAY" : "FAILno image downloaded");
+                downloaded = 0;
+            } else if (cmd == "oem device-info") {
+                ok = Reply(s, "INFODevice tampered: false") && Reply(s, "INFODevice unlocked: false") &&
+                     Reply(s, "INFODevice critical unlocked: false") &&
+                     Reply(s, "INFOCharger screen enabled: true") && Reply(s, "OKAY");
+            } else if (cmd.compare(0, 6, "erase:") == 0 || cmd.compare(0, 11, "set_active:") == 0 ||
+                       cmd.compare(0, 9, "flashing ") == 0) {
+                ok = Reply(s, "OKAY");
+            } else if (cmd.compare(0, 6, "reboot") == 0) {
+                Reply(s, "OKAY");
+                return;
+            } else {
+                ok = Reply(s, "FAILunknown command");
             }
+            if (!ok) return;
         }
     }
+};
+
+// Command line: --fastboot-standin [port] [seconds] serves on 127.0.0.1
+std::string FastbootStandInReport(const std::vector<std::string>& args) {
+    FastbootStandIn standIn;
+    int port = standIn.Start(args.size() > 1 ? atoi(args[1].c_str()) : FASTBOOT_TCP_PORT);
+    if (port == 0) return "Error: cannot listen for fastboot connections\n";
+    int seconds = args.size() > 2 ? atoi(args[2].c_str()) : 600;
+    WriteReport("Fastboot stand-in on tcp:127.0.0.1:" + std::to_string(port) + " for " +
+        std::to_string(seconds) + " s\n", "Fastboot stand-in");
+    ::Sleep((DWORD)seconds * 1000);
+    standIn.Stop();
+    return "Stand-in received " + FormatSize(standIn.BytesReceived()) + "\n";
+}
+
+// Fastboot transport benchmark:
+//   frpunlock.exe --bench-fastboot [tcp:host[:port]] [download-MB]
+// Without a device, runs against an in-process stand-in on loopback.
+// Compares one getvar per round trip with a pipelined batch, and a download
+// sent as 64 KB frames with the large read-ahead buffers flashing uses.
+std::string BenchmarkFastboot(const std::vector<std::string>& args) {
+    std::string serial;
+    uint64_t megabytes = 256;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (FastbootSessions::IsTcpSerial(args[i])) serial = args[i];
+        else megabytes = std::max<uint64_t>(strtoull(args[i].c_str(), NULL, 10), 1);
+    }
+    FastbootStandIn standIn;
+    if (serial.empty()) {
+        int port = standIn.Start(0);
+        if (port == 0) return "Error: cannot start the fastboot stand-in\n";
+        serial = "tcp:127.0.0.1:" + std::to_string(port);
+    }
     
-    // Check Fastboot devices
-    std::string fbResult = ExecuteCommand("fastboot devices");
-    SendMessage(g_hProgress, PBM_SETPOS, 80, 0);
+    std::ostringstream report;
+    std::shared_ptr<FastbootTcpSession> session = g_fastbootSessions.Get(serial);
+    std::lock_guard<std::mutex> lock(session->Mutex());
+    std::string error;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (!session->Connect(error)) return error + "\n";
+    report << "Fastboot benchmark against " << serial << "\n"
+           << "Connect + handshake: " << CoreMillisecondsSince(start) << " ms\n";
+    
+    std::vector<FastbootVar> vars;
+    const char* const* names = FastbootStandIn::Vars();
+    for (size_t i = 0; names[i]; i += 2) vars.push_back(FastbootVar(names[i]));
+    FastbootTimings single, batched;
+    for (size_t i = 0; i < vars.size(); i++) {
+        std::vector<FastbootVar> one(1, vars[i]);
+        if (!session->GetVars(one, single, error)) return report.str() + error + "\n";
+    }
+    if (!session->GetVars(vars, batched, error)) return report.str() + error + "\n";
+    report << "getvar x" << vars.size() << ": one at a time " << single.commandMs
+           << " ms, pipelined batch " << batched.commandMs << " ms\n";
+    
+    uint64_t maxDownload = session->MaxDownloadSize(batched);
+    uint64_t size = megabytes * 1024 * 1024;
+    if (maxDownload && size > maxDownload) size = maxDownload;
+    ReadAtFunc read = [](uint64_t pos, void* buffer, size_t len) -> size_t {
+        memset(buffer, (int)(pos >> 20) & 0xFF, len);
+        return len;
+    };
+    struct { const char* label; size_t chunk; size_t ahead; } configs[] = {
+        { "64 KB frames, 1 ahead", 64 * 1024, 1 },
+        { "4 MB frames, 3 ahead", FASTBOOT_CHUNK_SIZE, FASTBOOT_CHUNKS_AHEAD },
+    };
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        FastbootTimings timings;
+        session->SetDownloadBuffers(configs[i].chunk, configs[i].ahead);
+        if (!session->Download(read, size, timings, error)) return report.str() + error + "\n";
+        if (!session->Write("flash:bench", error, FastbootInfoFunc(), timings)) {
+            return report.str() + "flash: " + error + "\n";
+        }
+        report << configs[i].label << ": " << FormatFastbootTimings(timings) << "\n";
+    }
+    session->Close();
+    return report.str();
+}
+
+// Local stand-in for the adb server with one device behind it: host queries,
+// transport switching and shell services (one-shot, or "exec sh" sessions fed
+// on stdin) answered by a fake shell that knows a handful of commands.
+// serviceDelayMs models what opening a shell costs on a real device
+// (transport switch, adbd fork/exec); commandDelayMs models running one.
+class AdbStandIn {
+public:
+    AdbStandIn(const std::string& serial, DWORD serviceDelayMs, DWORD commandDelayMs)
+        : serial(serial), serviceDelayMs(serviceDelayMs), commandDelayMs(commandDelayMs),
+          listener(INVALID_SOCKET), stopping(false), services(0) {}
+    ~AdbStandIn() { Stop(); }
+    
+    // Returns the bound port (port 0 picks a free one), or 0 on failure
+    int Start(int port) {
+        listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listener == INVALID_SOCKET) return 0;
+        sockaddr_in addr;
+        ZeroMemory(&addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((u_short)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int len = sizeof(addr);
+        if (bind(listener, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+            listen(listener, 16) == SOCKET_ERROR ||
+            getsockname(listener, (sockaddr*)&addr, &len) == SOCKET_ERROR) {
+            closesocket(listener);
+            listener = INVALID_SOCKET;
+            return 0;
+        }
+        server = std::thread(&AdbStandIn::Serve, this);
+        return ntohs(addr.sin_port);
+    }
+    
+    void Stop() {
+        stopping = true;
+        if (listener != INVALID_SOCKET) {
+            shutdown(listener, SD_BOTH);            // wakes accept() where closing alone doesn't
+            closesocket(listener);
+        }
+        listener = INVALID_SOCKET;
+        if (server.joinable()) server.join();
+        std::vector<std::thread> running;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t i = 0; i < clients.size(); i++) shutdown(clients[i], SD_BOTH);
+            running.swap(connections);
+        }
+        for (size_t i = 0; i < running.size(); i++) running[i].join();
+    }
+    
+    // Shell services opened so far (one-shot shells and sessions)
+    size_t ServicesOpened() const { return services; }
     
-    std::istringstream fbStream(fbResult);
-    while (std::getline(fbStream, line)) {
-        if (line.find("fastboot") != std::string::npos) {
-            size_t pos = line.find("\t");
-            if (pos != std::string::npos) {
-                std::string device = "[FASTBOOT] " + line.substr(0, pos);
-                SendMessageA(g_hDeviceList, LB_ADDSTRING, 0, (LPARAM)device.c_str());
-                std::string deviceId = line.substr(0, pos);
-                AddLog("Device in fastboot mode: " + deviceId);
+    // Output and exit code of cmd on the fake device
+    std::string FakeShell(const std::string& cmd, int& exitCode) const {
+        static const char* const props[] = {
+            "ro.product.model", "SM-S911B",
+            "ro.product.device", "dm1q",
+            "ro.product.manufacturer", "samsung",
+            "ro.build.version.release", "14",
+            "ro.build.version.sdk", "34",
+            "ro.boot.flash.locked", "1",
+            "ro.boot.verifiedbootstate", "green",
+            "ro.frp.pst", "/dev/block/persistent",
+            NULL
+        };
+        static const char* const packages[] = {
+            "android", "com.android.settings", "com.android.systemui", "com.samsung.android.bixby.agent",
+            "com.sec.android.app.launcher", "com.google.android.gms", "com.android.vending", NULL
+        };
+        if (commandDelayMs) ::Sleep(commandDelayMs);
+        exitCode = 0;
+        std::istringstream words(cmd);
+        std::string verb, arg;
+        words >> verb >> arg;
+        std::string out;
+        if (verb == "getprop" && arg.empty()) {
+            for (size_t i = 0; props[i]; i += 2) out += "[" + std::string(props[i]) + "]: [" + props[i + 1] + "]\n";
+            out += "[ro.serialno]: [" + serial + "]\n";
+        } else if (verb == "getprop") {
+            if (arg == "ro.serialno") out = serial;
+            for (size_t i = 0; props[i]; i += 2) {
+                if (arg == props[i]) out = props[i + 1];
             }
+            out += "\n";
+        } else if (verb == "echo") {
+            out = cmd.size() > 5 ? cmd.substr(5) + "\n" : "\n";
+        } else if (verb == "pm" && arg == "list") {
+            for (size_t i = 0; packages[i]; i++) out += std::string("package:") + packages[i] + "\n";
+        } else if (verb == "true") {
+        } else if (verb == "false") {
+            exitCode = 1;
+        } else {
+            out = "/system/bin/sh: " + verb + ": inaccessible or not found\n";
+            exitCode = 127;
         }
+        return out;
     }
+
+private:
+    std::string serial;
+    DWORD serviceDelayMs, commandDelayMs;
+    SOCKET listener;
+    std::atomic<bool> stopping;
+    std::atomic<size_t> services;
+    std::mutex mutex;
+    std::thread server;
+    std::vector<std::thread> connections;
+    std::vector<SOCKET> clients;
     
-    SendMessage(g_hProgress, PBM_SETPOS, 100, 0);
+    void Serve() {
+        while (!stopping) {
+            SOCKET s = accept(listener, NULL, NULL);
+            if (s == INVALID_SOCKET) break;
+            BOOL noDelay = TRUE;
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+            std::lock_guard<std::mutex> lock(mutex);
+            clients.push_back(s);
+            connections.push_back(std::thread(&AdbStandIn::Connection, this, s));
+        }
+    }
     
-    if (SendMessage(g_hDeviceList, LB_GETCOUNT, 0, 0) == 0) {
-        AddLog("No devices found. Check USB connection and drivers.");
-        SendMessageA(g_hDeviceList, LB_ADDSTRING, 0, (LPARAM)"No devices detected");
-    } else {
-        AddLog("Device scan complete");
+    static bool Okay(SOCKET s, const std::string& payload, bool withLength) {
+        char len[5];
+        snprintf(len, sizeof(len), "%04x", (unsigned int)payload.size());
+        std::string reply = withLength ? "OKAY" + std::string(len) + payload : "OKAY";
+        return SocketSendAll(s, reply.data(), reply.size());
     }
     
-    Sleep(500);
-    SendMessage(g_hProgress, PBM_SETPOS, 0, 0);
-}
+    static bool Packet(SOCKET s, int id, const std::string& data) {
+        std::string packet(5, '\0');
+        packet[0] = (char)id;
+        uint32_t len = (uint32_t)data.size();
+        for (int i = 0; i < 4; i++) packet[1 + i] = (char)(len >> (8 * i));
+        packet += data;
+        return SocketSendAll(s, packet.data(), packet.size());
+    }
+    
+    void Connection(SOCKET s) {
+        for (;;) {
+            char len[5] = {0};
+            if (!SocketReadExact(s, len, 4)) break;
+            std::string service(strtoul(len, NULL, 16), '\0');
+            if (!service.empty() && !SocketReadExact(s, &service[0], service.size())) break;
+            
+            if (service == "host:version") {
+                Okay(s, "0029", true);
+            } else if (service == "host:features" || service == "host-serial:" + serial + ":features") {
+                Okay(s, "shell_v2,cmd", true);
+            } else if (service == "host:devices" || service == "host:devices-l") {
+                Okay(s, serial + "\tdevice" + (service == "host:devices-l" ?
+                    " product:dm1qxxx model:SM_S911B device:dm1q transport_id:1" : "") + "\n", true);
+            } else if (service == "host:get-serialno") {
+                Okay(s, serial, true);
+            } else if (service == "host:transport-any" || service == "host:transport:" + serial) {
+                if (Okay(s, "", false)) continue;           // the device service follows
+            } else if (service.compare(0, 13, "shell,v2,raw:") == 0) {
+                services++;
+                if (serviceDelayMs) ::Sleep(serviceDelayMs);
+                if (!Okay(s, "", false)) break;
+                std::string cmd = service.substr(13);
+                if (cmd == "exec sh") {
+                    Session(s);
+                } else {
+                    int exitCode;
+                    std::string out = FakeShell(cmd, exitCode);
+                    if (Packet(s, ADB_SHELL_STDOUT, out)) Packet(s, ADB_SHELL_EXIT, std::string(1, (char)exitCode));
+                }
+            } else {
+                std::string message = "unknown service " + service;
+                char hex[5];
+                snprintf(hex, sizeof(hex), "%04x", (unsigned int)message.size());
+                std::string reply = "FAIL" + std::string(hex) + message;
+                SocketSendAll(s, reply.data(), reply.size());
+            }
+            break;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        clients.erase(std::remove(clients.begin(), clients.end(), s), clients.end());
+        closesocket(s);
+    }
+    
+    // "exec sh" fed on stdin; understands the framing AdbShellSession writes:
+    // "sh -c '<cmd>' </dev/null 2>&1; echo \"<marker>$?\"\n"
+    void Session(SOCKET s) {
+        static const char head[] = "sh -c '";
+        static const char tail[] = " </dev/null 2>&1; echo \"";
+        std::string input;
+        for (;;) {
+            unsigned char header[5];
+            if (!SocketReadExact(s, (char*)header, sizeof(header))) return;
+            unsigned int len = header[1] | (header[2] << 8) | (header[3] << 16) | ((unsigned int)header[4] << 24);
+            std::string data(len, '\0');
+            if (len > 0 && !SocketReadExact(s, &data[0], len)) return;
+            if (header[0] == ADB_SHELL_CLOSE_STDIN) {
+                Packet(s, ADB_SHELL_EXIT, std::string(1, '\0'));
+                return;
+            }
+            if (header[0] != ADB_SHELL_STDIN) continue;
+            input += data;
+            
+            size_t start = 0, end;
+            while (input.compare(start, sizeof(head) - 1, head) == 0 &&
+                   (end = input.find("$?\"\n", start)) != std::string::npos) {
+                // Undo the quoting: '\'' stands for one ', a lone ' closes
+                std::string cmd;
+                size_t at = start + sizeof(head) - 1;
+                for (;;) {
+                    size_t quote = input.find('\'', at);
+                    if (quote == std::string::npos || quote > end) return;   // not our framing
+                    cmd.append(input, at, quote - at);
+                    if (input.compare(quote, 4, "'\\''") != 0) {
+                        at = quote + 1;
+                        break;
+                    }
+                    cmd += '\'';
+                    at = quote + 4;
+                }
+                if (input.compare(at, sizeof(tail) - 1, tail) != 0) return;
+                size_t markerStart = at + sizeof(tail) - 1;
+                int exitCode;
+                std::string out = FakeShell(cmd, exitCode);
+                out += input.substr(markerStart, end - markerStart) + std::to_string(exitCode) + "\n";
+                if (!Packet(s, ADB_SHELL_STDOUT, out)) return;
+                start = end + 4;
+            }
+            input.erase(0, start);
+        }
+    }
+};
 
-void ExecuteADBCommand(const std::string& cmd) {
-    if (g_adbPath.empty()) {
-        AddLog("ERROR: ADB not found!");
-        return;
+// Shell round-trip benchmark:
+//   frpunlock.exe --bench-shell [commands] [shell-open-ms] [command-ms]
+// Runs the same getprop queries against a stand-in adb server three ways:
+// a one-shot shell each, one at a time over a persistent session, and as a
+// single pipelined batch over the session.
+std::string BenchmarkShell(const std::vector<std::string>& args) {
+    size_t count = args.size() > 1 ? (size_t)std::max(atoi(args[1].c_str()), 1) : 50;
+    DWORD openMs = args.size() > 2 ? (DWORD)atoi(args[2].c_str()) : 30;
+    DWORD commandMs = args.size() > 3 ? (DWORD)atoi(args[3].c_str()) : 1;
+    const std::string serial = "R5CW10STANDIN";
+    AdbStandIn standIn(serial, openMs, commandMs);
+    int port = standIn.Start(0);
+    if (port == 0) return "Error: cannot start the adb stand-in\n";
+    AdbClient adb;
+    adb.host = "127.0.0.1";
+    adb.port = port;
+    
+    const char* keys[] = { "ro.product.model", "ro.product.device", "ro.build.version.release",
+                           "ro.boot.flash.locked", "ro.serialno" };
+    std::vector<std::string> commands;
+    for (size_t i = 0; i < count; i++) commands.push_back(std::string("getprop ") + keys[i % 5]);
+    
+    std::ostringstream report;
+    report << "Shell benchmark: " << count << " commands, stand-in shell open " << openMs
+           << " ms, command " << commandMs << " ms\n";
+    std::vector<std::string> expected(count);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        int exitCode = -1;
+        if (!adb.Shell(serial, commands[i], expected[i], &exitCode) || exitCode != 0) {
+            return report.str() + "one-shot shell failed: " + expected[i] + "\n";
+        }
+    }
+    long long oneShotMs = CoreMillisecondsSince(start);
+    
+    AdbShellSession session(adb, serial);
+    std::vector<ShellCommandResult> results;
+    std::string error;
+    size_t mismatches = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        if (!session.Run(std::vector<std::string>(1, commands[i]), results, error)) {
+            return report.str() + "session failed: " + error + "\n";
+        }
+        if (results[0].output != expected[i] || results[0].exitCode != 0) mismatches++;
     }
-    std::string fullCmd = "adb " + cmd;
-    std::string result = ExecuteCommand(fullCmd.c_str());
-    if (!result.empty()) {
-        AddLog(result);
+    long long sequentialMs = CoreMillisecondsSince(start);
+    
+    start = std::chrono::steady_clock::now();
+    if (!session.Run(commands, results, error)) return report.str() + "session failed: " + error + "\n";
+    long long batchMs = CoreMillisecondsSince(start);
+    for (size_t i = 0; i < count; i++) {
+        if (results[i].output != expected[i] || results[i].exitCode != 0) mismatches++;
     }
+    session.Close();
+    
+    report << std::fixed << std::setprecision(2)
+           << "One-shot shells:      " << oneShotMs << " ms (" << (double)oneShotMs / count << " ms/command)\n"
+           << "Session, one by one:  " << sequentialMs << " ms (" << (double)sequentialMs / count << " ms/command)\n"
+           << "Session, one batch:   " << batchMs << " ms (" << (double)batchMs / count << " ms/command)\n"
+           << "Shells opened on the device: " << standIn.ServicesOpened() << "\n"
+           << (mismatches ? "MISMATCH in " + std::to_string(mismatches) + " results\n" :
+               std::string("Session output identical to one-shot shells\n"));
+    return report.str();
 }
 
-void ExecuteFastbootCommand(const std::string& cmd) {
-    if (g_fastbootPath.empty()) {
-        AddLog("ERROR: Fastboot not found!");
-        return;
+// Command line: --adb-selftest
+// Exercises AdbClient against the stand-in server: host queries, device
+// listing, feature negotiation, one-shot shells with their exit codes, a
+// FAIL reply, name resolution, and a session batch with awkward quoting.
+std::string AdbClientSelfTest() {
+    const std::string serial = "R5CW10STANDIN";
+    AdbStandIn standIn(serial, 0, 0);
+    int port = standIn.Start(0);
+    if (port == 0) return "Error: cannot start the adb stand-in\n";
+    AdbClient adb;
+    adb.host = "localhost";
+    adb.port = port;
+    
+    std::ostringstream report;
+    int failures = 0;
+    auto check = [&](const char* what, bool ok, const std::string& detail) {
+        report << (ok ? "ok    " : "FAIL  ") << what;
+        if (!ok) report << " (" << detail << ")";
+        report << "\n";
+        if (!ok) failures++;
+    };
+    
+    std::string out;
+    bool ok = adb.HostQuery("host:version", out);
+    check("host:version over a resolved host name", ok && out == "0029", out);
+    std::vector<AdbDevice> devices = adb.ListDevices();
+    check("host:devices-l", devices.size() == 1 && devices[0].serial == serial && devices[0].state == "device" &&
+          devices[0].model == "SM_S911B", std::to_string(devices.size()) + " device(s)");
+    ok = adb.HostQuery("host:get-serialno", out);
+    check("host:get-serialno", ok && out == serial, out);
+    check("shell_v2 feature", adb.HasFeature(serial, "shell_v2"), "not reported");
+    ok = adb.HostQuery("host:no-such-service", out);
+    check("FAIL reply surfaces as an error", !ok && out.find("unknown service") != std::string::npos, out);
+    
+    int exitCode = -1;
+    ok = adb.Shell(serial, "getprop ro.product.model", out, &exitCode);
+    check("one-shot shell output", ok && out == "SM-S911B\n" && exitCode == 0, out);
+    ok = adb.Shell(serial, "false", out, &exitCode);
+    check("one-shot shell exit code", ok && exitCode == 1, std::to_string(exitCode));
+    ok = adb.Shell(serial, "no-such-tool", out, &exitCode);
+    check("one-shot shell, unknown command", ok && exitCode == 127, std::to_string(exitCode));
+    
+    AdbShellSession session(adb, serial);
+    std::vector<std::string> commands;
+    commands.push_back("echo it's");
+    commands.push_back("echo '' \\");
+    commands.push_back("getprop ro.serialno");
+    std::vector<ShellCommandResult> results;
+    std::string error;
+    ok = session.Run(commands, results, error);
+    check("session batch with quotes and a trailing backslash", ok && results.size() == 3 &&
+          results[0].output == "it's\n" && results[1].output == "'' \\\n" &&
+          results[2].output == serial + "\n" && results[2].exitCode == 0, ok ? results[0].output : error);
+    session.Close();
+    
+    report << (failures ? std::to_string(failures) + " check(s) failed\n" : std::string("All checks passed\n"));
+    return report.str();
+}
+
+// Command line: --shell-batch <serial> <script.txt>
+// Runs every non-empty line of the script over one shell session
+std::string ShellBatchReport(const std::vector<std::string>& args) {
+    if (args.size() < 3) return "Usage: --shell-batch <serial> <script.txt>\n";
+    std::ifstream in(args[2].c_str());
+    if (!in) return "Error: cannot open " + args[2] + "\n";
+    std::vector<std::string> commands;
+    std::string line;
+    while (std::getline(in, line)) {
+        line.erase(line.find_last_not_of("\r \t") + 1);
+        if (!line.empty() && line[0] != '#') commands.push_back(line);
+    }
+    if (!g_adb.ServerAvailable()) return "Error: no adb server\n";
+    
+    std::vector<ShellCommandResult> results;
+    std::string error;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (!g_shellSessions.Run(args[1], commands, results, error)) return error + "\n";
+    long long elapsed = CoreMillisecondsSince(start);
+    
+    std::string report;
+    for (size_t i = 0; i < commands.size(); i++) {
+        report += "$ " + commands[i] + "\n" + results[i].output;
+        if (!results[i].output.empty() && results[i].output[results[i].output.size() - 1] != '\n') report += "\n";
+        if (results[i].exitCode != 0) report += "[exit " + std::to_string(results[i].exitCode) + "]\n";
     }
-    std::string fullCmd = "fastboot " + cmd;
-    std::string result = ExecuteCommand(fullCmd.c_str());
-    if (!result.empty()) {
-        AddLog(result);
+    return report + std::to_string(commands.size()) + " command(s) in " + std::to_string(elapsed) + " ms\n";
+}
+
+// Command line: --batch <script.txt|-> [--serial S,...] [--jobs N] [--timeout ms] [--stats file]
+// Headless batch run (see RunBatch in devcore.h) with the resolved tools
+std::string BatchReport(const std::vector<std::string>& args) {
+    BatchOptions options;
+    std::string adb = ResolveTool("adb.exe"), fastboot = ResolveTool("fastboot.exe");
+    if (!adb.empty()) options.adbPath = adb;
+    if (!fastboot.empty()) options.fastbootPath = fastboot;
+    std::string error;
+    if (!ParseBatchArgs(args, options, error)) {
+        return "Error: " + error + "\nUsage: --batch <script.txt|-> [--serial S,...] [--jobs N] [--timeout ms] "
+               "[--adb path] [--fastboot path] [--stats file.csv|file.json]\n";
     }
+    std::string report;
+    RunBatch(options, [&](const std::string& line) { report += line + "\n"; });
+    return report;
 }
 
+// Fills one band per distinct colour rather than one line per scanline; a
+// subtle gradient only has a handful of shades
 void DrawGradient(HDC hdc, RECT* rect, COLORREF start, COLORREF end) {
     int r1 = GetRValue(start), g1 = GetGValue(start), b1 = GetBValue(start);
     int r2 = GetRValue(end), g2 = GetGValue(end), b2 = GetBValue(end);
@@ -686,17 +9121,36 @@ void DrawGradient(HDC hdc, RECT* rect, COLORREF start, COLORREF end) {
     int height = rect->bottom - rect->top;
     if (height <= 0) return;
     
-    for (int y = rect->top; y < rect->bottom; y++) {
+    int y = rect->top;
+    while (y < rect->bottom) {
         int r = r1 + (r2 - r1) * (y - rect->top) / height;
         int g = g1 + (g2 - g1) * (y - rect->top) / height;
         int b = b1 + (b2 - b1) * (y - rect->top) / height;
+        COLORREF color = RGB(r, g, b);
         
-        HPEN pen = CreatePen(PS_SOLID, 1, RGB(r, g, b));
-        HPEN oldPen = (HPEN)SelectObject(hdc, pen);
-        MoveToEx(hdc, rect->left, y, NULL);
-        LineTo(hdc, rect->right, y);
-        SelectObject(hdc, oldPen);
-        DeleteObject(pen);
+        RECT band = { rect->left, y, rect->right, y + 1 };
+        while (band.bottom < rect->bottom &&
+               RGB(r1 + (r2 - r1) * (band.bottom - rect->top) / height,
+                   g1 + (g2 - g1) * (band.bottom - rect->top) / height,
+                   b1 + (b2 - b1) * (band.bottom - rect->top) / height) == color) {
+            band.bottom++;
+        }
+        HBRUSH brush = CreateSolidBrush(color);
+        FillRect(hdc, &band, brush);
+        DeleteObject(brush);
+        y = band.bottom;
+    }
+}
+
+// Prints a report to the console we were started from, or shows it in a
+// message box when launched from Explorer
+void WriteReport(const std::string& text, const char* title) {
+    if (AttachConsole(ATTACH_PARENT_PROCESS)) {
+        HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
+        DWORD written;
+        WriteFile(out, text.data(), (DWORD)text.size(), &written, NULL);
+    } else {
+        MessageBoxA(NULL, text.c_str(), title, MB_OK | MB_ICONINFORMATION);
     }
 }
 
@@ -714,7 +9168,22 @@ BOOL InitApplication(HINSTANCE hInstance) {
     wcex.lpszMenuName = NULL;
     wcex.lpszClassName = "S23ManagerClass";
     wcex.hIconSm = LoadIcon(NULL, IDI_APPLICATION);
+    if (!RegisterClassExA(&wcex)) return FALSE;
+    
+    // Broadcast results windows
+    wcex.lpfnWndProc = BroadcastWndProc;
+    wcex.hbrBackground = (HBRUSH)(COLOR_BTNFACE + 1);
+    wcex.lpszClassName = BROADCAST_CLASS;
+    if (!RegisterClassExA(&wcex)) return FALSE;
     
+    // Logcat viewers
+    wcex.lpfnWndProc = LogcatWndProc;
+    wcex.lpszClassName = LOGCAT_CLASS;
+    if (!RegisterClassExA(&wcex)) return FALSE;
+    
+    // Command statistics view
+    wcex.lpfnWndProc = StatsWndProc;
+    wcex.lpszClassName = STATS_CLASS;
     return RegisterClassExA(&wcex);
 }
 
@@ -734,11 +9203,123 @@ int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
     LPSTR lpCmdLine, int nCmdShow) {
     
     (void)hPrevInstance;  // Suppress unused parameter warning
-    (void)lpCmdLine;      // Suppress unused parameter warning
+    
+    // Winsock for the adb server client and fastboot over TCP
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+    
+    // Command line tools
+    std::vector<std::string> args = SplitCommandLine(lpCmdLine);
+    if (!args.empty() && args[0] == "--noop") {
+        return 0;   // trivial stand-in for spawn benchmarks
+    }
+    // No window in command line modes, so no WM_CREATE: resolve the tools
+    // here, or adb/fastboot fallbacks (and starting the adb server) fail
+    g_adbPath = ResolveTool("adb.exe");
+    g_fastbootPath = ResolveTool("fastboot.exe");
+    if (!args.empty() && args[0] == "--export-journal") {
+        WriteReport(ExportJournal(args), "Journal export");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--index") {
+        WriteReport(PackageIndexReport(std::vector<std::string>(args.begin() + 1, args.end())),
+            "Package index");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--extract") {
+        WriteReport(ExtractMemberReport(args), "Extract");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--lz4") {
+        WriteReport(DecodeLz4FileReport(args), "LZ4 decode");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--bench-lz4") {
+        WriteReport(BenchmarkLz4(args.size() > 1 ? strtoull(args[1].c_str(), NULL, 10) : 0,
+            args.size() > 2 ? (size_t)atoi(args[2].c_str()) : 0), "LZ4 benchmark");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--sparse") {
+        WriteReport(SparseImageReport(args), "Sparse image");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--verify") {
+        WriteReport(VerifyPackagesReport(std::vector<std::string>(args.begin() + 1, args.end())),
+            "Package verification");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--getvar") {
+        WriteReport(FastbootInfoReport(args), "Fastboot variables");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--bench-fastboot") {
+        WriteReport(BenchmarkFastboot(args), "Fastboot benchmark");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--fastboot-standin") {
+        WriteReport(FastbootStandInReport(args), "Fastboot stand-in");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--bench-shell") {
+        WriteReport(BenchmarkShell(args), "Shell benchmark");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--adb-selftest") {
+        WriteReport(AdbClientSelfTest(), "adb client self-test");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--shell-batch") {
+        WriteReport(ShellBatchReport(args), "Shell batch");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--broadcast") {
+        WriteReport(BroadcastReport(args), "Broadcast");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--logcat") {
+        WriteReport(LogcatReport(args), "Logcat");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--packages") {
+        WriteReport(AppInventoryReport(args), "Package inventory");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--bench-packages") {
+        WriteReport(BenchmarkAppInventory(args), "Package inventory benchmark");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--build-catalog") {
+        WriteReport(BuildCatalogReport(args), "Device catalogue");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--catalog") {
+        WriteReport(CatalogReport(args), "Device catalogue");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--batch") {
+        WriteReport(BatchReport(args), "Batch");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--bench-spawn") {
+        std::string report = BenchmarkSpawn(args.size() > 1 ? atoi(args[1].c_str()) : 50,
+            args.size() > 2 ? args[2] : "");
+        WriteReport(report, "Spawn benchmark");
+        return 0;
+    }
     
     // Enable visual styles
     InitCommonControls();
     
+    // Before the window exists so its startup log lines are journaled too
+    g_journal.Start(JournalDirectory());
+    
+    // devices.cat is optional; without it the built-in catalogue is used
+    std::string catalogError;
+    if (GetFileAttributesA(CatalogPath().c_str()) != INVALID_FILE_ATTRIBUTES &&
+        !g_catalog.Load(CatalogPath(), catalogError)) {
+        AddLog("Device catalogue: " + catalogError);
+    }
+    
     if (!InitApplication(hInstance)) return FALSE;
     if (!InitInstance(hInstance, nCmdShow)) return FALSE;
     
@@ -748,5 +9329,7 @@ int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
         DispatchMessage(&msg);
     }
     
+    g_journal.Stop();
+    WSACleanup();
     return (int)msg.wParam;
-}
\ No newline at end of file
+}
\ No newline at end of file